@@ -0,0 +1,558 @@
+/*
+ pngquant-bench - end-to-end benchmark of libimagequant on a deterministic synthetic corpus.
+
+ Every image is generated from a hash of pixel coordinates, so the corpus is the same on every run
+ and rows can be generated in any order (huge images are supplied row by row from a callback).
+ Each run is done in a forked process, so that peak RSS is measured for that run only.
+ */
+
+#if !defined(WIN32) && !defined(__WIN32__)
+#define _POSIX_C_SOURCE 200112L /* fork(), clock_gettime() */
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <math.h>
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#include "libimagequant.h"
+#include "stats.h"
+
+#define BENCH_USAGE "\
+usage:  pngquant-bench [options]\n\
+        pngquant-bench --compare baseline.json results.json\n\n\
+options:\n\
+  -o file           write results to file instead of stdout (JSON, one line per run)\n\
+  --types list      gradient,photo,ui,sprites (default: all)\n\
+  --sizes list      e.g. 256,1024x768,70000x70000 (default: 256,512)\n\
+  --speeds list     e.g. 1-10 or 1,3,10 (default: 1-10)\n\
+  --threads list    e.g. 1,4 (default: 1 and number of cores)\n\
+  --huge            add 32768x32768 (gigapixel) images. Very slow, so limit --speeds\n\
+  --compare         compare results with a baseline and exit with status 1 on regression\n\
+  --threshold N     throughput regression threshold in percent (default: 10)\n"
+
+#define MAX_LIST 64
+#define HUGE_SIZE 32768
+// images bigger than this (in pixels) are generated row by row instead of being held in memory
+#define MAX_BITMAP_PIXELS (1UL<<28)
+
+typedef enum {
+    CORPUS_GRADIENT, // smooth gradients, where banding shows
+    CORPUS_PHOTO,    // photo-like noise at several scales
+    CORPUS_UI,       // flat colors, borders and text-like lines
+    CORPUS_SPRITES,  // soft-edged shapes with glows on transparent background
+    CORPUS_TYPES
+} corpus_type;
+
+static const char *const corpus_names[CORPUS_TYPES] = {
+    [CORPUS_GRADIENT] = "gradient",
+    [CORPUS_PHOTO] = "photo",
+    [CORPUS_UI] = "ui",
+    [CORPUS_SPRITES] = "sprites",
+};
+
+struct bench_case {
+    corpus_type type;
+    unsigned int width, height;
+    int speed, threads;
+};
+
+struct bench_result {
+    char name[64];
+    int speed, threads;
+    double mpps, mse;
+};
+
+static unsigned int hash2(unsigned int x, unsigned int y, unsigned int seed)
+{
+    unsigned int h = x * 0x8da6b343u ^ y * 0xd8163841u ^ seed * 0xcb1ab31fu;
+    h ^= h >> 15; h *= 0x2c1b3c6du;
+    h ^= h >> 12; h *= 0x297a2d39u;
+    h ^= h >> 15;
+    return h;
+}
+
+/* 0..1, smoothly interpolated between random values on a lattice of cell-sized squares */
+static float value_noise(unsigned int x, unsigned int y, unsigned int cell, unsigned int seed)
+{
+    const unsigned int cx = x / cell, cy = y / cell;
+    float fx = (float)(x % cell) / cell, fy = (float)(y % cell) / cell;
+    fx = fx*fx*(3.f-2.f*fx);
+    fy = fy*fy*(3.f-2.f*fy);
+
+    const float v00 = (hash2(cx, cy, seed) & 0xFFFF) / 65535.f, v10 = (hash2(cx+1, cy, seed) & 0xFFFF) / 65535.f,
+                v01 = (hash2(cx, cy+1, seed) & 0xFFFF) / 65535.f, v11 = (hash2(cx+1, cy+1, seed) & 0xFFFF) / 65535.f;
+
+    const float top = v00 + (v10-v00)*fx, bottom = v01 + (v11-v01)*fx;
+    return top + (bottom-top)*fy;
+}
+
+static unsigned char clamp255(float v)
+{
+    return v < 0 ? 0 : (v > 255.f ? 255 : (unsigned char)(v + 0.5f));
+}
+
+static liq_color gradient_pixel(unsigned int x, unsigned int y, unsigned int width, unsigned int height)
+{
+    const float fx = (float)x / (width > 1 ? width-1 : 1), fy = (float)y / (height > 1 ? height-1 : 1);
+    return (liq_color){
+        .r = clamp255(255.f * fx),
+        .g = clamp255(255.f * fy),
+        .b = clamp255(255.f * (1.f - (fx+fy)/2.f)),
+        .a = 255,
+    };
+}
+
+static liq_color photo_pixel(unsigned int x, unsigned int y)
+{
+    float ch[3];
+    for(unsigned int i=0; i < 3; i++) {
+        ch[i] = value_noise(x, y, 256, 1+i*3) * 0.6f + value_noise(x, y, 48, 2+i*3) * 0.3f + value_noise(x, y, 8, 3+i*3) * 0.1f;
+    }
+    const float grain = (float)(hash2(x, y, 10) & 31) - 16.f;
+    return (liq_color){
+        .r = clamp255(ch[0] * 255.f + grain),
+        .g = clamp255(ch[1] * 255.f + grain),
+        .b = clamp255(ch[2] * 255.f + grain),
+        .a = 255,
+    };
+}
+
+static liq_color ui_pixel(unsigned int x, unsigned int y)
+{
+    static const liq_color palette[] = {
+        {246,246,248,255}, {255,255,255,255}, {230,236,245,255}, {52,120,246,255},
+        {40,167,69,255}, {255,193,7,255}, {220,53,69,255}, {108,117,125,255},
+    };
+    const liq_color border = {60,60,70,255}, text = {20,20,24,255};
+
+    const unsigned int cx = x / 96, cy = y / 64, lx = x % 96, ly = y % 64;
+    if (lx < 2 || ly < 2) return border;
+
+    // up to 3 lines of "text" of random length in each cell
+    const unsigned int line = (ly - 12) / 10;
+    if (ly >= 12 && line < 3 && (ly - 12) % 10 < 2 && lx >= 8 && lx < 8 + hash2(cx, cy*3 + line, 21) % 80) {
+        return text;
+    }
+    return palette[hash2(cx, cy, 20) % (sizeof(palette)/sizeof(palette[0]))];
+}
+
+static liq_color sprite_pixel(unsigned int x, unsigned int y)
+{
+    const unsigned int cx = x / 48, cy = y / 48;
+    const unsigned int h = hash2(cx, cy, 30);
+    const float dx = (float)(x % 48) - (20.f + h % 9), dy = (float)(y % 48) - (20.f + (h >> 4) % 9);
+    const float radius = 8.f + (h >> 8) % 10, dist = sqrtf(dx*dx + dy*dy);
+
+    float alpha;
+    if (dist < radius - 1.f) {
+        alpha = 255.f;
+    } else if (dist < radius) {
+        alpha = 255.f * (radius - dist); // anti-aliased edge
+    } else if (dist < radius + 8.f) {
+        alpha = 96.f * (1.f - (dist - radius) / 8.f); // glow
+    } else {
+        return (liq_color){0,0,0,0};
+    }
+    if (h % 3 == 0) alpha *= 0.5f; // translucent sprites
+
+    const unsigned int color = hash2(cx, cy, 31);
+    const float shade = 1.f - dist / (radius + 8.f) * 0.5f;
+    return (liq_color){
+        .r = clamp255((color & 0xFF) * shade),
+        .g = clamp255(((color >> 8) & 0xFF) * shade),
+        .b = clamp255(((color >> 16) & 0xFF) * shade),
+        .a = clamp255(alpha),
+    };
+}
+
+/* liq_image_get_rgba_rows_callback, also used to fill bitmaps */
+static void generate_rows(liq_color rows_out[], int first_row, int num_rows, int width, void *user_info)
+{
+    const struct bench_case *c = user_info;
+
+    for(int row = first_row; row < first_row + num_rows; row++) {
+        for(int col = 0; col < width; col++) {
+            liq_color px;
+            switch (c->type) {
+                case CORPUS_GRADIENT: px = gradient_pixel(col, row, c->width, c->height); break;
+                case CORPUS_PHOTO: px = photo_pixel(col, row); break;
+                case CORPUS_UI: px = ui_pixel(col, row); break;
+                default: px = sprite_pixel(col, row); break;
+            }
+            *rows_out++ = px;
+        }
+    }
+}
+
+static double now_seconds(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec/1e9;
+}
+
+static void bench_case_name(const struct bench_case *c, char *name, size_t size)
+{
+    snprintf(name, size, "%s-%ux%u", corpus_names[c->type], c->width, c->height);
+}
+
+/* error of the remapped (dithered) image against the original, averaged over RGBA channels in 0-255 units */
+static double remapped_mse(const struct bench_case *c, const liq_color *bitmap, const unsigned char *indexed, const liq_palette *palette)
+{
+    liq_color generated_row[c->width];
+    double total = 0;
+
+    for(unsigned int row=0; row < c->height; row++) {
+        const liq_color *original = bitmap ? &bitmap[(size_t)row * c->width] : generated_row;
+        if (!bitmap) generate_rows(generated_row, row, 1, c->width, (void*)c);
+
+        const unsigned char *remapped = &indexed[(size_t)row * c->width];
+        for(unsigned int col=0; col < c->width; col++) {
+            const liq_color px = palette->entries[remapped[col]];
+            const int r = px.r - original[col].r, g = px.g - original[col].g,
+                      b = px.b - original[col].b, a = px.a - original[col].a;
+            total += r*r + g*g + b*b + a*a;
+        }
+    }
+    return total / ((double)c->width * c->height * 4.0);
+}
+
+/* runs whole pipeline (image, quantization, remapping with dithering) and writes one line of JSON */
+static int bench_case_run(const struct bench_case *c, FILE *out)
+{
+    liq_set_threads(c->threads);
+
+    const size_t pixels = (size_t)c->width * c->height;
+    const bool custom = pixels > MAX_BITMAP_PIXELS;
+
+    // generation of bitmaps isn't timed. Rows of custom images are generated during quantization.
+    liq_color *bitmap = NULL;
+    if (!custom) {
+        bitmap = malloc(pixels * sizeof(bitmap[0]));
+        if (!bitmap) return LIQ_OUT_OF_MEMORY;
+        generate_rows(bitmap, 0, c->height, c->width, (void*)c);
+    }
+    unsigned char *indexed = malloc(pixels);
+    liq_attr *attr = liq_attr_create();
+    if (!indexed || !attr) return LIQ_OUT_OF_MEMORY;
+
+    struct liq_stats stats = {};
+    liq_set_speed(attr, c->speed);
+    liq_set_stats(attr, &stats);
+
+    const double start = now_seconds();
+    liq_image *image = custom ? liq_image_create_custom(attr, generate_rows, (void*)c, c->width, c->height, 0)
+                              : liq_image_create_rgba(attr, bitmap, c->width, c->height, 0, 0);
+    liq_result *result = NULL;
+    liq_error err = image ? liq_image_quantize(image, attr, &result) : LIQ_OUT_OF_MEMORY;
+    if (LIQ_OK == err) {
+        liq_set_dithering_level(result, 1.0f);
+        err = liq_write_remapped_image(result, image, indexed, pixels);
+    }
+    const double seconds = now_seconds() - start;
+    const double palette_mse = result ? liq_get_quantization_error(result) : -1;
+    const double mse = LIQ_OK == err ? remapped_mse(c, bitmap, indexed, liq_get_palette(result)) : -1;
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    char name[64];
+    bench_case_name(c, name, sizeof(name));
+    fprintf(out, "{\"case\":\"%s\",\"type\":\"%s\",\"width\":%u,\"height\":%u,\"input\":\"%s\",\"speed\":%d,\"threads\":%d,\"status\":%d,"
+                 "\"seconds\":%.4f,\"mpps\":%.3f,\"mse\":%.4f,\"palette_mse\":%.4f,\"peak_rss_kb\":%ld,\"mem_peak\":%lu,\"stages\":",
+            name, corpus_names[c->type], c->width, c->height, custom ? "callback" : "bitmap", c->speed, c->threads, err,
+            seconds, pixels / 1e6 / seconds, mse, palette_mse, (long)usage.ru_maxrss, (unsigned long)stats.mem_peak);
+    stats_write_stages_json(out, &stats);
+    fputs("}\n", out);
+
+    fprintf(stderr, "%-22s speed %2d, %2d thread%s: %8.3f MP/s, MSE %.3f\n", name, c->speed, c->threads, c->threads == 1 ? " " : "s",
+            pixels / 1e6 / seconds, mse);
+
+    liq_result_destroy(result);
+    if (image) liq_image_destroy(image);
+    liq_attr_destroy(attr);
+    free(indexed);
+    free(bitmap);
+    return err;
+}
+
+/* each run in its own process, so peak RSS isn't inherited from previous runs */
+static bool bench_case_fork(const struct bench_case *c, FILE *out)
+{
+    fflush(out);
+    fflush(stderr);
+
+    pid_t pid = fork();
+    if (pid < 0) return false;
+    if (0 == pid) {
+        int err = bench_case_run(c, out);
+        fflush(out);
+        _exit(err ? 1 : 0);
+    }
+
+    int status;
+    if (waitpid(pid, &status, 0) < 0) return false;
+    return WIFEXITED(status) && 0 == WEXITSTATUS(status);
+}
+
+/* comma-separated numbers and ranges, e.g. "1-3,8" */
+static unsigned int parse_int_list(const char *str, int list[], unsigned int max)
+{
+    unsigned int count = 0;
+    while (*str) {
+        char *end;
+        long first = strtol(str, &end, 10), last = first;
+        if (end == str) return 0;
+        if ('-' == *end) {
+            str = end+1;
+            last = strtol(str, &end, 10);
+            if (end == str || last < first) return 0;
+        }
+        for(long i = first; i <= last; i++) {
+            if (count >= max) return 0;
+            list[count++] = i;
+        }
+        str = end;
+        if (',' == *str) str++;
+        else if (*str) return 0;
+    }
+    return count;
+}
+
+/* comma-separated sizes, e.g. "256,1024x768" */
+static unsigned int parse_size_list(const char *str, unsigned int widths[], unsigned int heights[], unsigned int max)
+{
+    unsigned int count = 0;
+    while (*str) {
+        char *end;
+        long w = strtol(str, &end, 10), h = w;
+        if (end == str || w <= 0) return 0;
+        if ('x' == *end) {
+            str = end+1;
+            h = strtol(str, &end, 10);
+            if (end == str || h <= 0) return 0;
+        }
+        if (count >= max) return 0;
+        widths[count] = w; heights[count] = h; count++;
+        str = end;
+        if (',' == *str) str++;
+        else if (*str) return 0;
+    }
+    return count;
+}
+
+static unsigned int parse_type_list(const char *str, corpus_type types[])
+{
+    unsigned int count = 0;
+    while (*str) {
+        const size_t len = strcspn(str, ",");
+        corpus_type t = 0;
+        while (t < CORPUS_TYPES && (strlen(corpus_names[t]) != len || 0 != strncmp(corpus_names[t], str, len))) t++;
+        if (t == CORPUS_TYPES) return 0;
+        types[count++] = t;
+        str += len;
+        if (',' == *str) str++;
+    }
+    return count;
+}
+
+static bool json_get_number(const char *line, const char *key, double *value)
+{
+    char pattern[32];
+    snprintf(pattern, sizeof(pattern), "\"%s\":", key);
+    const char *p = strstr(line, pattern);
+    if (!p) return false;
+    *value = strtod(p + strlen(pattern), NULL);
+    return true;
+}
+
+static bool parse_result(const char *line, struct bench_result *r)
+{
+    const char *name = strstr(line, "\"case\":\"");
+    if (!name) return false;
+    name += strlen("\"case\":\"");
+    const size_t len = strcspn(name, "\"");
+    if (len >= sizeof(r->name)) return false;
+    memcpy(r->name, name, len);
+    r->name[len] = '\0';
+
+    double speed, threads;
+    if (!json_get_number(line, "speed", &speed) || !json_get_number(line, "threads", &threads) ||
+        !json_get_number(line, "mpps", &r->mpps) || !json_get_number(line, "mse", &r->mse)) {
+        return false;
+    }
+    r->speed = speed; r->threads = threads;
+    return true;
+}
+
+static struct bench_result *load_results(const char *filename, unsigned int *count)
+{
+    FILE *fp = fopen(filename, "r");
+    if (!fp) {
+        fprintf(stderr, "  error: cannot open %s for reading\n", filename);
+        return NULL;
+    }
+
+    unsigned int capacity = 64;
+    struct bench_result *results = malloc(capacity * sizeof(results[0]));
+    *count = 0;
+
+    char line[4096];
+    while (results && fgets(line, sizeof(line), fp)) {
+        if (*count == capacity) {
+            capacity *= 2;
+            struct bench_result *tmp = realloc(results, capacity * sizeof(results[0]));
+            if (!tmp) { free(results); results = NULL; break; }
+            results = tmp;
+        }
+        if (parse_result(line, &results[*count])) (*count)++;
+    }
+    fclose(fp);
+    return results;
+}
+
+/*
+ Throughput lower than baseline by more than threshold, or MSE of the remapped image higher by more than 2%, is a regression.
+ Runs are matched by case name, speed and threads; runs missing from either file are skipped.
+ */
+static int bench_compare(const char *baseline_file, const char *results_file, double threshold)
+{
+    unsigned int base_count, count;
+    struct bench_result *base = load_results(baseline_file, &base_count);
+    struct bench_result *results = base ? load_results(results_file, &count) : NULL;
+    if (!base || !results) {
+        free(base);
+        return 2;
+    }
+
+    unsigned int regressions = 0, compared = 0;
+    for(unsigned int i=0; i < count; i++) {
+        const struct bench_result *r = &results[i], *b = NULL;
+        for(unsigned int j=0; j < base_count && !b; j++) {
+            if (base[j].speed == r->speed && base[j].threads == r->threads && 0 == strcmp(base[j].name, r->name)) b = &base[j];
+        }
+        if (!b) continue;
+        compared++;
+
+        const double change = b->mpps > 0 ? (r->mpps - b->mpps) / b->mpps * 100.0 : 0;
+        const bool slower = change < -threshold, worse = b->mse >= 0 && r->mse > b->mse * 1.02 + 0.001;
+        printf("%-11s %-22s speed %2d, %2d threads: %8.3f -> %8.3f MP/s (%+.1f%%), MSE %.3f -> %.3f\n",
+               slower || worse ? "REGRESSION" : "ok", r->name, r->speed, r->threads, b->mpps, r->mpps, change, b->mse, r->mse);
+        if (slower || worse) regressions++;
+    }
+    printf("%u of %u runs regressed\n", regressions, compared);
+
+    free(base);
+    free(results);
+    return regressions ? 1 : 0;
+}
+
+enum {arg_types=1, arg_sizes, arg_speeds, arg_threads, arg_huge, arg_compare, arg_threshold};
+
+static const struct option long_options[] = {
+    {"types", required_argument, NULL, arg_types},
+    {"sizes", required_argument, NULL, arg_sizes},
+    {"speeds", required_argument, NULL, arg_speeds},
+    {"threads", required_argument, NULL, arg_threads},
+    {"huge", no_argument, NULL, arg_huge},
+    {"compare", no_argument, NULL, arg_compare},
+    {"threshold", required_argument, NULL, arg_threshold},
+    {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0},
+};
+
+int main(int argc, char *argv[])
+{
+    corpus_type types[CORPUS_TYPES] = {CORPUS_GRADIENT, CORPUS_PHOTO, CORPUS_UI, CORPUS_SPRITES};
+    unsigned int num_types = CORPUS_TYPES;
+    unsigned int widths[MAX_LIST+1] = {256, 512}, heights[MAX_LIST+1] = {256, 512}, num_sizes = 2;
+    int speeds[MAX_LIST] = {1,2,3,4,5,6,7,8,9,10}, threads[MAX_LIST] = {1, liq_get_threads()};
+    unsigned int num_speeds = 10, num_threads = threads[1] > 1 ? 2 : 1;
+    bool huge = false, compare = false;
+    double threshold = 10;
+    FILE *out = stdout;
+
+    int opt;
+    while (-1 != (opt = getopt_long(argc, argv, "o:h", long_options, NULL))) {
+        switch (opt) {
+            case 'o':
+                if (!(out = fopen(optarg, "w"))) {
+                    fprintf(stderr, "  error: cannot open %s for writing\n", optarg);
+                    return 2;
+                }
+                break;
+            case arg_types:
+                if (!(num_types = parse_type_list(optarg, types))) goto invalid;
+                break;
+            case arg_sizes:
+                if (!(num_sizes = parse_size_list(optarg, widths, heights, MAX_LIST))) goto invalid;
+                break;
+            case arg_speeds:
+                if (!(num_speeds = parse_int_list(optarg, speeds, MAX_LIST))) goto invalid;
+                for(unsigned int i=0; i < num_speeds; i++) if (speeds[i] < 1 || speeds[i] > 10) goto invalid;
+                break;
+            case arg_threads:
+                if (!(num_threads = parse_int_list(optarg, threads, MAX_LIST))) goto invalid;
+                for(unsigned int i=0; i < num_threads; i++) if (threads[i] < 1) goto invalid;
+                break;
+            case arg_huge: huge = true; break;
+            case arg_compare: compare = true; break;
+            case arg_threshold:
+                threshold = atof(optarg);
+                if (threshold <= 0) goto invalid;
+                break;
+            case 'h':
+                fputs(BENCH_USAGE, stdout);
+                return 0;
+            default:
+                goto invalid;
+        }
+    }
+
+    if (compare) {
+        if (argc - optind != 2) goto invalid;
+        return bench_compare(argv[optind], argv[optind+1], threshold);
+    }
+    if (optind != argc) goto invalid;
+
+    if (huge) {
+        widths[num_sizes] = heights[num_sizes] = HUGE_SIZE;
+        num_sizes++;
+    }
+
+    unsigned int failed = 0;
+    for(unsigned int s=0; s < num_sizes; s++) {
+        for(unsigned int t=0; t < num_types; t++) {
+            for(unsigned int sp=0; sp < num_speeds; sp++) {
+                for(unsigned int th=0; th < num_threads; th++) {
+                    const struct bench_case c = {
+                        .type = types[t],
+                        .width = widths[s], .height = heights[s],
+                        .speed = speeds[sp], .threads = threads[th],
+                    };
+                    if (!bench_case_fork(&c, out)) {
+                        char name[64];
+                        bench_case_name(&c, name, sizeof(name));
+                        fprintf(stderr, "  error: %s at speed %d failed\n", name, c.speed);
+                        failed++;
+                    }
+                }
+            }
+        }
+    }
+
+    if (out != stdout) fclose(out);
+    return failed ? 1 : 0;
+
+invalid:
+    fputs(BENCH_USAGE, stderr);
+    return 2;
+}
@@ -10,7 +10,7 @@ static void transposing_1d_blur(float *restrict src, float *restrict dst, unsign
     const float sizef = size;
 
     for(unsigned int j=0; j < height; j++) {
-        float *restrict row = src + j*width;
+        float *restrict row = src + (size_t)j*width;
 
         // accumulate sum for pixels outside line
         float sum;
@@ -24,14 +24,14 @@ static void transposing_1d_blur(float *restrict src, float *restrict dst, unsign
             sum -= row[0];
             sum += row[i+size];
 
-            dst[i*height + j] = sum / (sizef*2.f);
+            dst[(size_t)i*height + j] = sum / (sizef*2.f);
         }
 
         for(unsigned int i=size; i < width-size; i++) {
             sum -= row[i-size];
             sum += row[i+size];
 
-            dst[i*height + j] = sum / (sizef*2.f);
+            dst[(size_t)i*height + j] = sum / (sizef*2.f);
         }
 
         // blur with right side outside line
@@ -39,7 +39,7 @@ static void transposing_1d_blur(float *restrict src, float *restrict dst, unsign
             sum -= row[i-size];
             sum += row[width-1];
 
-            dst[i*height + j] = sum/(sizef*2.0f);
+            dst[(size_t)i*height + j] = sum/(sizef*2.0f);
         }
     }
 }
@@ -50,9 +50,9 @@ static void transposing_1d_blur(float *restrict src, float *restrict dst, unsign
 void max3(float *src, float *dst, unsigned int width, unsigned int height)
 {
     for(unsigned int j=0; j < height; j++) {
-        const float *row = src + j*width,
-        *prevrow = src + (j > 1 ? j-1 : 0)*width,
-        *nextrow = src + MIN(height-1,j+1)*width;
+        const float *row = src + (size_t)j*width,
+        *prevrow = src + (size_t)(j > 1 ? j-1 : 0)*width,
+        *nextrow = src + (size_t)MIN(height-1,j+1)*width;
 
         float prev,curr=row[0],next=row[0];
 
@@ -77,9 +77,9 @@ void max3(float *src, float *dst, unsigned int width, unsigned int height)
 void min3(float *src, float *dst, unsigned int width, unsigned int height)
 {
     for(unsigned int j=0; j < height; j++) {
-        const float *row = src + j*width,
-        *prevrow = src + (j > 1 ? j-1 : 0)*width,
-        *nextrow = src + MIN(height-1,j+1)*width;
+        const float *row = src + (size_t)j*width,
+        *prevrow = src + (size_t)(j > 1 ? j-1 : 0)*width,
+        *nextrow = src + (size_t)MIN(height-1,j+1)*width;
 
         float prev,curr=row[0],next=row[0];
 
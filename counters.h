@@ -0,0 +1,50 @@
+#ifndef COUNTERS_H
+#define COUNTERS_H
+
+/*
+ Counts of work done by hashing, nearest color search and median cut, to explain why an image is slow.
+ They're compiled in only with -DLIQ_COUNTERS, otherwise all functions below do nothing.
+
+ Each thread counts into its own thread-local struct. Tasks of a parallel loop add their counts
+ to a struct shared by the loop with counters_flush(), which the thread that started the loop
+ takes over with counters_add(). The library flushes counts of each quantization into liq_stats.
+ */
+struct liq_counters {
+    unsigned long hash_pixels;           // pixels added to the color hash
+    unsigned long hash_probes;           // colors compared in hash bucket chains
+    unsigned long hash_longest_chain;    // most colors in a single bucket
+    unsigned long hash_chain_allocs;     // buckets that overflowed inline colors
+    unsigned long hash_chain_reallocs;   // bucket arrays grown
+    unsigned long nearest_searches;
+    unsigned long nearest_heads;         // vantage points tried
+    unsigned long nearest_candidates;    // palette colors compared
+    unsigned long floyd_tolerance_checks;
+    unsigned long floyd_tolerance_hits;  // pixels that kept remapped color without a search
+    unsigned long boxes_split;
+    unsigned long sort_partitions;
+};
+
+#ifdef LIQ_COUNTERS
+
+extern __thread struct liq_counters liq_thread_counters;
+
+#define COUNTER_ADD(name, n) (liq_thread_counters.name += (n))
+#define COUNTER_MAX(name, n) do { \
+    if (liq_thread_counters.name < (n)) liq_thread_counters.name = (n); \
+} while(0)
+
+/* adds counts of the calling thread to dst and resets them. NULL dst discards the counts */
+void counters_flush(struct liq_counters *dst);
+void counters_add(const struct liq_counters *src);
+
+#else
+
+#define COUNTER_ADD(name, n) do {} while(0)
+#define COUNTER_MAX(name, n) do {} while(0)
+
+inline static void counters_flush(struct liq_counters *dst) {}
+inline static void counters_add(const struct liq_counters *src) {}
+
+#endif
+
+#endif
@@ -0,0 +1,109 @@
+/*
+ Exact quantization of grayscale images.
+
+ Gray colors lie on a line, where the best palette splits the sorted histogram into contiguous ranges,
+ each represented by its weighted mean. Dynamic programming over the gray levels (at most 256) finds
+ the split with the least total error for every number of colors, so mediancut, its feedback loop and
+ Voronoi iteration aren't needed.
+ */
+
+#include <stdlib.h>
+
+#include "pam.h"
+#include "gray.h"
+#include "stats.h"
+
+static int compare_gray(const void *ap, const void *bp)
+{
+    const float a = ((const hist_item *)ap)->acolor.r, b = ((const hist_item *)bp)->acolor.r;
+    return a > b ? 1 : (a < b ? -1 : 0);
+}
+
+struct gray_sums {
+    double weight, sum, sum_squares;
+};
+
+/* weighted squared error of colors from start to end-1 represented by their mean */
+inline static double range_error(const struct gray_sums prefix[], unsigned int start, unsigned int end)
+{
+    const double weight = prefix[end].weight - prefix[start].weight;
+    if (weight <= 0) return 0;
+    const double sum = prefix[end].sum - prefix[start].sum;
+    const double error = prefix[end].sum_squares - prefix[start].sum_squares - sum*sum/weight;
+    return error > 0 ? error : 0; // rounding
+}
+
+colormap *gray_quantize(histogram *hist, unsigned int max_colors, double target_mse, double *palette_error_p)
+{
+    hist_item *const achv = hist->achv;
+    const unsigned int levels = hist->size;
+    qsort(achv, levels, sizeof(achv[0]), compare_gray);
+
+    struct gray_sums prefix[levels+1];
+    prefix[0] = (struct gray_sums){0,0,0};
+    for(unsigned int i=0; i < levels; i++) {
+        const double weight = achv[i].perceptual_weight, x = achv[i].acolor.r;
+        prefix[i+1] = (struct gray_sums){
+            .weight = prefix[i].weight + weight,
+            .sum = prefix[i].sum + x * weight,
+            .sum_squares = prefix[i].sum_squares + x * x * weight,
+        };
+    }
+
+    // colordifference() of opaque grays is 2 (on black and white) * 3 channels of the squared difference
+    const double error_scale = 6.0 / hist->total_perceptual_weight;
+    max_colors = MIN(max_colors, levels);
+
+    // error[k*(levels+1) + j] is the least error of the first j levels in k+1 colors, where the last range starts at split[…]
+    double *const error = stats_malloc(sizeof(error[0]) * max_colors * (levels+1));
+    unsigned short *const split = stats_malloc(sizeof(split[0]) * max_colors * (levels+1));
+    if (!error || !split) {
+        stats_free(error);
+        stats_free(split);
+        return NULL;
+    }
+
+    for(unsigned int j=1; j <= levels; j++) {
+        error[j] = range_error(prefix, 0, j);
+        split[j] = 0;
+    }
+
+    // each additional color is added only if the error is still above the target
+    unsigned int colors = 1;
+    while (colors < max_colors && error[(colors-1)*(levels+1) + levels] * error_scale > target_mse) {
+        const double *const prev = &error[(colors-1)*(levels+1)];
+        double *const row = &error[colors*(levels+1)];
+        unsigned short *const row_split = &split[colors*(levels+1)];
+
+        for(unsigned int j=colors+1; j <= levels; j++) {
+            double best = MAX_DIFF; unsigned int best_split = colors;
+            for(unsigned int i=colors; i < j; i++) {
+                const double e = prev[i] + range_error(prefix, i, j);
+                if (e < best) {
+                    best = e;
+                    best_split = i;
+                }
+            }
+            row[j] = best;
+            row_split[j] = best_split;
+        }
+        colors++;
+    }
+
+    colormap *map = pam_colormap(colors);
+    for(unsigned int k=colors, end=levels; k-- > 0;) {
+        const unsigned int start = split[k*(levels+1) + end];
+        const double weight = prefix[end].weight - prefix[start].weight;
+        const float gray = weight > 0 ? (prefix[end].sum - prefix[start].sum) / weight : achv[start].acolor.r;
+
+        map->palette[k].acolor = (f_pixel){.a = 1, .r = gray, .g = gray, .b = gray};
+        map->palette[k].popularity = weight;
+        end = start;
+    }
+
+    *palette_error_p = error[(colors-1)*(levels+1) + levels] * error_scale;
+
+    stats_free(error);
+    stats_free(split);
+    return map;
+}
@@ -0,0 +1,10 @@
+#ifndef GRAY_H
+#define GRAY_H
+
+/*
+ Palette of at most max_colors for a histogram of an opaque grayscale image (hist->gray) with the least possible error.
+ Uses the fewest colors that keep error within target_mse, if it's above 0. Sorts the histogram.
+ */
+colormap *gray_quantize(histogram *hist, unsigned int max_colors, double target_mse, double *palette_error_p);
+
+#endif
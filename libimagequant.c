@@ -0,0 +1,2274 @@
+/* libimagequant.c - quantize the colors in an alphamap down to a specified number
+**
+** Copyright (C) 1989, 1991 by Jef Poskanzer.
+** Copyright (C) 1997, 2000, 2002 by Greg Roelofs; based on an idea by
+**                                Stefan Schneider.
+** © 2009-2013 by Kornel Lesinski.
+**
+** Permission to use, copy, modify, and distribute this software and its
+** documentation for any purpose and without fee is hereby granted, provided
+** that the above copyright notice appear in all copies and that both that
+** copyright notice and this permission notice appear in supporting
+** documentation.  This software is provided "as is" without express or
+** implied warranty.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdbool.h>
+
+
+#include "libimagequant.h"
+
+#include "pam.h"
+#include "mediancut.h"
+#include "nearest.h"
+#include "blur.h"
+#include "viter.h"
+#include "gray.h"
+#include "simd.h"
+#include "stats.h"
+#include "trace.h"
+#include "taskpool.h"
+
+struct liq_attr {
+    double target_mse, max_mse;
+    float min_opaque_val;
+    unsigned int max_colors;
+    unsigned int speed;
+    bool last_index_transparent;
+    size_t max_memory; // 0 = unlimited
+    size_t pyramid_pixels; // palette of larger images is found on a downscaled copy, 0 = never
+
+    liq_log_callback_function *log_callback;
+    void *log_callback_user_info;
+    liq_log_flush_callback_function *log_flush_callback;
+    void *log_flush_callback_user_info;
+
+    liq_stats *stats;
+};
+
+#define LIQ_DEFAULT_ROW_CACHE_SIZE 32
+
+struct liq_image {
+    double gamma;
+    const rgb_pixel **rows;
+    const unsigned char **rgb_rows; // images created with liq_image_create_rgb_rows() have 3 bytes per pixel instead of rows
+    float *noise, *edges;
+    unsigned int width, height;
+    bool free_rows;
+    bool opaque; // known to have no transparency: created from RGB, or found to be opaque when making its histogram
+    bool gray; // opaque and r = g = b, found when making its histogram
+
+    // images created with liq_image_create_custom() have no rows; a band of rows is fetched at a time
+    liq_image_get_rgba_rows_callback *row_callback;
+    void *row_callback_user_info;
+    rgb_pixel *row_cache;
+    unsigned int row_cache_size, row_cache_first, row_cache_count;
+
+    bool modified; // alpha is adjusted on the fly for IE6, see modify_alpha()
+    unsigned char alpha_lut[256];
+};
+
+struct liq_fixed_palette {
+    colormap *map;
+    struct nearest_map *nearest; // built once, only read by remapping
+    liq_palette int_palette;
+    double gamma;
+};
+
+struct liq_histogram {
+    histogram *hist; // colors of all images added so far, NULL before the first
+    double gamma;
+};
+
+struct liq_result {
+    struct liq_attr options;
+    colormap *palette;
+    const liq_fixed_palette *fixed; // palette belongs to it and isn't changed by remapping
+    liq_palette int_palette;
+    float dither_level;
+    double gamma, palette_error;
+};
+
+static void verbose_printf(const liq_attr *context, const char *fmt, ...)
+{
+    if (context->log_callback) {
+        va_list va;
+        va_start(va, fmt);
+        int required_space = vsnprintf(NULL, 0, fmt, va)+1; // +\0
+        va_end(va);
+
+        char buf[required_space];
+        va_start(va, fmt);
+        vsnprintf(buf, required_space, fmt, va);
+        va_end(va);
+
+        context->log_callback(context, buf, context->log_callback_user_info);
+    }
+}
+
+inline static void verbose_print(const liq_attr *attr, const char *msg)
+{
+    if (attr->log_callback) attr->log_callback(attr, msg, attr->log_callback_user_info);
+}
+
+static void verbose_printf_flush(const liq_attr *attr)
+{
+    if (attr->log_flush_callback) attr->log_flush_callback(attr, attr->log_flush_callback_user_info);
+}
+
+static double quality_to_mse(long quality)
+{
+    if (quality == 0) return MAX_DIFF;
+
+    // curve fudged to be roughly similar to quality of libjpeg
+    return 2.5/pow(210.0 + quality, 1.2) * (100.1-quality)/100.0;
+}
+
+static int mse_to_quality(double mse)
+{
+    for(int i=100; i > 0; i--) {
+        if (mse <= quality_to_mse(i) + 0.000001) return i;
+    }
+    return 0;
+}
+
+LIQ_EXPORT liq_attr* liq_attr_create(void)
+{
+    simd_init();
+
+    liq_attr *attr = malloc(sizeof(liq_attr));
+    if (!attr) return NULL;
+
+    *attr = (liq_attr) {
+        .max_colors = 256,
+        .min_opaque_val = 1, // whether preserve opaque colors for IE (1.0=no, does not affect alpha)
+        .speed = 3, // 1 max quality, 10 rough & fast. 3 is optimum.
+        .last_index_transparent = false, // puts transparent color at last index. This is workaround for blu-ray subtitles.
+        .target_mse = 0,
+        .max_mse = MAX_DIFF,
+    };
+    return attr;
+}
+
+LIQ_EXPORT liq_attr* liq_attr_copy(const liq_attr *orig)
+{
+    liq_attr *attr = malloc(sizeof(liq_attr));
+    if (!attr) return NULL;
+
+    *attr = *orig;
+    return attr;
+}
+
+LIQ_EXPORT void liq_attr_destroy(liq_attr *attr)
+{
+    free(attr);
+}
+
+LIQ_EXPORT liq_error liq_set_max_colors(liq_attr* attr, int colors)
+{
+    if (colors < 2 || colors > 256) return LIQ_VALUE_OUT_OF_RANGE;
+
+    attr->max_colors = colors;
+    return LIQ_OK;
+}
+
+LIQ_EXPORT int liq_get_max_colors(const liq_attr* attr)
+{
+    return attr->max_colors;
+}
+
+LIQ_EXPORT liq_error liq_set_speed(liq_attr* attr, int speed)
+{
+    if (speed < 1 || speed > 10) return LIQ_VALUE_OUT_OF_RANGE;
+
+    attr->speed = speed;
+    return LIQ_OK;
+}
+
+LIQ_EXPORT int liq_get_speed(const liq_attr* attr)
+{
+    return attr->speed;
+}
+
+LIQ_EXPORT liq_error liq_set_min_opacity(liq_attr* attr, int min)
+{
+    if (min < 0 || min > 255) return LIQ_VALUE_OUT_OF_RANGE;
+
+    attr->min_opaque_val = (double)min/256.0;
+    return LIQ_OK;
+}
+
+LIQ_EXPORT int liq_get_min_opacity(const liq_attr* attr)
+{
+    return MIN(255, 256.0 * attr->min_opaque_val);
+}
+
+LIQ_EXPORT liq_error liq_set_quality(liq_attr* attr, int minimum, int target)
+{
+    if (target < 0 || target > 100 || target < minimum || minimum < 0) return LIQ_VALUE_OUT_OF_RANGE;
+
+    attr->target_mse = quality_to_mse(target);
+    attr->max_mse = quality_to_mse(minimum);
+    return LIQ_OK;
+}
+
+LIQ_EXPORT int liq_get_min_quality(const liq_attr* attr)
+{
+    return mse_to_quality(attr->max_mse);
+}
+
+LIQ_EXPORT int liq_get_max_quality(const liq_attr* attr)
+{
+    return mse_to_quality(attr->target_mse);
+}
+
+LIQ_EXPORT liq_error liq_set_max_memory(liq_attr* attr, size_t bytes)
+{
+    attr->max_memory = bytes;
+    return LIQ_OK;
+}
+
+LIQ_EXPORT size_t liq_get_max_memory(const liq_attr* attr)
+{
+    return attr->max_memory;
+}
+
+#define PYRAMID_MIN_PIXELS (64*64)
+
+LIQ_EXPORT liq_error liq_set_pyramid(liq_attr* attr, size_t max_pixels)
+{
+    if (max_pixels && max_pixels < PYRAMID_MIN_PIXELS) return LIQ_VALUE_OUT_OF_RANGE;
+
+    attr->pyramid_pixels = max_pixels;
+    return LIQ_OK;
+}
+
+LIQ_EXPORT size_t liq_get_pyramid(const liq_attr* attr)
+{
+    return attr->pyramid_pixels;
+}
+
+LIQ_EXPORT liq_error liq_set_threads(int threads)
+{
+    if (threads < 0) return LIQ_VALUE_OUT_OF_RANGE;
+    if (!taskpool_init(threads)) return LIQ_OUT_OF_MEMORY;
+    return LIQ_OK;
+}
+
+LIQ_EXPORT int liq_get_threads(void)
+{
+    return taskpool_threads();
+}
+
+/*
+ Bytes that can still be allocated within the liq_set_max_memory() limit.
+ Memory already counted in stats (the input image, if the client added it) is included.
+ */
+static size_t liq_memory_available(const liq_attr *attr)
+{
+    if (!attr->max_memory) return (size_t)-1;
+
+    const size_t used = attr->stats ? attr->stats->mem_live : 0;
+    return used < attr->max_memory ? attr->max_memory - used : 0;
+}
+
+LIQ_EXPORT void liq_set_last_index_transparent(liq_attr* attr, int is_last)
+{
+    attr->last_index_transparent = !!is_last;
+}
+
+LIQ_EXPORT void liq_set_log_callback(liq_attr *attr, liq_log_callback_function *callback, void* user_info)
+{
+    verbose_printf_flush(attr);
+    attr->log_callback = callback;
+    attr->log_callback_user_info = user_info;
+}
+
+LIQ_EXPORT void liq_set_stats(liq_attr *attr, liq_stats *stats)
+{
+    attr->stats = stats;
+}
+
+LIQ_EXPORT void liq_set_log_flush_callback(liq_attr *attr, liq_log_flush_callback_function *callback, void* user_info)
+{
+    attr->log_flush_callback = callback;
+    attr->log_flush_callback_user_info = user_info;
+}
+
+/*
+ IE6 makes colors with even slightest transparency completely transparent,
+ thus to improve situation in IE, make colors that are less than ~10% transparent
+ completely opaque. Only alpha changes, so it's precomputed for all 256 alpha values
+ and applied as rows are read, leaving caller's pixels untouched.
+ */
+static void modify_alpha(liq_image *input_image, const float min_opaque_val)
+{
+    const float almost_opaque_val = min_opaque_val * 169.f/256.f;
+    const unsigned int almost_opaque_val_int = almost_opaque_val*255.f;
+
+    for(unsigned int a=0; a < 256; a++) {
+        input_image->alpha_lut[a] = a;
+
+        /* ie bug: to avoid visible step caused by forced opaqueness, linearily raise opaqueness of almost-opaque colors */
+        if (a >= almost_opaque_val_int) {
+            f_pixel px = {.a = a/255.f};
+
+            float al = almost_opaque_val + (px.a-almost_opaque_val) * (1-almost_opaque_val) / (min_opaque_val-almost_opaque_val);
+            if (al > 1) al = 1;
+            px.a = al;
+            input_image->alpha_lut[a] = to_rgb(input_image->gamma, px).a;
+        }
+    }
+    input_image->modified = true;
+}
+
+/* Fetches band of rows starting at the given row from the callback. Cache is allocated on first use */
+static bool liq_image_fill_row_cache(liq_image *img, unsigned int row)
+{
+    if (!img->row_cache) {
+        img->row_cache_size = MIN(img->row_cache_size, img->height);
+        img->row_cache = stats_malloc(sizeof(rgb_pixel) * img->width * img->row_cache_size);
+        if (!img->row_cache) return false;
+    }
+
+    img->row_cache_first = row;
+    img->row_cache_count = MIN(img->row_cache_size, img->height - row);
+    img->row_callback((liq_color *)img->row_cache, row, img->row_cache_count, img->width, img->row_callback_user_info);
+
+    if (img->modified) {
+        const size_t pixels = (size_t)img->width * img->row_cache_count;
+        for(size_t i=0; i < pixels; i++) {
+            img->row_cache[i].a = img->alpha_lut[img->row_cache[i].a];
+        }
+    }
+    return true;
+}
+
+/*
+ Returns row of the image. temp_row (width pixels) is used if the row needs to be modified before use.
+
+ Rows of callback images come from the row cache and are valid only until the next call,
+ which also must not be made concurrently (see liq_image_has_rows()).
+ */
+static const rgb_pixel *liq_image_get_row_rgba(liq_image *img, unsigned int row, rgb_pixel *temp_row)
+{
+    if (img->row_callback) {
+        if (row < img->row_cache_first || row >= img->row_cache_first + img->row_cache_count) {
+            if (!liq_image_fill_row_cache(img, row)) {
+                // out of memory, so get just the one row
+                img->row_callback((liq_color *)temp_row, row, 1, img->width, img->row_callback_user_info);
+                if (img->modified) for(unsigned int col=0; col < img->width; col++) {
+                    temp_row[col].a = img->alpha_lut[temp_row[col].a];
+                }
+                return temp_row;
+            }
+        }
+        return img->row_cache + (size_t)(row - img->row_cache_first) * img->width;
+    }
+
+    if (img->rgb_rows) {
+        const unsigned char *const rgb = img->rgb_rows[row];
+        const unsigned char alpha = img->modified ? img->alpha_lut[255] : 255;
+        for(unsigned int col=0; col < img->width; col++) {
+            temp_row[col] = (rgb_pixel){rgb[col*3], rgb[col*3+1], rgb[col*3+2], alpha};
+        }
+        return temp_row;
+    }
+
+    const rgb_pixel *const row_pixels = img->rows[row];
+    if (!img->modified) {
+        return row_pixels;
+    }
+
+    for(unsigned int col=0; col < img->width; col++) {
+        temp_row[col] = row_pixels[col];
+        temp_row[col].a = img->alpha_lut[row_pixels[col].a];
+    }
+    return temp_row;
+}
+
+/* Same as liq_image_get_row_rgba(), but the row stays valid until temp_row is reused */
+static const rgb_pixel *liq_image_get_row_rgba_copy(liq_image *img, unsigned int row, rgb_pixel *temp_row)
+{
+    const rgb_pixel *const row_pixels = liq_image_get_row_rgba(img, row, temp_row);
+    if (img->row_callback && row_pixels != temp_row) {
+        memcpy(temp_row, row_pixels, sizeof(rgb_pixel) * img->width);
+        return temp_row;
+    }
+    return row_pixels;
+}
+
+/* rows of images with row pointers can be read from multiple threads */
+inline static bool liq_image_has_rows(const liq_image *img)
+{
+    return img->rows || img->rgb_rows;
+}
+
+/* otherwise liq_image_get_row_rgba() needs temp_row */
+inline static bool liq_image_can_use_rows(const liq_image *img)
+{
+    return img->rows && !img->modified;
+}
+
+static liq_image *liq_image_create_internal(const liq_attr *attr, const rgb_pixel *rows[], liq_image_get_rgba_rows_callback *row_callback, void *row_callback_user_info, int width, int height, double gamma)
+{
+    if (width <= 0 || height <= 0) return NULL;
+
+    liq_image *img = malloc(sizeof(liq_image));
+    if (!img) return NULL;
+
+    *img = (liq_image){
+        .rows = rows,
+        .row_callback = row_callback,
+        .row_callback_user_info = row_callback_user_info,
+        .row_cache_size = LIQ_DEFAULT_ROW_CACHE_SIZE,
+        .width = width, .height = height,
+        .gamma = gamma ? gamma : 0.45455,
+    };
+
+    if (attr->min_opaque_val <= 254.f/255.f) {
+        verbose_print(attr, "  Working around IE6 bug by making image less transparent...");
+        const stats_time start = stats_start(attr->stats);
+        modify_alpha(img, attr->min_opaque_val);
+        stats_end(attr->stats, STATS_MODIFY_ALPHA, start);
+    }
+    return img;
+}
+
+LIQ_EXPORT liq_image *liq_image_create_custom(const liq_attr *attr, liq_image_get_rgba_rows_callback *row_callback, void* user_info, int width, int height, double gamma)
+{
+    if (!row_callback) return NULL;
+    return liq_image_create_internal(attr, NULL, row_callback, user_info, width, height, gamma);
+}
+
+LIQ_EXPORT liq_error liq_image_set_row_cache_size(liq_image *img, int rows)
+{
+    if (rows < 1) return LIQ_VALUE_OUT_OF_RANGE;
+    if (!img->row_callback) return LIQ_OK; // images with row pointers don't need a cache
+
+    stats_free(img->row_cache);
+    img->row_cache = NULL;
+    img->row_cache_size = rows;
+    img->row_cache_count = 0;
+    return LIQ_OK;
+}
+
+LIQ_EXPORT liq_image *liq_image_create_rgba_rows(const liq_attr *attr, void* rows[], int width, int height, double gamma)
+{
+    if (!rows) return NULL;
+    return liq_image_create_internal(attr, (const rgb_pixel **)rows, NULL, NULL, width, height, gamma);
+}
+
+LIQ_EXPORT liq_image *liq_image_create_rgb_rows(const liq_attr *attr, void* rows[], int width, int height, double gamma)
+{
+    if (!rows) return NULL;
+    liq_image *img = liq_image_create_internal(attr, NULL, NULL, NULL, width, height, gamma);
+    if (img) {
+        img->rgb_rows = (const unsigned char **)rows;
+        img->opaque = true;
+    }
+    return img;
+}
+
+typedef liq_image *create_rows_fn(const liq_attr *attr, void* rows[], int width, int height, double gamma);
+
+/* image with rows pointing into the bitmap, which are freed with the image */
+static liq_image *liq_image_create_bitmap(const liq_attr *attr, create_rows_fn *create_rows, void* bitmap, int width, int height, size_t stride, const size_t pixel_size, double gamma)
+{
+    if (width <= 0 || height <= 0 || !bitmap) return NULL;
+    if (!stride) stride = width * pixel_size;
+    if (stride < width * pixel_size) return NULL;
+
+    struct liq_stats *const prev_stats = stats_set_current(attr->stats);
+    unsigned char **rows = stats_malloc(sizeof(rows[0]) * height);
+    stats_set_current(prev_stats);
+    if (!rows) return NULL;
+
+    for(int i=0; i < height; i++) {
+        rows[i] = (unsigned char *)bitmap + (size_t)i * stride;
+    }
+
+    liq_image *img = create_rows(attr, (void**)rows, width, height, gamma);
+    if (!img) {
+        stats_free(rows);
+        return NULL;
+    }
+    img->free_rows = true;
+    return img;
+}
+
+LIQ_EXPORT liq_image *liq_image_create_rgba(const liq_attr *attr, void* bitmap, int width, int height, size_t stride, double gamma)
+{
+    return liq_image_create_bitmap(attr, liq_image_create_rgba_rows, bitmap, width, height, stride, sizeof(rgb_pixel), gamma);
+}
+
+LIQ_EXPORT liq_image *liq_image_create_rgb(const liq_attr *attr, void* bitmap, int width, int height, size_t stride, double gamma)
+{
+    return liq_image_create_bitmap(attr, liq_image_create_rgb_rows, bitmap, width, height, stride, 3, gamma);
+}
+
+/* image that owns its pixels: they're allocated after the row pointers and freed with them */
+static liq_image *liq_image_create_owned(const liq_image *source, unsigned int width, unsigned int height)
+{
+    const rgb_pixel **rows = stats_malloc(sizeof(rows[0]) * height + sizeof(rgb_pixel) * width * height);
+    if (!rows) return NULL;
+
+    liq_image *img = malloc(sizeof(liq_image));
+    if (!img) {
+        stats_free(rows);
+        return NULL;
+    }
+
+    rgb_pixel *const pixels = (rgb_pixel *)(rows + height);
+    for(unsigned int i=0; i < height; i++) {
+        rows[i] = pixels + (size_t)i * width;
+    }
+
+    *img = (liq_image){
+        .rows = rows,
+        .free_rows = true,
+        .width = width, .height = height,
+        .gamma = source->gamma,
+    };
+    return img;
+}
+
+LIQ_EXPORT liq_image *liq_image_copy(const liq_image *source)
+{
+    if (!source) return NULL;
+
+    liq_image *img = malloc(sizeof(liq_image));
+    if (!img) return NULL;
+
+    // pixels still belong to the source. The copy has its own row cache, and edges that its remapping changes
+    *img = *source;
+    img->free_rows = false;
+    img->noise = img->edges = NULL;
+    img->row_cache = NULL;
+    img->row_cache_first = img->row_cache_count = 0;
+
+    if (source->edges) {
+        const size_t size = sizeof(img->edges[0]) * source->width * source->height;
+        if (!(img->edges = stats_malloc(size))) {
+            free(img);
+            return NULL;
+        }
+        memcpy(img->edges, source->edges, size);
+    }
+    return img;
+}
+
+LIQ_EXPORT int liq_image_get_width(const liq_image *img)
+{
+    return img->width;
+}
+
+LIQ_EXPORT int liq_image_get_height(const liq_image *img)
+{
+    return img->height;
+}
+
+static void liq_image_free_maps(liq_image *input_image)
+{
+    if (input_image->noise) {
+        stats_free(input_image->noise);
+        input_image->noise = NULL;
+    }
+
+    if (input_image->edges) {
+        stats_free(input_image->edges);
+        input_image->edges = NULL;
+    }
+}
+
+LIQ_EXPORT void liq_image_destroy(liq_image *input_image)
+{
+    liq_image_free_maps(input_image);
+
+    if (input_image->free_rows) {
+        stats_free(input_image->rows);
+        stats_free(input_image->rgb_rows);
+    }
+    stats_free(input_image->row_cache);
+    free(input_image);
+}
+
+static int compare_popularity(const void *ch1, const void *ch2)
+{
+    const float v1 = ((const colormap_item*)ch1)->popularity;
+    const float v2 = ((const colormap_item*)ch2)->popularity;
+    return v1 > v2 ? 1 : -1;
+}
+
+static void sort_palette(colormap *map, const liq_attr *options)
+{
+    /*
+    ** Step 3.5 [GRR]: remap the palette colors so that all entries with
+    ** the maximal alpha value (i.e., fully opaque) are at the end and can
+    ** therefore be omitted from the tRNS chunk.
+    */
+
+
+    if (options->last_index_transparent) for(unsigned int i=0; i < map->colors; i++) {
+        if (map->palette[i].acolor.a < 1.0/256.0) {
+            const unsigned int old = i, transparent_dest = map->colors-1;
+
+            const colormap_item tmp = map->palette[transparent_dest];
+            map->palette[transparent_dest] = map->palette[old];
+            map->palette[old] = tmp;
+
+            /* colors sorted by popularity make pngs slightly more compressible */
+            qsort(map->palette, map->colors-1, sizeof(map->palette[0]), compare_popularity);
+            return;
+            }
+        }
+
+    /* move transparent colors to the beginning to shrink trns chunk */
+    unsigned int num_transparent=0;
+    for(unsigned int i=0; i < map->colors; i++) {
+        if (map->palette[i].acolor.a < 255.0/256.0) {
+            // current transparent color is swapped with earlier opaque one
+            if (i != num_transparent) {
+                const colormap_item tmp = map->palette[num_transparent];
+                map->palette[num_transparent] = map->palette[i];
+                map->palette[i] = tmp;
+                i--;
+            }
+            num_transparent++;
+        }
+    }
+
+    verbose_printf(options, "  eliminated opaque tRNS-chunk entries...%d entr%s transparent", num_transparent, (num_transparent == 1)? "y" : "ies");
+
+    /* colors sorted by popularity make pngs slightly more compressible
+     * opaque and transparent are sorted separately
+     */
+    qsort(map->palette, num_transparent, sizeof(map->palette[0]), compare_popularity);
+    qsort(map->palette+num_transparent, map->colors-num_transparent, sizeof(map->palette[0]), compare_popularity);
+}
+
+static void set_palette(liq_result *result, const colormap *map)
+{
+    float gamma_lut[256];
+    to_f_set_gamma(gamma_lut, result->gamma);
+
+    result->int_palette.count = map->colors;
+    for(unsigned int x = 0; x < map->colors; ++x) {
+        rgb_pixel px = to_rgb(result->gamma, map->palette[x].acolor);
+        map->palette[x].acolor = to_f(gamma_lut, px); /* saves rounding error introduced by to_rgb, which makes remapping & dithering more accurate */
+
+        result->int_palette.entries[x] = (liq_color){.r=px.r, .g=px.g, .b=px.b, .a=px.a};
+    }
+}
+
+struct remap_context {
+    liq_image *input_image;
+    unsigned char *const *output_pixels;
+    colormap *map;
+    const struct nearest_map *n;
+    const float *gamma_lut;
+    float min_opaque_val;
+    unsigned int transparent_ind;
+    bool opaque; // image and palette are opaque, so no pixel is transparent and alpha can be skipped
+    const unsigned char *gray_lut; // for grayscale images: palette index, distance and color of each of 256 levels
+    const float *gray_diff;
+    const f_pixel *gray_colors;
+    rgb_pixel *temp_rows;
+    viter_state *average_color; // NULL if the palette is fixed
+    double *remapping_error; // these two are one per chunk
+    size_t *remapped_pixels;
+    struct liq_counters *counters;
+};
+
+static void remap_rows(void *context, unsigned int chunk, unsigned int start, unsigned int end)
+{
+    struct remap_context *const c = context;
+    const unsigned int cols = c->input_image->width;
+    trace_begin("remap_to_palette rows");
+
+    size_t remapped_pixels=0;
+    double remapping_error=0;
+    size_t level_pixels[256];
+    if (c->gray_lut) memset(level_pixels, 0, sizeof(level_pixels));
+
+    for(unsigned int row = start; row < end; ++row) {
+        const rgb_pixel *const row_pixels = liq_image_get_row_rgba(c->input_image, row, c->temp_rows ? c->temp_rows + (size_t)cols * chunk : NULL);
+
+        if (c->gray_lut) {
+            for(unsigned int col = 0; col < cols; ++col) {
+                const unsigned char level = row_pixels[col].r;
+                c->output_pixels[row][col] = c->gray_lut[level];
+                level_pixels[level]++;
+            }
+            continue;
+        }
+
+        if (c->opaque) {
+            for(unsigned int col = 0; col < cols; ++col) {
+                const f_pixel px = to_f(c->gamma_lut, row_pixels[col]);
+                float diff;
+                const unsigned int match = nearest_search_rgb(c->n, px, &diff);
+                remapping_error += diff;
+
+                c->output_pixels[row][col] = match;
+                if (c->average_color) viter_update_color(px, 1.0, c->map, match, chunk, c->average_color);
+            }
+            remapped_pixels += cols;
+            continue;
+        }
+
+        for(unsigned int col = 0; col < cols; ++col) {
+
+            f_pixel px = to_f(c->gamma_lut, row_pixels[col]);
+            unsigned int match;
+
+            if (px.a < 1.0/256.0) {
+                match = c->transparent_ind;
+            } else {
+                float diff;
+                match = nearest_search(c->n, px, c->min_opaque_val, &diff);
+
+                remapped_pixels++;
+                remapping_error += diff;
+            }
+
+            c->output_pixels[row][col] = match;
+
+            if (c->average_color) viter_update_color(px, 1.0, c->map, match, chunk, c->average_color);
+        }
+    }
+    // pixels of each gray level are added at once
+    if (c->gray_lut) for(unsigned int level=0; level < 256; level++) {
+        if (!level_pixels[level]) continue;
+        remapped_pixels += level_pixels[level];
+        remapping_error += c->gray_diff[level] * level_pixels[level];
+        if (c->average_color) viter_update_color(c->gray_colors[level], level_pixels[level], c->map, c->gray_lut[level], chunk, c->average_color);
+    }
+
+    c->remapping_error[chunk] = remapping_error;
+    c->remapped_pixels[chunk] = remapped_pixels;
+
+    counters_flush(c->counters);
+    trace_end("remap_to_palette rows");
+}
+
+/* palette is refined with colors of remapped pixels, unless it's fixed (has fixed_nearest) */
+static float remap_to_palette(liq_image *const input_image, unsigned char *const *const output_pixels, colormap *const map, const struct nearest_map *fixed_nearest, const float min_opaque_val)
+{
+    const unsigned int rows = input_image->height;
+    const unsigned int cols = input_image->width;
+
+    float gamma_lut[256];
+    to_f_set_gamma(gamma_lut, input_image->gamma);
+
+    struct nearest_map *const own_nearest = fixed_nearest ? NULL : nearest_init(map);
+    const struct nearest_map *const n = fixed_nearest ? fixed_nearest : own_nearest;
+    const bool opaque = input_image->opaque && nearest_is_opaque(n);
+    const unsigned int transparent_ind = opaque ? 0 : nearest_search(n, (f_pixel){0,0,0,0}, min_opaque_val, NULL);
+
+    // every pixel of a grayscale image is one of 256 levels, so each level is searched for only once
+    unsigned char gray_lut[256]; float gray_diff[256]; f_pixel gray_colors[256];
+    if (input_image->gray) for(unsigned int level=0; level < 256; level++) {
+        gray_colors[level] = to_f(gamma_lut, (rgb_pixel){level, level, level, 255});
+        gray_lut[level] = nearest_search(n, gray_colors[level], min_opaque_val, &gray_diff[level]);
+    }
+
+    // bands of rows don't depend on number of threads, so the result is the same for any number of threads
+    const unsigned int chunks = taskpool_row_chunks(rows, cols);
+    // sums for every color in every chunk are too large for stacks of worker threads; without them the palette isn't refined
+    viter_state *average_color = fixed_nearest ? NULL : stats_malloc(sizeof(average_color[0]) * map->colors * chunks);
+    if (average_color) viter_init(map, chunks, average_color);
+    double chunk_errors[chunks];
+    size_t chunk_pixels[chunks];
+
+    rgb_pixel *temp_rows = !liq_image_can_use_rows(input_image) ? stats_malloc(sizeof(rgb_pixel) * cols * chunks) : NULL;
+    struct liq_counters counters = {0};
+    struct remap_context context = {
+        .input_image = input_image,
+        .output_pixels = output_pixels,
+        .map = map,
+        .n = n,
+        .gamma_lut = gamma_lut,
+        .min_opaque_val = min_opaque_val,
+        .transparent_ind = transparent_ind,
+        .opaque = opaque,
+        .gray_lut = input_image->gray ? gray_lut : NULL,
+        .gray_diff = gray_diff,
+        .gray_colors = gray_colors,
+        .temp_rows = temp_rows,
+        .average_color = average_color,
+        .remapping_error = chunk_errors,
+        .remapped_pixels = chunk_pixels,
+        .counters = &counters,
+    };
+    // row callback isn't called concurrently
+    taskpool_parallel_for(rows, chunks, remap_rows, &context, liq_image_has_rows(input_image));
+    counters_add(&counters);
+
+    size_t remapped_pixels=0;
+    double remapping_error=0;
+    for(unsigned int i=0; i < chunks; i++) {
+        remapped_pixels += chunk_pixels[i];
+        remapping_error += chunk_errors[i];
+    }
+
+    if (average_color) viter_finalize(map, chunks, average_color);
+    if (own_nearest) nearest_free(own_nearest);
+    stats_free(average_color);
+    stats_free(temp_rows);
+
+    return remapping_error / MAX(1,remapped_pixels);
+}
+
+static float distance_from_closest_other_color(const colormap *map, const unsigned int i)
+{
+    float second_best=MAX_DIFF;
+    for(unsigned int j=0; j < map->colors; j++) {
+        if (i == j) continue;
+        float diff = colordifference(map->palette[i].acolor, map->palette[j].acolor);
+        if (diff <= second_best) {
+            second_best = diff;
+        }
+    }
+    return second_best;
+}
+
+inline static float min_4(float a, float b, float c, float d)
+{
+    float x = MIN(a,b), y = MIN(c,d);
+    return MIN(x,y);
+}
+
+inline static f_pixel get_dithered_pixel(const float dither_level, const float max_dither_error, const f_pixel thiserr, const f_pixel px)
+{
+    /* Use Floyd-Steinberg errors to adjust actual color. */
+    const float sr = thiserr.r * dither_level,
+                sg = thiserr.g * dither_level,
+                sb = thiserr.b * dither_level,
+                sa = thiserr.a * dither_level;
+
+    float ratio = min_4((sr < 0) ? px.r/-sr : (sr > 0) ? (1.0-px.r)/sr : 1.0,
+                        (sg < 0) ? px.g/-sg : (sg > 0) ? (1.0-px.g)/sg : 1.0,
+                        (sb < 0) ? px.b/-sb : (sb > 0) ? (1.0-px.b)/sb : 1.0,
+                        (sa < 0) ? px.a/-sa : (sa > 0) ? (1.0-px.a)/sa : 1.0);
+
+     // If dithering error is crazy high, don't propagate it that much
+     // This prevents crazy geen pixels popping out of the blue (or red or black! ;)
+     const float dither_error = sr*sr + sg*sg + sb*sb + sa*sa;
+     if (dither_error > max_dither_error) {
+         ratio *= 0.8;
+     } else if (dither_error < 2.f/256.f/256.f) {
+        // don't dither areas that don't have noticeable error — makes file smaller
+        return px;
+     }
+
+     if (ratio > 1.0) ratio = 1.0;
+     if (ratio < 0) ratio = 0;
+
+     return (f_pixel){
+         .r=px.r + sr * ratio,
+         .g=px.g + sg * ratio,
+         .b=px.b + sb * ratio,
+         .a=px.a + sa * ratio,
+     };
+}
+
+/*
+ Noise of +/-0.5/255 for the initial error row. This is a local LCG rather than rand(),
+ because rand() state is shared by the whole process and images remapped in parallel would reseed each other.
+ */
+inline static float dither_seed_error(unsigned int *seed)
+{
+    *seed = *seed * 1103515245u + 12345u;
+    return (((*seed >> 16) & 0x7fff) / 32767.0 - 0.5) / 255.0;
+}
+
+/**
+  Uses edge/noise map to apply dithering only to flat areas. Dithering on edges creates jagged lines, and noisy areas are "naturally" dithered.
+
+  If output_image_is_remapped is true, only pixels noticeably changed by error diffusion will be written to output image.
+ */
+static void remap_to_palette_floyd(liq_image *input_image, unsigned char *const output_pixels[], const colormap *map, const struct nearest_map *fixed_nearest, const float min_opaque_val, const float *dither_map, const int output_image_is_remapped, const float max_dither_error, const float base_dithering_level)
+{
+    const unsigned int rows = input_image->height, cols = input_image->width;
+
+    float gamma_lut[256];
+    to_f_set_gamma(gamma_lut, input_image->gamma);
+
+    const colormap_item *acolormap = map->palette;
+
+    struct nearest_map *const own_nearest = fixed_nearest ? NULL : nearest_init(map);
+    const struct nearest_map *const n = fixed_nearest ? fixed_nearest : own_nearest;
+    const unsigned int transparent_ind = nearest_search(n, (f_pixel){0,0,0,0}, min_opaque_val, NULL);
+
+    float difference_tolerance[map->colors];
+
+    if (output_image_is_remapped) for(unsigned int i=0; i < map->colors; i++) {
+            difference_tolerance[i] = distance_from_closest_other_color(map,i) / 4.f; // half of squared distance
+        }
+
+    /* Initialize Floyd-Steinberg error vectors. */
+    f_pixel *restrict thiserr, *restrict nexterr;
+    thiserr = stats_malloc((cols + 2) * sizeof(*thiserr));
+    nexterr = stats_malloc((cols + 2) * sizeof(*thiserr));
+    rgb_pixel *temp_row = !liq_image_can_use_rows(input_image) ? stats_malloc(sizeof(rgb_pixel) * cols) : NULL;
+    unsigned int seed = 12345; /* deterministic dithering is better for comparing results */
+
+    for (unsigned int col = 0; col < cols + 2; ++col) {
+        thiserr[col].r = dither_seed_error(&seed);
+        thiserr[col].g = dither_seed_error(&seed);
+        thiserr[col].b = dither_seed_error(&seed);
+        thiserr[col].a = dither_seed_error(&seed);
+    }
+
+    bool fs_direction = true;
+    for (unsigned int row = 0; row < rows; ++row) {
+        memset(nexterr, 0, (cols + 2) * sizeof(*nexterr));
+
+        unsigned int col = (fs_direction) ? 0 : (cols - 1);
+        const rgb_pixel *const row_pixels = liq_image_get_row_rgba(input_image, row, temp_row);
+
+        do {
+            float dither_level = (dither_map ? dither_map[(size_t)row*cols + col] : 15.f/16.f) * base_dithering_level;
+            const f_pixel spx = get_dithered_pixel(dither_level, max_dither_error, thiserr[col + 1], to_f(gamma_lut, row_pixels[col]));
+
+            unsigned int ind;
+            if (spx.a < 1.0/256.0) {
+                ind = transparent_ind;
+            } else {
+                unsigned int curr_ind = output_pixels[row][col];
+                if (output_image_is_remapped) COUNTER_ADD(floyd_tolerance_checks, 1);
+                if (output_image_is_remapped && colordifference(map->palette[curr_ind].acolor, spx) < difference_tolerance[curr_ind]) {
+                    COUNTER_ADD(floyd_tolerance_hits, 1);
+                    ind = curr_ind;
+                } else {
+                    ind = nearest_search(n, spx, min_opaque_val, NULL);
+                }
+            }
+
+            output_pixels[row][col] = ind;
+
+            const f_pixel xp = acolormap[ind].acolor;
+            f_pixel err = {
+                .r = (spx.r - xp.r),
+                .g = (spx.g - xp.g),
+                .b = (spx.b - xp.b),
+                .a = (spx.a - xp.a),
+            };
+
+            // If dithering error is crazy high, don't propagate it that much
+            // This prevents crazy geen pixels popping out of the blue (or red or black! ;)
+            if (err.r*err.r + err.g*err.g + err.b*err.b + err.a*err.a > max_dither_error) {
+                dither_level *= 0.75;
+            }
+
+            const float colorimp = (3.0f + acolormap[ind].acolor.a)/4.0f * dither_level;
+            err.r *= colorimp;
+            err.g *= colorimp;
+            err.b *= colorimp;
+            err.a *= dither_level;
+
+            /* Propagate Floyd-Steinberg error terms. */
+            if (fs_direction) {
+                thiserr[col + 2].a += (err.a * 7.0f) / 16.0f;
+                thiserr[col + 2].r += (err.r * 7.0f) / 16.0f;
+                thiserr[col + 2].g += (err.g * 7.0f) / 16.0f;
+                thiserr[col + 2].b += (err.b * 7.0f) / 16.0f;
+
+                nexterr[col    ].a += (err.a * 3.0f) / 16.0f;
+                nexterr[col    ].r += (err.r * 3.0f) / 16.0f;
+                nexterr[col    ].g += (err.g * 3.0f) / 16.0f;
+                nexterr[col    ].b += (err.b * 3.0f) / 16.0f;
+
+                nexterr[col + 1].a += (err.a * 5.0f) / 16.0f;
+                nexterr[col + 1].r += (err.r * 5.0f) / 16.0f;
+                nexterr[col + 1].g += (err.g * 5.0f) / 16.0f;
+                nexterr[col + 1].b += (err.b * 5.0f) / 16.0f;
+
+                nexterr[col + 2].a += (err.a       ) / 16.0f;
+                nexterr[col + 2].r += (err.r       ) / 16.0f;
+                nexterr[col + 2].g += (err.g       ) / 16.0f;
+                nexterr[col + 2].b += (err.b       ) / 16.0f;
+            } else {
+                thiserr[col    ].a += (err.a * 7.0f) / 16.0f;
+                thiserr[col    ].r += (err.r * 7.0f) / 16.0f;
+                thiserr[col    ].g += (err.g * 7.0f) / 16.0f;
+                thiserr[col    ].b += (err.b * 7.0f) / 16.0f;
+
+                nexterr[col    ].a += (err.a       ) / 16.0f;
+                nexterr[col    ].r += (err.r       ) / 16.0f;
+                nexterr[col    ].g += (err.g       ) / 16.0f;
+                nexterr[col    ].b += (err.b       ) / 16.0f;
+
+                nexterr[col + 1].a += (err.a * 5.0f) / 16.0f;
+                nexterr[col + 1].r += (err.r * 5.0f) / 16.0f;
+                nexterr[col + 1].g += (err.g * 5.0f) / 16.0f;
+                nexterr[col + 1].b += (err.b * 5.0f) / 16.0f;
+
+                nexterr[col + 2].a += (err.a * 3.0f) / 16.0f;
+                nexterr[col + 2].r += (err.r * 3.0f) / 16.0f;
+                nexterr[col + 2].g += (err.g * 3.0f) / 16.0f;
+                nexterr[col + 2].b += (err.b * 3.0f) / 16.0f;
+            }
+
+            // remapping is done in zig-zag
+            if (fs_direction) {
+                ++col;
+                if (col >= cols) break;
+            } else {
+                if (col <= 0) break;
+                --col;
+            }
+        }
+        while(1);
+
+        f_pixel *const temperr = thiserr;
+        thiserr = nexterr;
+        nexterr = temperr;
+        fs_direction = !fs_direction;
+    }
+
+    stats_free(thiserr);
+    stats_free(nexterr);
+    stats_free(temp_row);
+    if (own_nearest) nearest_free(own_nearest);
+}
+
+// each color is in the hash and then in the histogram copied from it while the hash is still alive.
+// Hash arrays have spare capacity and mempool allocates ahead, so a color takes several hash items.
+#define HISTOGRAM_COLOR_SIZE (sizeof(struct acolorhist_arr_item)*4 + sizeof(hist_item))
+
+static unsigned int histogram_max_colors(const liq_attr *options)
+{
+    return (1<<17) + (1<<18)*(10-options->speed);
+}
+
+/* histogram contains information how many times each color is present in the image, weighted by importance_map */
+static histogram *get_histogram(liq_image *input_image, const liq_attr *options)
+{
+    unsigned int ignorebits=0;
+    const unsigned int cols = input_image->width, rows = input_image->height;
+    rgb_pixel *temp_row = !liq_image_can_use_rows(input_image) ? stats_malloc(sizeof(rgb_pixel) * cols) : NULL;
+
+   /*
+    ** Step 2: attempt to make a histogram of the colors, unclustered.
+    ** If at first we don't succeed, increase ignorebits to increase color
+    ** coherence and try again.
+    */
+
+    if (options->speed > 7) ignorebits++;
+    unsigned int maxcolors = histogram_max_colors(options);
+
+    // With fewer colors allowed the hash starts over with more ignorebits sooner, using less memory.
+    const size_t memory_colors = liq_memory_available(options) / HISTOGRAM_COLOR_SIZE;
+    if (memory_colors < maxcolors) {
+        maxcolors = MAX(1<<12, memory_colors);
+        verbose_printf(options, "  limiting histogram to %u colors to stay within memory limit", maxcolors);
+    }
+
+    struct acolorhash_table *acht = pam_allocacolorhash(maxcolors, (size_t)rows*cols, ignorebits);
+    for (; ;) {
+
+        // histogram uses noise contrast map for importance. Color accuracy in noisy areas is not very important.
+        // noise map does not include edges to avoid ruining anti-aliasing
+        bool added_all_rows = true;
+        for(unsigned int row=0; row < rows; row++) {
+            const rgb_pixel *const row_pixels = liq_image_get_row_rgba(input_image, row, temp_row);
+            if (!pam_computeacolorhash(acht, &row_pixels, cols, 1, input_image->noise ? &input_image->noise[(size_t)row * cols] : NULL)) {
+                added_all_rows = false;
+                break;
+            }
+        }
+        if (added_all_rows) {
+            break;
+        }
+
+        ignorebits++;
+        if (options->stats) options->stats->histogram_restarts++;
+        verbose_print(options, "  too many colors! Scaling colors to improve clustering...");
+        pam_freeacolorhash(acht);
+        acht = pam_allocacolorhash(maxcolors, (size_t)rows*cols, ignorebits);
+    }
+
+    if (input_image->noise) {
+        stats_free(input_image->noise);
+        input_image->noise = NULL;
+    }
+    stats_free(temp_row);
+
+    histogram *hist = pam_acolorhashtoacolorhist(acht, input_image->gamma);
+    pam_freeacolorhash(acht);
+    if (hist->opaque) input_image->opaque = true;
+    if (hist->gray) input_image->gray = true;
+
+    verbose_printf(options, "  made histogram...%d colors found", hist->size);
+    return hist;
+}
+
+/* noise, edges and tmp maps, and 3 rows of pixels */
+static size_t contrast_maps_size(unsigned int width, unsigned int height)
+{
+    return (size_t)width * height * sizeof(float) * 3 + sizeof(rgb_pixel) * width * 3;
+}
+
+/**
+ Builds two maps:
+    noise - approximation of areas with high-frequency noise, except straight edges. 1=flat, 0=noisy.
+    edges - noise map including all edges
+ */
+static void contrast_maps(liq_image *image)
+{
+    const unsigned int cols = image->width, rows = image->height;
+    float *restrict noise = stats_malloc(sizeof(float)*cols*rows);
+    float *restrict tmp = stats_malloc(sizeof(float)*cols*rows);
+    float *restrict edges = stats_malloc(sizeof(float)*cols*rows);
+    rgb_pixel *temp_rows = stats_malloc(sizeof(rgb_pixel)*cols*3);
+
+    float gamma_lut[256];
+    to_f_set_gamma(gamma_lut, image->gamma);
+
+    // rolling window of 3 rows, so each row is fetched only once and in order
+    const rgb_pixel *window[3];
+    window[0] = liq_image_get_row_rgba_copy(image, 0, temp_rows);
+
+    for (unsigned int j=0; j < rows; j++) {
+        const unsigned int below = MIN(rows-1,j+1), above = j > 1 ? j-1 : 0;
+        if (below != j) {
+            window[below%3] = liq_image_get_row_rgba_copy(image, below, temp_rows + cols*(below%3));
+        }
+
+        const rgb_pixel *const row_pixels = window[j%3];
+        const rgb_pixel *const prev_row_pixels = window[below%3];
+        const rgb_pixel *const next_row_pixels = window[above%3];
+
+        f_pixel prev, curr = to_f(gamma_lut, row_pixels[0]), next=curr;
+        for (unsigned int i=0; i < cols; i++) {
+            prev=curr;
+            curr=next;
+            next = to_f(gamma_lut, row_pixels[MIN(cols-1,i+1)]);
+
+            // contrast is difference between pixels neighbouring horizontally and vertically
+            const float a = fabsf(prev.a+next.a - curr.a*2.f),
+            r = fabsf(prev.r+next.r - curr.r*2.f),
+            g = fabsf(prev.g+next.g - curr.g*2.f),
+            b = fabsf(prev.b+next.b - curr.b*2.f);
+
+            const f_pixel prevl = to_f(gamma_lut, prev_row_pixels[i]);
+            const f_pixel nextl = to_f(gamma_lut, next_row_pixels[i]);
+
+            const float a1 = fabsf(prevl.a+nextl.a - curr.a*2.f),
+            r1 = fabsf(prevl.r+nextl.r - curr.r*2.f),
+            g1 = fabsf(prevl.g+nextl.g - curr.g*2.f),
+            b1 = fabsf(prevl.b+nextl.b - curr.b*2.f);
+
+            const float horiz = MAX(MAX(a,r),MAX(g,b));
+            const float vert = MAX(MAX(a1,r1),MAX(g1,b1));
+            const float edge = MAX(horiz,vert);
+            float z = edge - fabsf(horiz-vert)*.5f;
+            z = 1.f - MAX(z,MIN(horiz,vert));
+            z *= z; // noise is amplified
+            z *= z;
+
+            noise[(size_t)j*cols+i] = z;
+            edges[(size_t)j*cols+i] = 1.f-edge;
+        }
+    }
+
+    // noise areas are shrunk and then expanded to remove thin edges from the map
+    max3(noise, tmp, cols, rows);
+    max3(tmp, noise, cols, rows);
+
+    blur(noise, tmp, noise, cols, rows, 3);
+
+    max3(noise, tmp, cols, rows);
+
+    min3(tmp, noise, cols, rows);
+    min3(noise, tmp, cols, rows);
+    min3(tmp, noise, cols, rows);
+
+    min3(edges, tmp, cols, rows);
+    max3(tmp, edges, cols, rows);
+    for(size_t i=0; i < (size_t)cols*rows; i++) edges[i] = MIN(noise[i], edges[i]);
+
+    stats_free(tmp);
+    stats_free(temp_rows);
+
+    image->noise = noise;
+    image->edges = edges;
+}
+
+/* smallest power of 2 the image has to be divided by to fit liq_set_pyramid() limit, 1 if it fits already */
+static unsigned int pyramid_scale(const liq_attr *options, unsigned int width, unsigned int height)
+{
+    unsigned int scale = 1;
+    if (options->pyramid_pixels) {
+        while ((size_t)((width+scale-1)/scale) * ((height+scale-1)/scale) > options->pyramid_pixels) scale *= 2;
+    }
+    return scale;
+}
+
+/**
+ Makes two images 1/scale of the size in one pass over the input image:
+    level - scale x scale squares averaged (premultiplied by alpha), for finding the palette
+    sample - pixel from the middle of each square as it is, for refining the palette at full resolution
+
+ Neither can tell whether all pixels of the input image are opaque or gray, so that's found here too.
+ */
+static bool pyramid_level(liq_image *input_image, unsigned int scale, liq_image **level_p, liq_image **sample_p)
+{
+    const unsigned int cols = input_image->width, rows = input_image->height;
+    const unsigned int level_cols = (cols+scale-1)/scale, level_rows = (rows+scale-1)/scale;
+
+    liq_image *level = liq_image_create_owned(input_image, level_cols, level_rows);
+    liq_image *sample = liq_image_create_owned(input_image, level_cols, level_rows);
+    double *sums = stats_calloc(level_cols * 4, sizeof(double));
+    rgb_pixel *temp_row = !liq_image_can_use_rows(input_image) ? stats_malloc(sizeof(rgb_pixel) * cols) : NULL;
+    if (!level || !sample || !sums || (!temp_row && !liq_image_can_use_rows(input_image))) {
+        if (level) liq_image_destroy(level);
+        if (sample) liq_image_destroy(sample);
+        stats_free(sums);
+        stats_free(temp_row);
+        return false;
+    }
+
+    bool opaque = true, gray = true;
+    for(unsigned int row=0; row < rows; row++) {
+        const rgb_pixel *const row_pixels = liq_image_get_row_rgba(input_image, row, temp_row);
+        const unsigned int level_row = row/scale, cell_height = MIN(scale, rows - level_row*scale), cell_row = row - level_row*scale;
+
+        for(unsigned int col=0; col < cols; col++) {
+            const rgb_pixel px = row_pixels[col];
+            opaque &= px.a == 255;
+            gray &= px.r == px.g && px.g == px.b;
+
+            // color of transparent pixels doesn't count
+            double *const sum = &sums[col/scale*4];
+            sum[0] += px.r * px.a;
+            sum[1] += px.g * px.a;
+            sum[2] += px.b * px.a;
+            sum[3] += px.a;
+        }
+
+        if (cell_row == cell_height/2) {
+            rgb_pixel *const sample_row = (rgb_pixel *)sample->rows[level_row];
+            for(unsigned int level_col=0; level_col < level_cols; level_col++) {
+                const unsigned int cell_width = MIN(scale, cols - level_col*scale);
+                sample_row[level_col] = row_pixels[level_col*scale + cell_width/2];
+            }
+        }
+
+        if (cell_row == cell_height-1) {
+            rgb_pixel *const level_row_pixels = (rgb_pixel *)level->rows[level_row];
+            for(unsigned int level_col=0; level_col < level_cols; level_col++) {
+                const unsigned int cell_width = MIN(scale, cols - level_col*scale);
+                const double *const sum = &sums[level_col*4];
+                level_row_pixels[level_col] = sum[3] > 0 ? (rgb_pixel){
+                    .r = sum[0]/sum[3] + 0.5,
+                    .g = sum[1]/sum[3] + 0.5,
+                    .b = sum[2]/sum[3] + 0.5,
+                    .a = sum[3]/(cell_width*cell_height) + 0.5,
+                } : (rgb_pixel){0,0,0,0};
+            }
+            memset(sums, 0, sizeof(double) * level_cols * 4);
+        }
+    }
+    stats_free(sums);
+    stats_free(temp_row);
+
+    if (opaque) input_image->opaque = true;
+    if (opaque && gray) input_image->gray = true;
+
+    *level_p = level;
+    *sample_p = sample;
+    return true;
+}
+
+/* edges of the pyramid level are stretched to full resolution for the dither map */
+static void pyramid_edges(liq_image *input_image, const liq_image *level, unsigned int scale, const liq_attr *options)
+{
+    const unsigned int cols = input_image->width, rows = input_image->height;
+    if (!level->edges || sizeof(float) * cols * rows > liq_memory_available(options)) return;
+
+    float *edges = stats_malloc(sizeof(float) * cols * rows);
+    if (!edges) return;
+
+    for(unsigned int row=0; row < rows; row++) {
+        const float *const level_edges = &level->edges[(size_t)(row/scale) * level->width];
+        for(unsigned int col=0; col < cols; col++) {
+            edges[(size_t)row*cols + col] = level_edges[col/scale];
+        }
+    }
+    input_image->edges = edges;
+}
+
+/**
+ * Builds map of neighbor pixels mapped to the same palette entry
+ *
+ * For efficiency/simplicity it mainly looks for same consecutive pixels horizontally
+ * and peeks 1 pixel above/below. Full 2d algorithm doesn't improve it significantly.
+ * Correct flood fill doesn't have visually good properties.
+ */
+static void update_dither_map(unsigned char *const *const row_pointers, liq_image *input_image)
+{
+    const unsigned int width = input_image->width;
+    const unsigned int height = input_image->height;
+    float *const edges = input_image->edges;
+
+    for(unsigned int row=0; row < height; row++) {
+        unsigned char lastpixel = row_pointers[row][0];
+        unsigned int lastcol=0;
+
+        for(unsigned int col=1; col < width; col++) {
+            const unsigned char px = row_pointers[row][col];
+
+            if (px != lastpixel || col == width-1) {
+                float neighbor_count = 2.5f + col-lastcol;
+
+                unsigned int i=lastcol;
+                while(i < col) {
+                    if (row > 0) {
+                        unsigned char pixelabove = row_pointers[row-1][i];
+                        if (pixelabove == lastpixel) neighbor_count += 1.f;
+                    }
+                    if (row < height-1) {
+                        unsigned char pixelbelow = row_pointers[row+1][i];
+                        if (pixelbelow == lastpixel) neighbor_count += 1.f;
+                    }
+                    i++;
+                }
+
+                while(lastcol <= col) {
+                    edges[(size_t)row*width + lastcol++] *= 1.f - 2.5f/neighbor_count;
+                }
+                lastpixel = px;
+            }
+        }
+    }
+}
+
+static void adjust_histogram_callback(hist_item *item, float diff)
+{
+    item->adjusted_weight = (item->perceptual_weight+item->adjusted_weight) * (sqrtf(1.f+diff));
+}
+
+/**
+ Repeats mediancut with different histogram weights to find palette with minimum error.
+
+ feedback_loop_trials controls how long the search will take. < 0 skips the iteration.
+ */
+static colormap *find_best_palette(histogram *hist, unsigned int reqcolors, int feedback_loop_trials, const liq_attr *options, double *palette_error_p)
+{
+    const double target_mse = options->target_mse;
+    colormap *acolormap = NULL;
+    double least_error = MAX_DIFF;
+    double target_mse_overshoot = feedback_loop_trials>0 ? 1.05 : 1.0;
+    const double percent = (double)(feedback_loop_trials>0?feedback_loop_trials:1)/100.0;
+
+    do {
+        const stats_time trial_start = stats_start(options->stats);
+        colormap *newmap = mediancut(hist, options->min_opaque_val, reqcolors, target_mse * target_mse_overshoot, MAX(MAX(90.0/65536.0, target_mse), least_error)*1.2, NULL);
+
+        if (feedback_loop_trials <= 0) {
+            stats_end_trial(options->stats, trial_start);
+            return newmap;
+        }
+
+        // after palette has been created, total error (MSE) is calculated to keep the best palette
+        // at the same time Voronoi iteration is done to improve the palette
+        // and histogram weights are adjusted based on remapping error to give more weight to poorly matched colors
+
+        const bool first_run_of_target_mse = !acolormap && target_mse > 0;
+        double total_error = viter_do_iteration(hist, newmap, options->min_opaque_val, first_run_of_target_mse ? NULL : adjust_histogram_callback);
+
+        // goal is to increase quality or to reduce number of colors used if quality is good enough
+        if (!acolormap || total_error < least_error || (total_error <= target_mse && newmap->colors < reqcolors)) {
+            if (acolormap) pam_freecolormap(acolormap);
+            acolormap = newmap;
+
+            if (total_error < target_mse && total_error > 0) {
+                // voronoi iteration improves quality above what mediancut aims for
+                // this compensates for it, making mediancut aim for worse
+                target_mse_overshoot = MIN(target_mse_overshoot*1.25, target_mse/total_error);
+            }
+
+            least_error = total_error;
+
+            // if number of colors could be reduced, try to keep it that way
+            // but allow extra color as a bit of wiggle room in case quality can be improved too
+            reqcolors = MIN(newmap->colors+1, reqcolors);
+
+            feedback_loop_trials -= 1; // asymptotic improvement could make it go on forever
+        } else {
+            for(unsigned int j=0; j < hist->size; j++) {
+                hist->achv[j].adjusted_weight = (hist->achv[j].perceptual_weight + hist->achv[j].adjusted_weight)/2.0;
+            }
+
+            target_mse_overshoot = 1.0;
+            feedback_loop_trials -= 6;
+            // if error is really bad, it's unlikely to improve, so end sooner
+            if (total_error > least_error*4) feedback_loop_trials -= 3;
+            pam_freecolormap(newmap);
+        }
+        stats_end_trial(options->stats, trial_start);
+
+        verbose_printf(options, "  selecting colors...%d%%",100-MAX(0,(int)(feedback_loop_trials/percent)));
+    }
+    while(feedback_loop_trials > 0);
+
+    *palette_error_p = least_error;
+    return acolormap;
+}
+
+#define ESTIMATE_MAX_COLORS (1<<14)
+#define ESTIMATE_REJECT_MARGIN 2.0
+
+/**
+ Cheap estimate of error of the palette, for rejecting images that can't get anywhere near the quality limit
+ before the full search. Median cut is done once on a coreset of the histogram: every n-th color, which
+ is a fair sample since colors are in hash order. Error of that palette is a pessimistic estimate,
+ since the feedback loop and Voronoi iteration only improve on it.
+ */
+static double estimate_palette_error(const histogram *hist, const liq_attr *options)
+{
+    const unsigned int step = (hist->size + ESTIMATE_MAX_COLORS-1) / ESTIMATE_MAX_COLORS;
+    histogram coreset = {
+        .achv = stats_malloc(sizeof(hist->achv[0]) * ((hist->size + step-1) / step)),
+        .opaque = hist->opaque,
+    };
+    if (!coreset.achv) return -1;
+
+    // copied, since median cut reorders items and the full search has to start from the same histogram
+    for(unsigned int i=0; i < hist->size; i += step) {
+        coreset.achv[coreset.size] = hist->achv[i];
+        coreset.achv[coreset.size].adjusted_weight = hist->achv[i].perceptual_weight;
+        coreset.total_perceptual_weight += hist->achv[i].perceptual_weight;
+        coreset.size++;
+    }
+
+    colormap *map = mediancut(&coreset, options->min_opaque_val, options->max_colors, 0, options->max_mse, NULL);
+    const double error = viter_do_iteration(&coreset, map, options->min_opaque_val, NULL);
+    pam_freecolormap(map);
+    stats_free(coreset.achv);
+    return error;
+}
+
+static colormap *gray_palette(histogram *hist, const liq_attr *options, double *palette_error_p)
+{
+    const stats_time start = stats_start(options->stats);
+    trace_begin("gray_quantize");
+    colormap *map = gray_quantize(hist, options->max_colors, options->target_mse, palette_error_p);
+    trace_end("gray_quantize");
+    stats_end(options->stats, STATS_PALETTE_SEARCH, start);
+
+    if (map) verbose_printf(options, "  grayscale image: found optimal %d-color palette", map->colors);
+    return map;
+}
+
+/* Voronoi iteration approaches local minimum for the palette. Returns its error (palette_error if there were no iterations) */
+static double refine_palette(histogram *hist, colormap *map, unsigned int iterations, double palette_error, const liq_attr *options)
+{
+    if (!iterations) return palette_error;
+
+    verbose_print(options, "  moving colormap towards local minimum");
+    const stats_time start = stats_start(options->stats);
+
+    const double max_mse = options->max_mse;
+    const double iteration_limit = 1.0/(double)(1<<(23-options->speed));
+    double previous_palette_error = MAX_DIFF;
+    for(unsigned int i=0; i < iterations; i++) {
+        palette_error = viter_do_iteration(hist, map, options->min_opaque_val, NULL);
+
+        if (fabs(previous_palette_error-palette_error) < iteration_limit) {
+            break;
+        }
+
+        if (palette_error > max_mse*1.5) { // probably hopeless
+            if (palette_error > max_mse*3.0) break; // definitely hopeless
+            iterations++;
+        }
+
+        previous_palette_error = palette_error;
+    }
+    stats_end(options->stats, STATS_VORONOI, start);
+    return palette_error;
+}
+
+/* averaging hides noise, so a palette of a pyramid level that is this much worse on full-resolution pixels is too narrow for them */
+#define PYRAMID_FALLBACK_RATIO 2.0
+
+/**
+ Palette is found for colors in hist. If sample_hist is given (hist is of a pyramid level),
+ the palette is refined and its error measured on these pixels sampled at full resolution.
+ If the level's palette turns out to be much worse for them, the search is repeated on the sample itself.
+ */
+static colormap *pngquant_quantize(histogram *hist, histogram *sample_hist, const liq_attr *options)
+{
+    const double max_mse = options->max_mse;
+
+    // If image has few colors to begin with (and no quality degradation is required)
+    // then it's possible to skip quantization entirely
+    const histogram *const full_hist = sample_hist ? sample_hist : hist;
+    if (full_hist->size <= options->max_colors && options->target_mse == 0) {
+        colormap *hist_palette = pam_colormap(full_hist->size);
+        for(unsigned int i=0; i < full_hist->size; i++) {
+            hist_palette->palette[i].acolor = full_hist->achv[i].acolor;
+            hist_palette->palette[i].popularity = full_hist->achv[i].perceptual_weight;
+        }
+
+        sort_palette(hist_palette, options);
+        hist_palette->palette_error = sample_hist ? -1 : 0; // sampling could have missed some colors, so it's measured when remapping
+        return hist_palette;
+    }
+
+    // with a quality limit, images that are clearly below it are rejected before the full search.
+    // Borderline ones still get the full search, which may reach the limit. Grays are exact and quick anyway.
+    if (max_mse < MAX_DIFF && !hist->gray) {
+        const stats_time start = stats_start(options->stats);
+        const double estimate = estimate_palette_error(hist, options);
+        stats_end(options->stats, STATS_QUALITY_ESTIMATE, start);
+
+        verbose_printf(options, "  estimated MSE=%.3f (limit %.3f)", estimate*65536.0/6.0, max_mse*65536.0/6.0);
+        if (estimate > max_mse * ESTIMATE_REJECT_MARGIN) {
+            verbose_printf(options, "  image degradation MSE~%.3f is far above limit of %.3f", estimate*65536.0/6.0, max_mse*65536.0/6.0);
+            return NULL;
+        }
+    }
+
+    double palette_error = -1;
+    // palette for grays is exact, so it doesn't need to be searched for or moved towards a local minimum
+    colormap *acolormap = hist->gray ? gray_palette(hist, options, &palette_error) : NULL;
+    const bool exact = acolormap != NULL;
+    if (!exact) acolormap = find_best_palette(hist, options->max_colors, 56-9*options->speed, options, &palette_error);
+
+    // Voronoi iteration approaches local minimum for the palette
+    unsigned int iterations = exact ? 0 : MAX(8-options->speed,0); iterations += iterations * iterations/2;
+    if (sample_hist && !exact) {
+        // error of the pyramid level isn't the error of the image
+        const double level_error = palette_error;
+        palette_error = refine_palette(sample_hist, acolormap, 1, -1, options);
+        if (palette_error > level_error * PYRAMID_FALLBACK_RATIO) {
+            verbose_printf(options, "  palette of pyramid level has MSE=%.3f at full resolution (%.3f on the level), searching again on sampled pixels",
+                           palette_error*65536.0/6.0, level_error*65536.0/6.0);
+            double sample_error = -1;
+            colormap *sample_map = find_best_palette(sample_hist, options->max_colors, 56-9*options->speed, options, &sample_error);
+            if (sample_map && sample_error < palette_error) {
+                pam_freecolormap(acolormap);
+                acolormap = sample_map;
+                palette_error = sample_error;
+            } else if (sample_map) {
+                pam_freecolormap(sample_map);
+            }
+        }
+        // the palette continues towards local minimum of the sample until its error stops improving
+        iterations = MAX(iterations, 2);
+        hist = sample_hist;
+    } else if (sample_hist) {
+        palette_error = -1; // sampling could have missed some grays, so it's measured when remapping
+    }
+    if (!iterations && palette_error < 0 && max_mse < MAX_DIFF) iterations = 1; // otherwise total error is never calculated and MSE limit won't work
+
+    palette_error = refine_palette(hist, acolormap, iterations, palette_error, options);
+
+    if (palette_error > max_mse) {
+        verbose_printf(options, "  image degradation MSE=%.3f exceeded limit of %.3f", palette_error*65536.0/6.0, max_mse*65536.0/6.0);
+        pam_freecolormap(acolormap);
+        return NULL;
+    }
+
+    sort_palette(acolormap, options);
+
+    acolormap->palette_error = palette_error;
+    return acolormap;
+}
+
+/* Ward's criterion: replacing two colors with their average weighted by popularity adds this much to the total error */
+inline static double merge_cost(const colormap_item *a, const colormap_item *b)
+{
+    const double weight = a->popularity + b->popularity;
+    if (weight <= 0) return 0;
+    return a->popularity * b->popularity / weight * colordifference(a->acolor, b->acolor);
+}
+
+/*
+ Pairs of colors that add the least error are merged until the palette fits max_colors and, with a quality target,
+ for as long as the estimated error stays within it. Popularity of colors must be set. Returns the estimated error.
+ */
+static double merge_palette_colors(colormap *map, const liq_attr *options, double palette_error, double total_weight)
+{
+    while (map->colors > 1) {
+        unsigned int best_i = 0, best_j = 1;
+        double best_cost = MAX_DIFF;
+        for(unsigned int i=0; i < map->colors; i++) {
+            for(unsigned int j=i+1; j < map->colors; j++) {
+                const double cost = merge_cost(&map->palette[i], &map->palette[j]);
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    best_i = i; best_j = j;
+                }
+            }
+        }
+
+        const double merged_error = palette_error + best_cost / total_weight;
+        if (map->colors <= options->max_colors && (!options->target_mse || merged_error > options->target_mse)) break;
+
+        colormap_item *const a = &map->palette[best_i];
+        const colormap_item b = map->palette[best_j];
+        const float weight = a->popularity + b.popularity;
+        if (weight > 0) {
+            const float wa = a->popularity / weight, wb = b.popularity / weight;
+            a->acolor = (f_pixel){
+                .a = a->acolor.a * wa + b.acolor.a * wb,
+                .r = a->acolor.r * wa + b.acolor.r * wb,
+                .g = a->acolor.g * wa + b.acolor.g * wb,
+                .b = a->acolor.b * wa + b.acolor.b * wb,
+            };
+        }
+        a->popularity = weight;
+        map->palette[best_j] = map->palette[--map->colors];
+        palette_error = merged_error;
+    }
+    return palette_error;
+}
+
+/**
+ Palette with fewer colors, or for a lower quality target, made from a larger palette instead of a new search:
+ its colors are merged pairwise (see merge_palette_colors()) and then moved towards local minimum for hist.
+ */
+static colormap *pngquant_quantize_from(histogram *hist, const colormap *larger, const liq_attr *options)
+{
+    // these palettes are exact and quick to make anyway
+    if (hist->gray || (hist->size <= options->max_colors && options->target_mse == 0)) {
+        return pngquant_quantize(hist, NULL, options);
+    }
+
+    const stats_time start = stats_start(options->stats);
+    colormap *map = pam_colormap(larger->colors);
+    memcpy(map->palette, larger->palette, sizeof(map->palette[0]) * larger->colors);
+
+    // the larger palette may have been made for other pixels or moved by remapping, so its popularity is measured anew
+    double palette_error = viter_do_iteration(hist, map, options->min_opaque_val, NULL);
+    palette_error = merge_palette_colors(map, options, palette_error, hist->total_perceptual_weight);
+    stats_end(options->stats, STATS_PALETTE_SEARCH, start);
+    verbose_printf(options, "  merged %d colors of the larger palette into %d", larger->colors, map->colors);
+
+    unsigned int iterations = MAX(8-options->speed,0); iterations += iterations * iterations/2;
+    palette_error = refine_palette(hist, map, iterations, palette_error, options);
+
+    if (palette_error > options->max_mse) {
+        verbose_printf(options, "  image degradation MSE=%.3f exceeded limit of %.3f", palette_error*65536.0/6.0, options->max_mse*65536.0/6.0);
+        pam_freecolormap(map);
+        return NULL;
+    }
+
+    sort_palette(map, options);
+
+    map->palette_error = palette_error;
+    return map;
+}
+
+LIQ_EXPORT size_t liq_image_memory_estimate(const liq_attr *attr, int width, int height)
+{
+    if (width <= 0 || height <= 0) return 0;
+
+    size_t bytes = 0;
+    const unsigned int scale = pyramid_scale(attr, width, height);
+    const unsigned int level_width = (width+scale-1)/scale, level_height = (height+scale-1)/scale;
+    if (scale > 1) {
+        bytes += (size_t)level_width * level_height * sizeof(rgb_pixel) * 2; // pyramid level and sample
+        bytes += sizeof(float) * width * height; // edges stretched to full resolution
+    }
+    if (attr->speed < 8 && level_width >= 4 && level_height >= 4) {
+        bytes += contrast_maps_size(level_width, level_height);
+    }
+    bytes += MIN((size_t)level_width * level_height, histogram_max_colors(attr)) * HISTOGRAM_COLOR_SIZE * (scale > 1 ? 2 : 1);
+    bytes += sizeof(unsigned char *) * height + sizeof(f_pixel) * (width + 2) * 2; // row pointers and dithering errors
+
+    return attr->max_memory ? MIN(bytes, attr->max_memory) : bytes;
+}
+
+/* takes ownership of the palette. NULL palette means it couldn't be made within the quality limit */
+static liq_error result_create(colormap *palette, const liq_attr *options, liq_result **result_output)
+{
+    if (!palette) {
+        verbose_printf_flush(options);
+        return LIQ_QUALITY_TOO_LOW;
+    }
+
+    liq_result *result = malloc(sizeof(liq_result));
+    if (!result) {
+        pam_freecolormap(palette);
+        return LIQ_OUT_OF_MEMORY;
+    }
+
+    *result = (liq_result){
+        .options = *options,
+        .palette = palette,
+        .dither_level = 1.0,
+        .gamma = 0.45455, // fixed gamma ~2.2 for the web. PNG can't store exact 1/2.2
+        .palette_error = palette->palette_error,
+    };
+    *result_output = result;
+
+    verbose_printf_flush(options);
+    return LIQ_OK;
+}
+
+static liq_error quantize_image(liq_image *input_image, const liq_attr *options, liq_result **result_output)
+{
+    // maps left by an earlier quantization that wasn't followed by a remap
+    liq_image_free_maps(input_image);
+
+    // palette of a large image is found on its downscaled copy, see liq_set_pyramid()
+    liq_image *level = NULL, *sample = NULL;
+    const unsigned int scale = pyramid_scale(options, input_image->width, input_image->height);
+    if (scale > 1) {
+        const stats_time start = stats_start(options->stats);
+        trace_begin("pyramid_level");
+        if (pyramid_level(input_image, scale, &level, &sample)) {
+            verbose_printf(options, "  finding palette on %ux%u pyramid level (1/%u)", level->width, level->height, scale);
+        }
+        trace_end("pyramid_level");
+        stats_end(options->stats, STATS_PYRAMID, start);
+    }
+    liq_image *const palette_image = level ? level : input_image;
+
+    if (options->speed < 8 && palette_image->width >= 4 && palette_image->height >= 4) {
+        if (contrast_maps_size(palette_image->width, palette_image->height) > liq_memory_available(options)) {
+            verbose_print(options, "  skipping noise and edge detection to stay within memory limit");
+        } else {
+            const stats_time start = stats_start(options->stats);
+            trace_begin("contrast_maps");
+            contrast_maps(palette_image);
+            if (level) pyramid_edges(input_image, level, scale, options);
+            trace_end("contrast_maps");
+            stats_end(options->stats, STATS_CONTRAST_MAPS, start);
+        }
+    }
+
+    const stats_time hist_start = stats_start(options->stats);
+    trace_begin("get_histogram");
+    histogram *hist = get_histogram(palette_image, options);
+    histogram *sample_hist = sample ? get_histogram(sample, options) : NULL;
+    trace_end("get_histogram");
+    stats_end(options->stats, STATS_HISTOGRAM, hist_start);
+
+    if (level) {
+        liq_image_destroy(level);
+        liq_image_destroy(sample);
+    }
+
+    trace_begin("pngquant_quantize");
+    colormap *palette = pngquant_quantize(hist, sample_hist, options);
+    trace_end("pngquant_quantize");
+    pam_freeacolorhist(hist);
+    if (sample_hist) pam_freeacolorhist(sample_hist);
+    counters_flush(options->stats ? &options->stats->counters : NULL);
+
+    if (!palette) liq_image_free_maps(input_image);
+    return result_create(palette, options, result_output);
+}
+
+LIQ_EXPORT liq_error liq_image_quantize(liq_image *input_image, const liq_attr *options, liq_result **result_output)
+{
+    if (!input_image || !options || !result_output) return LIQ_INVALID_POINTER;
+    *result_output = NULL;
+
+    struct liq_stats *const prev_stats = stats_set_current(options->stats);
+    liq_error err = quantize_image(input_image, options, result_output);
+    stats_set_current(prev_stats);
+    return err;
+}
+
+LIQ_EXPORT liq_histogram *liq_histogram_create(const liq_attr *attr)
+{
+    if (!attr) return NULL;
+
+    liq_histogram *hist = malloc(sizeof(liq_histogram));
+    if (hist) *hist = (liq_histogram){.hist = NULL};
+    return hist;
+}
+
+struct histogram_images_context {
+    liq_image **images;
+    histogram **hists;
+    const liq_attr *options; // without log callbacks and stats, which aren't safe to use from many threads
+};
+
+static void histogram_images(void *context, unsigned int chunk, unsigned int start, unsigned int end)
+{
+    const struct histogram_images_context *const c = context;
+    struct liq_stats *const prev_stats = stats_set_current(NULL);
+    for(unsigned int i = start; i < end; i++) {
+        liq_image *const image = c->images[i];
+        liq_image_free_maps(image);
+        if (c->options->speed < 8 && image->width >= 4 && image->height >= 4 &&
+            contrast_maps_size(image->width, image->height) <= liq_memory_available(c->options)) {
+            contrast_maps(image);
+        }
+        c->hists[i] = get_histogram(image, c->options);
+    }
+    stats_set_current(prev_stats);
+}
+
+LIQ_EXPORT liq_error liq_histogram_add_images(liq_histogram *hist, const liq_attr *attr, liq_image *images[], int count)
+{
+    if (!hist || !attr || !images || count < 1) return LIQ_INVALID_POINTER;
+    for(int i=0; i < count; i++) {
+        if (!images[i]) return LIQ_INVALID_POINTER;
+        if (images[i]->gamma != (hist->hist ? hist->gamma : images[0]->gamma)) return LIQ_VALUE_OUT_OF_RANGE;
+    }
+
+    // previous colors are merged again with the new ones
+    const unsigned int num_hists = count + (hist->hist ? 1 : 0);
+    histogram **hists = malloc(num_hists * sizeof(hists[0]));
+    if (!hists) return LIQ_OUT_OF_MEMORY;
+    if (hist->hist) hists[count] = hist->hist;
+
+    liq_attr quiet_attr = *attr;
+    quiet_attr.log_callback = NULL;
+    quiet_attr.log_flush_callback = NULL;
+    quiet_attr.stats = NULL;
+    struct histogram_images_context context = {.images = images, .hists = hists, .options = &quiet_attr};
+
+    const stats_time start = stats_start(attr->stats);
+    trace_begin("get_histogram");
+    taskpool_parallel_for(count, MIN(count, TASKPOOL_MAX_CHUNKS), histogram_images, &context, true);
+
+    // images are merged in the same order regardless of threads, so the sums of weights are the same too
+    struct liq_stats *const prev_stats = stats_set_current(NULL);
+    hist->hist = pam_mergeacolorhists(hists, num_hists);
+    hist->gamma = images[0]->gamma;
+    stats_set_current(prev_stats);
+    trace_end("get_histogram");
+    stats_end(attr->stats, STATS_HISTOGRAM, start);
+    free(hists);
+
+    verbose_printf(attr, "  made histogram of %d image%s...%d colors found", count, count == 1 ? "" : "s", hist->hist->size);
+    return LIQ_OK;
+}
+
+LIQ_EXPORT liq_error liq_histogram_quantize(liq_histogram *hist, const liq_attr *attr, liq_result **result_output)
+{
+    if (!hist || !attr || !result_output) return LIQ_INVALID_POINTER;
+    *result_output = NULL;
+    if (!hist->hist) return LIQ_VALUE_OUT_OF_RANGE;
+
+    struct liq_stats *const prev_stats = stats_set_current(attr->stats);
+    trace_begin("pngquant_quantize");
+    colormap *palette = pngquant_quantize(hist->hist, NULL, attr);
+    trace_end("pngquant_quantize");
+    counters_flush(attr->stats ? &attr->stats->counters : NULL);
+    const liq_error err = result_create(palette, attr, result_output);
+    stats_set_current(prev_stats);
+    return err;
+}
+
+LIQ_EXPORT liq_error liq_histogram_quantize_from(liq_histogram *hist, const liq_attr *attr, const liq_result *larger, liq_result **result_output)
+{
+    if (!hist || !attr || !larger || !result_output) return LIQ_INVALID_POINTER;
+    *result_output = NULL;
+    if (!hist->hist) return LIQ_VALUE_OUT_OF_RANGE;
+
+    struct liq_stats *const prev_stats = stats_set_current(attr->stats);
+    trace_begin("pngquant_quantize_from");
+    colormap *palette = pngquant_quantize_from(hist->hist, larger->palette, attr);
+    trace_end("pngquant_quantize_from");
+    counters_flush(attr->stats ? &attr->stats->counters : NULL);
+    const liq_error err = result_create(palette, attr, result_output);
+    stats_set_current(prev_stats);
+    return err;
+}
+
+LIQ_EXPORT liq_error liq_histogram_analyze(liq_histogram *hist, const liq_attr *attr, double mse_out[], int *count_out, const int refine_colors[], int num_refine, double refined_mse_out[])
+{
+    if (!hist || !attr || !mse_out || !count_out) return LIQ_INVALID_POINTER;
+    if (num_refine > 0 && (!refine_colors || !refined_mse_out)) return LIQ_INVALID_POINTER;
+    if (!hist->hist) return LIQ_VALUE_OUT_OF_RANGE;
+
+    const unsigned int max_colors = attr->max_colors;
+    bool keep[max_colors];
+    colormap *palettes[max_colors];
+    double errors[max_colors];
+    memset(keep, 0, sizeof(keep));
+    memset(palettes, 0, sizeof(palettes));
+    for(int i=0; i < num_refine; i++) {
+        if (refine_colors[i] < 1 || refine_colors[i] > (int)max_colors) return LIQ_VALUE_OUT_OF_RANGE;
+        keep[refine_colors[i]-1] = true;
+    }
+
+    struct liq_stats *const prev_stats = stats_set_current(attr->stats);
+    histogram *const h = hist->hist;
+
+    // a single run without the feedback loop, so weights adjusted by earlier quantization of the histogram are reset
+    for(unsigned int i=0; i < h->size; i++) {
+        h->achv[i].adjusted_weight = h->achv[i].perceptual_weight;
+    }
+
+    const stats_time start = stats_start(attr->stats);
+    trace_begin("mediancut_curve");
+    struct mediancut_curve curve = {.errors = errors, .keep = keep, .palettes = palettes};
+    colormap *map = mediancut(h, attr->min_opaque_val, max_colors, 0, MAX_DIFF, &curve);
+    const unsigned int count = map->colors;
+    pam_freecolormap(map);
+    trace_end("mediancut_curve");
+    stats_end(attr->stats, STATS_PALETTE_SEARCH, start);
+    verbose_printf(attr, "  median cut passed through %d palette sizes", count);
+
+    for(unsigned int i=0; i < count; i++) {
+        mse_out[i] = MAX(0, errors[i])*65536.0/6.0; // error of boxes is updated on every split, and may drift below 0
+    }
+    *count_out = count;
+
+    // at least one iteration, since error of boxes isn't the error of their palette, which pixels are mapped to
+    unsigned int iterations = MAX(8-attr->speed,0); iterations += iterations * iterations/2;
+    if (!iterations) iterations = 1;
+    for(int i=0; i < num_refine; i++) {
+        colormap *const palette = palettes[refine_colors[i]-1];
+        refined_mse_out[i] = palette ? refine_palette(h, palette, iterations, errors[refine_colors[i]-1], attr)*65536.0/6.0 : -1;
+    }
+
+    for(unsigned int i=0; i < max_colors; i++) {
+        if (palettes[i]) pam_freecolormap(palettes[i]);
+    }
+    counters_flush(attr->stats ? &attr->stats->counters : NULL);
+    verbose_printf_flush(attr);
+    stats_set_current(prev_stats);
+    return LIQ_OK;
+}
+
+LIQ_EXPORT void liq_histogram_destroy(liq_histogram *hist)
+{
+    if (!hist) return;
+
+    if (hist->hist) pam_freeacolorhist(hist->hist);
+    free(hist);
+}
+
+/* serialized histogram is the header followed by colors, each as a, r, g, b and perceptual weight */
+#define HISTOGRAM_MAGIC "LIQhist1"
+#define HISTOGRAM_ITEM_SIZE (5 * sizeof(float))
+
+struct histogram_header {
+    char magic[8];
+    double gamma;
+    unsigned int size;
+    unsigned char opaque, gray;
+};
+
+LIQ_EXPORT size_t liq_histogram_serialized_size(const liq_histogram *hist)
+{
+    if (!hist || !hist->hist) return 0;
+    return sizeof(struct histogram_header) + hist->hist->size * HISTOGRAM_ITEM_SIZE;
+}
+
+LIQ_EXPORT liq_error liq_histogram_serialize(const liq_histogram *hist, void *buffer, size_t buffer_size)
+{
+    if (!hist || !buffer) return LIQ_INVALID_POINTER;
+    if (!hist->hist) return LIQ_VALUE_OUT_OF_RANGE;
+    if (buffer_size < liq_histogram_serialized_size(hist)) return LIQ_BUFFER_TOO_SMALL;
+
+    struct histogram_header header;
+    memset(&header, 0, sizeof(header)); // padding is written too
+    memcpy(header.magic, HISTOGRAM_MAGIC, sizeof(header.magic));
+    header.gamma = hist->gamma;
+    header.size = hist->hist->size;
+    header.opaque = hist->hist->opaque;
+    header.gray = hist->hist->gray;
+
+    unsigned char *out = buffer;
+    memcpy(out, &header, sizeof(header));
+    out += sizeof(header);
+    for(unsigned int i=0; i < hist->hist->size; i++) {
+        const hist_item *const item = &hist->hist->achv[i];
+        const float values[5] = {item->acolor.a, item->acolor.r, item->acolor.g, item->acolor.b, item->perceptual_weight};
+        memcpy(out, values, HISTOGRAM_ITEM_SIZE);
+        out += HISTOGRAM_ITEM_SIZE;
+    }
+    return LIQ_OK;
+}
+
+LIQ_EXPORT liq_error liq_histogram_add_serialized(liq_histogram *hist, const liq_attr *attr, const void *buffer, size_t size)
+{
+    if (!hist || !attr || !buffer) return LIQ_INVALID_POINTER;
+
+    struct histogram_header header;
+    if (size < sizeof(header)) return LIQ_VALUE_OUT_OF_RANGE;
+    memcpy(&header, buffer, sizeof(header));
+    if (memcmp(header.magic, HISTOGRAM_MAGIC, sizeof(header.magic)) ||
+        (size - sizeof(header)) % HISTOGRAM_ITEM_SIZE || (size - sizeof(header)) / HISTOGRAM_ITEM_SIZE != header.size) {
+        return LIQ_VALUE_OUT_OF_RANGE;
+    }
+    if (hist->hist && header.gamma != hist->gamma) return LIQ_VALUE_OUT_OF_RANGE;
+
+    const stats_time start = stats_start(attr->stats);
+    struct liq_stats *const prev_stats = stats_set_current(NULL);
+    histogram *added = stats_malloc(sizeof(added[0]));
+    added->achv = stats_malloc(MAX(1, header.size) * sizeof(added->achv[0]));
+    added->size = header.size;
+    added->opaque = header.opaque;
+    added->gray = header.gray;
+
+    const unsigned char *in = (const unsigned char *)buffer + sizeof(header);
+    bool valid = true;
+    for(unsigned int i=0; i < header.size; i++) {
+        float v[5];
+        memcpy(v, in, HISTOGRAM_ITEM_SIZE);
+        in += HISTOGRAM_ITEM_SIZE;
+        // also rejects NaNs
+        if (!(v[0] >= 0 && v[0] <= 1 && v[1] >= 0 && v[1] <= 1 && v[2] >= 0 && v[2] <= 1 && v[3] >= 0 && v[3] <= 1 && v[4] >= 0)) {
+            valid = false;
+            break;
+        }
+        added->achv[i] = (hist_item){
+            .acolor = (f_pixel){.a = v[0], .r = v[1], .g = v[2], .b = v[3]},
+            .perceptual_weight = v[4],
+            .adjusted_weight = v[4],
+        };
+    }
+
+    if (valid) {
+        // previous colors are merged again with the new ones, like in liq_histogram_add_images()
+        histogram *hists[2] = {added, hist->hist};
+        hist->hist = pam_mergeacolorhists(hists, hist->hist ? 2 : 1);
+        hist->gamma = header.gamma;
+    } else {
+        pam_freeacolorhist(added);
+    }
+    stats_set_current(prev_stats);
+    stats_end(attr->stats, STATS_HISTOGRAM, start);
+    if (!valid) return LIQ_VALUE_OUT_OF_RANGE;
+
+    verbose_printf(attr, "  merged histogram of %u colors...%u colors in total", header.size, hist->hist->size);
+    return LIQ_OK;
+}
+
+LIQ_EXPORT liq_error liq_set_dithering_level(liq_result *res, float dither_level)
+{
+    if (dither_level < 0 || dither_level > 1.0f) return LIQ_VALUE_OUT_OF_RANGE;
+
+    res->dither_level = dither_level;
+    return LIQ_OK;
+}
+
+LIQ_EXPORT liq_error liq_set_output_gamma(liq_result* res, double gamma)
+{
+    if (gamma <= 0 || gamma >= 1.0) return LIQ_VALUE_OUT_OF_RANGE;
+    if (res->fixed && gamma != res->gamma) return LIQ_VALUE_OUT_OF_RANGE; // fixed colors are in the palette's gamma
+
+    res->gamma = gamma;
+    return LIQ_OK;
+}
+
+LIQ_EXPORT double liq_get_output_gamma(const liq_result *result)
+{
+    return result->gamma;
+}
+
+LIQ_EXPORT liq_error liq_write_remapped_image(liq_result *result, liq_image *input_image, void *buffer, size_t buffer_size)
+{
+    const size_t required_size = (size_t)input_image->width * input_image->height;
+    if (buffer_size < required_size) {
+        return LIQ_BUFFER_TOO_SMALL;
+    }
+
+    struct liq_stats *const prev_stats = stats_set_current(result->options.stats);
+    unsigned char **rows = stats_malloc(sizeof(rows[0]) * input_image->height);
+    stats_set_current(prev_stats);
+    if (!rows) return LIQ_OUT_OF_MEMORY;
+
+    unsigned char *buffer_bytes = buffer;
+    for(unsigned int i=0; i < input_image->height; i++) {
+        rows[i] = &buffer_bytes[(size_t)input_image->width * i];
+    }
+
+    liq_error err = liq_write_remapped_image_rows(result, input_image, rows);
+    stats_free(rows);
+    return err;
+}
+
+static void remap_image(liq_result *result, liq_image *input_image, unsigned char **row_pointers)
+{
+    colormap *const acolormap = result->palette;
+    const liq_attr *const options = &result->options;
+    const struct nearest_map *const fixed_nearest = result->fixed ? result->fixed->nearest : NULL;
+
+    /*
+     ** Step 4: map the colors in the image to their closest match in the
+     ** new colormap, and write 'em out.
+     */
+
+    const bool floyd = result->dither_level > 0,
+              use_dither_map = floyd && input_image->edges && options->speed < 6;
+
+    if (!floyd || use_dither_map) {
+        // If no dithering is required, that's the final remapping.
+        // If dithering (with dither map) is required, this image is used to find areas that require dithering
+        const stats_time start = stats_start(options->stats);
+        float remapping_error = remap_to_palette(input_image, row_pointers, acolormap, fixed_nearest, options->min_opaque_val);
+        stats_end(options->stats, STATS_REMAP, start);
+
+        // remapping error from dithered image is absurd, so always non-dithered value is used
+        // palette_error includes some perceptual weighting from histogram which is closer correlated with dssim
+        // so that should be used when possible.
+        if (result->palette_error < 0) {
+            result->palette_error = remapping_error;
+        }
+
+        if (use_dither_map) {
+            const stats_time start = stats_start(options->stats);
+            update_dither_map(row_pointers, input_image);
+            stats_end(options->stats, STATS_DITHER_MAP, start);
+        }
+    }
+
+    if (result->palette_error >= 0) {
+        verbose_printf(options, "  mapped image to new colors...MSE=%.3f", result->palette_error*65536.0/6.0);
+    }
+
+    // remapping above was the last chance to do voronoi iteration, hence the final palette is set after remapping
+    if (!result->fixed) set_palette(result, acolormap);
+
+    if (floyd) {
+        const stats_time start = stats_start(options->stats);
+        trace_begin("remap_to_palette_floyd");
+        remap_to_palette_floyd(input_image, row_pointers, acolormap, fixed_nearest, options->min_opaque_val, input_image->edges, use_dither_map, MAX(result->palette_error*2.4, 16.f/256.f), result->dither_level);
+        trace_end("remap_to_palette_floyd");
+        stats_end(options->stats, STATS_FLOYD, start);
+    }
+    counters_flush(options->stats ? &options->stats->counters : NULL);
+
+    liq_image_free_maps(input_image);
+    verbose_printf_flush(options);
+}
+
+LIQ_EXPORT liq_error liq_write_remapped_image_rows(liq_result *result, liq_image *input_image, unsigned char **row_pointers)
+{
+    if (!result || !input_image || !row_pointers) return LIQ_INVALID_POINTER;
+
+    struct liq_stats *const prev_stats = stats_set_current(result->options.stats);
+    remap_image(result, input_image, row_pointers);
+    stats_set_current(prev_stats);
+    return LIQ_OK;
+}
+
+LIQ_EXPORT const liq_palette *liq_get_palette(liq_result *result)
+{
+    if (!result->int_palette.count) {
+        set_palette(result, result->palette);
+    }
+    return &result->int_palette;
+}
+
+LIQ_EXPORT double liq_get_quantization_error(const liq_result *result)
+{
+    if (result->palette_error >= 0) {
+        return result->palette_error*65536.0/6.0;
+    }
+    return -1;
+}
+
+LIQ_EXPORT int liq_get_quantization_quality(const liq_result *result)
+{
+    if (result->palette_error >= 0) {
+        return mse_to_quality(result->palette_error);
+    }
+    return -1;
+}
+
+LIQ_EXPORT void liq_result_destroy(liq_result *result)
+{
+    if (!result) return;
+
+    if (!result->fixed) pam_freecolormap(result->palette);
+    free(result);
+}
+
+LIQ_EXPORT liq_fixed_palette *liq_fixed_palette_create(const liq_attr *attr, const liq_color colors[], int count, double gamma)
+{
+    if (!attr || !colors || count < 1 || count > 256) return NULL;
+
+    liq_fixed_palette *palette = malloc(sizeof(liq_fixed_palette));
+    if (!palette) return NULL;
+
+    // palette is shared by images, so its memory isn't counted in stats of any of them
+    struct liq_stats *const prev_stats = stats_set_current(NULL);
+
+    *palette = (liq_fixed_palette){
+        .map = pam_colormap(count),
+        .gamma = gamma ? gamma : 0.45455,
+    };
+
+    float gamma_lut[256];
+    to_f_set_gamma(gamma_lut, palette->gamma);
+    for(int i=0; i < count; i++) {
+        palette->map->palette[i].acolor = to_f(gamma_lut, (rgb_pixel){colors[i].r, colors[i].g, colors[i].b, colors[i].a});
+        palette->map->palette[i].popularity = i; // keeps the order, apart from transparent colors moved for tRNS
+    }
+    sort_palette(palette->map, attr);
+
+    palette->int_palette.count = count;
+    for(int i=0; i < count; i++) {
+        const rgb_pixel px = to_rgb(palette->gamma, palette->map->palette[i].acolor);
+        palette->int_palette.entries[i] = (liq_color){.r=px.r, .g=px.g, .b=px.b, .a=px.a};
+    }
+    palette->nearest = nearest_init(palette->map);
+
+    stats_set_current(prev_stats);
+    verbose_printf(attr, "  using fixed palette of %d colors", count);
+    return palette;
+}
+
+LIQ_EXPORT void liq_fixed_palette_destroy(liq_fixed_palette *palette)
+{
+    if (!palette) return;
+
+    nearest_free(palette->nearest);
+    pam_freecolormap(palette->map);
+    free(palette);
+}
+
+LIQ_EXPORT liq_error liq_fixed_palette_error(const liq_fixed_palette *palette, liq_image *input_image, const liq_attr *attr, double *error_out)
+{
+    if (!palette || !input_image || !attr || !error_out) return LIQ_INVALID_POINTER;
+
+    struct liq_stats *const prev_stats = stats_set_current(attr->stats);
+    const stats_time hist_start = stats_start(attr->stats);
+    histogram *hist = get_histogram(input_image, attr);
+    stats_end(attr->stats, STATS_HISTOGRAM, hist_start);
+
+    // Voronoi iteration moves colors after measuring the error, so it's given a copy
+    const stats_time start = stats_start(attr->stats);
+    colormap *map = pam_colormap(palette->map->colors);
+    memcpy(map->palette, palette->map->palette, sizeof(map->palette[0]) * map->colors);
+    const double error = viter_do_iteration(hist, map, attr->min_opaque_val, NULL);
+    pam_freecolormap(map);
+    pam_freeacolorhist(hist);
+    stats_end(attr->stats, STATS_VORONOI, start);
+    stats_set_current(prev_stats);
+
+    *error_out = error*65536.0/6.0;
+    return error > attr->max_mse ? LIQ_QUALITY_TOO_LOW : LIQ_OK;
+}
+
+LIQ_EXPORT liq_result *liq_result_create_fixed(const liq_attr *attr, const liq_fixed_palette *palette)
+{
+    if (!attr || !palette) return NULL;
+
+    liq_result *result = malloc(sizeof(liq_result));
+    if (!result) return NULL;
+
+    *result = (liq_result){
+        .options = *attr,
+        .palette = palette->map,
+        .fixed = palette,
+        .int_palette = palette->int_palette,
+        .dither_level = 1.0,
+        .gamma = palette->gamma,
+        .palette_error = -1, // measured when remapping
+    };
+    return result;
+}
@@ -0,0 +1,221 @@
+/*
+ * libimagequant - quantization of RGBA images to 256-color palette, without PNG I/O
+ *
+ * © 2009-2013 by Kornel Lesinski.
+ *
+ * Permission to use, copy, modify, and distribute this software and its
+ * documentation for any purpose and without fee is hereby granted, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation.  This software is provided "as is" without express or
+ * implied warranty.
+ */
+
+#ifndef LIBIMAGEQUANT_H
+#define LIBIMAGEQUANT_H
+
+#ifndef LIQ_EXPORT
+#define LIQ_EXPORT extern
+#endif
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct liq_attr liq_attr;
+typedef struct liq_image liq_image;
+typedef struct liq_result liq_result;
+
+typedef struct liq_color {
+    unsigned char r, g, b, a;
+} liq_color;
+
+typedef struct liq_palette {
+    unsigned int count;
+    liq_color entries[256];
+} liq_palette;
+
+typedef enum liq_error {
+    LIQ_OK = 0,
+    LIQ_QUALITY_TOO_LOW = 99,
+    LIQ_VALUE_OUT_OF_RANGE = 100,
+    LIQ_OUT_OF_MEMORY,
+    LIQ_BUFFER_TOO_SMALL,
+    LIQ_INVALID_POINTER,
+} liq_error;
+
+typedef void liq_log_callback_function(const liq_attr*, const char *message, void* user_info);
+typedef void liq_log_flush_callback_function(const liq_attr*, void* user_info);
+
+/* Settings. Attributes are copied into images and results, so they can be changed or destroyed afterwards */
+LIQ_EXPORT liq_attr* liq_attr_create(void);
+LIQ_EXPORT liq_attr* liq_attr_copy(const liq_attr *orig);
+LIQ_EXPORT void liq_attr_destroy(liq_attr *attr);
+
+LIQ_EXPORT liq_error liq_set_max_colors(liq_attr* attr, int colors);
+LIQ_EXPORT int liq_get_max_colors(const liq_attr* attr);
+LIQ_EXPORT liq_error liq_set_speed(liq_attr* attr, int speed);
+LIQ_EXPORT int liq_get_speed(const liq_attr* attr);
+LIQ_EXPORT liq_error liq_set_min_opacity(liq_attr* attr, int min);
+LIQ_EXPORT int liq_get_min_opacity(const liq_attr* attr);
+LIQ_EXPORT liq_error liq_set_quality(liq_attr* attr, int minimum, int maximum);
+LIQ_EXPORT int liq_get_min_quality(const liq_attr* attr);
+LIQ_EXPORT int liq_get_max_quality(const liq_attr* attr);
+LIQ_EXPORT void liq_set_last_index_transparent(liq_attr* attr, int is_last);
+
+/*
+ Memory limit in bytes (0 = unlimited). When buffers wouldn't fit, cheaper methods are used:
+ noise/edge maps are skipped and the histogram is made with fewer colors. Memory counted in stats counts too.
+ */
+LIQ_EXPORT liq_error liq_set_max_memory(liq_attr* attr, size_t bytes);
+LIQ_EXPORT size_t liq_get_max_memory(const liq_attr* attr);
+/*
+ Peak memory needed to quantize and remap an image of that size, not counting the caller's pixels.
+ Only dimensions are needed (e.g. from a PNG header), so callers can decide how many images fit in memory at once.
+ It's never more than the liq_set_max_memory() limit, which cheaper methods are used to stay within.
+ */
+LIQ_EXPORT size_t liq_image_memory_estimate(const liq_attr* attr, int width, int height);
+
+/*
+ Images with more than max_pixels pixels get their palette from a copy downscaled by a power of 2 to fit
+ (a pyramid level), which is then refined on pixels sampled at full resolution. Much faster for large photos,
+ whose palette depends on the overall distribution of colors rather than on detail. 0 (the default) disables it.
+ */
+LIQ_EXPORT liq_error liq_set_pyramid(liq_attr* attr, size_t max_pixels);
+LIQ_EXPORT size_t liq_get_pyramid(const liq_attr* attr);
+
+LIQ_EXPORT void liq_set_log_callback(liq_attr*, liq_log_callback_function*, void* user_info);
+LIQ_EXPORT void liq_set_log_flush_callback(liq_attr*, liq_log_flush_callback_function*, void* user_info);
+
+/*
+ Time and memory used in each stage are added to stats (struct defined in stats.h). NULL disables timing.
+ Stats must outlive images and results created while they're set.
+ */
+typedef struct liq_stats liq_stats;
+LIQ_EXPORT void liq_set_stats(liq_attr *attr, liq_stats *stats);
+
+/*
+ Number of threads used by all quantizations in the process (0 = one per CPU, which is the default).
+ Results don't depend on it. Don't change it while other threads are quantizing or remapping.
+ */
+LIQ_EXPORT liq_error liq_set_threads(int threads);
+LIQ_EXPORT int liq_get_threads(void);
+
+/*
+ Images reference caller's pixels (RGBA, 8 bits per channel), which must stay valid until the image is destroyed.
+ Pixels are never modified. Gamma 0 means the default 0.45455 (sRGB-like).
+ */
+LIQ_EXPORT liq_image *liq_image_create_rgba_rows(const liq_attr *attr, void* rows[], int width, int height, double gamma);
+LIQ_EXPORT liq_image *liq_image_create_rgba(const liq_attr *attr, void* bitmap, int width, int height, size_t stride, double gamma);
+
+/*
+ Same for opaque images with 3 bytes per pixel (RGB), which take 25% less memory than RGBA.
+ Opaque images are quantized and remapped with faster versions of kernels that skip the alpha channel.
+ */
+LIQ_EXPORT liq_image *liq_image_create_rgb_rows(const liq_attr *attr, void* rows[], int width, int height, double gamma);
+LIQ_EXPORT liq_image *liq_image_create_rgb(const liq_attr *attr, void* bitmap, int width, int height, size_t stride, double gamma);
+
+/*
+ Pixels of a custom image are requested from the callback, a band of rows at a time, so the whole image doesn't
+ have to be in memory. The callback must write num_rows*width pixels (no padding) to rows_out.
+ Rows may be requested more than once (quantization and remapping read the image several times),
+ but never from more than one thread at a time.
+ */
+typedef void liq_image_get_rgba_rows_callback(liq_color rows_out[], int first_row, int num_rows, int width, void* user_info);
+
+LIQ_EXPORT liq_image *liq_image_create_custom(const liq_attr *attr, liq_image_get_rgba_rows_callback *row_callback, void* user_info, int width, int height, double gamma);
+/* number of rows requested from the callback at once (default 32). Ignored for images with row pointers */
+LIQ_EXPORT liq_error liq_image_set_row_cache_size(liq_image *img, int rows);
+/*
+ Another image of the same pixels, which must outlive it. The edge map made by quantization is copied, so the pixels
+ can be remapped to several palettes at once (remapping changes and frees the map). Copies of a custom image share
+ its callback, so they can't be remapped at the same time.
+ */
+LIQ_EXPORT liq_image *liq_image_copy(const liq_image *source);
+LIQ_EXPORT int liq_image_get_width(const liq_image *img);
+LIQ_EXPORT int liq_image_get_height(const liq_image *img);
+LIQ_EXPORT void liq_image_destroy(liq_image *img);
+
+/* Returns LIQ_QUALITY_TOO_LOW if the image can't be quantized within the quality limit set by liq_set_quality() */
+LIQ_EXPORT liq_error liq_image_quantize(liq_image *input_image, const liq_attr *attr, liq_result **result_output);
+
+/*
+ One palette for many images, e.g. frames of an animation, made from a histogram of all of them.
+ Images added at once get their noise/edge maps and histograms made in parallel (edges are kept for dithering when
+ they're remapped). All images must have the same gamma. The histogram isn't safe to use from many threads at once.
+ */
+typedef struct liq_histogram liq_histogram;
+LIQ_EXPORT liq_histogram *liq_histogram_create(const liq_attr *attr);
+LIQ_EXPORT liq_error liq_histogram_add_images(liq_histogram *hist, const liq_attr *attr, liq_image *images[], int count);
+LIQ_EXPORT liq_error liq_histogram_quantize(liq_histogram *hist, const liq_attr *attr, liq_result **result_output);
+LIQ_EXPORT void liq_histogram_destroy(liq_histogram *hist);
+
+/*
+ Palette with fewer colors or a lower quality target (set in attr), made from a larger result instead of a new search,
+ e.g. a ladder of palettes of one image, each made from the previous one. Colors of the larger palette are merged
+ pairwise where that adds the least error, and then moved towards a local minimum for the histogram.
+ */
+LIQ_EXPORT liq_error liq_histogram_quantize_from(liq_histogram *hist, const liq_attr *attr, const liq_result *larger, liq_result **result_output);
+
+/*
+ Rate-distortion curve without remapping. Median cut splits boxes one at a time, so a single run passes through every
+ number of colors up to the attr's max colors: mse_out[n-1] is set to the error of its n-color palette (same units as
+ liq_get_quantization_error()) and *count_out to the number of entries set, which is lower if the histogram has fewer
+ colors. mse_out needs max colors entries. Palettes for the num_refine numbers of colors in refine_colors[] are also
+ moved towards a local minimum with Voronoi iteration, which is closer to what liq_histogram_quantize() would give,
+ and their errors are set in refined_mse_out[] (-1 for palettes the run didn't reach).
+ */
+LIQ_EXPORT liq_error liq_histogram_analyze(liq_histogram *hist, const liq_attr *attr, double mse_out[], int *count_out, const int refine_colors[], int num_refine, double refined_mse_out[]);
+
+/*
+ Histograms can be made in other processes, e.g. each of a band of rows of a giant image, and merged in one.
+ The data is in the machine's native byte order, for processes on the same machine. Serializing needs a buffer
+ of liq_histogram_serialized_size() bytes. Adding data that isn't a serialized histogram, or has different gamma,
+ returns LIQ_VALUE_OUT_OF_RANGE. Histograms added in the same order give the same palette.
+ */
+LIQ_EXPORT size_t liq_histogram_serialized_size(const liq_histogram *hist);
+LIQ_EXPORT liq_error liq_histogram_serialize(const liq_histogram *hist, void *buffer, size_t buffer_size);
+LIQ_EXPORT liq_error liq_histogram_add_serialized(liq_histogram *hist, const liq_attr *attr, const void *buffer, size_t size);
+
+/* 0 = no dithering, 1 = full Floyd-Steinberg dithering */
+LIQ_EXPORT liq_error liq_set_dithering_level(liq_result *res, float dither_level);
+LIQ_EXPORT liq_error liq_set_output_gamma(liq_result* res, double gamma);
+LIQ_EXPORT double liq_get_output_gamma(const liq_result *result);
+
+/* Remapping refines the palette, so get the palette after writing the remapped image */
+LIQ_EXPORT liq_error liq_write_remapped_image(liq_result *result, liq_image *input_image, void *buffer, size_t buffer_size);
+LIQ_EXPORT liq_error liq_write_remapped_image_rows(liq_result *result, liq_image *input_image, unsigned char **row_pointers);
+LIQ_EXPORT const liq_palette *liq_get_palette(liq_result *result);
+
+/* MSE and 0-100 quality of the palette, or -1 if unknown (not calculated at high speed settings until remapped) */
+LIQ_EXPORT double liq_get_quantization_error(const liq_result *result);
+LIQ_EXPORT int liq_get_quantization_quality(const liq_result *result);
+
+LIQ_EXPORT void liq_result_destroy(liq_result *);
+
+/*
+ Fixed palette, e.g. brand colors or a palette made earlier, that images are remapped to without liq_image_quantize().
+ Colors are in the given gamma (0 = default), which is also the output gamma. Transparent colors are moved to the
+ beginning (or the end, see liq_set_last_index_transparent()), otherwise the order is kept.
+ Its nearest color index is built once, and remapping doesn't change it, so it can be used by any number of
+ images and threads at once. It must outlive results created with it.
+ */
+typedef struct liq_fixed_palette liq_fixed_palette;
+LIQ_EXPORT liq_fixed_palette *liq_fixed_palette_create(const liq_attr *attr, const liq_color colors[], int count, double gamma);
+LIQ_EXPORT void liq_fixed_palette_destroy(liq_fixed_palette *palette);
+/* result to be used with liq_write_remapped_image() instead of one from liq_image_quantize() */
+LIQ_EXPORT liq_result *liq_result_create_fixed(const liq_attr *attr, const liq_fixed_palette *palette);
+/*
+ MSE the image would have with the fixed palette (same units as liq_get_quantization_error()), found quicker than
+ by remapping: from the image's histogram with one Voronoi iteration. Returns LIQ_QUALITY_TOO_LOW if it's below
+ the liq_set_quality() minimum. Lets a palette be reused for as long as it suits images, e.g. frames of animation.
+ */
+LIQ_EXPORT liq_error liq_fixed_palette_error(const liq_fixed_palette *palette, liq_image *input_image, const liq_attr *attr, double *error_out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -18,10 +18,12 @@
 
 #include "pam.h"
 #include "mediancut.h"
+#include "simd.h"
+#include "counters.h"
 
 #define index_of_channel(ch) (offsetof(f_pixel,ch)/sizeof(float))
 
-static f_pixel averagepixels(unsigned int clrs, const hist_item achv[static clrs], float min_opaque_val);
+static f_pixel averagepixels(unsigned int clrs, const hist_item achv[static clrs], float min_opaque_val, bool opaque);
 
 struct box {
     f_pixel color;
@@ -31,44 +33,27 @@ struct box {
     unsigned int colors;
 };
 
-inline static double variance_diff(double val, const double good_enough) ALWAYS_INLINE;
-inline static double variance_diff(double val, const double good_enough)
-{
-    val *= val;
-    if (val < good_enough*good_enough) return val*0.5;
-    return val;
-}
-
 /** Weighted per-channel variance of the box. It's used to decide which channel to split by */
-static f_pixel box_variance(const hist_item achv[], const struct box *box)
+static f_pixel box_variance(const hist_item achv[], const struct box *box, const bool opaque)
 {
-    f_pixel mean = box->color;
-    double variancea=0, variancer=0, varianceg=0, varianceb=0;
-
-    for(unsigned int i = 0; i < box->colors; ++i) {
-        f_pixel px = achv[box->ind + i].acolor;
-        double weight = achv[box->ind + i].adjusted_weight;
-        variancea += variance_diff(mean.a - px.a, 2.0/256.0)*weight;
-        variancer += variance_diff(mean.r - px.r, 1.0/256.0)*weight;
-        varianceg += variance_diff(mean.g - px.g, 1.0/256.0)*weight;
-        varianceb += variance_diff(mean.b - px.b, 1.0/256.0)*weight;
-    }
+    double variance[4]; // a, r, g, b
+    (opaque ? simd.variance_rgb : simd.variance)(&achv[box->ind], box->colors, box->color, variance);
 
     return (f_pixel){
-        .a = variancea*(4.0/16.0),
-        .r = variancer*(7.0/16.0),
-        .g = varianceg*(9.0/16.0),
-        .b = varianceb*(5.0/16.0),
+        .a = variance[0]*(4.0/16.0),
+        .r = variance[1]*(7.0/16.0),
+        .g = variance[2]*(9.0/16.0),
+        .b = variance[3]*(5.0/16.0),
     };
 }
 
-static double box_max_error(const hist_item achv[], const struct box *box)
+static double box_max_error(const hist_item achv[], const struct box *box, const bool opaque)
 {
     f_pixel mean = box->color;
     double max_error = 0;
 
     for(unsigned int i = 0; i < box->colors; ++i) {
-        const double diff = colordifference(mean, achv[box->ind + i].acolor);
+        const double diff = opaque ? colordifference_rgb(mean, achv[box->ind + i].acolor) : colordifference(mean, achv[box->ind + i].acolor);
         if (diff > max_error) {
             max_error = diff;
         }
@@ -101,6 +86,7 @@ inline static unsigned int qsort_pivot(const hist_item *const base, const unsign
 inline static unsigned int qsort_partition(hist_item *const base, const unsigned int len) ALWAYS_INLINE;
 inline static unsigned int qsort_partition(hist_item *const base, const unsigned int len)
 {
+    COUNTER_ADD(sort_partitions, 1);
     unsigned int l = 1, r = len;
     if (len >= 8) {
         hist_item_swap(&base[0], &base[qsort_pivot(base,len)]);
@@ -169,7 +155,7 @@ static hist_item *hist_item_sort_halfvar(hist_item *base, unsigned int len, doub
     } while(1);
 }
 
-static f_pixel get_median(const struct box *b, hist_item achv[]);
+static f_pixel get_median(const struct box *b, hist_item achv[], bool opaque);
 
 typedef struct {
     unsigned int chan; float variance;
@@ -182,7 +168,7 @@ static int comparevariance(const void *ch1, const void *ch2)
 }
 
 /** Finds which channels need to be sorted first and preproceses achv for fast sort */
-static double prepare_sort(struct box *b, hist_item achv[])
+static double prepare_sort(struct box *b, hist_item achv[], const bool opaque)
 {
     /*
      ** Sort dimensions by their variance, and then sort colors first by dimension with highest variance
@@ -204,7 +190,7 @@ static double prepare_sort(struct box *b, hist_item achv[])
                                        (unsigned int)((chans[channels[2].chan] + chans[channels[1].chan]/2.0 + chans[channels[3].chan]/4.0)*65535.0);
     }
 
-    const f_pixel median = get_median(b, achv);
+    const f_pixel median = get_median(b, achv, opaque);
 
     // box will be split to make color_weight of each side even
     const unsigned int ind = b->ind, end = ind+b->colors;
@@ -214,7 +200,7 @@ static double prepare_sort(struct box *b, hist_item achv[])
 }
 
 /** finds median in unsorted set by sorting only minimum required */
-static f_pixel get_median(const struct box *b, hist_item achv[])
+static f_pixel get_median(const struct box *b, hist_item achv[], const bool opaque)
 {
     const unsigned int median_start = (b->colors-1)/2;
 
@@ -224,7 +210,7 @@ static f_pixel get_median(const struct box *b, hist_item achv[])
 
     if (b->colors&1) return achv[b->ind + median_start].acolor;
 
-    return averagepixels(2, &achv[b->ind + median_start], 1.0);
+    return averagepixels(2, &achv[b->ind + median_start], 1.0, opaque);
 }
 
 /*
@@ -276,6 +262,15 @@ double box_error(const struct box *box, const hist_item achv[])
 }
 
 
+/* error of boxes is kept up to date on every split, instead of lazily */
+static void curve_record(struct mediancut_curve *curve, struct box bv[], unsigned int boxes, double total_error, const histogram *hist)
+{
+    curve->errors[boxes-1] = total_error / hist->total_perceptual_weight;
+    if (curve->keep && curve->keep[boxes-1]) {
+        curve->palettes[boxes-1] = colormap_from_boxes(bv, boxes, hist->achv);
+    }
+}
+
 static bool total_box_error_below_target(double target_mse, struct box bv[], unsigned int boxes, const histogram *hist)
 {
     target_mse *= hist->total_perceptual_weight;
@@ -305,9 +300,10 @@ static bool total_box_error_below_target(double target_mse, struct box bv[], uns
  ** on Paul Heckbert's paper, "Color Image Quantization for Frame Buffer
  ** Display," SIGGRAPH 1982 Proceedings, page 297.
  */
-colormap *mediancut(histogram *hist, const float min_opaque_val, unsigned int newcolors, const double target_mse, const double max_mse)
+colormap *mediancut(histogram *hist, const float min_opaque_val, unsigned int newcolors, const double target_mse, const double max_mse, struct mediancut_curve *curve)
 {
     hist_item *achv = hist->achv;
+    const bool opaque = hist->opaque;
     struct box bv[newcolors];
 
     /*
@@ -315,15 +311,21 @@ colormap *mediancut(histogram *hist, const float min_opaque_val, unsigned int ne
      */
     bv[0].ind = 0;
     bv[0].colors = hist->size;
-    bv[0].color = averagepixels(bv[0].colors, &achv[bv[0].ind], min_opaque_val);
-    bv[0].variance = box_variance(achv, &bv[0]);
-    bv[0].max_error = box_max_error(achv, &bv[0]);
+    bv[0].color = averagepixels(bv[0].colors, &achv[bv[0].ind], min_opaque_val, opaque);
+    bv[0].variance = box_variance(achv, &bv[0], opaque);
+    bv[0].max_error = box_max_error(achv, &bv[0], opaque);
     bv[0].sum = 0;
     bv[0].total_error = -1;
     for(unsigned int i=0; i < bv[0].colors; i++) bv[0].sum += achv[i].adjusted_weight;
 
     unsigned int boxes = 1;
 
+    double curve_error = 0;
+    if (curve) {
+        bv[0].total_error = curve_error = box_error(&bv[0], achv);
+        curve_record(curve, bv, boxes, curve_error, hist);
+    }
+
     // remember smaller palette for fast searching
     colormap *representative_subset = NULL;
     unsigned int subset_size = ceilf(powf(newcolors,0.7f));
@@ -358,7 +360,7 @@ colormap *mediancut(histogram *hist, const float min_opaque_val, unsigned int ne
          Median used as expected value gives much better results than mean.
          */
 
-        const double halfvar = prepare_sort(&bv[bi], achv);
+        const double halfvar = prepare_sort(&bv[bi], achv, opaque);
         double lowervar=0;
 
         // hist_item_sort_halfvar sorts and sums lowervar at the same time
@@ -369,25 +371,34 @@ colormap *mediancut(histogram *hist, const float min_opaque_val, unsigned int ne
         /*
          ** Split the box.
          */
+        const double split_error = bv[bi].total_error;
         double sm = bv[bi].sum;
         double lowersum = 0;
         for(unsigned int i=0; i < break_at; i++) lowersum += achv[indx + i].adjusted_weight;
 
         bv[bi].colors = break_at;
         bv[bi].sum = lowersum;
-        bv[bi].color = averagepixels(bv[bi].colors, &achv[bv[bi].ind], min_opaque_val);
+        bv[bi].color = averagepixels(bv[bi].colors, &achv[bv[bi].ind], min_opaque_val, opaque);
         bv[bi].total_error = -1;
-        bv[bi].variance = box_variance(achv, &bv[bi]);
-        bv[bi].max_error = box_max_error(achv, &bv[bi]);
+        bv[bi].variance = box_variance(achv, &bv[bi], opaque);
+        bv[bi].max_error = box_max_error(achv, &bv[bi], opaque);
         bv[boxes].ind = indx + break_at;
         bv[boxes].colors = clrs - break_at;
         bv[boxes].sum = sm - lowersum;
-        bv[boxes].color = averagepixels(bv[boxes].colors, &achv[bv[boxes].ind], min_opaque_val);
+        bv[boxes].color = averagepixels(bv[boxes].colors, &achv[bv[boxes].ind], min_opaque_val, opaque);
         bv[boxes].total_error = -1;
-        bv[boxes].variance = box_variance(achv, &bv[boxes]);
-        bv[boxes].max_error = box_max_error(achv, &bv[boxes]);
+        bv[boxes].variance = box_variance(achv, &bv[boxes], opaque);
+        bv[boxes].max_error = box_max_error(achv, &bv[boxes], opaque);
+
+        if (curve) {
+            bv[bi].total_error = box_error(&bv[bi], achv);
+            bv[boxes].total_error = box_error(&bv[boxes], achv);
+            curve_error += bv[bi].total_error + bv[boxes].total_error - split_error;
+        }
 
         ++boxes;
+        COUNTER_ADD(boxes_split, 1);
+        if (curve) curve_record(curve, bv, boxes, curve_error, hist);
 
         if (total_box_error_below_target(target_mse, bv, boxes, hist)) {
             break;
@@ -436,7 +447,8 @@ static void adjust_histogram(hist_item *achv, const colormap *map, const struct
     }
 }
 
-static f_pixel averagepixels(unsigned int clrs, const hist_item achv[static clrs], const float min_opaque_val)
+/* alpha of opaque colors isn't averaged, it's 1 anyway */
+static f_pixel averagepixels(unsigned int clrs, const hist_item achv[static clrs], const float min_opaque_val, const bool opaque)
 {
     double r = 0, g = 0, b = 0, a = 0, sum = 0;
     float maxa = 0;
@@ -461,10 +473,12 @@ static f_pixel averagepixels(unsigned int clrs, const hist_item achv[static clrs
         r += px.r * weight;
         g += px.g * weight;
         b += px.b * weight;
-        a += px.a * weight;
+        if (!opaque) {
+            a += px.a * weight;
 
-        /* find if there are opaque colors, in case we're supposed to preserve opacity exactly (ie_bug) */
-        if (px.a > maxa) maxa = px.a;
+            /* find if there are opaque colors, in case we're supposed to preserve opacity exactly (ie_bug) */
+            if (px.a > maxa) maxa = px.a;
+        }
     }
 
     /* Colors are in premultiplied alpha colorspace, so they'll blend OK
@@ -478,7 +492,7 @@ static f_pixel averagepixels(unsigned int clrs, const hist_item achv[static clrs
     assert(!isnan(r) && !isnan(g) && !isnan(b) && !isnan(a));
 
     /** if there was at least one completely opaque color, "round" final color to opaque */
-    if (a >= min_opaque_val && maxa >= (255.0/256.0)) a = 1;
+    if (opaque || (a >= min_opaque_val && maxa >= (255.0/256.0))) a = 1;
 
     return (f_pixel){.r=r, .g=g, .b=b, .a=a};
 }
@@ -1,2 +1,12 @@
 
-colormap *mediancut(histogram *hist, const float min_opaque_val, unsigned int newcolors, const double target_mse, const double max_mse);
+/*
+ Optional record of a run, which passes through every number of boxes up to newcolors, one split at a time.
+ errors[n-1] is set to total error (MSE) of n boxes, and if keep[n-1] is set, their palette is kept in palettes[n-1].
+ */
+struct mediancut_curve {
+    double *errors;
+    const bool *keep;
+    colormap **palettes;
+};
+
+colormap *mediancut(histogram *hist, const float min_opaque_val, unsigned int newcolors, const double target_mse, const double max_mse, struct mediancut_curve *curve);
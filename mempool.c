@@ -1,5 +1,6 @@
 
 #include "mempool.h"
+#include "stats.h"
 #include <stdlib.h>
 #include <assert.h>
 
@@ -23,7 +24,7 @@ void* mempool_new(mempool *mptr, unsigned int size, unsigned int max_size)
     mempool old = *mptr;
     if (!max_size) max_size = size > (1<<17) ? size : 1<<17;
 
-    (*mptr) = (mempool)calloc(MEMPOOL_RESERVED + max_size, 1);
+    (*mptr) = stats_calloc(MEMPOOL_RESERVED + max_size, 1);
     (*mptr)->size = MEMPOOL_RESERVED + max_size;
     (*mptr)->used = MEMPOOL_RESERVED;
     (*mptr)->next = old;
@@ -35,7 +36,7 @@ void mempool_free(mempool m)
 {
     while (m) {
         mempool next = m->next;
-        free(m);
+        stats_free(m);
         m = next;
     }
 }
@@ -0,0 +1,541 @@
+/*
+ pngquant-microbench - timing of individual quantization kernels, to test changes to them in isolation.
+
+ Every kernel runs on fixed, generated data. The number of iterations is calibrated so that each sample
+ takes at least --min-time, and after warmup samples the time per operation is reported as mean,
+ relative standard deviation and minimum of the samples.
+ */
+
+#if !defined(WIN32) && !defined(__WIN32__)
+#define _POSIX_C_SOURCE 200112L /* clock_gettime() */
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <math.h>
+#include <getopt.h>
+#include <time.h>
+
+#include "pam.h"
+#include "nearest.h"
+#include "mediancut.h"
+#include "blur.h"
+#include "simd.h"
+
+#define MICROBENCH_USAGE "\
+usage:  pngquant-microbench [options] [filter...]\n\n\
+options:\n\
+  --samples N       number of measured samples (default: 10)\n\
+  --warmup N        number of samples run before measurement (default: 2)\n\
+  --min-time ms     minimum duration of a sample (default: 20)\n\n\
+Only benchmarks with names containing one of the filters are run, e.g. nearest_search/real\n"
+
+#define MAX_SAMPLES 1000
+
+typedef void (*kernel_fn)(void *context, unsigned long iterations);
+
+struct options {
+    unsigned int samples, warmup;
+    double min_time;
+    char **filters;
+    unsigned int num_filters;
+};
+
+static volatile double sink; // keeps results of kernels alive, so that the compiler can't skip them
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static bool selected(const struct options *options, const char *name)
+{
+    if (!options->num_filters) return true;
+    for(unsigned int i=0; i < options->num_filters; i++) {
+        if (strstr(name, options->filters[i])) return true;
+    }
+    return false;
+}
+
+static double time_kernel(kernel_fn fn, void *context, unsigned long iterations)
+{
+    const double start = now();
+    fn(context, iterations);
+    return now() - start;
+}
+
+/* ops is number of operations done in a single iteration of the kernel */
+static void measure(const struct options *options, const char *name, kernel_fn fn, void *context, double ops)
+{
+    if (!selected(options, name)) return;
+
+    // calibration also warms up caches and branch predictors
+    unsigned long iterations = 1;
+    double elapsed;
+    while ((elapsed = time_kernel(fn, context, iterations)) < options->min_time) {
+        const double scale = elapsed > 0 ? options->min_time / elapsed * 1.1 : 100;
+        iterations = MAX(iterations + 1, iterations * MIN(scale, 100.0));
+    }
+
+    for(unsigned int i=0; i < options->warmup; i++) {
+        time_kernel(fn, context, iterations);
+    }
+
+    double sum = 0, sum_squares = 0, best = MAX_DIFF;
+    for(unsigned int i=0; i < options->samples; i++) {
+        const double ns_per_op = time_kernel(fn, context, iterations) * 1e9 / (iterations * ops);
+        sum += ns_per_op;
+        sum_squares += ns_per_op * ns_per_op;
+        best = MIN(best, ns_per_op);
+    }
+
+    const double mean = sum / options->samples;
+    const double variance = options->samples > 1 ? MAX(0, (sum_squares - sum*mean) / (options->samples-1)) : 0;
+
+    printf("%-36s %12.2f ns/op  ±%5.1f%%  min %12.2f  (%lu×%.0f ops)\n",
+           name, mean, mean > 0 ? 100.0 * sqrt(variance) / mean : 0, best, iterations, ops);
+    fflush(stdout);
+}
+
+/* xorshift, so that data is the same on every run and platform */
+static unsigned int random_next(unsigned int *state)
+{
+    unsigned int x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+static rgb_pixel random_rgba(unsigned int *state)
+{
+    const unsigned int v = random_next(state);
+    return (rgb_pixel){.r = v, .g = v >> 8, .b = v >> 16, .a = v >> 24};
+}
+
+/* smooth shapes with a bit of grain, similar in color distribution to a photo */
+static rgb_pixel photo_pixel(unsigned int x, unsigned int y, unsigned int *state)
+{
+    const float fx = x / 97.f, fy = y / 61.f;
+    const int grain = (int)(random_next(state) & 15) - 8;
+    const float r = 128.f + 100.f * sinf(fx + 0.7f * sinf(fy)) + grain,
+                g = 110.f + 90.f * sinf(fy * 1.3f + fx * 0.4f) + grain,
+                b = 100.f + 80.f * cosf(fx * 0.8f - fy) + grain;
+    return (rgb_pixel){
+        .r = MAX(0, MIN(255, r)),
+        .g = MAX(0, MIN(255, g)),
+        .b = MAX(0, MIN(255, b)),
+        .a = 255,
+    };
+}
+
+static rgb_pixel *photo_image(unsigned int width, unsigned int height)
+{
+    rgb_pixel *pixels = malloc(sizeof(pixels[0]) * width * height);
+    unsigned int state = 1;
+    for(unsigned int y=0; y < height; y++) {
+        for(unsigned int x=0; x < width; x++) {
+            pixels[x + y*width] = photo_pixel(x, y, &state);
+        }
+    }
+    return pixels;
+}
+
+/* each pixel is one of exactly min(colors, width*height) distinct colors */
+static rgb_pixel *colors_image(unsigned int width, unsigned int height, unsigned int colors)
+{
+    rgb_pixel *pixels = malloc(sizeof(pixels[0]) * width * height);
+    unsigned int state = 1;
+    for(unsigned int i=0; i < width*height; i++) {
+        // multiplication by an odd number is a bijection, so different indices give different colors
+        const unsigned int index = colors >= width*height ? i : random_next(&state) % colors;
+        const union rgba_as_int px = {.l = index * 0x9E3779B1u};
+        pixels[i] = px.rgb;
+    }
+    return pixels;
+}
+
+static histogram *image_histogram(const rgb_pixel *pixels, unsigned int width, unsigned int height)
+{
+    struct acolorhash_table *acht = pam_allocacolorhash(width*height, width*height, 0);
+    const rgb_pixel *const *rows = malloc(sizeof(rows[0]) * height);
+    for(unsigned int y=0; y < height; y++) ((const rgb_pixel **)rows)[y] = &pixels[y*width];
+
+    pam_computeacolorhash(acht, rows, width, height, NULL);
+    histogram *hist = pam_acolorhashtoacolorhist(acht, 0.45455);
+
+    pam_freeacolorhash(acht);
+    free((void*)rows);
+    return hist;
+}
+
+static f_pixel *to_f_pixels(const rgb_pixel *pixels, unsigned int count)
+{
+    float gamma_lut[256];
+    to_f_set_gamma(gamma_lut, 0.45455);
+
+    f_pixel *out = malloc(sizeof(out[0]) * count);
+    for(unsigned int i=0; i < count; i++) out[i] = to_f(gamma_lut, pixels[i]);
+    return out;
+}
+
+/*
+ colordifference
+ */
+
+#define COLOR_PAIRS 4096
+
+struct color_pairs {
+    f_pixel *a, *b;
+};
+
+static void colordifference_stdc_kernel(void *context, unsigned long iterations)
+{
+    const struct color_pairs *pairs = context;
+    float sum = 0;
+    for(unsigned long n=0; n < iterations; n++) {
+        for(unsigned int i=0; i < COLOR_PAIRS; i++) sum += colordifference_stdc(pairs->a[i], pairs->b[i]);
+    }
+    sink = sum;
+}
+
+#if USE_SSE
+static void colordifference_sse_kernel(void *context, unsigned long iterations)
+{
+    const struct color_pairs *pairs = context;
+    float sum = 0;
+    for(unsigned long n=0; n < iterations; n++) {
+        for(unsigned int i=0; i < COLOR_PAIRS; i++) sum += colordifference(pairs->a[i], pairs->b[i]);
+    }
+    sink = sum;
+}
+#endif
+
+static void bench_colordifference(const struct options *options)
+{
+    unsigned int state = 1;
+    rgb_pixel pixels[COLOR_PAIRS*2];
+    for(unsigned int i=0; i < COLOR_PAIRS*2; i++) pixels[i] = random_rgba(&state);
+
+    struct color_pairs pairs = {
+        .a = to_f_pixels(pixels, COLOR_PAIRS),
+        .b = to_f_pixels(pixels + COLOR_PAIRS, COLOR_PAIRS),
+    };
+
+    measure(options, "colordifference/stdc", colordifference_stdc_kernel, &pairs, COLOR_PAIRS);
+#if USE_SSE
+    measure(options, "colordifference/sse", colordifference_sse_kernel, &pairs, COLOR_PAIRS);
+#endif
+
+    free(pairs.a);
+    free(pairs.b);
+}
+
+/*
+ nearest_init, nearest_search
+ */
+
+#define NEAREST_QUERIES (256*256)
+
+struct nearest_context {
+    colormap *map;
+    struct nearest_map *nearest;
+    const f_pixel *queries;
+};
+
+static void nearest_init_kernel(void *context, unsigned long iterations)
+{
+    const struct nearest_context *c = context;
+    for(unsigned long n=0; n < iterations; n++) {
+        nearest_free(nearest_init(c->map));
+    }
+}
+
+static void nearest_search_kernel(void *context, unsigned long iterations)
+{
+    const struct nearest_context *c = context;
+    unsigned int sum = 0;
+    for(unsigned long n=0; n < iterations; n++) {
+        for(unsigned int i=0; i < NEAREST_QUERIES; i++) sum += nearest_search(c->nearest, c->queries[i], 1, NULL);
+    }
+    sink = sum;
+}
+
+/* photo and its palette are opaque */
+static void nearest_search_rgb_kernel(void *context, unsigned long iterations)
+{
+    const struct nearest_context *c = context;
+    unsigned int sum = 0;
+    for(unsigned long n=0; n < iterations; n++) {
+        for(unsigned int i=0; i < NEAREST_QUERIES; i++) sum += nearest_search_rgb(c->nearest, c->queries[i], NULL);
+    }
+    sink = sum;
+}
+
+static void bench_nearest(const struct options *options)
+{
+    // real: palette made by mediancut for a photo-like image, queried with its pixels in scanline order.
+    // random: random palette and queries, which defeat any locality.
+    rgb_pixel *photo = photo_image(256, 256);
+    histogram *hist = image_histogram(photo, 256, 256);
+    hist_item *original_achv = malloc(sizeof(hist->achv[0]) * hist->size);
+    memcpy(original_achv, hist->achv, sizeof(hist->achv[0]) * hist->size);
+    f_pixel *real_queries = to_f_pixels(photo, NEAREST_QUERIES);
+    free(photo);
+
+    unsigned int state = 1;
+    rgb_pixel *random_pixels = malloc(sizeof(random_pixels[0]) * NEAREST_QUERIES);
+    for(unsigned int i=0; i < NEAREST_QUERIES; i++) random_pixels[i] = random_rgba(&state);
+    f_pixel *random_queries = to_f_pixels(random_pixels, NEAREST_QUERIES);
+
+    for(unsigned int colors=2; colors <= 256; colors *= 2) {
+        char name[64];
+
+        memcpy(hist->achv, original_achv, sizeof(hist->achv[0]) * hist->size);
+        colormap *real_map = mediancut(hist, 1, colors, 0, MAX_DIFF, NULL);
+
+        colormap *random_map = pam_colormap(colors);
+        for(unsigned int i=0; i < colors; i++) random_map->palette[i].acolor = random_queries[i * (NEAREST_QUERIES/colors)];
+
+        struct nearest_context real = {real_map, nearest_init(real_map), real_queries},
+                             random_palette = {random_map, nearest_init(random_map), random_queries};
+
+        snprintf(name, sizeof(name), "nearest_init/%u", colors);
+        measure(options, name, nearest_init_kernel, &real, 1);
+        snprintf(name, sizeof(name), "nearest_search/real/%u", colors);
+        measure(options, name, nearest_search_kernel, &real, NEAREST_QUERIES);
+        if (nearest_is_opaque(real.nearest)) {
+            snprintf(name, sizeof(name), "nearest_search/rgb/%u", colors);
+            measure(options, name, nearest_search_rgb_kernel, &real, NEAREST_QUERIES);
+        }
+        snprintf(name, sizeof(name), "nearest_search/random/%u", colors);
+        measure(options, name, nearest_search_kernel, &random_palette, NEAREST_QUERIES);
+
+        nearest_free(real.nearest);
+        nearest_free(random_palette.nearest);
+        pam_freecolormap(real_map);
+        pam_freecolormap(random_map);
+    }
+
+    pam_freeacolorhist(hist);
+    free(original_achv);
+    free(real_queries);
+    free(random_pixels);
+    free(random_queries);
+}
+
+/*
+ pam_computeacolorhash
+ */
+
+#define HASH_SIZE 512
+
+struct hash_context {
+    const rgb_pixel *const *rows;
+};
+
+static void hash_kernel(void *context, unsigned long iterations)
+{
+    const struct hash_context *c = context;
+    for(unsigned long n=0; n < iterations; n++) {
+        struct acolorhash_table *acht = pam_allocacolorhash(HASH_SIZE*HASH_SIZE, HASH_SIZE*HASH_SIZE, 0);
+        if (!pam_computeacolorhash(acht, c->rows, HASH_SIZE, HASH_SIZE, NULL)) abort();
+        sink = acht->colors;
+        pam_freeacolorhash(acht);
+    }
+}
+
+static void bench_hash_image(const struct options *options, const char *name, const rgb_pixel *pixels)
+{
+    const rgb_pixel *rows[HASH_SIZE];
+    for(unsigned int y=0; y < HASH_SIZE; y++) rows[y] = &pixels[y*HASH_SIZE];
+
+    struct hash_context context = {rows};
+    measure(options, name, hash_kernel, &context, HASH_SIZE*HASH_SIZE);
+}
+
+static void bench_hash(const struct options *options)
+{
+    static const unsigned int color_counts[] = {16, 256, 4096, 65536, HASH_SIZE*HASH_SIZE};
+    for(unsigned int i=0; i < sizeof(color_counts)/sizeof(color_counts[0]); i++) {
+        char name[64];
+        snprintf(name, sizeof(name), "pam_computeacolorhash/%u", color_counts[i]);
+        if (!selected(options, name)) continue;
+
+        rgb_pixel *pixels = colors_image(HASH_SIZE, HASH_SIZE, color_counts[i]);
+        bench_hash_image(options, name, pixels);
+        free(pixels);
+    }
+
+    if (selected(options, "pam_computeacolorhash/photo")) {
+        rgb_pixel *pixels = photo_image(HASH_SIZE, HASH_SIZE);
+        bench_hash_image(options, "pam_computeacolorhash/photo", pixels);
+        free(pixels);
+    }
+}
+
+/*
+ mediancut
+ */
+
+struct mediancut_context {
+    histogram *hist;
+    const hist_item *original_achv;
+};
+
+static void mediancut_kernel(void *context, unsigned long iterations)
+{
+    const struct mediancut_context *c = context;
+    for(unsigned long n=0; n < iterations; n++) {
+        // mediancut sorts the histogram, so every run gets a fresh copy (copying is a tiny part of the time)
+        memcpy(c->hist->achv, c->original_achv, sizeof(c->hist->achv[0]) * c->hist->size);
+        pam_freecolormap(mediancut(c->hist, 1, 256, 0, MAX_DIFF, NULL));
+    }
+}
+
+static void bench_mediancut_histogram(const struct options *options, const char *name, rgb_pixel *pixels, unsigned int size)
+{
+    histogram *hist = image_histogram(pixels, size, size);
+    free(pixels);
+
+    hist_item *original_achv = malloc(sizeof(hist->achv[0]) * hist->size);
+    memcpy(original_achv, hist->achv, sizeof(hist->achv[0]) * hist->size);
+
+    char full_name[64];
+    snprintf(full_name, sizeof(full_name), "%s/%u", name, hist->size);
+    struct mediancut_context context = {hist, original_achv};
+    measure(options, full_name, mediancut_kernel, &context, 1);
+
+    free(original_achv);
+    pam_freeacolorhist(hist);
+}
+
+static void bench_mediancut(const struct options *options)
+{
+    if (!selected(options, "mediancut")) return;
+
+    bench_mediancut_histogram(options, "mediancut/photo", photo_image(256, 256), 256);
+    bench_mediancut_histogram(options, "mediancut/photo", photo_image(512, 512), 512);
+    bench_mediancut_histogram(options, "mediancut/random", colors_image(256, 256, 4096), 256);
+    bench_mediancut_histogram(options, "mediancut/random", colors_image(512, 512, 65536), 512);
+}
+
+/*
+ blur, max3, min3
+ */
+
+struct blur_context {
+    float *src, *tmp, *dst;
+    unsigned int size;
+};
+
+static void blur_kernel(void *context, unsigned long iterations)
+{
+    const struct blur_context *c = context;
+    for(unsigned long n=0; n < iterations; n++) blur(c->src, c->tmp, c->dst, c->size, c->size, 3);
+}
+
+static void max3_kernel(void *context, unsigned long iterations)
+{
+    const struct blur_context *c = context;
+    for(unsigned long n=0; n < iterations; n++) max3(c->src, c->dst, c->size, c->size);
+}
+
+static void min3_kernel(void *context, unsigned long iterations)
+{
+    const struct blur_context *c = context;
+    for(unsigned long n=0; n < iterations; n++) min3(c->src, c->dst, c->size, c->size);
+}
+
+static void bench_blur(const struct options *options)
+{
+    static const unsigned int sizes[] = {256, 1024, 2048};
+    for(unsigned int i=0; i < sizeof(sizes)/sizeof(sizes[0]); i++) {
+        const unsigned int size = sizes[i];
+        char names[3][64];
+        snprintf(names[0], sizeof(names[0]), "blur/%ux%u", size, size);
+        snprintf(names[1], sizeof(names[1]), "max3/%ux%u", size, size);
+        snprintf(names[2], sizeof(names[2]), "min3/%ux%u", size, size);
+        if (!selected(options, names[0]) && !selected(options, names[1]) && !selected(options, names[2])) continue;
+
+        struct blur_context context = {
+            .src = malloc(sizeof(float) * size * size),
+            .tmp = malloc(sizeof(float) * size * size),
+            .dst = malloc(sizeof(float) * size * size),
+            .size = size,
+        };
+        unsigned int state = 1;
+        for(unsigned int j=0; j < size*size; j++) context.src[j] = (random_next(&state) & 0xFFFF) / 65535.f;
+
+        measure(options, names[0], blur_kernel, &context, size*size);
+        measure(options, names[1], max3_kernel, &context, size*size);
+        measure(options, names[2], min3_kernel, &context, size*size);
+
+        free(context.src);
+        free(context.tmp);
+        free(context.dst);
+    }
+}
+
+static const struct option long_options[] = {
+    {"samples", required_argument, NULL, 's'},
+    {"warmup", required_argument, NULL, 'w'},
+    {"min-time", required_argument, NULL, 't'},
+    {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0},
+};
+
+int main(int argc, char *argv[])
+{
+    struct options options = {
+        .samples = 10,
+        .warmup = 2,
+        .min_time = 0.020,
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "h", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 's':
+                options.samples = atoi(optarg);
+                if (options.samples < 1 || options.samples > MAX_SAMPLES) goto invalid;
+                break;
+            case 'w':
+                options.warmup = atoi(optarg);
+                if (options.warmup > MAX_SAMPLES) goto invalid;
+                break;
+            case 't':
+                options.min_time = atof(optarg) / 1000.0;
+                if (options.min_time <= 0) goto invalid;
+                break;
+            case 'h':
+                fputs(MICROBENCH_USAGE, stdout);
+                return 0;
+            default:
+            invalid:
+                fputs(MICROBENCH_USAGE, stderr);
+                return 1;
+        }
+    }
+    options.filters = &argv[optind];
+    options.num_filters = argc - optind;
+
+#ifndef NDEBUG
+    fputs("warning: built without -DNDEBUG, assertions slow down kernels\n", stderr);
+#endif
+
+    // nearest_search and mediancut use kernels for the best instruction set, unless limited with LIQ_ISA
+    simd_init();
+    printf("kernels: %s\n", simd_isa_name());
+
+    bench_colordifference(&options);
+    bench_nearest(&options);
+    bench_hash(&options);
+    bench_mediancut(&options);
+    bench_blur(&options);
+    return 0;
+}
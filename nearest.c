@@ -2,6 +2,8 @@
 #include "pam.h"
 #include "nearest.h"
 #include "mempool.h"
+#include "simd.h"
+#include "counters.h"
 #include <stdlib.h>
 
 struct color_entry {
@@ -20,12 +22,14 @@ struct head {
     float radius;
     unsigned int num_candidates;
     struct color_entry *candidates;
+    float *channels; // candidates' a, r, g, b as separate arrays for simd.nearest_scan, padded to SIMD_PADDING
 };
 
 struct nearest_map {
     struct head *heads;
     mempool mempool;
     unsigned int num_heads;
+    bool opaque; // all colors of the palette are opaque
 };
 
 static int find_slow(const f_pixel px, const colormap *map)
@@ -75,6 +79,17 @@ static struct head build_head(f_pixel px, const colormap *map, unsigned int num_
         .vantage_point = px,
         .num_candidates = num_candidates,
     };
+    const unsigned int stride = SIMD_PADDED(num_candidates);
+    h.channels = mempool_new(m, 4 * stride * sizeof(h.channels[0]), 0);
+    for(unsigned int i=0; i < stride; i++) {
+        const f_pixel color = i < num_candidates ? map->palette[colors[i].index].acolor :
+            (f_pixel){SIMD_PADDING_COLOR, SIMD_PADDING_COLOR, SIMD_PADDING_COLOR, SIMD_PADDING_COLOR};
+        h.channels[i] = color.a;
+        h.channels[stride + i] = color.r;
+        h.channels[stride*2 + i] = color.g;
+        h.channels[stride*3 + i] = color.b;
+    }
+
     for(unsigned int i=0; i < num_candidates; i++) {
         h.candidates[i] = (struct color_entry) {
             .color = map->palette[colors[i].index].acolor,
@@ -168,6 +183,11 @@ struct nearest_map *nearest_init(const colormap *map)
     centroids->heads[h].radius = MAX_DIFF;
     centroids->num_heads = ++h;
 
+    centroids->opaque = true;
+    for(unsigned int i=0; i < map->colors; i++) {
+        if (map->palette[i].acolor.a != 1.f) centroids->opaque = false;
+    }
+
     // get_subset_palette could have created a copy
     if (subset_palette != map->subset_palette) {
         pam_freecolormap(subset_palette);
@@ -176,6 +196,30 @@ struct nearest_map *nearest_init(const colormap *map)
     return centroids;
 }
 
+inline static unsigned int nearest_scan_generic(const struct color_entry candidates[], unsigned int count, const f_pixel px, const float penalty, float *dist) ALWAYS_INLINE;
+inline static unsigned int nearest_scan_generic(const struct color_entry candidates[], unsigned int count, const f_pixel px, const float penalty, float *dist)
+{
+    unsigned int best = 0;
+    float best_dist = colordifference(px, candidates[0].color);
+    if (penalty && candidates[0].color.a < 1) {
+        best_dist += penalty;
+    }
+
+    for(unsigned int j=1; j < count; j++) {
+        float newdist = colordifference(px, candidates[j].color);
+        if (penalty && candidates[j].color.a < 1) {
+            newdist += penalty;
+        }
+
+        if (newdist < best_dist) {
+            best_dist = newdist;
+            best = j;
+        }
+    }
+    *dist = best_dist;
+    return best;
+}
+
 unsigned int nearest_search(const struct nearest_map *centroids, const f_pixel px, const float min_opaque_val, float *diff)
 {
     const bool iebug = px.a > min_opaque_val;
@@ -186,29 +230,58 @@ unsigned int nearest_search(const struct nearest_map *centroids, const f_pixel p
 
         if (vantage_point_dist <= heads[i].radius) {
             assert(heads[i].num_candidates);
-            unsigned int ind=heads[i].candidates[0].index;
-            float dist = colordifference(px, heads[i].candidates[0].color);
-
             /* penalty for making holes in IE */
-            if (iebug && heads[i].candidates[0].color.a < 1) {
-                dist += 1.f/1024.f;
-            }
+            const float penalty = iebug ? 1.f/1024.f : 0;
+
+            float dist;
+            const unsigned int best = simd.nearest_scan ?
+                simd.nearest_scan(heads[i].channels, SIMD_PADDED(heads[i].num_candidates), heads[i].num_candidates, px, penalty, &dist) :
+                nearest_scan_generic(heads[i].candidates, heads[i].num_candidates, px, penalty, &dist);
+            const unsigned int ind = heads[i].candidates[best].index;
+            COUNTER_ADD(nearest_searches, 1);
+            COUNTER_ADD(nearest_heads, i+1);
+            COUNTER_ADD(nearest_candidates, heads[i].num_candidates);
+            if (diff) *diff = dist;
+            return ind;
+        }
+    }
+}
 
-            for(unsigned int j=1; j < heads[i].num_candidates; j++) {
-                float newdist = colordifference(px, heads[i].candidates[j].color);
+bool nearest_is_opaque(const struct nearest_map *centroids)
+{
+    return centroids->opaque;
+}
 
-                /* penalty for making holes in IE */
-                if (iebug && heads[i].candidates[j].color.a < 1) {
-                    newdist += 1.f/1024.f;
-                }
+unsigned int nearest_search_rgb(const struct nearest_map *centroids, const f_pixel px, float *diff)
+{
+    assert(centroids->opaque && px.a == 1.f);
 
-                if (newdist < dist) {
-                    dist = newdist;
-                    ind = heads[i].candidates[j].index;
+    const struct head *const heads = centroids->heads;
+    for(unsigned int i=0; /* last head will always be selected */ ; i++) {
+        // vantage point of the last head is transparent, but its radius includes everything anyway
+        if (heads[i].radius >= MAX_DIFF || colordifference_rgb(px, heads[i].vantage_point) <= heads[i].radius) {
+            assert(heads[i].num_candidates);
+
+            float dist;
+            unsigned int best;
+            if (simd.nearest_scan_rgb) {
+                best = simd.nearest_scan_rgb(heads[i].channels, SIMD_PADDED(heads[i].num_candidates), heads[i].num_candidates, px, &dist);
+            } else {
+                best = 0;
+                dist = colordifference_rgb(px, heads[i].candidates[0].color);
+                for(unsigned int j=1; j < heads[i].num_candidates; j++) {
+                    const float newdist = colordifference_rgb(px, heads[i].candidates[j].color);
+                    if (newdist < dist) {
+                        dist = newdist;
+                        best = j;
+                    }
                 }
             }
+            COUNTER_ADD(nearest_searches, 1);
+            COUNTER_ADD(nearest_heads, i+1);
+            COUNTER_ADD(nearest_candidates, heads[i].num_candidates);
             if (diff) *diff = dist;
-            return ind;
+            return heads[i].candidates[best].index;
         }
     }
 }
@@ -5,4 +5,8 @@
 struct nearest_map;
 struct nearest_map *nearest_init(const colormap *palette);
 unsigned int nearest_search(const struct nearest_map *map, const f_pixel px, const float min_opaque, float *diff);
+
+/* faster search that skips alpha. Only for opaque px and a map for which nearest_is_opaque() is true */
+bool nearest_is_opaque(const struct nearest_map *map);
+unsigned int nearest_search_rgb(const struct nearest_map *map, const f_pixel px, float *diff);
 void nearest_free(struct nearest_map *map);
@@ -16,6 +16,7 @@
 #include <string.h>
 #include "pam.h"
 #include "mempool.h"
+#include "stats.h"
 
 /* libpam3.c - pam (portable alpha map) utility library part 3
  **
@@ -48,8 +49,15 @@ bool pam_computeacolorhash(struct acolorhash_table *acht, const rgb_pixel*const*
     struct acolorhist_arr_item **freestack = acht->freestack;
     unsigned int freestackp=acht->freestackp;
 
+    // rows hashed by previous calls, when the image is added in parts
+    const unsigned int total_rows = MAX(1, acht->surface/cols), rows_done = acht->pixels_seen/cols;
+
+    COUNTER_ADD(hash_pixels, (size_t)rows*cols);
+
     /* Go through the entire image, building a hash table of colors. */
     for(unsigned int row = 0; row < rows; ++row) {
+        const unsigned int image_row = rows_done + row;
+        const unsigned int rows_left = total_rows > image_row ? total_rows - image_row : 1;
 
         float boost=1.0;
         for(unsigned int col = 0; col < cols; ++col) {
@@ -74,12 +82,14 @@ bool pam_computeacolorhash(struct acolorhash_table *acht, const rgb_pixel*const*
                to reduce number of allocations of achl->other_items.
              */
             struct acolorhist_arr_head *achl = &buckets[hash];
+            COUNTER_ADD(hash_probes, MIN(achl->used, 1));
             if (achl->inline1.color.l == px.l && achl->used) {
                 achl->inline1.perceptual_weight += boost;
                 continue;
             }
             if (achl->used) {
                 if (achl->used > 1) {
+                    COUNTER_ADD(hash_probes, 1);
                     if (achl->inline2.color.l == px.l) {
                         achl->inline2.perceptual_weight += boost;
                         continue;
@@ -90,9 +100,12 @@ bool pam_computeacolorhash(struct acolorhash_table *acht, const rgb_pixel*const*
                     for (; i < achl->used-2; i++) {
                         if (other_items[i].color.l == px.l) {
                             other_items[i].perceptual_weight += boost;
+                            COUNTER_ADD(hash_probes, i+1);
                             goto continue_outer_loop;
                         }
                     }
+                    COUNTER_ADD(hash_probes, i);
+                    COUNTER_MAX(hash_longest_chain, achl->used+1);
 
                     // the array was allocated with spare items
                     if (i < achl->capacity) {
@@ -114,10 +127,11 @@ bool pam_computeacolorhash(struct acolorhash_table *acht, const rgb_pixel*const*
                     struct acolorhist_arr_item *new_items;
                     unsigned int capacity;
                     if (!other_items) { // there was no array previously, alloc "small" array
+                        COUNTER_ADD(hash_chain_allocs, 1);
                         capacity = 8;
                         if (freestackp <= 0) {
-                            // estimate how many colors are going to be + headroom
-                            const int mempool_size = ((rows-row) * 2 * colors / (1+row) + 1024) * sizeof(struct acolorhist_arr_item);
+                            // estimate how many colors are going to be + headroom (never more than the table can hold)
+                            const int mempool_size = (MIN(rows_left * 2 * colors / (1+image_row), maxacolors) + 1024) * sizeof(struct acolorhist_arr_item);
                             new_items = mempool_new(&acht->mempool, sizeof(struct acolorhist_arr_item)*capacity, mempool_size);
                         } else {
                             // freestack stores previously freed (reallocated) arrays that can be reused
@@ -126,11 +140,12 @@ bool pam_computeacolorhash(struct acolorhash_table *acht, const rgb_pixel*const*
                         }
                     } else {
                         // simply reallocs and copies array to larger capacity
+                        COUNTER_ADD(hash_chain_reallocs, 1);
                         capacity = achl->capacity*2 + 16;
                         if (freestackp < stacksize-1) {
                             freestack[freestackp++] = other_items;
                         }
-                        const int mempool_size = ((rows-row) * 2 * colors / (1+row) + 32*capacity) * sizeof(struct acolorhist_arr_item);
+                        const int mempool_size = (MIN(rows_left * 2 * colors / (1+image_row), maxacolors) + 32*capacity) * sizeof(struct acolorhist_arr_item);
                         new_items = mempool_new(&acht->mempool, sizeof(struct acolorhist_arr_item)*capacity, mempool_size);
                         memcpy(new_items, other_items, sizeof(other_items[0])*achl->capacity);
                     }
@@ -147,12 +162,14 @@ bool pam_computeacolorhash(struct acolorhash_table *acht, const rgb_pixel*const*
                     achl->inline2.color.l = px.l;
                     achl->inline2.perceptual_weight = boost;
                     achl->used = 2;
+                    COUNTER_MAX(hash_longest_chain, 2);
                     ++colors;
                 }
             } else {
                 achl->inline1.color.l = px.l;
                 achl->inline1.perceptual_weight = boost;
                 achl->used = 1;
+                COUNTER_MAX(hash_longest_chain, 1);
                 ++colors;
             }
 
@@ -162,10 +179,11 @@ bool pam_computeacolorhash(struct acolorhash_table *acht, const rgb_pixel*const*
     }
     acht->colors = colors;
     acht->freestackp = freestackp;
+    acht->pixels_seen += (size_t)rows*cols;
     return true;
 }
 
-struct acolorhash_table *pam_allocacolorhash(unsigned int maxcolors, unsigned int surface, unsigned int ignorebits)
+struct acolorhash_table *pam_allocacolorhash(unsigned int maxcolors, size_t surface, unsigned int ignorebits)
 {
     const unsigned int estimated_colors = MIN(maxcolors, surface/(4+ignorebits));
     const unsigned int hash_size = estimated_colors < 66000 ? 6673 : (estimated_colors < 200000 ? 12011 : 24019);
@@ -178,11 +196,14 @@ struct acolorhash_table *pam_allocacolorhash(unsigned int maxcolors, unsigned in
     t->hash_size = hash_size;
     t->maxcolors = maxcolors;
     t->ignorebits = ignorebits;
+    t->surface = surface;
     return t;
 }
 
 #define PAM_ADD_TO_HIST(entry) { \
-    hist->achv[j].acolor = to_f(entry.color.rgb); \
+    hist->achv[j].acolor = to_f(gamma_lut, entry.color.rgb); \
+    opaque &= entry.color.rgb.a == 255; \
+    gray &= entry.color.rgb.r == entry.color.rgb.g && entry.color.rgb.g == entry.color.rgb.b; \
     hist->achv[j].adjusted_weight = hist->achv[j].perceptual_weight = entry.perceptual_weight; \
     ++j; \
     total_weight += entry.perceptual_weight; \
@@ -190,12 +211,15 @@ struct acolorhash_table *pam_allocacolorhash(unsigned int maxcolors, unsigned in
 
 histogram *pam_acolorhashtoacolorhist(const struct acolorhash_table *acht, const double gamma)
 {
-    histogram *hist = malloc(sizeof(hist[0]));
-    hist->achv = malloc(acht->colors * sizeof(hist->achv[0]));
+    histogram *hist = stats_malloc(sizeof(hist[0]));
+    hist->achv = stats_malloc(acht->colors * sizeof(hist->achv[0]));
     hist->size = acht->colors;
 
-    to_f_set_gamma(gamma);
+    float gamma_lut[256];
+    to_f_set_gamma(gamma_lut, gamma);
 
+    // posterization keeps alpha 255 unchanged, so this is true only if all pixels were opaque
+    bool opaque = true, gray = true;
     double total_weight=0;
     for(unsigned int j=0, i=0; i < acht->hash_size; ++i) {
         const struct acolorhist_arr_head *const achl = &acht->buckets[i];
@@ -213,10 +237,62 @@ histogram *pam_acolorhashtoacolorhist(const struct acolorhash_table *acht, const
     }
 
     hist->total_perceptual_weight = total_weight;
+    hist->opaque = opaque;
+    hist->gray = opaque && gray && !acht->ignorebits; // posterized channels can be equal when pixels' weren't
     return hist;
 }
 
 
+static int compare_acolor(const void *ch1, const void *ch2)
+{
+    const f_pixel *const c1 = &((const hist_item*)ch1)->acolor, *const c2 = &((const hist_item*)ch2)->acolor;
+    if (c1->a != c2->a) return c1->a < c2->a ? -1 : 1;
+    if (c1->r != c2->r) return c1->r < c2->r ? -1 : 1;
+    if (c1->g != c2->g) return c1->g < c2->g ? -1 : 1;
+    if (c1->b != c2->b) return c1->b < c2->b ? -1 : 1;
+    return 0;
+}
+
+/*
+ One histogram of colors of all the given ones (e.g. of frames of an animation), which are freed.
+ Colors found in more than one have their weights added. All must have been made with the same gamma.
+ */
+histogram *pam_mergeacolorhists(histogram *hists[], unsigned int count)
+{
+    size_t size = 0;
+    for(unsigned int i=0; i < count; i++) size += hists[i]->size;
+
+    histogram *hist = stats_malloc(sizeof(hist[0]));
+    hist->achv = stats_malloc(MAX(1, size) * sizeof(hist->achv[0]));
+    hist->opaque = true; hist->gray = true;
+    size = 0;
+    for(unsigned int i=0; i < count; i++) {
+        memcpy(&hist->achv[size], hists[i]->achv, hists[i]->size * sizeof(hist->achv[0]));
+        size += hists[i]->size;
+        hist->opaque &= hists[i]->opaque;
+        hist->gray &= hists[i]->gray;
+        pam_freeacolorhist(hists[i]);
+    }
+
+    // same colors end up next to each other
+    qsort(hist->achv, size, sizeof(hist->achv[0]), compare_acolor);
+
+    double total_weight = 0;
+    unsigned int j = 0;
+    for(size_t i=0; i < size; i++) {
+        if (j && !compare_acolor(&hist->achv[j-1], &hist->achv[i])) {
+            hist->achv[j-1].perceptual_weight += hist->achv[i].perceptual_weight;
+            hist->achv[j-1].adjusted_weight = hist->achv[j-1].perceptual_weight;
+        } else {
+            hist->achv[j++] = hist->achv[i];
+        }
+        total_weight += hist->achv[i].perceptual_weight;
+    }
+    hist->size = j;
+    hist->total_perceptual_weight = total_weight;
+    return hist;
+}
+
 void pam_freeacolorhash(struct acolorhash_table *acht)
 {
     mempool_free(acht->mempool);
@@ -224,14 +300,14 @@ void pam_freeacolorhash(struct acolorhash_table *acht)
 
 void pam_freeacolorhist(histogram *hist)
 {
-    free(hist->achv);
-    free(hist);
+    stats_free(hist->achv);
+    stats_free(hist);
 }
 
 colormap *pam_colormap(unsigned int colors)
 {
-    colormap *map = malloc(sizeof(colormap));
-    map->palette = calloc(colors, sizeof(map->palette[0]));
+    colormap *map = stats_malloc(sizeof(colormap));
+    map->palette = stats_calloc(colors, sizeof(map->palette[0]));
     map->subset_palette = NULL;
     map->colors = colors;
     map->palette_error = -1;
@@ -241,14 +317,12 @@ colormap *pam_colormap(unsigned int colors)
 void pam_freecolormap(colormap *c)
 {
     if (c->subset_palette) pam_freecolormap(c->subset_palette);
-    free(c->palette); free(c);
+    stats_free(c->palette); stats_free(c);
 }
 
-void to_f_set_gamma(double gamma)
+void to_f_set_gamma(float gamma_lut[], double gamma)
 {
     for(int i=0; i < 256; i++) {
         gamma_lut[i] = pow((double)i/255.0, internal_gamma/gamma);
     }
 }
-
-float gamma_lut[256];
@@ -62,15 +62,14 @@ typedef struct {
 
 static const double internal_gamma = 0.5499;
 
-extern float gamma_lut[256];
-void to_f_set_gamma(double gamma);
+void to_f_set_gamma(float gamma_lut[], double gamma);
 
 /**
  Converts 8-bit color to internal gamma and premultiplied alpha.
  (premultiplied color space is much better for blending of semitransparent colors)
  */
-inline static f_pixel to_f(rgb_pixel px) ALWAYS_INLINE;
-inline static f_pixel to_f(rgb_pixel px)
+inline static f_pixel to_f(const float gamma_lut[], rgb_pixel px) ALWAYS_INLINE;
+inline static f_pixel to_f(const float gamma_lut[], rgb_pixel px)
 {
     float a = px.a/255.f;
 
@@ -177,6 +176,33 @@ inline static float colordifference(f_pixel px, f_pixel py)
 #endif
 }
 
+/*
+ Same as colordifference() for two opaque colors (a = 1), with the same result to the last bit:
+ when alphas are equal, difference blended on white is the same as on black.
+ */
+inline static float colordifference_rgb(f_pixel px, f_pixel py) ALWAYS_INLINE;
+inline static float colordifference_rgb(f_pixel px, f_pixel py)
+{
+#if USE_SSE
+    const __m128 vpx = _mm_load_ps((const float*)&px);
+    const __m128 vpy = _mm_load_ps((const float*)&py);
+
+    __m128 diff = _mm_sub_ps(vpx, vpy);
+    diff = _mm_mul_ps(diff, diff);
+    const __m128 max = _mm_add_ps(diff, diff);
+
+    const __m128 maxhl = _mm_movehl_ps(max, max);
+    const __m128 tmp = _mm_add_ps(max, maxhl);
+    const __m128 sum = _mm_add_ss(maxhl, _mm_shuffle_ps(tmp, tmp, 1));
+
+    return _mm_cvtss_f32(sum);
+#else
+    return colordifference_ch(px.r, py.r, 0) +
+           colordifference_ch(px.g, py.g, 0) +
+           colordifference_ch(px.b, py.b, 0);
+#endif
+}
+
 /* from pamcmap.h */
 union rgba_as_int {
     rgb_pixel rgb;
@@ -196,6 +222,8 @@ typedef struct {
     hist_item *achv;
     double total_perceptual_weight;
     unsigned int size;
+    bool opaque; // all colors have alpha = 1, so 3-channel versions of kernels can be used
+    bool gray; // opaque and r = g = b, see gray_quantize()
 } histogram;
 
 typedef struct {
@@ -228,17 +256,19 @@ struct acolorhash_table {
     struct mempool *mempool;
     struct acolorhist_arr_head *buckets;
     unsigned int ignorebits, maxcolors, colors;
+    size_t surface, pixels_seen; // image may be added in multiple calls
     struct acolorhist_arr_item *freestack[512];
     unsigned int freestackp;
     unsigned int hash_size;
 };
 
 void pam_freeacolorhash(struct acolorhash_table *acht);
-struct acolorhash_table *pam_allocacolorhash(unsigned int maxcolors, unsigned int image_surface, unsigned int ignorebits);
+struct acolorhash_table *pam_allocacolorhash(unsigned int maxcolors, size_t image_surface, unsigned int ignorebits);
 histogram *pam_acolorhashtoacolorhist(const struct acolorhash_table *acht, const double gamma);
 bool pam_computeacolorhash(struct acolorhash_table *acht, const rgb_pixel*const* apixels, unsigned int cols, unsigned int rows, const float *importance_map);
 
 void pam_freeacolorhist(histogram *h);
+histogram *pam_mergeacolorhists(histogram *hists[], unsigned int count);
 
 colormap *pam_colormap(unsigned int colors);
 void pam_freecolormap(colormap *c);
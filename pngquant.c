@@ -15,6 +15,10 @@
 
 #define PNGQUANT_VERSION "1.8.3 (February 2013)"
 
+#if !defined(WIN32) && !defined(__WIN32__)
+#define _POSIX_C_SOURCE 200112L /* sockets and stat() for --daemon */
+#endif
+
 #define PNGQUANT_USAGE "\
 usage:  pngquant [options] [ncolors] [pngfile [pngfile ...]]\n\n\
 options:\n\
@@ -26,6 +30,20 @@ options:\n\
   --verbose         print status messages (synonym: -v)\n\
   --iebug           increase opacity to work around Internet Explorer 6 bug\n\
   --transbug        transparent color will be placed at the end of the palette\n\
+  --daemon[=socket] serve framed requests on stdin/stdout or a Unix socket\n\
+  --stats           print time spent in each stage as JSON, one line per file\n\
+  --stats-file file write the JSON stats to a file instead of stderr\n\
+  --hw-counters     add CPU cycles, cache and branch misses to --stats (Linux)\n\
+  --trace file      write timeline of threads' work as Chrome trace JSON\n\
+  --max-memory size use less memory-hungry methods to stay within size (k/M/G)\n\
+  --pyramid[=MP]    find palette on a copy downscaled to MP megapixels (default 1)\n\
+  --map file        remap to colors of a PNG, or of a text file with r g b [a] lines\n\
+  --sequence        files are frames: reuse palette and remap only what changed\n\
+  --shards N        split each image in N bands of rows quantized by N processes\n\
+  --ladder list     write a file for each of colors or qN qualities, e.g. 256,64\n\
+  --analyze[=list]  print MSE for every number of colors as JSON, don't write\n\
+  --threads N       number of threads for all files together (default: CPUs)\n\
+  --pin-threads     pin threads to CPUs and keep work on their NUMA node (Linux)\n\
 \n\
 Quantizes one or more 32-bit RGBA PNGs to 8-bit (or smaller) RGBA-palette\n\
 PNGs using Floyd-Steinberg diffusion dithering (unless disabled).\n\
@@ -41,52 +59,95 @@ use --force to overwrite.\n"
 #include <string.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <limits.h>
 #include <getopt.h>
 
 #if defined(WIN32) || defined(__WIN32__)
 #  include <fcntl.h>    /* O_BINARY */
 #  include <io.h>   /* setmode() */
-#endif
-
-#ifdef _OPENMP
-#include <omp.h>
 #else
-#define omp_get_max_threads() 1
-#define omp_get_thread_num() 0
+#  include <stdint.h>
+#  include <errno.h>
+#  include <signal.h>
+#  include <unistd.h>
+#  include <sys/stat.h>
+#  include <sys/socket.h>
+#  include <sys/wait.h>
+#  include <sys/un.h>
 #endif
 
+#include <pthread.h>
+
 #include "rwpng.h"  /* typedefs, common macros, public prototypes */
-#include "pam.h"
-#include "mediancut.h"
-#include "nearest.h"
-#include "blur.h"
-#include "viter.h"
+#include "pam.h"    /* MIN, USE_SSE */
+#include "libimagequant.h"
+#include "stats.h"
+#include "simd.h"
+#include "taskpool.h"
+
+/* PNG reading and writing is serialized, since libpng builds aren't guaranteed to be thread-safe */
+static pthread_mutex_t libpng_lock = PTHREAD_MUTEX_INITIALIZER;
+#include "trace.h"
 
 struct pngquant_options {
-    double target_mse, max_mse;
-    float min_opaque_val;
-    unsigned int reqcolors;
-    unsigned int speed_tradeoff;
-    bool floyd, last_index_transparent;
+    liq_attr *liq;
+    bool floyd;
     bool using_stdin, force;
-    void (*log_callback)(void *context, const char *msg);
-    void (*log_callback_flush)(void *context);
+    FILE *stats_file; // per-file timing is collected only when set
+    FILE *trace_file;
+    bool hw_counters; // perf events are opened for each file
+    bool spread_pages; // decoded rows are first written by threads that remap them, see first_touch_rows()
+    struct liq_stats *stats;
+    liq_fixed_palette *fixed_palette; // --map, shared by all files
+    struct sequence_state *sequence; // --sequence, files are processed one at a time in order
+    unsigned int shards; // --shards, bands of rows of each file are processed by this many processes
+    const struct ladder_rung *ladder; // --ladder, outputs of each file, largest first
+    unsigned int ladder_rungs;
+    bool analyze; // --analyze, curve of MSE for numbers of colors is printed instead of writing images
+    const int *refine_colors; // numbers of colors whose palettes are also refined by --analyze
+    unsigned int num_refine;
+    liq_log_callback_function *log_callback;
+    liq_log_flush_callback_function *log_callback_flush;
     void *log_callback_context;
 };
 
-typedef struct {
-    png24_image rwpng_image;
-    float *noise, *edges;
-    bool modified;
-} pngquant_image;
-
-static colormap *pngquant_quantize(histogram *hist, const struct pngquant_options *options);
-static pngquant_error pngquant_remap(colormap *acolormap, pngquant_image *input_image, png8_image *output_image, const struct pngquant_options *options);
-static void prepare_image(pngquant_image *input_image, struct pngquant_options *options);
-static void pngquant_image_free(pngquant_image *input_image);
-static void pngquant_output_image_free(png8_image *output_image);
-static histogram *get_histogram(pngquant_image *input_image, struct pngquant_options *options);
+/* --sequence: the previous frame and its output, which the next frame is compared with */
+struct sequence_state {
+    png24_image frame;
+    png8_image output;
+    liq_fixed_palette *palette; // made from the last keyframe's palette
+    double palette_error; // of the last keyframe, -1 until known
+    double frame_error; // estimate for the previous frame, which has changed pixels of later frames mixed in
+};
+
+// rows are compared in bands, and changed pixels of each band are remapped as one rectangle
+#define SEQUENCE_BAND_ROWS 64
+// the palette is kept while the frame's estimated error is at most this much worse than keyframe's
+#define SEQUENCE_ERROR_GROWTH 1.5
+#define SEQUENCE_ERROR_MARGIN 1.0
+
+// --shards: bands of rows of a file are at least this tall
+#define SHARD_MIN_ROWS 64
+
+/* --ladder: number of colors or quality target of one output */
+struct ladder_rung {
+    unsigned int colors, quality; // colors is 0 for a quality target
+    char name[8]; // inserted before extension of the output file, e.g. "-64" or "-q80"
+};
+
+#define LADDER_MAX_RUNGS 16
+
+static void pngquant_image_free(png24_image *input_image, struct liq_stats *stats);
+static void pngquant_output_image_free(png8_image *output_image, struct liq_stats *stats);
+static pngquant_error pngquant_process_image(png24_image *input_image, png8_image *output_image, struct pngquant_options *options);
+static pngquant_error sequence_process_image(png24_image *input_image, png8_image *output_image, struct pngquant_options *options);
+static void sequence_keep_frame(struct sequence_state *sequence, png24_image *input_image, png8_image *output_image, struct liq_stats *stats);
 static pngquant_error read_image(const char *filename, int using_stdin, png24_image *input_image_p);
+static bool file_is_apng(const char *filename);
+static pngquant_error pngquant_file_apng(const char *filename, const char *outname, struct pngquant_options *options);
+static pngquant_error pngquant_file_sharded(const char *filename, const char *outname, struct pngquant_options *options);
+static pngquant_error pngquant_file_ladder(const char *filename, const char *newext, struct pngquant_options *options);
+static pngquant_error pngquant_file_analyze(const char *filename, struct pngquant_options *options);
 static pngquant_error write_image(png8_image *output_image, png24_image *output_image24, const char *outname, struct pngquant_options *options);
 static char *add_filename_extension(const char *filename, const char *newext);
 static bool file_exists(const char *outname);
@@ -104,33 +165,39 @@ static void verbose_printf(const struct pngquant_options *context, const char *f
         vsnprintf(buf, required_space, fmt, va);
         va_end(va);
 
-        context->log_callback(context->log_callback_context, buf);
+        context->log_callback(context->liq, buf, context->log_callback_context);
     }
 }
 
 inline static void verbose_print(const struct pngquant_options *context, const char *msg)
 {
-    if (context->log_callback) context->log_callback(context->log_callback_context, msg);
+    if (context->log_callback) context->log_callback(context->liq, msg, context->log_callback_context);
 }
 
-static void log_callback(void *context, const char *msg)
+static void log_callback(const liq_attr *attr, const char *msg, void *context)
 {
     fprintf(stderr, "%s\n", msg);
 }
 
 static void verbose_printf_flush(struct pngquant_options *context)
 {
-    if (context->log_callback_flush) context->log_callback_flush(context->log_callback_context);
+    if (context->log_callback_flush) context->log_callback_flush(context->liq, context->log_callback_context);
+}
+
+/* messages from the library and from the CLI go through the same callbacks */
+static void set_log_callbacks(struct pngquant_options *options)
+{
+    liq_set_log_callback(options->liq, options->log_callback, options->log_callback_context);
+    liq_set_log_flush_callback(options->liq, options->log_callback_flush, options->log_callback_context);
 }
 
-#ifdef _OPENMP
 #define LOG_BUFFER_SIZE 1300
 struct buffered_log {
     int buf_used;
     char buf[LOG_BUFFER_SIZE];
 };
 
-static void log_callback_buferred_flush(void *context)
+static void log_callback_buferred_flush(const liq_attr *attr, void *context)
 {
     struct buffered_log *log = context;
     if (log->buf_used) {
@@ -139,19 +206,55 @@ static void log_callback_buferred_flush(void *context)
     }
 }
 
-static void log_callback_buferred(void *context, const char *msg)
+static void log_callback_buferred(const liq_attr *attr, const char *msg, void *context)
 {
     struct buffered_log *log = context;
     int len = MIN(LOG_BUFFER_SIZE-1, strlen(msg));
 
-    if (len > LOG_BUFFER_SIZE - log->buf_used - 2) log_callback_buferred_flush(log);
+    if (len > LOG_BUFFER_SIZE - log->buf_used - 2) log_callback_buferred_flush(attr, log);
     memcpy(&log->buf[log->buf_used], msg, len);
     log->buf_used += len+1;
     assert(log->buf_used < LOG_BUFFER_SIZE);
     log->buf[log->buf_used-1] = '\n';
     log->buf[log->buf_used] = '\0';
 }
+
+/* stats are also collected for --max-memory and, with -DLIQ_COUNTERS, for verbose output of counters */
+static bool wants_stats(const struct pngquant_options *options)
+{
+#ifdef LIQ_COUNTERS
+    if (options->log_callback) return true;
+#endif
+    // memory limit takes into account memory counted in stats
+    return options->stats_file != NULL || liq_get_max_memory(options->liq);
+}
+
+static void write_stats(const struct pngquant_options *options, const char *filename, pngquant_error status)
+{
+    if (!options->stats || !options->stats_file) return;
+
+    static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+    pthread_mutex_lock(&stats_lock);
+    stats_write_json(options->stats_file, options->stats, filename, status);
+    fflush(options->stats_file);
+    pthread_mutex_unlock(&stats_lock);
+}
+
+static void verbose_print_counters(const struct pngquant_options *options)
+{
+#ifdef LIQ_COUNTERS
+    if (!options->stats) return;
+
+    const struct liq_counters *c = &options->stats->counters;
+    verbose_printf(options, "  hash: %lu pixels, %.2f colors compared per pixel, longest chain %lu, %lu chains allocated, %lu grown, %u restarts",
+                   c->hash_pixels, c->hash_probes/(double)MAX(1, c->hash_pixels), c->hash_longest_chain,
+                   c->hash_chain_allocs, c->hash_chain_reallocs, options->stats->histogram_restarts);
+    verbose_printf(options, "  nearest: %lu searches, %.2f heads and %.2f colors compared per search",
+                   c->nearest_searches, c->nearest_heads/(double)MAX(1, c->nearest_searches), c->nearest_candidates/(double)MAX(1, c->nearest_searches));
+    verbose_printf(options, "  floyd: %lu of %lu remapped pixels kept without search", c->floyd_tolerance_hits, c->floyd_tolerance_checks);
+    verbose_printf(options, "  mediancut: %lu boxes split, %lu sort partitions", c->boxes_split, c->sort_partitions);
 #endif
+}
 
 static void print_full_version(FILE *fd)
 {
@@ -162,10 +265,13 @@ static void print_full_version(FILE *fd)
         #if USE_SSE
                     "   Compiled with SSE2 instructions.\n"
         #endif
-        #if _OPENMP
-                    "   Compiled with OpenMP (multicore support).\n"
-        #endif
         , PNGQUANT_VERSION);
+    fprintf(fd, "   Using %s kernels (LIQ_ISA environment variable can select lower instruction set).\n", simd_isa_name());
+    fprintf(fd, "   Using %d thread%s", liq_get_threads(), liq_get_threads() == 1 ? "" : "s");
+    if (taskpool_numa_nodes()) {
+        fprintf(fd, " pinned to CPUs of %u NUMA node%s", taskpool_numa_nodes(), taskpool_numa_nodes() == 1 ? "" : "s");
+    }
+    fputs(".\n", fd);
     rwpng_version_info(fd);
     fputs("\n", fd);
 }
@@ -187,15 +293,6 @@ inline static bool is_sse2_available()
         }
 #endif
 
-static double quality_to_mse(long quality)
-{
-    if (quality == 0) return MAX_DIFF;
-
-    // curve fudged to be roughly similar to quality of libjpeg
-    return 2.5/pow(210.0 + quality, 1.2) * (100.1-quality)/100.0;
-}
-
-
 /**
  *   N = automatic quality, uses limit unless force is set (N-N or 0-N)
  *  -N = no better than N (same as 0-N)
@@ -204,7 +301,7 @@ static double quality_to_mse(long quality)
  *
  * where N,M are numbers between 0 (lousy) and 100 (perfect)
  */
-static bool parse_quality(const char *quality, struct pngquant_options *options)
+static bool parse_quality(const char *quality, liq_attr *options)
 {
     long limit, target;
     const char *str = quality; char *end;
@@ -229,10 +326,97 @@ static bool parse_quality(const char *quality, struct pngquant_options *options)
         limit = t1;
     }
 
-    if (target < 0 || target > 100 || limit < 0 || limit > 100) return false;
+    return LIQ_OK == liq_set_quality(options, limit, target);
+}
+
+/* size in bytes, with optional k/M/G suffix (powers of 1024) */
+static bool parse_memory_size(const char *size, liq_attr *options)
+{
+    char *end;
+    unsigned long long bytes = strtoull(size, &end, 10);
+    if (end == size || '-' == size[0]) return false;
+
+    unsigned int shift = 0;
+    switch (*end) {
+        case 'k': case 'K': shift = 10; end++; break;
+        case 'm': case 'M': shift = 20; end++; break;
+        case 'g': case 'G': shift = 30; end++; break;
+    }
+    if ('\0' != *end || !bytes || bytes > ((size_t)-1) >> shift) return false;
+
+    return LIQ_OK == liq_set_max_memory(options, (size_t)bytes << shift);
+}
+
+/* megapixels, 1 if not given */
+static bool parse_pyramid(const char *megapixels, liq_attr *options)
+{
+    double mp = 1.0;
+    if (megapixels) {
+        char *end;
+        mp = strtod(megapixels, &end);
+        if (end == megapixels || '\0' != *end || !(mp > 0) || mp > (double)((size_t)-1) / 1000000.0) return false;
+    }
+
+    return LIQ_OK == liq_set_pyramid(options, mp * 1000000.0);
+}
+
+static int compare_rungs(const void *a, const void *b)
+{
+    const struct ladder_rung *r1 = a, *r2 = b;
+    if (r1->colors != r2->colors) return r1->colors > r2->colors ? -1 : 1;
+    if (r1->quality != r2->quality) return r1->quality > r2->quality ? -1 : 1;
+    return 0;
+}
+
+/*
+ * --ladder list of numbers of colors (2-256), or of quality targets (0-100) prefixed with q,
+ * e.g. 256,128,64 or q90,q70. Rungs are sorted largest first, which is the order they're quantized in
+ */
+static bool parse_ladder(const char *list, struct ladder_rung rungs[], unsigned int *num_rungs)
+{
+    unsigned int count = 0;
+    const char *str = list;
+    for(;;) {
+        const bool quality = 'q' == str[0];
+        if (quality) str++;
+
+        char *end;
+        const long value = strtol(str, &end, 10);
+        if (str == end || (end[0] && end[0] != ',') || count == LADDER_MAX_RUNGS) return false;
+        if (quality ? value < 0 || value > 100 : value < 2 || value > 256) return false;
+        if (count && quality != !rungs[0].colors) return false; // colors and qualities can't be ordered together
+
+        rungs[count] = (struct ladder_rung){.colors = quality ? 0 : value, .quality = quality ? value : 0};
+        snprintf(rungs[count].name, sizeof(rungs[count].name), quality ? "-q%ld" : "-%ld", value);
+        count++;
+
+        if (!end[0]) break;
+        str = end+1;
+    }
+
+    qsort(rungs, count, sizeof(rungs[0]), compare_rungs);
+    for(unsigned int i=1; i < count; i++) {
+        if (!compare_rungs(&rungs[i-1], &rungs[i])) return false; // both would be written to the same file
+    }
+    *num_rungs = count;
+    return true;
+}
 
-    options->max_mse = quality_to_mse(limit);
-    options->target_mse = quality_to_mse(target);
+/* --analyze=list of numbers of colors (1-256), e.g. 16,64,256 */
+static bool parse_refine_colors(const char *list, int colors[], unsigned int *num_colors)
+{
+    unsigned int count = 0;
+    const char *str = list;
+    for(;;) {
+        char *end;
+        const long value = strtol(str, &end, 10);
+        if (str == end || (end[0] && end[0] != ',') || count == 256 || value < 1 || value > 256) return false;
+        colors[count++] = value;
+
+        if (!end[0]) break;
+        str = end+1;
+    }
+    *num_colors = count;
     return true;
 }
 
@@ -270,7 +454,7 @@ static void fix_obsolete_options(const unsigned int argc, char *argv[])
     }
 }
 
-enum {arg_floyd=1, arg_ordered, arg_ext, arg_no_force, arg_iebug, arg_transbug, arg_quality};
+enum {arg_floyd=1, arg_ordered, arg_ext, arg_no_force, arg_iebug, arg_transbug, arg_quality, arg_daemon, arg_stats, arg_stats_file, arg_trace, arg_max_memory, arg_hw_counters, arg_threads, arg_pin_threads, arg_pyramid, arg_map, arg_sequence, arg_shards, arg_ladder, arg_analyze};
 
 static const struct option long_options[] = {
     {"verbose", no_argument, NULL, 'v'},
@@ -285,26 +469,215 @@ static const struct option long_options[] = {
     {"ext", required_argument, NULL, arg_ext},
     {"speed", required_argument, NULL, 's'},
     {"quality", required_argument, NULL, arg_quality},
+    {"daemon", optional_argument, NULL, arg_daemon},
+    {"stats", no_argument, NULL, arg_stats},
+    {"stats-file", required_argument, NULL, arg_stats_file},
+    {"trace", required_argument, NULL, arg_trace},
+    {"max-memory", required_argument, NULL, arg_max_memory},
+    {"hw-counters", no_argument, NULL, arg_hw_counters},
+    {"threads", required_argument, NULL, arg_threads},
+    {"pin-threads", no_argument, NULL, arg_pin_threads},
+    {"pyramid", optional_argument, NULL, arg_pyramid},
+    {"map", required_argument, NULL, arg_map},
+    {"sequence", no_argument, NULL, arg_sequence},
+    {"shards", required_argument, NULL, arg_shards},
+    {"ladder", required_argument, NULL, arg_ladder},
+    {"analyze", optional_argument, NULL, arg_analyze},
     {"version", no_argument, NULL, 'V'},
     {"help", no_argument, NULL, 'h'},
 };
 
 int pngquant_file(const char *filename, const char *newext, struct pngquant_options *options);
+static size_t png24_image_size(const png24_image *input_image);
+
+struct deferred_file {
+    int index;
+    size_t memory;
+};
+
+/* files given on the command line, shared by the tasks that process them */
+struct file_batch {
+    const struct pngquant_options *options;
+    char **filenames;
+    const char *newext;
+    int num_files;
+    volatile int next_file;
+
+    pthread_mutex_t lock; // for everything below
+    unsigned int error_count, skipped_count, file_count;
+    pngquant_error latest_error;
+
+    // with --max-memory, files are started only while estimates of files in progress add up to less than the limit
+    size_t memory_limit, memory_in_use;
+    pthread_cond_t memory_released;
+    struct deferred_file *deferred; // files that didn't fit when their turn came, oldest first
+    int num_deferred;
+};
+
+static void file_batch_process(struct file_batch *batch, int i)
+{
+    struct pngquant_options opts = *batch->options;
+    opts.liq = liq_attr_copy(batch->options->liq);
+    const char *filename = opts.using_stdin ? "stdin" : batch->filenames[i];
+
+    struct buffered_log buf = {};
+    if (opts.log_callback && taskpool_threads() > 1 && batch->num_files > 1) {
+        verbose_printf_flush(&opts);
+        opts.log_callback = log_callback_buferred;
+        opts.log_callback_flush = log_callback_buferred_flush;
+        opts.log_callback_context = &buf;
+        set_log_callbacks(&opts);
+    }
+
+    struct liq_stats stats = {};
+    if (wants_stats(&opts) && opts.liq) {
+        opts.stats = &stats;
+        liq_set_stats(opts.liq, &stats);
+        if (opts.hw_counters) stats_hw_open(&stats);
+    }
+
+    trace_begin_arg("file", filename);
+    pngquant_error retval = opts.liq ? pngquant_file(filename, batch->newext, &opts) : OUT_OF_MEMORY_ERROR;
+    trace_end("file");
+
+    verbose_print_counters(&opts);
+    verbose_printf_flush(&opts);
+    if (opts.liq) liq_attr_destroy(opts.liq);
+    write_stats(&opts, filename, retval);
+    stats_hw_close(&stats);
+
+    pthread_mutex_lock(&batch->lock);
+    if (retval) {
+        batch->latest_error = retval;
+        if (retval == TOO_LOW_QUALITY) {
+            batch->skipped_count++;
+        } else {
+            batch->error_count++;
+        }
+    }
+    batch->file_count++;
+    pthread_mutex_unlock(&batch->lock);
+}
+
+/* peak memory of a file from dimensions in its PNG header, including decoded and remapped pixels */
+static size_t file_memory_estimate(const struct file_batch *batch, int i)
+{
+    FILE *infile = fopen(batch->filenames[i], "rb");
+    if (!infile) return 0;
+
+    png_uint_32 width, height;
+    const pngquant_error retval = rwpng_read_dimensions(infile, &width, &height);
+    fclose(infile);
+    if (retval || width > INT_MAX || height > INT_MAX) return 0; // reading it will fail anyway
+
+    // each rung of --ladder has its own output and copy of the edge map
+    const png24_image image = {.width = width, .height = height};
+    const unsigned int rungs = batch->options->ladder_rungs;
+    const size_t outputs = rungs ? (size_t)width * height * (1 + sizeof(float)) * rungs : (size_t)width * height;
+    const size_t bytes = png24_image_size(&image) + outputs + liq_image_memory_estimate(batch->options->liq, width, height);
+    return MIN(bytes, batch->memory_limit);
+}
+
+/* a file that doesn't fit with others in progress can still run alone */
+static bool file_batch_fits(const struct file_batch *batch, size_t memory)
+{
+    return !batch->memory_in_use || batch->memory_in_use + memory <= batch->memory_limit;
+}
+
+/*
+ Index of the next file to process, or -1 when there are none left. Memory reserved for the file is set in *memory.
+ Deferred files are retried first whenever another file finishes, and once all files have been looked at,
+ the remaining tasks wait for memory to be released.
+ */
+static int file_batch_admit(struct file_batch *batch, size_t *memory)
+{
+    if (!batch->memory_limit) {
+        *memory = 0;
+        const int i = __sync_fetch_and_add(&batch->next_file, 1);
+        return i < batch->num_files ? i : -1;
+    }
+
+    pthread_mutex_lock(&batch->lock);
+    for(;;) {
+        for(int d=0; d < batch->num_deferred; d++) {
+            if (file_batch_fits(batch, batch->deferred[d].memory)) {
+                const struct deferred_file file = batch->deferred[d];
+                memmove(&batch->deferred[d], &batch->deferred[d+1], (batch->num_deferred - d - 1) * sizeof(batch->deferred[0]));
+                batch->num_deferred--;
+                batch->memory_in_use += file.memory;
+                pthread_mutex_unlock(&batch->lock);
+                *memory = file.memory;
+                return file.index;
+            }
+        }
+
+        if (batch->next_file < batch->num_files) {
+            const int i = batch->next_file++;
+            pthread_mutex_unlock(&batch->lock);
+            const size_t estimate = file_memory_estimate(batch, i);
+            pthread_mutex_lock(&batch->lock);
+
+            if (file_batch_fits(batch, estimate)) {
+                batch->memory_in_use += estimate;
+                pthread_mutex_unlock(&batch->lock);
+                *memory = estimate;
+                return i;
+            }
+            verbose_printf(batch->options, "%s: needs about %luKB, deferred until other files finish",
+                           batch->filenames[i], (unsigned long)(estimate+1023)/1024UL);
+            batch->deferred[batch->num_deferred++] = (struct deferred_file){.index = i, .memory = estimate};
+            continue;
+        }
+
+        if (!batch->num_deferred) break;
+        pthread_cond_wait(&batch->memory_released, &batch->lock);
+    }
+    pthread_mutex_unlock(&batch->lock);
+    return -1;
+}
+
+static void file_batch_release(struct file_batch *batch, size_t memory)
+{
+    if (!batch->memory_limit) return;
+
+    pthread_mutex_lock(&batch->lock);
+    batch->memory_in_use -= memory;
+    pthread_cond_broadcast(&batch->memory_released);
+    pthread_mutex_unlock(&batch->lock);
+}
+
+static void file_batch_task(void *arg)
+{
+    struct file_batch *batch = arg;
+    size_t memory;
+    int i;
+    while ((i = file_batch_admit(batch, &memory)) >= 0) {
+        file_batch_process(batch, i);
+        file_batch_release(batch, memory);
+    }
+}
+
+static int pngquant_daemon(const char *socket_path, const struct pngquant_options *options);
+static int pngquant_finish(struct pngquant_options *options, int retval);
+static pngquant_error read_fixed_palette(const char *filename, struct pngquant_options *options);
 
 int main(int argc, char *argv[])
 {
     struct pngquant_options options = {
-        .reqcolors = 256,
         .floyd = true, // floyd-steinberg dithering
-        .min_opaque_val = 1, // whether preserve opaque colors for IE (1.0=no, does not affect alpha)
-        .speed_tradeoff = 3, // 1 max quality, 10 rough & fast. 3 is optimum.
-        .last_index_transparent = false, // puts transparent color at last index. This is workaround for blu-ray subtitles.
-        .target_mse = 0,
-        .max_mse = MAX_DIFF,
     };
-    unsigned int error_count=0, skipped_count=0, file_count=0;
-    pngquant_error latest_error=SUCCESS;
+    options.liq = liq_attr_create();
+
+    if (!options.liq) {
+        return OUT_OF_MEMORY_ERROR;
+    }
     const char *newext = NULL;
+    bool daemon_mode = false, print_version = false, pin_threads = false;
+    struct sequence_state sequence = {.palette_error = -1};
+    struct ladder_rung ladder[LADDER_MAX_RUNGS];
+    int refine_colors[256];
+    int threads = 0; // one per CPU
+    const char *daemon_socket = NULL, *map_file = NULL;
 
     fix_obsolete_options(argc, argv);
 
@@ -321,36 +694,125 @@ int main(int argc, char *argv[])
             case arg_ext: newext = optarg; break;
 
             case arg_iebug:
-            options.min_opaque_val = 238.0/256.0; // opacities above 238 will be rounded up to 255, because IE6 truncates <255 to 0.
+                liq_set_min_opacity(options.liq, 238); // opacities above 238 will be rounded up to 255, because IE6 truncates <255 to 0.
                 break;
 
             case arg_transbug:
-                options.last_index_transparent = true;
+                liq_set_last_index_transparent(options.liq, true);
                 break;
 
             case 's':
-                options.speed_tradeoff = atoi(optarg);
-                if (options.speed_tradeoff < 1 || options.speed_tradeoff > 10) {
+                if (LIQ_OK != liq_set_speed(options.liq, atoi(optarg))) {
                     fputs("Speed should be between 1 (slow) and 10 (fast).\n", stderr);
                     return INVALID_ARGUMENT;
                 }
                 break;
 
             case arg_quality:
-                if (!parse_quality(optarg, &options)) {
+                if (!parse_quality(optarg, options.liq)) {
                     fputs("Quality should be in format min-max where min and max are numbers in range 0-100.\n", stderr);
                     return INVALID_ARGUMENT;
                 }
                 break;
 
+            case arg_daemon:
+                daemon_mode = true;
+                daemon_socket = optarg;
+                break;
+
+            case arg_stats:
+                if (!options.stats_file) options.stats_file = stderr;
+                break;
+
+            case arg_stats_file:
+                if (options.stats_file && options.stats_file != stderr) fclose(options.stats_file);
+                if (!(options.stats_file = fopen(optarg, "w"))) {
+                    fprintf(stderr, "  error: cannot open %s for writing\n", optarg);
+                    return CANT_WRITE_ERROR;
+                }
+                break;
+
+            case arg_hw_counters:
+                options.hw_counters = true;
+                if (!options.stats_file) options.stats_file = stderr;
+                break;
+
+            case arg_trace:
+                if (options.trace_file) fclose(options.trace_file);
+                if (!(options.trace_file = fopen(optarg, "w"))) {
+                    fprintf(stderr, "  error: cannot open %s for writing\n", optarg);
+                    return CANT_WRITE_ERROR;
+                }
+                trace_enable();
+                break;
+
+            case arg_max_memory:
+                if (!parse_memory_size(optarg, options.liq)) {
+                    fputs("Memory limit should be a number of bytes, optionally followed by k, M or G.\n", stderr);
+                    return INVALID_ARGUMENT;
+                }
+                break;
+
+            case arg_pyramid:
+                if (!parse_pyramid(optarg, options.liq)) {
+                    fputs("Pyramid level size should be a number of megapixels, at least 0.005.\n", stderr);
+                    return INVALID_ARGUMENT;
+                }
+                break;
+
+            case arg_map:
+                map_file = optarg;
+                break;
+
+            case arg_sequence:
+                options.sequence = &sequence;
+                break;
+
+            case arg_shards:
+                if (atoi(optarg) < 1) {
+                    fputs("Number of shards should be 1 or more.\n", stderr);
+                    return INVALID_ARGUMENT;
+                }
+                options.shards = atoi(optarg);
+                break;
+
+            case arg_ladder:
+                if (!parse_ladder(optarg, ladder, &options.ladder_rungs)) {
+                    fprintf(stderr, "Ladder should be a list of up to %d different numbers of colors (2-256) or qualities (q0-q100), e.g. 256,128,64.\n", LADDER_MAX_RUNGS);
+                    return INVALID_ARGUMENT;
+                }
+                options.ladder = ladder;
+                break;
+
+            case arg_analyze:
+                options.analyze = true;
+                options.num_refine = 0;
+                if (optarg && !parse_refine_colors(optarg, refine_colors, &options.num_refine)) {
+                    fputs("Numbers of colors to refine should be a list of numbers in range 1-256, e.g. --analyze=16,64,256.\n", stderr);
+                    return INVALID_ARGUMENT;
+                }
+                options.refine_colors = refine_colors;
+                break;
+
+            case arg_threads:
+                if ((threads = atoi(optarg)) < 1) {
+                    fputs("Number of threads should be 1 or more.\n", stderr);
+                    return INVALID_ARGUMENT;
+                }
+                break;
+
+            case arg_pin_threads:
+                pin_threads = true;
+                break;
+
             case 'h':
                 print_full_version(stdout);
                 print_usage(stdout);
                 return SUCCESS;
 
             case 'V':
-                puts(PNGQUANT_VERSION);
-                return SUCCESS;
+                print_version = true;
+                break;
 
             case -1: break;
 
@@ -359,8 +821,72 @@ int main(int argc, char *argv[])
         }
     } while (opt != -1);
 
+    // the pool is started once all options are known, since pinning applies when threads start
+    if (threads || pin_threads) {
+        taskpool_set_pinning(pin_threads);
+        if (LIQ_OK != liq_set_threads(threads)) {
+            fputs("  warning: could not start all threads\n", stderr);
+        }
+    }
+
+    // plain version number is for scripts, --verbose also shows build and CPU features
+    if (print_version) {
+        if (options.log_callback) print_full_version(stdout);
+        else puts(PNGQUANT_VERSION);
+        return SUCCESS;
+    }
+
+#if USE_SSE
+    if (!is_sse2_available()) {
+        print_full_version(stderr);
+        fputs("SSE2-capable CPU is required for this build.\n", stderr);
+        return WRONG_ARCHITECTURE;
+    }
+#endif
+
+    if (options.hw_counters) {
+        struct liq_stats probe = {};
+        if (!stats_hw_open(&probe)) {
+            fputs("  warning: hardware counters are not supported or not permitted (see perf_event_paranoid), --hw-counters ignored\n", stderr);
+            options.hw_counters = false;
+        }
+        stats_hw_close(&probe);
+    }
+
+    set_log_callbacks(&options);
+
+    // palette and its nearest color index are made once for all files (and daemon requests)
+    if (map_file) {
+        pngquant_error retval = read_fixed_palette(map_file, &options);
+        if (retval) return pngquant_finish(&options, retval);
+    }
+
     int argn = optind;
 
+    if (daemon_mode) {
+        if (argn < argc) {
+            fputs("Input files can't be used with --daemon. Send images as requests instead.\n", stderr);
+            return INVALID_ARGUMENT;
+        }
+        if (options.sequence) {
+            fputs("--sequence can't be used with --daemon.\n", stderr);
+            return INVALID_ARGUMENT;
+        }
+        if (options.shards > 1) {
+            fputs("--shards can't be used with --daemon.\n", stderr);
+            return INVALID_ARGUMENT;
+        }
+        if (options.ladder_rungs) {
+            fputs("--ladder can't be used with --daemon.\n", stderr);
+            return INVALID_ARGUMENT;
+        }
+        if (options.analyze) {
+            fputs("--analyze can't be used with --daemon.\n", stderr);
+            return INVALID_ARGUMENT;
+        }
+        return pngquant_finish(&options, pngquant_daemon(daemon_socket, &options));
+    }
+
     if (argn >= argc) {
         if (argn > 1) {
             fputs("No input files specified. See -h for help.\n", stderr);
@@ -374,19 +900,24 @@ int main(int argc, char *argv[])
     char *colors_end;
     unsigned long colors = strtoul(argv[argn], &colors_end, 10);
     if (colors_end != argv[argn] && '\0' == colors_end[0]) {
-        options.reqcolors = colors;
+        if (LIQ_OK != liq_set_max_colors(options.liq, MIN(colors, 257))) {
+            fputs("Number of colors must be between 2 and 256.\n", stderr);
+            return INVALID_ARGUMENT;
+        }
         argn++;
     }
 
-    if (options.reqcolors < 2 || options.reqcolors > 256) {
-        fputs("Number of colors must be between 2 and 256.\n", stderr);
-        return INVALID_ARGUMENT;
+    for(unsigned int i=0; i < options.num_refine; i++) {
+        if (options.refine_colors[i] > liq_get_max_colors(options.liq)) {
+            fputs("Numbers of colors to refine with --analyze can't be more than the number of colors.\n", stderr);
+            return INVALID_ARGUMENT;
+        }
     }
 
     // new filename extension depends on options used. Typically basename-fs8.png
     if (newext == NULL) {
         newext = options.floyd ? "-ie-fs8.png" : "-ie-or8.png";
-        if (options.min_opaque_val == 1.f) newext += 3; /* skip "-ie" */
+        if (liq_get_min_opacity(options.liq) == 255) newext += 3; /* skip "-ie" */
     }
 
     if (argn == argc || (argn == argc-1 && 0==strcmp(argv[argn],"-"))) {
@@ -394,60 +925,55 @@ int main(int argc, char *argv[])
         argn = argc-1;
     }
 
-#if USE_SSE
-    if (!is_sse2_available()) {
-        print_full_version(stderr);
-        fputs("SSE2-capable CPU is required for this build.\n", stderr);
-        return WRONG_ARCHITECTURE;
+    // workers read their rows from the file, and frames of a sequence depend on whole previous frames
+    if (options.shards > 1 && (options.using_stdin || options.sequence)) {
+        fputs(options.using_stdin ? "--shards can't be used with stdin.\n" : "--shards can't be used with --sequence.\n", stderr);
+        return INVALID_ARGUMENT;
     }
-#endif
 
-    const int num_files = argc-argn;
-
-#ifdef _OPENMP
-    // if there's a lot of files, coarse parallelism can be used
-    if (num_files > 2*omp_get_max_threads()) {
-        omp_set_nested(0);
-        omp_set_dynamic(1);
-    } else {
-        omp_set_nested(1);
+    // rungs are written to files named after the input, and each needs a palette of its own
+    if (options.ladder_rungs && (options.using_stdin || options.sequence || options.shards > 1 || options.fixed_palette)) {
+        fputs("--ladder can't be used with stdin, --sequence, --shards or --map.\n", stderr);
+        return INVALID_ARGUMENT;
     }
-#endif
 
-    #pragma omp parallel for \
-        schedule(dynamic) reduction(+:skipped_count) reduction(+:error_count) reduction(+:file_count) shared(latest_error)
-    for(int i=0; i < num_files; i++) {
-        struct pngquant_options opts = options;
-        const char *filename = opts.using_stdin ? "stdin" : argv[argn+i];
-
-        #ifdef _OPENMP
-        struct buffered_log buf = {};
-        if (opts.log_callback && omp_get_num_threads() > 1 && num_files > 1) {
-            verbose_printf_flush(&opts);
-            opts.log_callback = log_callback_buferred;
-            opts.log_callback_flush = log_callback_buferred_flush;
-            opts.log_callback_context = &buf;
-        }
-        #endif
-
-        pngquant_error retval = pngquant_file(filename, newext, &opts);
+    // nothing is remapped, so options that pick palettes or outputs don't apply
+    if (options.analyze && (options.sequence || options.shards > 1 || options.ladder_rungs || options.fixed_palette)) {
+        fputs("--analyze can't be used with --sequence, --shards, --ladder or --map.\n", stderr);
+        return INVALID_ARGUMENT;
+    }
 
-        verbose_printf_flush(&opts);
+    // a single file is remapped by all threads, so its rows are placed in memory of their nodes.
+    // With more files each thread has its own, and pages are placed on its node by decoding it
+    options.spread_pages = taskpool_numa_nodes() > 1 && argc-argn == 1;
+
+    struct file_batch batch = {
+        .options = &options,
+        .filenames = &argv[argn],
+        .newext = newext,
+        .num_files = argc-argn,
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .memory_released = PTHREAD_COND_INITIALIZER,
+    };
+    // stdin is a single file and can't be read twice. Frames of a sequence can't be reordered
+    if (liq_get_max_memory(options.liq) && !options.using_stdin && !options.sequence && options.shards < 2 && batch.num_files > 1) {
+        batch.deferred = malloc(batch.num_files * sizeof(batch.deferred[0]));
+        if (batch.deferred) batch.memory_limit = liq_get_max_memory(options.liq);
+    }
 
-        if (retval) {
-            #pragma omp critical
-            {
-                latest_error = retval;
-            }
-            if (retval == TOO_LOW_QUALITY) {
-                skipped_count++;
-            } else {
-                error_count++;
-            }
-        }
-        ++file_count;
+    // every thread takes files one by one, and threads left without files help with parts of the others.
+    // Each frame of a sequence depends on the previous one, so they're taken by one thread and others only help.
+    // Shards of a file use all CPUs in their own processes, so files are taken one at a time
+    task_group files = {0};
+    const int num_tasks = options.sequence || options.shards > 1 ? 1 : MIN(batch.num_files, (int)taskpool_threads());
+    for(int i=0; i < num_tasks; i++) {
+        taskpool_spawn(&files, file_batch_task, &batch, false);
     }
+    taskpool_wait(&files);
 
+    free(batch.deferred);
+
+    const unsigned int error_count = batch.error_count, skipped_count = batch.skipped_count, file_count = batch.file_count;
     if (error_count) {
         verbose_printf(&options, "There were errors quantizing %d file%s out of a total of %d file%s.",
                        error_count, (error_count == 1)? "" : "s", file_count, (file_count == 1)? "" : "s");
@@ -463,36 +989,80 @@ int main(int argc, char *argv[])
 
     verbose_printf_flush(&options);
 
-    return latest_error;
+    return pngquant_finish(&options, batch.latest_error);
 }
 
-static void pngquant_image_free(pngquant_image *input_image)
+/* closes files of --stats-file and --trace, which are written until the end */
+static int pngquant_finish(struct pngquant_options *options, int retval)
 {
-    /* now we're done with the INPUT data and row_pointers, so free 'em */
-    if (input_image->rwpng_image.rgba_data) {
-        free(input_image->rwpng_image.rgba_data);
-        input_image->rwpng_image.rgba_data = NULL;
+    if (options->trace_file) {
+        if (!trace_write(options->trace_file)) {
+            fputs("  error: failed writing trace\n", stderr);
+            if (!retval) retval = CANT_WRITE_ERROR;
+        }
+        fclose(options->trace_file);
+    }
+
+    if (options->stats_file && options->stats_file != stderr) fclose(options->stats_file);
+    liq_fixed_palette_destroy(options->fixed_palette);
+    if (options->sequence) {
+        pngquant_image_free(&options->sequence->frame, NULL);
+        pngquant_output_image_free(&options->sequence->output, NULL);
+        liq_fixed_palette_destroy(options->sequence->palette);
     }
+    liq_attr_destroy(options->liq);
+    return retval;
+}
+
+struct first_touch_context {
+    unsigned char **rows;
+    png_size_t rowbytes;
+};
 
-    if (input_image->rwpng_image.row_pointers) {
-        free(input_image->rwpng_image.row_pointers);
-        input_image->rwpng_image.row_pointers = NULL;
+static void first_touch_band(void *context, unsigned int chunk, unsigned int start, unsigned int end)
+{
+    const struct first_touch_context *c = context;
+    for(unsigned int row = start; row < end; row++) {
+        memset(c->rows[row], 0, c->rowbytes);
     }
+}
+
+/*
+ Memory pages are placed on the NUMA node of the thread that writes them first. Rows are written in the same bands
+ that remapping uses, instead of all by the decoding thread, so that pinned threads mostly read their own node's memory.
+ */
+static void first_touch_rows(unsigned char **row_pointers, png_size_t rowbytes, png_uint_32 height)
+{
+    struct first_touch_context context = {.rows = row_pointers, .rowbytes = rowbytes};
+    taskpool_parallel_for(height, taskpool_row_chunks(height, rowbytes/4), first_touch_band, &context, true);
+}
+
+/* decoded image is counted in stats, so that the library knows how much of --max-memory is left */
+static size_t png24_image_size(const png24_image *input_image)
+{
+    const unsigned int channels = input_image->channels == 3 ? 3 : 4; // unknown before decoding, so RGBA is assumed
+    return (size_t)input_image->width * input_image->height * channels + input_image->height * sizeof(input_image->row_pointers[0]);
+}
 
-    if (input_image->noise) {
-        free(input_image->noise);
-        input_image->noise = NULL;
+static void pngquant_image_free(png24_image *input_image, struct liq_stats *stats)
+{
+    /* now we're done with the INPUT data and row_pointers, so free 'em */
+    if (input_image->rgba_data) {
+        stats_mem_sub(stats, png24_image_size(input_image));
+        free(input_image->rgba_data);
+        input_image->rgba_data = NULL;
     }
 
-    if (input_image->edges) {
-        free(input_image->edges);
-        input_image->edges = NULL;
+    if (input_image->row_pointers) {
+        free(input_image->row_pointers);
+        input_image->row_pointers = NULL;
     }
 }
 
-static void pngquant_output_image_free(png8_image *output_image)
+static void pngquant_output_image_free(png8_image *output_image, struct liq_stats *stats)
 {
     if (output_image->indexed_data) {
+        stats_mem_sub(stats, (size_t)output_image->width * output_image->height);
         free(output_image->indexed_data);
         output_image->indexed_data = NULL;
     }
@@ -504,6 +1074,15 @@ int pngquant_file(const char *filename, const char *newext, struct pngquant_opti
 
     verbose_printf(options, "%s:", filename);
 
+    // every rung of --ladder is written to a file of its own
+    if (options->ladder_rungs) {
+        return pngquant_file_ladder(filename, newext, options);
+    }
+
+    if (options->analyze) {
+        return pngquant_file_analyze(filename, options);
+    }
+
     char *outname = NULL;
     if (!options->using_stdin) {
         outname = add_filename_extension(filename,newext);
@@ -513,891 +1092,1549 @@ int pngquant_file(const char *filename, const char *newext, struct pngquant_opti
         }
     }
 
-    pngquant_image input_image = {}; // initializes all fields to 0
+    // animated PNGs are read and written whole, with one palette for all frames
+    if (!retval && !options->using_stdin && file_is_apng(filename)) {
+        if (options->sequence || options->shards > 1) {
+            fprintf(stderr, "  error: animated PNGs can't be converted with %s\n", options->sequence ? "--sequence" : "--shards");
+            retval = INVALID_ARGUMENT;
+        } else {
+            retval = pngquant_file_apng(filename, outname, options);
+        }
+        free(outname);
+        return retval;
+    }
+
+    // bands of rows of a giant image are decoded, quantized and remapped by separate processes
+    if (!retval && options->shards > 1) {
+        retval = pngquant_file_sharded(filename, outname, options);
+        free(outname);
+        return retval;
+    }
+
+    png24_image input_image = {}; // initializes all fields to 0
+    if (options->spread_pages) input_image.first_touch = first_touch_rows;
     if (!retval) {
-        retval = read_image(filename, options->using_stdin, &input_image.rwpng_image);
+        const stats_time start = stats_start(options->stats);
+        retval = read_image(filename, options->using_stdin, &input_image);
+        if (input_image.rgba_data) stats_mem_add(options->stats, png24_image_size(&input_image));
+        stats_end(options->stats, STATS_READ, start);
     }
 
     png8_image output_image = {};
     if (!retval) {
         verbose_printf(options, "  read %luKB file corrected for gamma %2.1f",
-                       (input_image.rwpng_image.file_size+1023UL)/1024UL, 1.0/input_image.rwpng_image.gamma);
-
-        prepare_image(&input_image, options);
-
-        histogram *hist = get_histogram(&input_image, options);
-        if (input_image.noise) {
-            free(input_image.noise);
-            input_image.noise = NULL;
-        }
+                       (input_image.file_size+1023UL)/1024UL, 1.0/input_image.gamma);
 
-        colormap *palette = pngquant_quantize(hist, options);
-        pam_freeacolorhist(hist);
-
-        if (palette) {
-            retval = pngquant_remap(palette, &input_image, &output_image, options);
-            pam_freecolormap(palette);
-        } else {
-            if (input_image.edges) {
-                free(input_image.edges);
-                input_image.edges = NULL;
-            }
-            retval = TOO_LOW_QUALITY;
-        }
+        retval = options->sequence ?
+            sequence_process_image(&input_image, &output_image, options) :
+            pngquant_process_image(&input_image, &output_image, options);
     }
 
+    const stats_time write_start = stats_start(options->stats);
     if (!retval) {
         retval = write_image(&output_image, NULL, outname, options);
+        stats_end(options->stats, STATS_WRITE, write_start);
     } else if (TOO_LOW_QUALITY == retval && options->using_stdin) {
         // when outputting to stdout it'd be nasty to create 0-byte file
         // so if quality is too low, output 24-bit original
-        if (!input_image.modified) {
-            int write_retval = write_image(NULL, &input_image.rwpng_image, outname, options);
-            if (write_retval) retval = write_retval;
-        } else {
-            // iebug preprocessing changes the original image
-            fputs("  error:  can't write the original image when iebug option is enabled\n", stderr);
-            retval = INVALID_ARGUMENT;
-        }
+        int write_retval = write_image(NULL, &input_image, outname, options);
+        if (write_retval) retval = write_retval;
+        stats_end(options->stats, STATS_WRITE, write_start);
+    }
+
+    if (!retval && options->sequence) {
+        sequence_keep_frame(options->sequence, &input_image, &output_image, options->stats);
     }
 
-    pngquant_image_free(&input_image);
-    pngquant_output_image_free(&output_image);
+    pngquant_image_free(&input_image, options->stats);
+    pngquant_output_image_free(&output_image, options->stats);
+    free(outname);
 
     return retval;
 }
 
-static int compare_popularity(const void *ch1, const void *ch2)
-{
-    const float v1 = ((const colormap_item*)ch1)->popularity;
-    const float v2 = ((const colormap_item*)ch2)->popularity;
-    return v1 > v2 ? 1 : -1;
-}
-
-static void sort_palette(colormap *map, const struct pngquant_options *options)
+/* tRNS, etc. */
+static void set_output_palette(png8_image *output_image, const liq_palette *palette)
 {
-    /*
-    ** Step 3.5 [GRR]: remap the palette colors so that all entries with
-    ** the maximal alpha value (i.e., fully opaque) are at the end and can
-    ** therefore be omitted from the tRNS chunk.
-    */
-
+    output_image->num_palette = palette->count;
+    output_image->num_trans = 0;
+    for(unsigned int i=0; i < palette->count; i++) {
+        liq_color px = palette->entries[i];
+        if (px.a < 255) {
+            output_image->num_trans = i+1;
+        }
+        output_image->palette[i] = (png_color){.red=px.r, .green=px.g, .blue=px.b};
+        output_image->trans[i] = px.a;
+    }
+}
 
-    if (options->last_index_transparent) for(unsigned int i=0; i < map->colors; i++) {
-        if (map->palette[i].acolor.a < 1.0/256.0) {
-            const unsigned int old = i, transparent_dest = map->colors-1;
+/* quantizes and remaps already-decoded image. Returns TOO_LOW_QUALITY if quality limit couldn't be met */
+static pngquant_error pngquant_process_image(png24_image *input_image, png8_image *output_image, struct pngquant_options *options)
+{
+    // input and output images have to fit, whichever methods quantization picks
+    const size_t max_memory = liq_get_max_memory(options->liq);
+    const size_t min_memory = png24_image_size(input_image) + (size_t)input_image->width * input_image->height;
+    if (max_memory && min_memory > max_memory) {
+        fprintf(stderr, "  error: image needs at least %luKB of memory, which exceeds --max-memory\n", (unsigned long)(min_memory+1023)/1024UL);
+        return OUT_OF_MEMORY_ERROR;
+    }
 
-            const colormap_item tmp = map->palette[transparent_dest];
-            map->palette[transparent_dest] = map->palette[old];
-            map->palette[old] = tmp;
+    liq_image *image = input_image->channels == 3 ?
+        liq_image_create_rgb_rows(options->liq, (void**)input_image->row_pointers, input_image->width, input_image->height, input_image->gamma) :
+        liq_image_create_rgba_rows(options->liq, (void**)input_image->row_pointers, input_image->width, input_image->height, input_image->gamma);
+    if (!image) {
+        return OUT_OF_MEMORY_ERROR;
+    }
 
-            /* colors sorted by popularity make pngs slightly more compressible */
-            qsort(map->palette, map->colors-1, sizeof(map->palette[0]), compare_popularity);
-            return;
-            }
+    liq_result *remap = NULL;
+    if (options->fixed_palette) {
+        // --map skips quantization entirely
+        if (!(remap = liq_result_create_fixed(options->liq, options->fixed_palette))) {
+            liq_image_destroy(image);
+            return OUT_OF_MEMORY_ERROR;
         }
-
-    /* move transparent colors to the beginning to shrink trns chunk */
-    unsigned int num_transparent=0;
-    for(unsigned int i=0; i < map->colors; i++) {
-        if (map->palette[i].acolor.a < 255.0/256.0) {
-            // current transparent color is swapped with earlier opaque one
-            if (i != num_transparent) {
-                const colormap_item tmp = map->palette[num_transparent];
-                map->palette[num_transparent] = map->palette[i];
-                map->palette[i] = tmp;
-                i--;
-            }
-            num_transparent++;
+    } else {
+        liq_error err = liq_image_quantize(image, options->liq, &remap);
+        if (LIQ_OK != err) {
+            liq_image_destroy(image);
+            return LIQ_QUALITY_TOO_LOW == err ? TOO_LOW_QUALITY : OUT_OF_MEMORY_ERROR;
         }
     }
 
-    verbose_printf(options, "  eliminated opaque tRNS-chunk entries...%d entr%s transparent", num_transparent, (num_transparent == 1)? "y" : "ies");
+    liq_set_dithering_level(remap, options->floyd ? 1.0f : 0.0f);
 
-    /* colors sorted by popularity make pngs slightly more compressible
-     * opaque and transparent are sorted separately
-     */
-    qsort(map->palette, num_transparent, sizeof(map->palette[0]), compare_popularity);
-    qsort(map->palette+num_transparent, map->colors-num_transparent, sizeof(map->palette[0]), compare_popularity);
-}
+    output_image->width = input_image->width;
+    output_image->height = input_image->height;
+    output_image->gamma = liq_get_output_gamma(remap);
 
-static void set_palette(png8_image *output_image, const colormap *map)
-{
-    to_f_set_gamma(output_image->gamma);
+    /*
+    ** Step 3.7 [GRR]: allocate memory for the entire indexed image
+    */
 
-    for(unsigned int x = 0; x < map->colors; ++x) {
-        rgb_pixel px = to_rgb(output_image->gamma, map->palette[x].acolor);
-        map->palette[x].acolor = to_f(px); /* saves rounding error introduced by to_rgb, which makes remapping & dithering more accurate */
+    const size_t indexed_size = (size_t)output_image->height * output_image->width;
+    output_image->indexed_data = malloc(indexed_size);
+    if (output_image->indexed_data) stats_mem_add(options->stats, indexed_size);
 
-        output_image->palette[x].red   = px.r;
-        output_image->palette[x].green = px.g;
-        output_image->palette[x].blue  = px.b;
-        output_image->trans[x]         = px.a;
+    pngquant_error retval = SUCCESS;
+    if (!output_image->indexed_data || LIQ_OK != liq_write_remapped_image(remap, image, output_image->indexed_data, indexed_size)) {
+        retval = OUT_OF_MEMORY_ERROR;
     }
+
+    if (!retval) {
+        const liq_palette *palette = liq_get_palette(remap);
+        set_output_palette(output_image, palette);
+
+        // a keyframe of --sequence. Its palette is kept for the following frames
+        if (options->sequence && !options->fixed_palette) {
+            struct sequence_state *const sequence = options->sequence;
+            liq_fixed_palette_destroy(sequence->palette);
+            sequence->palette = liq_fixed_palette_create(options->liq, palette->entries, palette->count, output_image->gamma);
+            sequence->frame_error = sequence->palette_error = liq_get_quantization_error(remap);
+        }
+    }
+
+    liq_result_destroy(remap);
+    liq_image_destroy(image);
+    return retval;
 }
 
-static float remap_to_palette(png24_image *input_image, png8_image *output_image, colormap *const map, const float min_opaque_val)
+static bool file_is_apng(const char *filename)
 {
-    const rgb_pixel *const *const input_pixels = (const rgb_pixel **)input_image->row_pointers;
-    unsigned char *const remapped = output_image->indexed_data;
-    const int rows = input_image->height;
-    const unsigned int cols = input_image->width;
-
-    to_f_set_gamma(input_image->gamma);
+    FILE *infile = fopen(filename, "rb");
+    if (!infile) return false; // reported when it's read
 
-    int remapped_pixels=0;
-    float remapping_error=0;
+    const bool apng = rwpng_is_apng(infile);
+    fclose(infile);
+    return apng;
+}
 
-    struct nearest_map *const n = nearest_init(map);
-    const unsigned int transparent_ind = nearest_search(n, (f_pixel){0,0,0,0}, min_opaque_val, NULL);
+struct frame_remap {
+    liq_image *image;
+    png8_image *output;
+    const liq_fixed_palette *palette;
+    const liq_attr *attr;
+    bool floyd;
+    pngquant_error retval;
+};
 
-    const unsigned int max_threads = omp_get_max_threads();
-    viter_state average_color[map->colors * max_threads];
-    viter_init(map, max_threads, average_color);
+static void frame_remap_task(void *arg)
+{
+    struct frame_remap *const f = arg;
+    liq_result *remap = liq_result_create_fixed(f->attr, f->palette);
+    if (!remap) {
+        f->retval = OUT_OF_MEMORY_ERROR;
+        return;
+    }
 
-    #pragma omp parallel for if (rows*cols > 3000) \
-        default(none) shared(average_color) reduction(+:remapping_error) reduction(+:remapped_pixels)
-    for(int row = 0; row < rows; ++row) {
-        for(unsigned int col = 0; col < cols; ++col) {
+    liq_set_dithering_level(remap, f->floyd ? 1.0f : 0.0f);
+    if (LIQ_OK != liq_write_remapped_image(remap, f->image, f->output->indexed_data, (size_t)f->output->width * f->output->height)) {
+        f->retval = OUT_OF_MEMORY_ERROR;
+    } else {
+        f->output->gamma = liq_get_output_gamma(remap);
+        set_output_palette(f->output, liq_get_palette(remap));
+    }
+    liq_result_destroy(remap);
+}
 
-            f_pixel px = to_f(input_pixels[row][col]);
-            unsigned int match;
+/*
+ All frames of an animation get one palette (APNG has one PLTE), made from a histogram of all of them, or --map's.
+ Noise maps and histograms of frames are made in parallel, and then frames are remapped in parallel, as tasks
+ that share a read-only palette, so the output is the same for any number of threads.
+ */
+static pngquant_error pngquant_process_frames(png24_image frames[], png8_image outputs[], unsigned int num_frames, struct pngquant_options *options)
+{
+    liq_image **images = calloc(num_frames, sizeof(images[0]));
+    struct frame_remap *remaps = calloc(num_frames, sizeof(remaps[0]));
+    liq_attr *frame_attr = liq_attr_copy(options->liq);
+    pngquant_error retval = images && remaps && frame_attr ? SUCCESS : OUT_OF_MEMORY_ERROR;
+    for(unsigned int i=0; i < num_frames && !retval; i++) {
+        images[i] = frames[i].channels == 3 ?
+            liq_image_create_rgb_rows(options->liq, (void**)frames[i].row_pointers, frames[i].width, frames[i].height, frames[i].gamma) :
+            liq_image_create_rgba_rows(options->liq, (void**)frames[i].row_pointers, frames[i].width, frames[i].height, frames[i].gamma);
+        if (!images[i]) retval = OUT_OF_MEMORY_ERROR;
+    }
 
-            if (px.a < 1.0/256.0) {
-                match = transparent_ind;
-            } else {
-                float diff;
-                match = nearest_search(n, px, min_opaque_val, &diff);
+    liq_fixed_palette *palette = NULL;
+    if (!retval && !options->fixed_palette) {
+        liq_histogram *hist = liq_histogram_create(options->liq);
+        liq_result *result = NULL;
+        liq_error err = hist ? liq_histogram_add_images(hist, options->liq, images, num_frames) : LIQ_OUT_OF_MEMORY;
+        if (LIQ_OK == err) err = liq_histogram_quantize(hist, options->liq, &result);
+        if (LIQ_OK == err) {
+            const liq_palette *result_palette = liq_get_palette(result);
+            palette = liq_fixed_palette_create(options->liq, result_palette->entries, result_palette->count, liq_get_output_gamma(result));
+            if (!palette) err = LIQ_OUT_OF_MEMORY;
+        }
+        liq_result_destroy(result);
+        liq_histogram_destroy(hist);
+        if (LIQ_OK != err) retval = LIQ_QUALITY_TOO_LOW == err ? TOO_LOW_QUALITY : OUT_OF_MEMORY_ERROR;
+    }
 
-                remapped_pixels++;
-                remapping_error += diff;
-            }
+    for(unsigned int i=0; i < num_frames && !retval; i++) {
+        outputs[i].width = frames[i].width;
+        outputs[i].height = frames[i].height;
+        const size_t indexed_size = (size_t)outputs[i].width * outputs[i].height;
+        if (!(outputs[i].indexed_data = malloc(indexed_size))) retval = OUT_OF_MEMORY_ERROR;
+        else stats_mem_add(options->stats, indexed_size);
+    }
 
-            remapped[row*cols + col] = match;
+    if (!retval) {
+        // frames are remapped at the same time, and log callbacks and stats can't be shared by them
+        liq_set_log_callback(frame_attr, NULL, NULL);
+        liq_set_log_flush_callback(frame_attr, NULL, NULL);
+        liq_set_stats(frame_attr, NULL);
+
+        const stats_time start = stats_start(options->stats);
+        task_group group = {0};
+        for(unsigned int i=0; i < num_frames; i++) {
+            remaps[i] = (struct frame_remap){
+                .image = images[i],
+                .output = &outputs[i],
+                .palette = options->fixed_palette ? options->fixed_palette : palette,
+                .attr = frame_attr,
+                .floyd = options->floyd,
+            };
+            taskpool_spawn(&group, frame_remap_task, &remaps[i], false);
+        }
+        taskpool_wait(&group);
+        stats_end(options->stats, STATS_REMAP, start);
 
-            viter_update_color(px, 1.0, map, match, omp_get_thread_num(), average_color);
+        for(unsigned int i=0; i < num_frames; i++) {
+            if (remaps[i].retval) retval = remaps[i].retval;
         }
+        if (!retval) verbose_printf(options, "  remapped %u frames to %u colors", num_frames, outputs[0].num_palette);
     }
 
-    viter_finalize(map, max_threads, average_color);
-
-    nearest_free(n);
-
-    return remapping_error / MAX(1,remapped_pixels);
+    for(unsigned int i=0; images && i < num_frames; i++) {
+        if (images[i]) liq_image_destroy(images[i]);
+    }
+    liq_fixed_palette_destroy(palette);
+    if (frame_attr) liq_attr_destroy(frame_attr);
+    free(images);
+    free(remaps);
+    return retval;
 }
 
-static float distance_from_closest_other_color(const colormap *map, const unsigned int i)
+static pngquant_error pngquant_file_apng(const char *filename, const char *outname, struct pngquant_options *options)
 {
-    float second_best=MAX_DIFF;
-    for(unsigned int j=0; j < map->colors; j++) {
-        if (i == j) continue;
-        float diff = colordifference(map->palette[i].acolor, map->palette[j].acolor);
-        if (diff <= second_best) {
-            second_best = diff;
+    FILE *infile = fopen(filename, "rb");
+    if (!infile) {
+        fprintf(stderr, "  error: cannot open %s for reading\n", filename);
+        return READ_ERROR;
+    }
+
+    apng_info info = {};
+    png24_image *frames = NULL;
+    const stats_time read_start = stats_start(options->stats);
+    pthread_mutex_lock(&libpng_lock);
+    pngquant_error retval = rwpng_read_apng24(infile, &info, &frames);
+    pthread_mutex_unlock(&libpng_lock);
+    fclose(infile);
+    if (retval) {
+        fprintf(stderr, "  error: rwpng_read_apng24() error %d\n", retval);
+        return retval;
+    }
+    for(unsigned int i=0; i < info.num_frames; i++) {
+        stats_mem_add(options->stats, png24_image_size(&frames[i]));
+    }
+    stats_end(options->stats, STATS_READ, read_start);
+
+    verbose_printf(options, "  read %luKB animation of %u frames corrected for gamma %2.1f",
+                   (info.file_size+1023UL)/1024UL, info.num_frames, 1.0/frames[0].gamma);
+
+    png8_image *outputs = calloc(info.num_frames, sizeof(outputs[0]));
+    retval = outputs ? pngquant_process_frames(frames, outputs, info.num_frames, options) : OUT_OF_MEMORY_ERROR;
+
+    if (!retval) {
+        const stats_time write_start = stats_start(options->stats);
+        FILE *outfile = fopen(outname, "wb");
+        if (!outfile) {
+            fprintf(stderr, "  error:  cannot open %s for writing\n", outname);
+            retval = CANT_WRITE_ERROR;
+        } else {
+            const char *outfilename = strrchr(outname, '/');
+            verbose_printf(options, "  writing %d-color animation as %s", outputs[0].num_palette, outfilename ? outfilename+1 : outname);
+
+            pthread_mutex_lock(&libpng_lock);
+            retval = rwpng_write_apng8(outfile, &info, outputs);
+            pthread_mutex_unlock(&libpng_lock);
+            if (retval) fprintf(stderr, "  error: failed writing image to %s\n", outname);
+            fclose(outfile);
         }
+        stats_end(options->stats, STATS_WRITE, write_start);
+    }
+
+    for(unsigned int i=0; i < info.num_frames; i++) {
+        pngquant_image_free(&frames[i], options->stats);
+        if (outputs) pngquant_output_image_free(&outputs[i], options->stats);
     }
-    return second_best;
+    free(frames);
+    free(outputs);
+    rwpng_free_apng_info(&info);
+    return retval;
 }
 
-inline static float min_4(float a, float b, float c, float d)
+struct ladder_remap {
+    char *outname;
+    liq_result *result;
+    liq_image *image; // copy of the file's image, since remapping changes its edge map
+    png8_image output;
+    bool floyd;
+    pngquant_error retval; // TOO_LOW_QUALITY if the rung has no result
+};
+
+static void ladder_remap_task(void *arg)
 {
-    float x = MIN(a,b), y = MIN(c,d);
-    return MIN(x,y);
+    struct ladder_remap *const r = arg;
+    liq_set_dithering_level(r->result, r->floyd ? 1.0f : 0.0f);
+    if (LIQ_OK != liq_write_remapped_image(r->result, r->image, r->output.indexed_data, (size_t)r->output.width * r->output.height)) {
+        r->retval = OUT_OF_MEMORY_ERROR;
+    } else {
+        r->output.gamma = liq_get_output_gamma(r->result);
+        set_output_palette(&r->output, liq_get_palette(r->result));
+    }
 }
 
-inline static f_pixel get_dithered_pixel(const float dither_level, const float max_dither_error, const f_pixel thiserr, const f_pixel px)
+/*
+ Noise/edge maps and the histogram of the image are made once for all rungs. Rungs are quantized largest first,
+ each from the palette of the previous one (liq_histogram_quantize_from()), and then remapped in parallel.
+ Rungs below the --quality minimum are left without output, and the next rung starts from the last one that has it.
+ */
+static pngquant_error pngquant_process_ladder(png24_image *input_image, struct ladder_remap remaps[], struct pngquant_options *options)
 {
-    /* Use Floyd-Steinberg errors to adjust actual color. */
-    const float sr = thiserr.r * dither_level,
-                sg = thiserr.g * dither_level,
-                sb = thiserr.b * dither_level,
-                sa = thiserr.a * dither_level;
+    const unsigned int num_rungs = options->ladder_rungs;
+    const size_t indexed_size = (size_t)input_image->width * input_image->height;
+    const size_t max_memory = liq_get_max_memory(options->liq);
+    const size_t min_memory = png24_image_size(input_image) + indexed_size * num_rungs;
+    if (max_memory && min_memory > max_memory) {
+        fprintf(stderr, "  error: image needs at least %luKB of memory, which exceeds --max-memory\n", (unsigned long)(min_memory+1023)/1024UL);
+        return OUT_OF_MEMORY_ERROR;
+    }
 
-    float ratio = min_4((sr < 0) ? px.r/-sr : (sr > 0) ? (1.0-px.r)/sr : 1.0,
-                        (sg < 0) ? px.g/-sg : (sg > 0) ? (1.0-px.g)/sg : 1.0,
-                        (sb < 0) ? px.b/-sb : (sb > 0) ? (1.0-px.b)/sb : 1.0,
-                        (sa < 0) ? px.a/-sa : (sa > 0) ? (1.0-px.a)/sa : 1.0);
+    liq_image *image = input_image->channels == 3 ?
+        liq_image_create_rgb_rows(options->liq, (void**)input_image->row_pointers, input_image->width, input_image->height, input_image->gamma) :
+        liq_image_create_rgba_rows(options->liq, (void**)input_image->row_pointers, input_image->width, input_image->height, input_image->gamma);
+    liq_histogram *hist = liq_histogram_create(options->liq);
+    liq_attr *rung_attr = liq_attr_copy(options->liq);
+    liq_error err = image && hist && rung_attr ? liq_histogram_add_images(hist, options->liq, &image, 1) : LIQ_OUT_OF_MEMORY;
+
+    // rungs are remapped at the same time, and log callbacks and stats can't be shared by them
+    if (rung_attr) {
+        liq_set_log_callback(rung_attr, NULL, NULL);
+        liq_set_log_flush_callback(rung_attr, NULL, NULL);
+        liq_set_stats(rung_attr, NULL);
+    }
 
-     // If dithering error is crazy high, don't propagate it that much
-     // This prevents crazy geen pixels popping out of the blue (or red or black! ;)
-     const float dither_error = sr*sr + sg*sg + sb*sb + sa*sa;
-     if (dither_error > max_dither_error) {
-         ratio *= 0.8;
-     } else if (dither_error < 2.f/256.f/256.f) {
-        // don't dither areas that don't have noticeable error — makes file smaller
-        return px;
-     }
+    // quality rungs replace only the target of --quality, and its minimum still applies to them
+    const int min_quality = liq_get_min_quality(options->liq);
+
+    const stats_time quantize_start = stats_start(options->stats);
+    const liq_result *larger = NULL;
+    for(unsigned int i=0; i < num_rungs && LIQ_OK == err; i++) {
+        const struct ladder_rung *const rung = &options->ladder[i];
+        if (rung->colors) liq_set_max_colors(rung_attr, rung->colors);
+        else if (LIQ_OK != liq_set_quality(rung_attr, min_quality, rung->quality)) {
+            verbose_printf(options, "  %s: target is below the minimum quality %d", rung->name+1, min_quality);
+            remaps[i].retval = TOO_LOW_QUALITY;
+            continue;
+        }
 
-     if (ratio > 1.0) ratio = 1.0;
-     if (ratio < 0) ratio = 0;
+        const liq_error rung_err = larger ?
+            liq_histogram_quantize_from(hist, rung_attr, larger, &remaps[i].result) :
+            liq_histogram_quantize(hist, rung_attr, &remaps[i].result);
+        if (LIQ_QUALITY_TOO_LOW == rung_err) {
+            verbose_printf(options, "  %s: quality too low", rung->name+1);
+            remaps[i].retval = TOO_LOW_QUALITY;
+        } else if (LIQ_OK != rung_err) {
+            err = rung_err;
+        } else {
+            // the palette itself is final only after remapping
+            if (liq_get_quantization_error(remaps[i].result) >= 0) {
+                verbose_printf(options, "  %s: MSE=%.3f (quality %d)", rung->name+1,
+                               liq_get_quantization_error(remaps[i].result), liq_get_quantization_quality(remaps[i].result));
+            }
+            larger = remaps[i].result;
+        }
+    }
+    stats_end(options->stats, STATS_PALETTE_SEARCH, quantize_start);
+    liq_histogram_destroy(hist);
+
+    for(unsigned int i=0; i < num_rungs && LIQ_OK == err; i++) {
+        if (!remaps[i].result) continue;
+        remaps[i].output.width = input_image->width;
+        remaps[i].output.height = input_image->height;
+        if (!(remaps[i].output.indexed_data = malloc(indexed_size)) || !(remaps[i].image = liq_image_copy(image))) {
+            err = LIQ_OUT_OF_MEMORY;
+        }
+        if (remaps[i].output.indexed_data) stats_mem_add(options->stats, indexed_size);
+    }
+    if (image) liq_image_destroy(image);
+
+    if (LIQ_OK == err) {
+        const stats_time start = stats_start(options->stats);
+        task_group group = {0};
+        for(unsigned int i=0; i < num_rungs; i++) {
+            if (!remaps[i].result) continue;
+            remaps[i].floyd = options->floyd;
+            taskpool_spawn(&group, ladder_remap_task, &remaps[i], false);
+        }
+        taskpool_wait(&group);
+        stats_end(options->stats, STATS_REMAP, start);
+    }
 
-     return (f_pixel){
-         .r=px.r + sr * ratio,
-         .g=px.g + sg * ratio,
-         .b=px.b + sb * ratio,
-         .a=px.a + sa * ratio,
-     };
+    if (rung_attr) liq_attr_destroy(rung_attr);
+    return LIQ_OK == err ? SUCCESS : OUT_OF_MEMORY_ERROR;
 }
 
-/**
-  Uses edge/noise map to apply dithering only to flat areas. Dithering on edges creates jagged lines, and noisy areas are "naturally" dithered.
-
-  If output_image_is_remapped is true, only pixels noticeably changed by error diffusion will be written to output image.
- */
-static void remap_to_palette_floyd(png24_image *input_image, png8_image *output_image, const colormap *map, const float min_opaque_val, const float *dither_map, const int output_image_is_remapped, const float max_dither_error)
+/* --ladder: the file is decoded once, and each rung is written to the file named after it, e.g. image-64-fs8.png */
+static pngquant_error pngquant_file_ladder(const char *filename, const char *newext, struct pngquant_options *options)
 {
-    const rgb_pixel *const *const input_pixels = (const rgb_pixel *const *const)input_image->row_pointers;
-    unsigned char *const remapped = output_image->indexed_data;
-    const unsigned int rows = input_image->height, cols = input_image->width;
-
-    to_f_set_gamma(input_image->gamma);
+    const unsigned int num_rungs = options->ladder_rungs;
+    struct ladder_remap remaps[LADDER_MAX_RUNGS] = {};
+    pngquant_error retval = SUCCESS;
+    for(unsigned int i=0; i < num_rungs; i++) {
+        char ext[sizeof(options->ladder[i].name) + strlen(newext)];
+        snprintf(ext, sizeof(ext), "%s%s", options->ladder[i].name, newext);
+        remaps[i].outname = add_filename_extension(filename, ext);
+        if (!options->force && file_exists(remaps[i].outname)) {
+            fprintf(stderr, "  error:  %s exists; not overwriting\n", remaps[i].outname);
+            retval = NOT_OVERWRITING_ERROR;
+        }
+    }
 
-    const colormap_item *acolormap = map->palette;
+    if (!retval && file_is_apng(filename)) {
+        fputs("  error: animated PNGs can't be converted with --ladder\n", stderr);
+        retval = INVALID_ARGUMENT;
+    }
 
-    struct nearest_map *const n = nearest_init(map);
-    const unsigned int transparent_ind = nearest_search(n, (f_pixel){0,0,0,0}, min_opaque_val, NULL);
+    png24_image input_image = {};
+    if (options->spread_pages) input_image.first_touch = first_touch_rows;
+    if (!retval) {
+        const stats_time start = stats_start(options->stats);
+        retval = read_image(filename, false, &input_image);
+        if (input_image.rgba_data) stats_mem_add(options->stats, png24_image_size(&input_image));
+        stats_end(options->stats, STATS_READ, start);
+    }
 
-    float difference_tolerance[map->colors];
+    if (!retval) {
+        verbose_printf(options, "  read %luKB file corrected for gamma %2.1f",
+                       (input_image.file_size+1023UL)/1024UL, 1.0/input_image.gamma);
+        retval = pngquant_process_ladder(&input_image, remaps, options);
+    }
 
-    if (output_image_is_remapped) for(unsigned int i=0; i < map->colors; i++) {
-            difference_tolerance[i] = distance_from_closest_other_color(map,i) / 4.f; // half of squared distance
+    // rungs that were rejected don't stop the others from being written
+    if (!retval) {
+        const stats_time write_start = stats_start(options->stats);
+        for(unsigned int i=0; i < num_rungs; i++) {
+            pngquant_error rung_retval = remaps[i].retval;
+            if (!rung_retval) rung_retval = write_image(&remaps[i].output, NULL, remaps[i].outname, options);
+            if (rung_retval && (!retval || TOO_LOW_QUALITY == retval)) retval = rung_retval;
         }
+        stats_end(options->stats, STATS_WRITE, write_start);
+    }
 
-    /* Initialize Floyd-Steinberg error vectors. */
-    f_pixel *restrict thiserr, *restrict nexterr;
-    thiserr = malloc((cols + 2) * sizeof(*thiserr));
-    nexterr = malloc((cols + 2) * sizeof(*thiserr));
-    srand(12345); /* deterministic dithering is better for comparing results */
-
-    for (unsigned int col = 0; col < cols + 2; ++col) {
-        const double rand_max = RAND_MAX;
-        thiserr[col].r = ((double)rand() - rand_max/2.0)/rand_max/255.0;
-        thiserr[col].g = ((double)rand() - rand_max/2.0)/rand_max/255.0;
-        thiserr[col].b = ((double)rand() - rand_max/2.0)/rand_max/255.0;
-        thiserr[col].a = ((double)rand() - rand_max/2.0)/rand_max/255.0;
-    }
-
-    bool fs_direction = true;
-    for (unsigned int row = 0; row < rows; ++row) {
-        memset(nexterr, 0, (cols + 2) * sizeof(*nexterr));
-
-        unsigned int col = (fs_direction) ? 0 : (cols - 1);
-
-        do {
-            float dither_level = dither_map ? dither_map[row*cols + col] : 15.f/16.f;
-            const f_pixel spx = get_dithered_pixel(dither_level, max_dither_error, thiserr[col + 1], to_f(input_pixels[row][col]));
-
-            unsigned int ind;
-            if (spx.a < 1.0/256.0) {
-                ind = transparent_ind;
-            } else {
-                unsigned int curr_ind = remapped[row*cols + col];
-                if (output_image_is_remapped && colordifference(map->palette[curr_ind].acolor, spx) < difference_tolerance[curr_ind]) {
-                    ind = curr_ind;
-                } else {
-                    ind = nearest_search(n, spx, min_opaque_val, NULL);
-                }
-            }
-
-            remapped[row*cols + col] = ind;
+    pngquant_image_free(&input_image, options->stats);
+    for(unsigned int i=0; i < num_rungs; i++) {
+        pngquant_output_image_free(&remaps[i].output, options->stats);
+        if (remaps[i].image) liq_image_destroy(remaps[i].image);
+        if (remaps[i].result) liq_result_destroy(remaps[i].result);
+        free(remaps[i].outname);
+    }
+    return retval;
+}
 
-            const f_pixel xp = acolormap[ind].acolor;
-            f_pixel err = {
-                .r = (spx.r - xp.r),
-                .g = (spx.g - xp.g),
-                .b = (spx.b - xp.b),
-                .a = (spx.a - xp.a),
-            };
+/* one line of JSON per file on stdout. Lines of files analyzed in parallel aren't mixed */
+static void write_analysis(const char *filename, const png24_image *image, const double mse[], int count, const double refined_mse[], const struct pngquant_options *options)
+{
+    static pthread_mutex_t analysis_lock = PTHREAD_MUTEX_INITIALIZER;
+    pthread_mutex_lock(&analysis_lock);
+
+    fputs("{\"file\":", stdout);
+    json_write_string(stdout, filename);
+    printf(",\"width\":%u,\"height\":%u,\"mse\":[", (unsigned int)image->width, (unsigned int)image->height);
+    for(int i=0; i < count; i++) {
+        printf("%s%.6g", i ? "," : "", mse[i]);
+    }
+    fputs("],\"refined\":[", stdout);
+    bool first = true;
+    for(unsigned int i=0; i < options->num_refine; i++) {
+        if (refined_mse[i] < 0) continue; // more colors than the image has
+        printf("%s{\"colors\":%d,\"mse\":%.6g}", first ? "" : ",", options->refine_colors[i], refined_mse[i]);
+        first = false;
+    }
+    fputs("]}\n", stdout);
+    fflush(stdout);
 
-            // If dithering error is crazy high, don't propagate it that much
-            // This prevents crazy geen pixels popping out of the blue (or red or black! ;)
-            if (err.r*err.r + err.g*err.g + err.b*err.b + err.a*err.a > max_dither_error) {
-                dither_level *= 0.75;
-            }
+    pthread_mutex_unlock(&analysis_lock);
+}
 
-            const float colorimp = (3.0f + acolormap[ind].acolor.a)/4.0f * dither_level;
-            err.r *= colorimp;
-            err.g *= colorimp;
-            err.b *= colorimp;
-            err.a *= dither_level;
-
-            /* Propagate Floyd-Steinberg error terms. */
-            if (fs_direction) {
-                thiserr[col + 2].a += (err.a * 7.0f) / 16.0f;
-                thiserr[col + 2].r += (err.r * 7.0f) / 16.0f;
-                thiserr[col + 2].g += (err.g * 7.0f) / 16.0f;
-                thiserr[col + 2].b += (err.b * 7.0f) / 16.0f;
-
-                nexterr[col    ].a += (err.a * 3.0f) / 16.0f;
-                nexterr[col    ].r += (err.r * 3.0f) / 16.0f;
-                nexterr[col    ].g += (err.g * 3.0f) / 16.0f;
-                nexterr[col    ].b += (err.b * 3.0f) / 16.0f;
-
-                nexterr[col + 1].a += (err.a * 5.0f) / 16.0f;
-                nexterr[col + 1].r += (err.r * 5.0f) / 16.0f;
-                nexterr[col + 1].g += (err.g * 5.0f) / 16.0f;
-                nexterr[col + 1].b += (err.b * 5.0f) / 16.0f;
-
-                nexterr[col + 2].a += (err.a       ) / 16.0f;
-                nexterr[col + 2].r += (err.r       ) / 16.0f;
-                nexterr[col + 2].g += (err.g       ) / 16.0f;
-                nexterr[col + 2].b += (err.b       ) / 16.0f;
-            } else {
-                thiserr[col    ].a += (err.a * 7.0f) / 16.0f;
-                thiserr[col    ].r += (err.r * 7.0f) / 16.0f;
-                thiserr[col    ].g += (err.g * 7.0f) / 16.0f;
-                thiserr[col    ].b += (err.b * 7.0f) / 16.0f;
-
-                nexterr[col    ].a += (err.a       ) / 16.0f;
-                nexterr[col    ].r += (err.r       ) / 16.0f;
-                nexterr[col    ].g += (err.g       ) / 16.0f;
-                nexterr[col    ].b += (err.b       ) / 16.0f;
-
-                nexterr[col + 1].a += (err.a * 5.0f) / 16.0f;
-                nexterr[col + 1].r += (err.r * 5.0f) / 16.0f;
-                nexterr[col + 1].g += (err.g * 5.0f) / 16.0f;
-                nexterr[col + 1].b += (err.b * 5.0f) / 16.0f;
-
-                nexterr[col + 2].a += (err.a * 3.0f) / 16.0f;
-                nexterr[col + 2].r += (err.r * 3.0f) / 16.0f;
-                nexterr[col + 2].g += (err.g * 3.0f) / 16.0f;
-                nexterr[col + 2].b += (err.b * 3.0f) / 16.0f;
-            }
+/*
+ --analyze: the image's histogram is made as usual, and one median cut run gives MSE of every number of colors
+ (mse[n-1] is for n colors). Palettes of --analyze=list sizes are refined as well. Nothing is remapped or written.
+ */
+static pngquant_error pngquant_file_analyze(const char *filename, struct pngquant_options *options)
+{
+    png24_image input_image = {};
+    const stats_time start = stats_start(options->stats);
+    pngquant_error retval = read_image(filename, options->using_stdin, &input_image);
+    if (input_image.rgba_data) stats_mem_add(options->stats, png24_image_size(&input_image));
+    stats_end(options->stats, STATS_READ, start);
 
-            // remapping is done in zig-zag
-            if (fs_direction) {
-                ++col;
-                if (col >= cols) break;
-            } else {
-                if (col <= 0) break;
-                --col;
-            }
+    if (!retval) {
+        verbose_printf(options, "  read %luKB file corrected for gamma %2.1f",
+                       (input_image.file_size+1023UL)/1024UL, 1.0/input_image.gamma);
+
+        liq_image *image = input_image.channels == 3 ?
+            liq_image_create_rgb_rows(options->liq, (void**)input_image.row_pointers, input_image.width, input_image.height, input_image.gamma) :
+            liq_image_create_rgba_rows(options->liq, (void**)input_image.row_pointers, input_image.width, input_image.height, input_image.gamma);
+        liq_histogram *hist = liq_histogram_create(options->liq);
+
+        double mse[256], refined_mse[256];
+        int count = 0;
+        liq_error err = image && hist ? liq_histogram_add_images(hist, options->liq, &image, 1) : LIQ_OUT_OF_MEMORY;
+        if (LIQ_OK == err) err = liq_histogram_analyze(hist, options->liq, mse, &count, options->refine_colors, options->num_refine, refined_mse);
+        if (LIQ_OK == err) {
+            write_analysis(filename, &input_image, mse, count, refined_mse, options);
+        } else {
+            retval = OUT_OF_MEMORY_ERROR;
         }
-        while(1);
 
-        f_pixel *const temperr = thiserr;
-        thiserr = nexterr;
-        nexterr = temperr;
-        fs_direction = !fs_direction;
+        liq_histogram_destroy(hist);
+        if (image) liq_image_destroy(image);
     }
 
-    free(thiserr);
-    free(nexterr);
-    nearest_free(n);
+    pngquant_image_free(&input_image, options->stats);
+    return retval;
 }
 
-static bool file_exists(const char *outname)
+/* frame and its output are kept for comparison with the next frame, instead of being freed */
+static void sequence_keep_frame(struct sequence_state *sequence, png24_image *input_image, png8_image *output_image, struct liq_stats *stats)
 {
-    FILE *outfile = fopen(outname, "rb");
-    if ((outfile ) != NULL) {
-        fclose(outfile);
-        return true;
-    }
-    return false;
+    pngquant_image_free(&sequence->frame, NULL);
+    pngquant_output_image_free(&sequence->output, NULL);
+
+    // the file's stats end here, and the frame's memory isn't counted in the next file's stats
+    stats_mem_sub(stats, png24_image_size(input_image) + (size_t)output_image->width * output_image->height);
+    sequence->frame = *input_image;
+    sequence->output = *output_image;
+    input_image->rgba_data = NULL; input_image->row_pointers = NULL;
+    output_image->indexed_data = NULL;
 }
 
-/* build the output filename from the input name by inserting "-fs8" or
- * "-or8" before the ".png" extension (or by appending that plus ".png" if
- * there isn't any extension), then make sure it doesn't exist already */
-static char *add_filename_extension(const char *filename, const char *newext)
-{
-    size_t x = strlen(filename);
-
-    char* outname = malloc(x+4+strlen(newext)+1);
+struct dirty_rect {
+    unsigned int left, top, width, height;
+};
 
-    strncpy(outname, filename, x);
-    if (strncmp(outname+x-4, ".png", 4) == 0)
-        strcpy(outname+x-4, newext);
-    else
-        strcpy(outname+x, newext);
+/* pixels that differ from the previous frame, as one rectangle per band of rows */
+static unsigned int sequence_find_changes(const png24_image *frame, const png24_image *prev, struct dirty_rect rects[], size_t *changed_pixels)
+{
+    const size_t rowbytes = (size_t)frame->width * frame->channels;
+    unsigned int num_rects = 0;
+    *changed_pixels = 0;
+
+    for(unsigned int top = 0; top < frame->height; top += SEQUENCE_BAND_ROWS) {
+        const unsigned int bottom = MIN(top + SEQUENCE_BAND_ROWS, frame->height);
+        size_t first = rowbytes, last = 0; // bytes, [first, last)
+        for(unsigned int row = top; row < bottom; row++) {
+            const unsigned char *const a = frame->row_pointers[row], *const b = prev->row_pointers[row];
+            if (!memcmp(a, b, rowbytes)) continue;
+
+            size_t i = 0, j = rowbytes;
+            while (a[i] == b[i]) i++;
+            while (a[j-1] == b[j-1]) j--;
+            first = MIN(first, i);
+            last = MAX(last, j);
+        }
+        if (first < last) {
+            const unsigned int left = first / frame->channels, right = (last + frame->channels-1) / frame->channels;
+            rects[num_rects++] = (struct dirty_rect){.left = left, .top = top, .width = right - left, .height = bottom - top};
+            *changed_pixels += (size_t)(right - left) * (bottom - top);
+        }
+    }
+    return num_rects;
+}
 
-    return outname;
+/* rows of a rectangle of the frame, as an image of its own */
+static liq_image *sequence_rect_image(const png24_image *frame, const struct dirty_rect *rect, unsigned char **rows, const struct pngquant_options *options)
+{
+    for(unsigned int y = 0; y < rect->height; y++) {
+        rows[y] = frame->row_pointers[rect->top + y] + (size_t)rect->left * frame->channels;
+    }
+    return frame->channels == 3 ?
+        liq_image_create_rgb_rows(options->liq, (void**)rows, rect->width, rect->height, frame->gamma) :
+        liq_image_create_rgba_rows(options->liq, (void**)rows, rect->width, rect->height, frame->gamma);
 }
 
-static void set_binary_mode(FILE *fp)
+/* error of the palette on all changed pixels together, as the library would measure it on one image with all of them */
+static liq_error sequence_palette_error(const liq_fixed_palette *palette, const png24_image *frame, const struct dirty_rect rects[], unsigned int num_rects,
+                                        unsigned char **rows, double *error_out, const struct pngquant_options *options)
 {
-#if defined(WIN32) || defined(__WIN32__)
-    setmode(fp == stdout ? 1 : 0, O_BINARY);
-#endif
+    liq_error result = LIQ_OK;
+    double error_sum = 0;
+    size_t pixels = 0;
+    for(unsigned int r = 0; r < num_rects; r++) {
+        liq_image *image = sequence_rect_image(frame, &rects[r], &rows[rects[r].top], options);
+        if (!image) return LIQ_OUT_OF_MEMORY;
+
+        double error;
+        const liq_error err = liq_fixed_palette_error(palette, image, options->liq, &error);
+        liq_image_destroy(image);
+        if (LIQ_QUALITY_TOO_LOW == err) result = err;
+        else if (LIQ_OK != err) return err;
+
+        error_sum += error * rects[r].width * rects[r].height;
+        pixels += (size_t)rects[r].width * rects[r].height;
+    }
+    *error_out = pixels ? error_sum / pixels : 0;
+    return result;
 }
 
-static pngquant_error write_image(png8_image *output_image, png24_image *output_image24, const char *outname, struct pngquant_options *options)
+/*
+ With --sequence a frame of the same size as the previous one is compared with it, and only rectangles that changed
+ are remapped, to the previous palette. Indices of unchanged pixels are copied from the previous output.
+ The palette is kept while the frame's error (previous frame's, with changed pixels' error mixed in) stays close
+ to the keyframe's and the changed pixels are within --quality; otherwise the whole frame becomes a new keyframe.
+ */
+static pngquant_error sequence_process_image(png24_image *input_image, png8_image *output_image, struct pngquant_options *options)
 {
-    FILE *outfile;
-    if (options->using_stdin) {
-        set_binary_mode(stdout);
-        outfile = stdout;
+    struct sequence_state *const sequence = options->sequence;
+    const png24_image *const prev = &sequence->frame;
+    const liq_fixed_palette *const palette = options->fixed_palette ? options->fixed_palette : sequence->palette;
 
-        if (output_image) {
-            verbose_printf(options, "  writing %d-color image to stdout", output_image->num_palette);
-        } else {
-            verbose_print(options, "  writing truecolor image to stdout");
+    if (!palette || !prev->rgba_data || prev->width != input_image->width || prev->height != input_image->height ||
+        prev->channels != input_image->channels || prev->gamma != input_image->gamma) {
+        return pngquant_process_image(input_image, output_image, options);
+    }
+
+    const unsigned int max_rects = (input_image->height + SEQUENCE_BAND_ROWS-1) / SEQUENCE_BAND_ROWS;
+    struct dirty_rect *rects = malloc(max_rects * sizeof(rects[0]));
+    unsigned char **rows = malloc(input_image->height * sizeof(rows[0]));
+    unsigned char **output_rows = malloc(input_image->height * sizeof(output_rows[0]));
+    if (!rects || !rows || !output_rows) {
+        free(rects); free(rows); free(output_rows);
+        return OUT_OF_MEMORY_ERROR;
+    }
+
+    size_t changed_pixels;
+    const unsigned int num_rects = sequence_find_changes(input_image, prev, rects, &changed_pixels);
+
+    // --map palette is used regardless of error
+    if (num_rects && !options->fixed_palette) {
+        if (sequence->palette_error < 0) {
+            // not known from quantization (e.g. at high speed), so it's measured on the keyframe
+            const struct dirty_rect whole = {.width = prev->width, .height = prev->height};
+            const liq_error err = sequence_palette_error(palette, prev, &whole, 1, rows, &sequence->palette_error, options);
+            if (LIQ_OK != err && LIQ_QUALITY_TOO_LOW != err) sequence->palette_error = 0;
+            sequence->frame_error = sequence->palette_error;
         }
-    } else {
 
-        if ((outfile = fopen(outname, "wb")) == NULL) {
-            fprintf(stderr, "  error:  cannot open %s for writing\n", outname);
-            return CANT_WRITE_ERROR;
+        double changed_error = 0; // not set if measuring runs out of memory
+        const liq_error err = sequence_palette_error(palette, input_image, rects, num_rects, rows, &changed_error, options);
+        const double changed = (double)changed_pixels / ((size_t)input_image->width * input_image->height);
+        const double frame_error = sequence->frame_error * (1.0 - changed) + changed_error * changed;
+        const double max_error = sequence->palette_error * SEQUENCE_ERROR_GROWTH + SEQUENCE_ERROR_MARGIN;
+        if (LIQ_OK != err || frame_error > max_error) {
+            if (LIQ_QUALITY_TOO_LOW == err) {
+                verbose_printf(options, "  changed pixels have MSE=%.3f with previous palette, below quality limit; making a new one", changed_error);
+            } else if (LIQ_OK == err) {
+                verbose_printf(options, "  estimated MSE=%.3f with previous palette (limit %.3f), making a new one", frame_error, max_error);
+            }
+            free(rects); free(rows); free(output_rows);
+            return pngquant_process_image(input_image, output_image, options);
         }
+        sequence->frame_error = frame_error;
+    }
 
-        const char *outfilename = strrchr(outname, '/');
-        if (outfilename) outfilename++; else outfilename = outname;
+    const size_t indexed_size = (size_t)input_image->width * input_image->height;
+    *output_image = sequence->output;
+    output_image->indexed_data = malloc(indexed_size);
+    if (!output_image->indexed_data) {
+        free(rects); free(rows); free(output_rows);
+        return OUT_OF_MEMORY_ERROR;
+    }
+    stats_mem_add(options->stats, indexed_size);
+    memcpy(output_image->indexed_data, sequence->output.indexed_data, indexed_size);
+
+    pngquant_error retval = SUCCESS;
+    for(unsigned int r = 0; r < num_rects && !retval; r++) {
+        const struct dirty_rect *rect = &rects[r];
+        for(unsigned int y = 0; y < rect->height; y++) {
+            output_rows[y] = output_image->indexed_data + (size_t)(rect->top + y) * output_image->width + rect->left;
+        }
 
-        if (output_image) {
-            verbose_printf(options, "  writing %d-color image as %s", output_image->num_palette, outfilename);
+        liq_image *image = sequence_rect_image(input_image, rect, rows, options);
+        liq_result *remap = image ? liq_result_create_fixed(options->liq, palette) : NULL;
+        if (!remap) {
+            retval = OUT_OF_MEMORY_ERROR;
         } else {
-            verbose_printf(options, "  writing truecolor image as %s", outfilename);
+            liq_set_dithering_level(remap, options->floyd ? 1.0f : 0.0f);
+            if (LIQ_OK != liq_write_remapped_image_rows(remap, image, output_rows)) retval = OUT_OF_MEMORY_ERROR;
         }
+        liq_result_destroy(remap);
+        if (image) liq_image_destroy(image);
     }
 
-    pngquant_error retval;
-    #pragma omp critical (libpng)
-    {
-        if (output_image) {
-            retval = rwpng_write_image8(outfile, output_image);
+    if (num_rects) {
+        verbose_printf(options, "  remapped %u changed rectangle%s (%.1f%% of pixels) to previous palette",
+                       num_rects, num_rects == 1 ? "" : "s", 100.0 * changed_pixels / indexed_size);
+    } else {
+        verbose_printf(options, "  same as previous frame");
+    }
+
+    free(rects); free(rows); free(output_rows);
+    return retval;
+}
+
+/*
+ Daemon mode keeps the process (and the thread pool with its malloc arenas) alive between images.
+
+ Requests and responses are framed with 32-bit big-endian lengths:
+    request:  <options length> <options, e.g. "64 --speed 5 --nofs"> <PNG length> <PNG data>
+    response: <pngquant_error status> <PNG length> <PNG data, empty unless status is 0>
+ */
+#if !defined(WIN32) && !defined(__WIN32__)
+
+#define DAEMON_MAX_OPTIONS_SIZE 4096
+#define DAEMON_MAX_PNG_SIZE (256UL<<20) /* without --max-memory */
+
+static char *next_token(char **str)
+{
+    char *s = *str;
+    while (*s == ' ' || *s == '\t' || *s == '\r' || *s == '\n') s++;
+    if (!*s) return NULL;
+
+    char *token = s;
+    while (*s && *s != ' ' && *s != '\t' && *s != '\r' && *s != '\n') s++;
+    if (*s) *s++ = '\0';
+
+    *str = s;
+    return token;
+}
+
+/* subset of command-line options that can be changed per request */
+static bool parse_request_options(char *str, struct pngquant_options *options)
+{
+    char *arg;
+    while ((arg = next_token(&str))) {
+        char *value = strchr(arg, '=');
+        if (value) *value++ = '\0';
+
+        if (0 == strcmp(arg, "--speed") || 0 == strcmp(arg, "-s")) {
+            if (!value && !(value = next_token(&str))) return false;
+            if (LIQ_OK != liq_set_speed(options->liq, atoi(value))) return false;
+        } else if (0 == strcmp(arg, "--quality")) {
+            if (!value && !(value = next_token(&str))) return false;
+            if (!parse_quality(value, options->liq)) return false;
+        } else if (0 == strcmp(arg, "--nofs") || 0 == strcmp(arg, "--ordered")) {
+            options->floyd = false;
+        } else if (0 == strcmp(arg, "--floyd")) {
+            options->floyd = true;
+        } else if (0 == strcmp(arg, "--iebug")) {
+            liq_set_min_opacity(options->liq, 238);
+        } else if (0 == strcmp(arg, "--transbug")) {
+            liq_set_last_index_transparent(options->liq, true);
         } else {
-            retval = rwpng_write_image24(outfile, output_image24);
+            char *end;
+            unsigned long colors = strtoul(arg, &end, 10);
+            if (end == arg || *end || LIQ_OK != liq_set_max_colors(options->liq, MIN(colors, 257))) return false;
         }
     }
+    return true;
+}
 
-    if (retval) {
-        fprintf(stderr, "  error: failed writing image to %s\n", outname);
+static bool read_full(int fd, void *buf, size_t len)
+{
+    unsigned char *p = buf;
+    while (len) {
+        ssize_t res = read(fd, p, len);
+        if (res < 0 && errno == EINTR) continue;
+        if (res <= 0) return false;
+        p += res; len -= res;
     }
+    return true;
+}
 
-    if (!options->using_stdin)
-        fclose(outfile);
+/* reads and discards len bytes */
+static bool skip_full(int fd, size_t len)
+{
+    unsigned char buf[1<<16];
+    while (len) {
+        const size_t chunk = MIN(len, sizeof(buf));
+        if (!read_full(fd, buf, chunk)) return false;
+        len -= chunk;
+    }
+    return true;
+}
 
-    return retval;
+static bool write_full(int fd, const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+    while (len) {
+        ssize_t res = write(fd, p, len);
+        if (res < 0 && errno == EINTR) continue;
+        if (res <= 0) return false;
+        p += res; len -= res;
+    }
+    return true;
 }
 
-/* histogram contains information how many times each color is present in the image, weighted by importance_map */
-static histogram *get_histogram(pngquant_image *input_image, struct pngquant_options *options)
+static bool read_u32(int fd, uint32_t *val)
 {
-    unsigned int ignorebits=0;
-    const rgb_pixel **input_pixels = (const rgb_pixel **)input_image->rwpng_image.row_pointers;
-    const unsigned int cols = input_image->rwpng_image.width, rows = input_image->rwpng_image.height;
+    unsigned char b[4];
+    if (!read_full(fd, b, 4)) return false;
+    *val = (uint32_t)b[0]<<24 | (uint32_t)b[1]<<16 | (uint32_t)b[2]<<8 | b[3];
+    return true;
+}
 
-   /*
-    ** Step 2: attempt to make a histogram of the colors, unclustered.
-    ** If at first we don't succeed, increase ignorebits to increase color
-    ** coherence and try again.
-    */
+static bool write_u32(int fd, uint32_t val)
+{
+    const unsigned char b[4] = {val>>24, val>>16, val>>8, val};
+    return write_full(fd, b, 4);
+}
 
-    if (options->speed_tradeoff > 7) ignorebits++;
-    unsigned int maxcolors = (1<<17) + (1<<18)*(10-options->speed_tradeoff);
+static pngquant_error daemon_process_request(char *optstr, const unsigned char *png_data, size_t png_size, struct pngquant_options *options, rwpng_buffer *out)
+{
+    if (!parse_request_options(optstr, options)) {
+        return INVALID_ARGUMENT;
+    }
 
-    struct acolorhash_table *acht = pam_allocacolorhash(maxcolors, rows*cols, ignorebits);
-    for (; ;) {
+    png24_image input_image = {};
+    pngquant_error retval;
+    const stats_time read_start = stats_start(options->stats);
+    pthread_mutex_lock(&libpng_lock);
+    retval = rwpng_read_image24_buffer(png_data, png_size, &input_image);
+    pthread_mutex_unlock(&libpng_lock);
+    if (input_image.rgba_data) stats_mem_add(options->stats, png24_image_size(&input_image));
+    stats_end(options->stats, STATS_READ, read_start);
 
-        // histogram uses noise contrast map for importance. Color accuracy in noisy areas is not very important.
-        // noise map does not include edges to avoid ruining anti-aliasing
-        if (pam_computeacolorhash(acht, input_pixels, cols, rows, input_image->noise)) {
-            break;
-        }
+    png8_image output_image = {};
+    if (!retval) {
+        verbose_printf(options, "  read %luKB request corrected for gamma %2.1f",
+                       (input_image.file_size+1023UL)/1024UL, 1.0/input_image.gamma);
 
-        ignorebits++;
-        verbose_print(options, "  too many colors! Scaling colors to improve clustering...");
-        pam_freeacolorhash(acht);
-        acht = pam_allocacolorhash(maxcolors, rows*cols, ignorebits);
+        retval = pngquant_process_image(&input_image, &output_image, options);
     }
 
-    if (input_image->noise) {
-        free(input_image->noise);
-        input_image->noise = NULL;
+    if (!retval) {
+        verbose_printf(options, "  writing %d-color image", output_image.num_palette);
+        const stats_time write_start = stats_start(options->stats);
+        pthread_mutex_lock(&libpng_lock);
+        retval = rwpng_write_image8_buffer(out, &output_image);
+        pthread_mutex_unlock(&libpng_lock);
+        stats_end(options->stats, STATS_WRITE, write_start);
     }
 
-    histogram *hist = pam_acolorhashtoacolorhist(acht, input_image->rwpng_image.gamma);
-    pam_freeacolorhash(acht);
+    pngquant_image_free(&input_image, options->stats);
+    pngquant_output_image_free(&output_image, options->stats);
 
-    verbose_printf(options, "  made histogram...%d colors found", hist->size);
-    return hist;
+    if (retval) out->size = 0;
+    return retval;
 }
 
-static void modify_alpha(png24_image *input_image, const float min_opaque_val)
+/* handles requests until EOF or protocol error. Concurrent connections buffer their log messages */
+static void daemon_serve(int infd, int outfd, const struct pngquant_options *defaults, bool concurrent)
 {
-    /* IE6 makes colors with even slightest transparency completely transparent,
-       thus to improve situation in IE, make colors that are less than ~10% transparent
-       completely opaque */
+    uint32_t options_size, png_size;
+    while (read_u32(infd, &options_size)) {
+        if (options_size > DAEMON_MAX_OPTIONS_SIZE) break;
+
+        char optstr[options_size+1];
+        if (!read_full(infd, optstr, options_size) || !read_u32(infd, &png_size)) break;
+        optstr[options_size] = '\0';
+
+        // length comes from the client, so it isn't trusted with an allocation larger than the memory limit
+        const size_t max_png_size = liq_get_max_memory(defaults->liq) ? liq_get_max_memory(defaults->liq) : DAEMON_MAX_PNG_SIZE;
+        if (png_size > max_png_size) {
+            // data is still read, so that the next request can follow
+            if (!skip_full(infd, png_size) || !write_u32(outfd, OUT_OF_MEMORY_ERROR) || !write_u32(outfd, 0)) break;
+            continue;
+        }
 
-    rgb_pixel *const *const input_pixels = (rgb_pixel **)input_image->row_pointers;
-    const unsigned int rows = input_image->height, cols = input_image->width;
-    const float gamma = input_image->gamma;
-    to_f_set_gamma(gamma);
+        unsigned char *png_data = malloc(png_size ? png_size : 1);
+        if (!png_data) break;
+        if (!read_full(infd, png_data, png_size)) {
+            free(png_data);
+            break;
+        }
 
-    const float almost_opaque_val = min_opaque_val * 169.f/256.f;
-    const unsigned int almost_opaque_val_int = almost_opaque_val*255.f;
+        struct pngquant_options opts = *defaults;
+        opts.liq = liq_attr_copy(defaults->liq);
+        if (!opts.liq) {
+            free(png_data);
+            break;
+        }
+        struct buffered_log buf = {};
+        if (opts.log_callback && concurrent) {
+            opts.log_callback = log_callback_buferred;
+            opts.log_callback_flush = log_callback_buferred_flush;
+            opts.log_callback_context = &buf;
+            set_log_callbacks(&opts);
+        }
 
+        struct liq_stats stats = {};
+        if (wants_stats(&opts)) {
+            opts.stats = &stats;
+            liq_set_stats(opts.liq, &stats);
+            if (opts.hw_counters) stats_hw_open(&stats);
+        }
 
-    for(unsigned int row = 0; row < rows; ++row) {
-        for(unsigned int col = 0; col < cols; col++) {
-            const rgb_pixel srcpx = input_pixels[row][col];
+        verbose_print(&opts, "request:");
+        rwpng_buffer out = {};
+        trace_begin("request");
+        pngquant_error retval = daemon_process_request(optstr, png_data, png_size, &opts, &out);
+        trace_end("request");
+        free(png_data);
+        verbose_print_counters(&opts);
+        verbose_printf_flush(&opts);
+        liq_attr_destroy(opts.liq);
+        write_stats(&opts, "request", retval);
+        stats_hw_close(&stats);
 
-            /* ie bug: to avoid visible step caused by forced opaqueness, linearily raise opaqueness of almost-opaque colors */
-            if (srcpx.a >= almost_opaque_val_int) {
-                f_pixel px = to_f(srcpx);
+        const bool sent = write_u32(outfd, retval) && write_u32(outfd, out.size) && write_full(outfd, out.data, out.size);
+        free(out.data);
+        if (!sent) break;
+    }
+}
 
-                float al = almost_opaque_val + (px.a-almost_opaque_val) * (1-almost_opaque_val) / (min_opaque_val-almost_opaque_val);
-                if (al > 1) al = 1;
-                px.a = al;
-                input_pixels[row][col].a = to_rgb(gamma, px).a;
-            }
+struct daemon_listener {
+    int fd;
+    const struct pngquant_options *options;
+    bool concurrent;
+};
+
+static void daemon_accept_task(void *arg)
+{
+    const struct daemon_listener *listener = arg;
+    for(;;) {
+        const int fd = accept(listener->fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            break;
         }
+        daemon_serve(fd, fd, listener->options, listener->concurrent);
+        close(fd);
     }
 }
 
-static pngquant_error read_image(const char *filename, int using_stdin, png24_image *input_image_p)
+static int pngquant_daemon(const char *socket_path, const struct pngquant_options *options)
 {
-    FILE *infile;
+    signal(SIGPIPE, SIG_IGN); // disconnecting client must not kill the daemon
 
-    if (using_stdin) {
-        set_binary_mode(stdin);
-        infile = stdin;
-    } else if ((infile = fopen(filename, "rb")) == NULL) {
-        fprintf(stderr, "  error: cannot open %s for reading\n", filename);
-        return READ_ERROR;
+    if (!socket_path) {
+        daemon_serve(STDIN_FILENO, STDOUT_FILENO, options, false);
+        return SUCCESS;
     }
 
-    pngquant_error retval;
-    #pragma omp critical (libpng)
-    {
-            retval = rwpng_read_image24(infile, input_image_p);
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "  error: socket path %s is too long\n", socket_path);
+        return INVALID_ARGUMENT;
     }
+    strcpy(addr.sun_path, socket_path);
 
-    if (!using_stdin)
-        fclose(infile);
+    // socket left over from previous run would make bind() fail
+    struct stat st;
+    if (0 == stat(socket_path, &st) && S_ISSOCK(st.st_mode)) {
+        unlink(socket_path);
+    }
 
-    if (retval) {
-        fprintf(stderr, "  error: rwpng_read_image() error %d\n", retval);
-        return retval;
+    const int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(listen_fd, 64)) {
+        fprintf(stderr, "  error: cannot listen on %s\n", socket_path);
+        if (listen_fd >= 0) close(listen_fd);
+        return CANT_WRITE_ERROR;
     }
 
-    return SUCCESS;
-}
+    const unsigned int workers = taskpool_threads();
+    verbose_printf(options, "listening on %s with %u worker%s", socket_path, workers, workers == 1 ? "" : "s");
 
-/**
- Builds two maps:
-    noise - approximation of areas with high-frequency noise, except straight edges. 1=flat, 0=noisy.
-    edges - noise map including all edges
- */
-static void contrast_maps(const rgb_pixel*const apixels[], const unsigned int cols, const unsigned int rows, const double gamma, float **noiseP, float **edgesP)
-{
-    float *restrict noise = malloc(sizeof(float)*cols*rows);
-    float *restrict tmp = malloc(sizeof(float)*cols*rows);
-    float *restrict edges = malloc(sizeof(float)*cols*rows);
-
-    to_f_set_gamma(gamma);
-
-    for (unsigned int j=0; j < rows; j++) {
-        f_pixel prev, curr = to_f(apixels[j][0]), next=curr;
-        for (unsigned int i=0; i < cols; i++) {
-            prev=curr;
-            curr=next;
-            next = to_f(apixels[j][MIN(cols-1,i+1)]);
-
-            // contrast is difference between pixels neighbouring horizontally and vertically
-            const float a = fabsf(prev.a+next.a - curr.a*2.f),
-            r = fabsf(prev.r+next.r - curr.r*2.f),
-            g = fabsf(prev.g+next.g - curr.g*2.f),
-            b = fabsf(prev.b+next.b - curr.b*2.f);
-
-            const f_pixel prevl = to_f(apixels[MIN(rows-1,j+1)][i]);
-            const f_pixel nextl = to_f(apixels[j > 1 ? j-1 : 0][i]);
-
-            const float a1 = fabsf(prevl.a+nextl.a - curr.a*2.f),
-            r1 = fabsf(prevl.r+nextl.r - curr.r*2.f),
-            g1 = fabsf(prevl.g+nextl.g - curr.g*2.f),
-            b1 = fabsf(prevl.b+nextl.b - curr.b*2.f);
-
-            const float horiz = MAX(MAX(a,r),MAX(g,b));
-            const float vert = MAX(MAX(a1,r1),MAX(g1,b1));
-            const float edge = MAX(horiz,vert);
-            float z = edge - fabsf(horiz-vert)*.5f;
-            z = 1.f - MAX(z,MIN(horiz,vert));
-            z *= z; // noise is amplified
-            z *= z;
-
-            noise[j*cols+i] = z;
-            edges[j*cols+i] = 1.f-edge;
-        }
+    // each worker serves one connection at a time
+    struct daemon_listener listener = {.fd = listen_fd, .options = options, .concurrent = workers > 1};
+    task_group connections = {0};
+    for(unsigned int i=0; i < workers; i++) {
+        taskpool_spawn(&connections, daemon_accept_task, &listener, false);
     }
+    taskpool_wait(&connections);
 
-    // noise areas are shrunk and then expanded to remove thin edges from the map
-    max3(noise, tmp, cols, rows);
-    max3(tmp, noise, cols, rows);
+    close(listen_fd);
+    return SUCCESS;
+}
 
-    blur(noise, tmp, noise, cols, rows, 3);
+#else
 
-    max3(noise, tmp, cols, rows);
+static int pngquant_daemon(const char *socket_path, const struct pngquant_options *options)
+{
+    fputs("--daemon is not supported on this platform.\n", stderr);
+    return INVALID_ARGUMENT;
+}
 
-    min3(tmp, noise, cols, rows);
-    min3(noise, tmp, cols, rows);
-    min3(tmp, noise, cols, rows);
+#endif
 
-    min3(edges, tmp, cols, rows);
-    max3(tmp, edges, cols, rows);
-    for(unsigned int i=0; i < cols*rows; i++) edges[i] = MIN(noise[i], edges[i]);
+/*
+ --shards: a giant image is split in bands of rows, each processed by a worker process. A worker decodes only
+ its rows, makes noise/edge maps and a histogram of them, and writes the serialized histogram to a temporary file.
+ The coordinator merges the histograms in order, quantizes them once and sends the palette to all workers
+ through pipes. Workers remap their rows to the palette, as a fixed one that remapping doesn't change, and write
+ them to another temporary file, from which the coordinator stitches rows of all bands into one PNG.
 
-    free(tmp);
+ Floyd-Steinberg error isn't carried across seams: each band starts diffusing from its top row, like a whole image
+ does. Bands start on even rows, so the serpentine scan goes the same way it would in the whole image. The output
+ depends only on the image and the number of shards, not on timing or the number of threads.
+ */
+#if !defined(WIN32) && !defined(__WIN32__)
 
-    *noiseP = noise;
-    *edgesP = edges;
-}
+struct shard {
+    png_uint_32 first_row, num_rows;
+    FILE *histogram_file, *rows_file; // temporary files written by the worker and read by the coordinator
+    int command_pipe[2], status_pipe[2]; // coordinator sends the palette, worker replies when its histogram is ready
+    pid_t pid;
+};
 
-/**
- * Builds map of neighbor pixels mapped to the same palette entry
- *
- * For efficiency/simplicity it mainly looks for same consecutive pixels horizontally
- * and peeks 1 pixel above/below. Full 2d algorithm doesn't improve it significantly.
- * Correct flood fill doesn't have visually good properties.
- */
-static void update_dither_map(const png8_image *output_image, float *edges)
+/* sent to every worker once histograms are merged. Workers exit without remapping if status isn't SUCCESS */
+struct shard_command {
+    int32_t status;
+    double gamma;
+    liq_palette palette; // colors for liq_fixed_palette_create(), unused with --map
+};
+
+static pngquant_error shard_worker(const char *filename, const struct shard *shard, const struct pngquant_options *options)
 {
-    const unsigned int width = output_image->width;
-    const unsigned int height = output_image->height;
-    const unsigned char *restrict pixels = output_image->indexed_data;
+    FILE *infile = fopen(filename, "rb");
+    if (!infile) return READ_ERROR;
 
-    for(unsigned int row=0; row < height; row++) {
-        unsigned char lastpixel = pixels[row*width];
-        unsigned int lastcol=0;
+    png24_image input_image = {};
+    pngquant_error retval = rwpng_read_image24_rows(infile, &input_image, shard->first_row, shard->num_rows);
+    fclose(infile);
 
-        for(unsigned int col=1; col < width; col++) {
-            const unsigned char px = pixels[row*width + col];
+    liq_image *image = NULL;
+    if (!retval) {
+        image = input_image.channels == 3 ?
+            liq_image_create_rgb_rows(options->liq, (void**)input_image.row_pointers, input_image.width, input_image.height, input_image.gamma) :
+            liq_image_create_rgba_rows(options->liq, (void**)input_image.row_pointers, input_image.width, input_image.height, input_image.gamma);
+        if (!image) retval = OUT_OF_MEMORY_ERROR;
+    }
 
-            if (px != lastpixel || col == width-1) {
-                float neighbor_count = 2.5f + col-lastcol;
+    // noise and edge maps stay in the image for dithering
+    if (!retval && !options->fixed_palette) {
+        liq_histogram *hist = liq_histogram_create(options->liq);
+        void *data = NULL;
+        size_t size = 0;
+        liq_error err = hist ? liq_histogram_add_images(hist, options->liq, &image, 1) : LIQ_OUT_OF_MEMORY;
+        if (LIQ_OK == err) {
+            size = liq_histogram_serialized_size(hist);
+            err = (data = malloc(size)) ? liq_histogram_serialize(hist, data, size) : LIQ_OUT_OF_MEMORY;
+        }
+        if (LIQ_OK != err) {
+            retval = OUT_OF_MEMORY_ERROR;
+        } else if (1 != fwrite(data, size, 1, shard->histogram_file) || fflush(shard->histogram_file)) {
+            retval = CANT_WRITE_ERROR;
+        }
+        free(data);
+        liq_histogram_destroy(hist);
+    }
 
-                unsigned int i=lastcol;
-                while(i < col) {
-                    if (row > 0) {
-                        unsigned char pixelabove = pixels[(row-1)*width + i];
-                        if (pixelabove == lastpixel) neighbor_count += 1.f;
-                    }
-                    if (row < height-1) {
-                        unsigned char pixelbelow = pixels[(row+1)*width + i];
-                        if (pixelbelow == lastpixel) neighbor_count += 1.f;
-                    }
-                    i++;
-                }
+    // the coordinator waits for every worker, so failures are reported too
+    struct shard_command command;
+    if (!write_u32(shard->status_pipe[1], retval) && !retval) retval = CANT_WRITE_ERROR;
+    if (!retval) {
+        if (!read_full(shard->command_pipe[0], &command, sizeof(command))) retval = READ_ERROR;
+        else retval = command.status;
+    }
 
-                while(lastcol <= col) {
-                    edges[row*width + lastcol++] *= 1.f - 2.5f/neighbor_count;
-                }
-                lastpixel = px;
+    liq_fixed_palette *palette = NULL;
+    if (!retval && !options->fixed_palette) {
+        palette = liq_fixed_palette_create(options->liq, command.palette.entries, command.palette.count, command.gamma);
+        if (!palette) retval = OUT_OF_MEMORY_ERROR;
+    }
+
+    if (!retval) {
+        const size_t indexed_size = (size_t)input_image.width * input_image.height;
+        liq_result *remap = liq_result_create_fixed(options->liq, options->fixed_palette ? options->fixed_palette : palette);
+        unsigned char *indexed_data = malloc(indexed_size);
+        if (!remap || !indexed_data) {
+            retval = OUT_OF_MEMORY_ERROR;
+        } else {
+            liq_set_dithering_level(remap, options->floyd ? 1.0f : 0.0f);
+            if (LIQ_OK != liq_write_remapped_image(remap, image, indexed_data, indexed_size)) {
+                retval = OUT_OF_MEMORY_ERROR;
+            } else if (1 != fwrite(indexed_data, indexed_size, 1, shard->rows_file) || fflush(shard->rows_file)) {
+                retval = CANT_WRITE_ERROR;
             }
         }
+        free(indexed_data);
+        liq_result_destroy(remap);
     }
+
+    liq_fixed_palette_destroy(palette);
+    if (image) liq_image_destroy(image);
+    pngquant_image_free(&input_image, NULL);
+    return retval;
 }
 
-static void adjust_histogram_callback(hist_item *item, float diff)
+/* worker keeps only its own ends of its own pipes, so that the coordinator sees end of file when it exits */
+static void shard_worker_close_fds(struct shard shards[], unsigned int num_shards, unsigned int own)
 {
-    item->adjusted_weight = (item->perceptual_weight+item->adjusted_weight) * (sqrtf(1.f+diff));
+    for(unsigned int i=0; i < num_shards; i++) {
+        close(shards[i].command_pipe[1]);
+        close(shards[i].status_pipe[0]);
+        if (i != own) {
+            close(shards[i].command_pipe[0]);
+            close(shards[i].status_pipe[1]);
+        }
+    }
 }
 
-/**
- Repeats mediancut with different histogram weights to find palette with minimum error.
+static pngquant_error shard_merge_histograms(struct shard shards[], unsigned int num_shards, struct shard_command *command, const struct pngquant_options *options)
+{
+    liq_histogram *hist = liq_histogram_create(options->liq);
+    if (!hist) return OUT_OF_MEMORY_ERROR;
+
+    pngquant_error retval = SUCCESS;
+    for(unsigned int i=0; i < num_shards && !retval; i++) {
+        FILE *fp = shards[i].histogram_file;
+        long size;
+        void *data = NULL;
+        if (fseek(fp, 0, SEEK_END) || (size = ftell(fp)) <= 0 || fseek(fp, 0, SEEK_SET)) {
+            retval = READ_ERROR;
+        } else if (!(data = malloc(size))) {
+            retval = OUT_OF_MEMORY_ERROR;
+        } else if (1 != fread(data, size, 1, fp) || LIQ_OK != liq_histogram_add_serialized(hist, options->liq, data, size)) {
+            retval = READ_ERROR;
+        }
+        free(data);
+    }
 
- feedback_loop_trials controls how long the search will take. < 0 skips the iteration.
- */
-static colormap *find_best_palette(histogram *hist, unsigned int reqcolors, int feedback_loop_trials, const struct pngquant_options *options, double *palette_error_p)
+    liq_result *result = NULL;
+    if (!retval) {
+        const liq_error err = liq_histogram_quantize(hist, options->liq, &result);
+        if (LIQ_OK != err) retval = LIQ_QUALITY_TOO_LOW == err ? TOO_LOW_QUALITY : OUT_OF_MEMORY_ERROR;
+    }
+    if (!retval) {
+        command->palette = *liq_get_palette(result);
+        command->gamma = liq_get_output_gamma(result);
+    }
+    liq_result_destroy(result);
+    liq_histogram_destroy(hist);
+    return retval;
+}
+
+struct shard_stitch {
+    struct shard *shards;
+    unsigned int num_shards, current;
+    png_uint_32 row, width;
+};
+
+static bool shard_next_row(unsigned char *row, void *user_info)
 {
-    const double target_mse = options->target_mse;
-    colormap *acolormap = NULL;
-    double least_error = MAX_DIFF;
-    double target_mse_overshoot = feedback_loop_trials>0 ? 1.05 : 1.0;
-    const double percent = (double)(feedback_loop_trials>0?feedback_loop_trials:1)/100.0;
+    struct shard_stitch *s = user_info;
+    while (s->row >= s->shards[s->current].num_rows) {
+        if (++s->current >= s->num_shards) return false;
+        s->row = 0;
+    }
+    s->row++;
+    return 1 == fread(row, s->width, 1, s->shards[s->current].rows_file);
+}
 
-    do {
-        colormap *newmap = mediancut(hist, options->min_opaque_val, reqcolors, target_mse * target_mse_overshoot, MAX(MAX(90.0/65536.0, target_mse), least_error)*1.2);
+static pngquant_error shard_write_image(struct shard shards[], unsigned int num_shards, png8_image *output_image, const char *outname, const struct pngquant_options *options)
+{
+    for(unsigned int i=0; i < num_shards; i++) {
+        rewind(shards[i].rows_file);
+    }
 
-        if (feedback_loop_trials <= 0) {
-            return newmap;
-        }
+    FILE *outfile = fopen(outname, "wb");
+    if (!outfile) {
+        fprintf(stderr, "  error:  cannot open %s for writing\n", outname);
+        return CANT_WRITE_ERROR;
+    }
 
-        // after palette has been created, total error (MSE) is calculated to keep the best palette
-        // at the same time Voronoi iteration is done to improve the palette
-        // and histogram weights are adjusted based on remapping error to give more weight to poorly matched colors
+    const char *outfilename = strrchr(outname, '/');
+    verbose_printf(options, "  writing %d-color image as %s", output_image->num_palette, outfilename ? outfilename+1 : outname);
 
-        const bool first_run_of_target_mse = !acolormap && target_mse > 0;
-        double total_error = viter_do_iteration(hist, newmap, options->min_opaque_val, first_run_of_target_mse ? NULL : adjust_histogram_callback);
+    struct shard_stitch stitch = {.shards = shards, .num_shards = num_shards, .width = output_image->width};
+    pthread_mutex_lock(&libpng_lock);
+    pngquant_error retval = rwpng_write_image8_rows(outfile, output_image, shard_next_row, &stitch);
+    pthread_mutex_unlock(&libpng_lock);
+    if (retval) fprintf(stderr, "  error: failed writing image to %s\n", outname);
+    fclose(outfile);
+    return retval;
+}
 
-        // goal is to increase quality or to reduce number of colors used if quality is good enough
-        if (!acolormap || total_error < least_error || (total_error <= target_mse && newmap->colors < reqcolors)) {
-            if (acolormap) pam_freecolormap(acolormap);
-            acolormap = newmap;
+static pngquant_error pngquant_file_sharded(const char *filename, const char *outname, struct pngquant_options *options)
+{
+    FILE *infile = fopen(filename, "rb");
+    if (!infile) {
+        fprintf(stderr, "  error: cannot open %s for reading\n", filename);
+        return READ_ERROR;
+    }
+    png_uint_32 width, height;
+    pngquant_error retval = rwpng_read_dimensions(infile, &width, &height);
+    fclose(infile);
+    if (retval) {
+        fprintf(stderr, "  error: %s is not a PNG file\n", filename);
+        return retval;
+    }
 
-            if (total_error < target_mse && total_error > 0) {
-                // voronoi iteration improves quality above what mediancut aims for
-                // this compensates for it, making mediancut aim for worse
-                target_mse_overshoot = MIN(target_mse_overshoot*1.25, target_mse/total_error);
-            }
+    const unsigned int num_shards = MAX(1, MIN(options->shards, height / SHARD_MIN_ROWS));
+    const unsigned int threads = MAX(1, taskpool_threads() / num_shards);
+    struct shard *shards = calloc(num_shards, sizeof(shards[0]));
+    if (!shards) return OUT_OF_MEMORY_ERROR;
+
+    for(unsigned int i=0; i < num_shards; i++) {
+        const png_uint_32 first_row = ((uint64_t)height * i / num_shards) & ~1U;
+        const png_uint_32 end_row = i+1 < num_shards ? ((uint64_t)height * (i+1) / num_shards) & ~1U : height;
+        shards[i] = (struct shard){
+            .first_row = first_row,
+            .num_rows = end_row - first_row,
+            .command_pipe = {-1, -1},
+            .status_pipe = {-1, -1},
+        };
+    }
+    for(unsigned int i=0; i < num_shards && !retval; i++) {
+        if (!(shards[i].histogram_file = tmpfile()) || !(shards[i].rows_file = tmpfile()) ||
+            pipe(shards[i].command_pipe) || pipe(shards[i].status_pipe)) {
+            fputs("  error: cannot create temporary files for shards\n", stderr);
+            retval = CANT_WRITE_ERROR;
+        }
+    }
+    verbose_printf(options, "  split %ux%u image into %u shards with %u thread%s each",
+                   width, height, num_shards, threads, threads == 1 ? "" : "s");
+
+    // a worker that dies mustn't kill the coordinator when the palette is sent to it
+    signal(SIGPIPE, SIG_IGN);
+    verbose_printf_flush(options);
+    fflush(stdout);
+    fflush(stderr);
+
+    const stats_time hist_start = stats_start(options->stats);
+    unsigned int started = 0;
+    for(; started < num_shards && !retval; started++) {
+        const pid_t pid = fork();
+        if (pid < 0) {
+            fputs("  error: cannot start shard process\n", stderr);
+            retval = OUT_OF_MEMORY_ERROR;
+            break;
+        }
+        if (0 == pid) {
+            // the child has only this thread, and starts its own pool. Its messages and stats aren't collected
+            shard_worker_close_fds(shards, num_shards, started);
+            taskpool_set_pinning(false);
+            liq_set_threads(threads);
+            liq_set_log_callback(options->liq, NULL, NULL);
+            liq_set_log_flush_callback(options->liq, NULL, NULL);
+            liq_set_stats(options->liq, NULL);
+            _exit(shard_worker(filename, &shards[started], options));
+        }
+        shards[started].pid = pid;
+    }
 
-            least_error = total_error;
+    for(unsigned int i=0; i < num_shards; i++) {
+        if (shards[i].command_pipe[0] >= 0) close(shards[i].command_pipe[0]);
+        if (shards[i].status_pipe[1] >= 0) close(shards[i].status_pipe[1]);
+    }
 
-            // if number of colors could be reduced, try to keep it that way
-            // but allow extra color as a bit of wiggle room in case quality can be improved too
-            reqcolors = MIN(newmap->colors+1, reqcolors);
+    // histograms are merged in order of bands, once all are ready
+    for(unsigned int i=0; i < started; i++) {
+        uint32_t status;
+        if (!read_u32(shards[i].status_pipe[0], &status)) status = READ_ERROR;
+        if (status && !retval) {
+            fprintf(stderr, "  error: shard of rows %u-%u failed with error %u\n", shards[i].first_row, shards[i].first_row + shards[i].num_rows - 1, status);
+            retval = status;
+        }
+    }
 
-            feedback_loop_trials -= 1; // asymptotic improvement could make it go on forever
-        } else {
-            for(unsigned int j=0; j < hist->size; j++) {
-                hist->achv[j].adjusted_weight = (hist->achv[j].perceptual_weight + hist->achv[j].adjusted_weight)/2.0;
-            }
+    struct shard_command command = {.status = retval};
+    if (!retval && !options->fixed_palette) {
+        command.status = retval = shard_merge_histograms(shards, num_shards, &command, options);
+    }
+    stats_end(options->stats, STATS_HISTOGRAM, hist_start);
 
-            target_mse_overshoot = 1.0;
-            feedback_loop_trials -= 6;
-            // if error is really bad, it's unlikely to improve, so end sooner
-            if (total_error > least_error*4) feedback_loop_trials -= 3;
-            pam_freecolormap(newmap);
+    // the coordinator makes the same fixed palette as workers, for the output's PLTE
+    liq_fixed_palette *palette = NULL;
+    liq_result *result = NULL;
+    if (!retval) {
+        palette = options->fixed_palette ? NULL : liq_fixed_palette_create(options->liq, command.palette.entries, command.palette.count, command.gamma);
+        result = palette || options->fixed_palette ? liq_result_create_fixed(options->liq, options->fixed_palette ? options->fixed_palette : palette) : NULL;
+        if (!result) command.status = retval = OUT_OF_MEMORY_ERROR;
+    }
+
+    const stats_time remap_start = stats_start(options->stats);
+    for(unsigned int i=0; i < started; i++) {
+        write_full(shards[i].command_pipe[1], &command, sizeof(command));
+        close(shards[i].command_pipe[1]);
+        shards[i].command_pipe[1] = -1;
+    }
+    for(unsigned int i=0; i < started; i++) {
+        int status;
+        const bool exited = waitpid(shards[i].pid, &status, 0) == shards[i].pid && WIFEXITED(status);
+        if (!retval && (!exited || WEXITSTATUS(status))) {
+            fprintf(stderr, "  error: shard of rows %u-%u failed\n", shards[i].first_row, shards[i].first_row + shards[i].num_rows - 1);
+            retval = exited ? WEXITSTATUS(status) : LIBPNG_FATAL_ERROR;
         }
+    }
+    stats_end(options->stats, STATS_REMAP, remap_start);
+
+    if (!retval) {
+        png8_image output_image = {.width = width, .height = height, .gamma = liq_get_output_gamma(result)};
+        set_output_palette(&output_image, liq_get_palette(result));
+        verbose_printf(options, "  remapped %u shards to %u colors", num_shards, output_image.num_palette);
 
-        verbose_printf(options, "  selecting colors...%d%%",100-MAX(0,(int)(feedback_loop_trials/percent)));
+        const stats_time write_start = stats_start(options->stats);
+        retval = shard_write_image(shards, num_shards, &output_image, outname, options);
+        stats_end(options->stats, STATS_WRITE, write_start);
     }
-    while(feedback_loop_trials > 0);
 
-    *palette_error_p = least_error;
-    return acolormap;
+    for(unsigned int i=0; i < num_shards; i++) {
+        if (shards[i].command_pipe[1] >= 0) close(shards[i].command_pipe[1]);
+        if (shards[i].status_pipe[0] >= 0) close(shards[i].status_pipe[0]);
+        if (shards[i].histogram_file) fclose(shards[i].histogram_file);
+        if (shards[i].rows_file) fclose(shards[i].rows_file);
+    }
+    liq_result_destroy(result);
+    liq_fixed_palette_destroy(palette);
+    free(shards);
+    return retval;
 }
 
-static void prepare_image(pngquant_image *input_image, struct pngquant_options *options)
+#else
+
+static pngquant_error pngquant_file_sharded(const char *filename, const char *outname, struct pngquant_options *options)
 {
-    if (options->min_opaque_val <= 254.f/255.f) {
-        verbose_print(options, "  Working around IE6 bug by making image less transparent...");
-        modify_alpha(&input_image->rwpng_image, options->min_opaque_val);
-        input_image->modified = true;
-    }
+    fputs("--shards is not supported on this platform.\n", stderr);
+    return INVALID_ARGUMENT;
+}
+
+#endif
 
-    if (options->speed_tradeoff < 8 && input_image->rwpng_image.width >= 4 && input_image->rwpng_image.height >= 4) {
-        contrast_maps((const rgb_pixel**)input_image->rwpng_image.row_pointers, input_image->rwpng_image.width, input_image->rwpng_image.height, input_image->rwpng_image.gamma,
-                   &input_image->noise, &input_image->edges);
+static bool file_exists(const char *outname)
+{
+    FILE *outfile = fopen(outname, "rb");
+    if ((outfile ) != NULL) {
+        fclose(outfile);
+        return true;
     }
+    return false;
 }
 
-static colormap *pngquant_quantize(histogram *hist, const struct pngquant_options *options)
+/* build the output filename from the input name by inserting "-fs8" or
+ * "-or8" before the ".png" extension (or by appending that plus ".png" if
+ * there isn't any extension), then make sure it doesn't exist already */
+static char *add_filename_extension(const char *filename, const char *newext)
 {
-    const double max_mse = options->max_mse;
+    size_t x = strlen(filename);
 
-    // If image has few colors to begin with (and no quality degradation is required)
-    // then it's possible to skip quantization entirely
-    if (hist->size <= options->reqcolors && options->target_mse == 0) {
-        colormap *hist_palette = pam_colormap(hist->size);
-        for(unsigned int i=0; i < hist->size; i++) {
-            hist_palette->palette[i].acolor = hist->achv[i].acolor;
-            hist_palette->palette[i].popularity = hist->achv[i].perceptual_weight;
-        }
+    char* outname = malloc(x+4+strlen(newext)+1);
 
-        sort_palette(hist_palette, options);
-        hist_palette->palette_error = 0;
-        return hist_palette;
-    }
+    strncpy(outname, filename, x);
+    if (strncmp(outname+x-4, ".png", 4) == 0)
+        strcpy(outname+x-4, newext);
+    else
+        strcpy(outname+x, newext);
 
-    double palette_error = -1;
-    colormap *acolormap = find_best_palette(hist, options->reqcolors, 56-9*options->speed_tradeoff, options, &palette_error);
+    return outname;
+}
 
-    // Voronoi iteration approaches local minimum for the palette
-    unsigned int iterations = MAX(8-options->speed_tradeoff,0); iterations += iterations * iterations/2;
-    if (!iterations && palette_error < 0 && max_mse < MAX_DIFF) iterations = 1; // otherwise total error is never calculated and MSE limit won't work
+static void set_binary_mode(FILE *fp)
+{
+#if defined(WIN32) || defined(__WIN32__)
+    setmode(fp == stdout ? 1 : 0, O_BINARY);
+#endif
+}
 
-    if (iterations) {
-        verbose_print(options, "  moving colormap towards local minimum");
+static pngquant_error write_image(png8_image *output_image, png24_image *output_image24, const char *outname, struct pngquant_options *options)
+{
+    FILE *outfile;
+    if (options->using_stdin) {
+        set_binary_mode(stdout);
+        outfile = stdout;
 
-        const double iteration_limit = 1.0/(double)(1<<(23-options->speed_tradeoff));
-        double previous_palette_error = MAX_DIFF;
-        for(unsigned int i=0; i < iterations; i++) {
-            palette_error = viter_do_iteration(hist, acolormap, options->min_opaque_val, NULL);
+        if (output_image) {
+            verbose_printf(options, "  writing %d-color image to stdout", output_image->num_palette);
+        } else {
+            verbose_print(options, "  writing truecolor image to stdout");
+        }
+    } else {
 
-            if (fabs(previous_palette_error-palette_error) < iteration_limit) {
-                break;
-            }
+        if ((outfile = fopen(outname, "wb")) == NULL) {
+            fprintf(stderr, "  error:  cannot open %s for writing\n", outname);
+            return CANT_WRITE_ERROR;
+        }
 
-            if (palette_error > max_mse*1.5) { // probably hopeless
-                if (palette_error > max_mse*3.0) break; // definitely hopeless
-                iterations++;
-            }
+        const char *outfilename = strrchr(outname, '/');
+        if (outfilename) outfilename++; else outfilename = outname;
 
-            previous_palette_error = palette_error;
+        if (output_image) {
+            verbose_printf(options, "  writing %d-color image as %s", output_image->num_palette, outfilename);
+        } else {
+            verbose_printf(options, "  writing truecolor image as %s", outfilename);
         }
     }
 
-    if (palette_error > max_mse) {
-        verbose_printf(options, "  image degradation MSE=%.3f exceeded limit of %.3f", palette_error*65536.0/6.0, max_mse*65536.0/6.0);
-        pam_freecolormap(acolormap);
-        return NULL;
+    pngquant_error retval;
+    pthread_mutex_lock(&libpng_lock);
+    if (output_image) {
+        retval = rwpng_write_image8(outfile, output_image);
+    } else {
+        retval = rwpng_write_image24(outfile, output_image24);
     }
+    pthread_mutex_unlock(&libpng_lock);
 
-    sort_palette(acolormap, options);
+    if (retval) {
+        fprintf(stderr, "  error: failed writing image to %s\n", outname);
+    }
 
-    acolormap->palette_error = palette_error;
-    return acolormap;
+    if (!options->using_stdin)
+        fclose(outfile);
+
+    return retval;
 }
 
-static pngquant_error pngquant_remap(colormap *acolormap, pngquant_image *input_image, png8_image *output_image, const struct pngquant_options *options)
+static bool add_palette_color(liq_color colors[], unsigned int *count, liq_color px)
 {
-    double palette_error = acolormap->palette_error;
-
-    output_image->width = input_image->rwpng_image.width;
-    output_image->height = input_image->rwpng_image.height;
-    output_image->gamma = 0.45455f; // fixed gamma ~2.2 for the web. PNG can't store exact 1/2.2
-
-    /*
-    ** Step 3.7 [GRR]: allocate memory for the entire indexed image
-    */
-
-    output_image->indexed_data = malloc(output_image->height * output_image->width);
-
-    if (!output_image->indexed_data) {
-        return OUT_OF_MEMORY_ERROR;
+    if (!px.a) px = (liq_color){0,0,0,0}; // all transparent colors are the same
+    for(unsigned int i=0; i < *count; i++) {
+        if (colors[i].r == px.r && colors[i].g == px.g && colors[i].b == px.b && colors[i].a == px.a) return true;
     }
+    if (*count >= 256) return false;
+    colors[(*count)++] = px;
+    return true;
+}
 
-    // tRNS, etc.
-    output_image->num_palette = acolormap->colors;
-    output_image->num_trans = 0;
-    for(unsigned int i=0; i < acolormap->colors; i++) {
-        if (acolormap->palette[i].acolor.a < 255.0/256.0) {
-            output_image->num_trans = i+1;
-        }
+/*
+ Colors for --map: all colors of a PNG image (at most 256), or a text file with one color per line
+ as decimal "r g b" or "r g b a". Other lines are skipped, so GIMP .gpl palettes can be used too.
+ */
+static pngquant_error read_fixed_palette(const char *filename, struct pngquant_options *options)
+{
+    FILE *fp = fopen(filename, "rb");
+    if (!fp) {
+        fprintf(stderr, "  error: cannot open %s for reading\n", filename);
+        return READ_ERROR;
     }
 
-    /*
-     ** Step 4: map the colors in the image to their closest match in the
-     ** new colormap, and write 'em out.
-     */
-
-    const bool floyd = options->floyd,
-              use_dither_map = floyd && input_image->edges && options->speed_tradeoff < 6;
-
-    if (!floyd || use_dither_map) {
-        // If no dithering is required, that's the final remapping.
-        // If dithering (with dither map) is required, this image is used to find areas that require dithering
-        float remapping_error = remap_to_palette(&input_image->rwpng_image, output_image, acolormap, options->min_opaque_val);
-
-        // remapping error from dithered image is absurd, so always non-dithered value is used
-        // palette_error includes some perceptual weighting from histogram which is closer correlated with dssim
-        // so that should be used when possible.
-        if (palette_error < 0) {
-            palette_error = remapping_error;
+    unsigned char signature[8];
+    const bool is_png = fread(signature, 1, sizeof(signature), fp) == sizeof(signature) && !png_sig_cmp(signature, 0, sizeof(signature));
+
+    liq_color colors[256];
+    unsigned int count = 0;
+    double gamma = 0;
+    pngquant_error retval = SUCCESS;
+    if (is_png) {
+        fclose(fp);
+        png24_image image = {};
+        retval = read_image(filename, false, &image);
+        if (!retval) {
+            gamma = image.gamma;
+            for(png_uint_32 row=0; row < image.height && !retval; row++) {
+                const unsigned char *px = image.row_pointers[row];
+                for(png_uint_32 col=0; col < image.width; col++, px += image.channels) {
+                    if (!add_palette_color(colors, &count, (liq_color){px[0], px[1], px[2], image.channels == 4 ? px[3] : 255})) {
+                        fprintf(stderr, "  error: %s has more than 256 colors\n", filename);
+                        retval = INVALID_ARGUMENT;
+                        break;
+                    }
+                }
+            }
         }
-
-        if (use_dither_map) {
-            update_dither_map(output_image, input_image->edges);
+        pngquant_image_free(&image, NULL);
+    } else {
+        rewind(fp);
+        char line[1024];
+        while (fgets(line, sizeof(line), fp)) {
+            const char *start = line;
+            while (*start == ' ' || *start == '\t') start++;
+            if (*start < '0' || *start > '9') continue;
+
+            unsigned int r, g, b, a = 255;
+            if (sscanf(start, "%u %u %u %u", &r, &g, &b, &a) < 3 || r > 255 || g > 255 || b > 255 || a > 255) {
+                fprintf(stderr, "  error: %s has a line that isn't a color: %s", filename, line);
+                retval = INVALID_ARGUMENT;
+                break;
+            }
+            if (count >= 256) {
+                fprintf(stderr, "  error: %s has more than 256 colors\n", filename);
+                retval = INVALID_ARGUMENT;
+                break;
+            }
+            colors[count++] = (liq_color){r, g, b, a};
         }
+        fclose(fp);
     }
+    if (retval) return retval;
 
-    if (palette_error >= 0) {
-        verbose_printf(options, "  mapped image to new colors...MSE=%.3f", palette_error*65536.0/6.0);
+    if (!count) {
+        fprintf(stderr, "  error: %s has no colors\n", filename);
+        return INVALID_ARGUMENT;
     }
 
-    // remapping above was the last chance to do voronoi iteration, hence the final palette is set after remapping
-    set_palette(output_image, acolormap);
+    verbose_printf(options, "  read %u colors from %s", count, filename);
+    options->fixed_palette = liq_fixed_palette_create(options->liq, colors, count, gamma);
+    return options->fixed_palette ? SUCCESS : OUT_OF_MEMORY_ERROR;
+}
 
-    if (floyd) {
-        remap_to_palette_floyd(&input_image->rwpng_image, output_image, acolormap, options->min_opaque_val, input_image->edges, use_dither_map, MAX(palette_error*2.4, 16.f/256.f));
+static pngquant_error read_image(const char *filename, int using_stdin, png24_image *input_image_p)
+{
+    FILE *infile;
+
+    if (using_stdin) {
+        set_binary_mode(stdin);
+        infile = stdin;
+    } else if ((infile = fopen(filename, "rb")) == NULL) {
+        fprintf(stderr, "  error: cannot open %s for reading\n", filename);
+        return READ_ERROR;
     }
 
-    if (input_image->edges) {
-        free(input_image->edges);
-        input_image->edges = NULL;
+    pngquant_error retval;
+    pthread_mutex_lock(&libpng_lock);
+    retval = rwpng_read_image24(infile, input_image_p);
+    pthread_mutex_unlock(&libpng_lock);
+
+    if (!using_stdin)
+        fclose(infile);
+
+    if (retval) {
+        fprintf(stderr, "  error: rwpng_read_image() error %d\n", retval);
+        return retval;
     }
 
     return SUCCESS;
 }
-
@@ -31,6 +31,8 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
 
 #include "png.h"
 #include "rwpng.h"
@@ -55,25 +57,62 @@ void rwpng_version_info(FILE *fp)
 
 struct rwpng_read_data {
     FILE *fp;
+    const unsigned char *buffer; // used instead of fp when reading from memory
+    png_size_t buffer_size;
     png_size_t bytes_read;
+    png_uint_32 first_row, num_rows; // only these rows are kept, unless num_rows is 0
 };
 
 static void user_read_data(png_structp png_ptr, png_bytep data, png_size_t length)
 {
     struct rwpng_read_data *read_data = (struct rwpng_read_data *)png_get_io_ptr(png_ptr);
 
-    png_size_t read = fread(data, 1, length, read_data->fp);
+    png_size_t read;
+    if (read_data->fp) {
+        read = fread(data, 1, length, read_data->fp);
+    } else {
+        read = read_data->buffer_size - read_data->bytes_read;
+        if (read > length) read = length;
+        memcpy(data, read_data->buffer + read_data->bytes_read, read);
+    }
     if (!read) png_error(png_ptr, "Read error");
     read_data->bytes_read += read;
 }
 
-static png_bytepp rwpng_create_row_pointers(png_infop info_ptr, png_structp png_ptr, unsigned char *base, unsigned int height, unsigned int rowbytes)
+static bool rwpng_buffer_append(rwpng_buffer *out, const void *data, png_size_t length)
+{
+    if (out->size + length > out->capacity) {
+        png_size_t capacity = out->capacity ? out->capacity : 1<<16;
+        while (capacity < out->size + length) capacity *= 2;
+
+        unsigned char *new_data = realloc(out->data, capacity);
+        if (!new_data) return false;
+        out->data = new_data;
+        out->capacity = capacity;
+    }
+    if (length) memcpy(out->data + out->size, data, length);
+    out->size += length;
+    return true;
+}
+
+static void user_write_data(png_structp png_ptr, png_bytep data, png_size_t length)
+{
+    rwpng_buffer *out = (rwpng_buffer *)png_get_io_ptr(png_ptr);
+
+    if (!rwpng_buffer_append(out, data, length)) png_error(png_ptr, "Out of memory");
+}
+
+static void user_flush_data(png_structp png_ptr)
+{
+}
+
+static png_bytepp rwpng_create_row_pointers(png_infop info_ptr, png_structp png_ptr, unsigned char *base, unsigned int height, png_size_t rowbytes)
 {
     if (!rowbytes) rowbytes = png_get_rowbytes(png_ptr, info_ptr);
 
     png_bytepp row_pointers = malloc(height * sizeof(row_pointers[0]));
     for(unsigned int row = 0;  row < height;  ++row) {
-        row_pointers[row] = base + row * rowbytes;
+        row_pointers[row] = base + (png_size_t)row * rowbytes;
     }
     return row_pointers;
 }
@@ -89,7 +128,7 @@ static png_bytepp rwpng_create_row_pointers(png_infop info_ptr, png_structp png_
     26 = wrong PNG color type (no alpha channel)
  */
 
-pngquant_error rwpng_read_image24_libpng(FILE *infile, png24_image *mainprog_ptr)
+static pngquant_error rwpng_read_image24_libpng(struct rwpng_read_data *read_data, png24_image *mainprog_ptr)
 {
     png_structp  png_ptr = NULL;
     png_infop    info_ptr = NULL;
@@ -116,8 +155,7 @@ pngquant_error rwpng_read_image24_libpng(FILE *infile, png24_image *mainprog_ptr
         return LIBPNG_FATAL_ERROR;   /* fatal libpng error (via longjmp()) */
     }
 
-    struct rwpng_read_data read_data = {infile, 0};
-    png_set_read_fn(png_ptr, &read_data, user_read_data);
+    png_set_read_fn(png_ptr, read_data, user_read_data);
 
     png_read_info(png_ptr, info_ptr);  /* read all PNG info up to image data */
 
@@ -136,12 +174,18 @@ pngquant_error rwpng_read_image24_libpng(FILE *infile, png24_image *mainprog_ptr
 
     /* GRR TO DO:  preserve all safe-to-copy ancillary PNG chunks */
 
+    /* opaque images are kept as RGB, which takes 25% less memory */
+    mainprog_ptr->channels = 4;
     if (!(color_type & PNG_COLOR_MASK_ALPHA)) {
 #ifdef PNG_READ_FILLER_SUPPORTED
         /* GRP:  expand palette to RGB, and grayscale or RGB to GA or RGBA */
         if (color_type == PNG_COLOR_TYPE_PALETTE)
             png_set_expand(png_ptr);
-        png_set_filler(png_ptr, 65535L, PNG_FILLER_AFTER);
+        if (color_type != PNG_COLOR_TYPE_PALETTE || !png_get_valid(png_ptr, info_ptr, PNG_INFO_tRNS)) {
+            mainprog_ptr->channels = 3;
+        } else {
+            png_set_filler(png_ptr, 65535L, PNG_FILLER_AFTER);
+        }
 #else
         fprintf(stderr, "pngquant readpng:  image is neither RGBA nor GA\n");
         png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
@@ -177,26 +221,69 @@ pngquant_error rwpng_read_image24_libpng(FILE *infile, png24_image *mainprog_ptr
 
     rowbytes = png_get_rowbytes(png_ptr, info_ptr);
 
-    if ((mainprog_ptr->rgba_data = malloc(rowbytes*mainprog_ptr->height)) == NULL) {
+    /* rows before the range are decoded to a scratch row, and decoding stops after the range. Interlaced
+     * images have rows spread over all passes, so they're decoded whole and the range is moved to the start */
+    const png_uint_32 first_row = read_data->num_rows ? read_data->first_row : 0;
+    const png_uint_32 num_rows = read_data->num_rows ? read_data->num_rows : mainprog_ptr->height;
+    const bool interlaced = png_get_interlace_type(png_ptr, info_ptr) != PNG_INTERLACE_NONE;
+    if (first_row >= mainprog_ptr->height || num_rows > mainprog_ptr->height - first_row) {
+        png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+        return INVALID_ARGUMENT;
+    }
+    const png_uint_32 decoded_rows = interlaced ? mainprog_ptr->height : num_rows;
+
+    // on 32-bit systems a big enough image can't be addressed at all
+    if (decoded_rows > SIZE_MAX/rowbytes || (mainprog_ptr->rgba_data = malloc(rowbytes*decoded_rows)) == NULL) {
         fprintf(stderr, "pngquant readpng:  unable to allocate image data\n");
         png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
         return PNG_OUT_OF_MEMORY_ERROR;
     }
 
-    png_bytepp row_pointers = rwpng_create_row_pointers(info_ptr, png_ptr, mainprog_ptr->rgba_data, mainprog_ptr->height, 0);
+    png_bytepp row_pointers = rwpng_create_row_pointers(info_ptr, png_ptr, mainprog_ptr->rgba_data, decoded_rows, 0);
 
-    /* now we can go ahead and just read the whole image */
+    if (mainprog_ptr->first_touch) {
+        mainprog_ptr->first_touch(row_pointers, rowbytes, decoded_rows);
+    }
+
+    if (num_rows == mainprog_ptr->height || interlaced) {
+        /* now we can go ahead and just read the whole image */
 
-    png_read_image(png_ptr, row_pointers);
+        png_read_image(png_ptr, row_pointers);
 
-    /* and we're done!  (png_read_end() can be omitted if no processing of
-     * post-IDAT text/time/etc. is desired) */
+        /* and we're done!  (png_read_end() can be omitted if no processing of
+         * post-IDAT text/time/etc. is desired) */
 
-    png_read_end(png_ptr, NULL);
+        png_read_end(png_ptr, NULL);
+
+        if (num_rows != mainprog_ptr->height) {
+            memmove(mainprog_ptr->rgba_data, row_pointers[first_row], rowbytes*num_rows);
+            unsigned char *shrunk = realloc(mainprog_ptr->rgba_data, rowbytes*num_rows);
+            if (shrunk) mainprog_ptr->rgba_data = shrunk;
+            free(row_pointers);
+            row_pointers = rwpng_create_row_pointers(info_ptr, png_ptr, mainprog_ptr->rgba_data, num_rows, 0);
+        }
+    } else {
+        png_bytep skipped_row = malloc(rowbytes);
+        if (!skipped_row) {
+            free(row_pointers);
+            free(mainprog_ptr->rgba_data);
+            mainprog_ptr->rgba_data = NULL;
+            png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+            return PNG_OUT_OF_MEMORY_ERROR;
+        }
+        for(png_uint_32 row = 0; row < first_row; row++) {
+            png_read_row(png_ptr, skipped_row, NULL);
+        }
+        free(skipped_row);
+        for(png_uint_32 row = 0; row < num_rows; row++) {
+            png_read_row(png_ptr, row_pointers[row], NULL);
+        }
+    }
+    mainprog_ptr->height = num_rows;
 
     png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
 
-    mainprog_ptr->file_size = read_data.bytes_read;
+    mainprog_ptr->file_size = read_data->bytes_read;
     mainprog_ptr->row_pointers = (unsigned char **)row_pointers;
 
     return SUCCESS;
@@ -208,12 +295,328 @@ pngquant_error rwpng_read_image24(FILE *infile, png24_image *input_image_p)
 #if USE_COCOA
     return rwpng_read_image24_cocoa(infile, input_image_p);
 #else
-    return rwpng_read_image24_libpng(infile, input_image_p);
+    struct rwpng_read_data read_data = {.fp = infile};
+    return rwpng_read_image24_libpng(&read_data, input_image_p);
 #endif
 }
 
+pngquant_error rwpng_read_image24_buffer(const unsigned char *buffer, size_t size, png24_image *input_image_p)
+{
+    struct rwpng_read_data read_data = {.buffer = buffer, .buffer_size = size};
+    return rwpng_read_image24_libpng(&read_data, input_image_p);
+}
+
+pngquant_error rwpng_read_image24_rows(FILE *infile, png24_image *input_image_p, png_uint_32 first_row, png_uint_32 num_rows)
+{
+    if (!num_rows) return INVALID_ARGUMENT;
+
+    struct rwpng_read_data read_data = {.fp = infile, .first_row = first_row, .num_rows = num_rows};
+    return rwpng_read_image24_libpng(&read_data, input_image_p);
+}
+
+/* reads only the IHDR chunk, which PNG requires to be first, to get dimensions without decoding the image */
+pngquant_error rwpng_read_dimensions(FILE *infile, png_uint_32 *width, png_uint_32 *height)
+{
+    unsigned char header[8+8+8]; // signature, chunk length and type, width and height
+    if (fread(header, 1, sizeof(header), infile) != sizeof(header)) {
+        return READ_ERROR;
+    }
+    if (png_sig_cmp(header, 0, 8) || memcmp(header+12, "IHDR", 4)) {
+        return READ_ERROR;
+    }
+
+    *width = png_get_uint_32(header+16);
+    *height = png_get_uint_32(header+20);
+    return SUCCESS;
+}
+
+/*
+ libpng doesn't support APNG, so its chunks are handled here. Each frame is decoded by libpng as a PNG made of
+ the file's chunks that precede image data (IHDR with the frame's size, PLTE, tRNS, gAMA...) and the frame's data.
+ Frames are written by libpng as separate PNGs too, and their image data is moved to fdAT chunks.
+ */
+
+static png_uint_32 rwpng_crc(const unsigned char *data, png_size_t length)
+{
+    png_uint_32 table[256];
+    for(unsigned int n = 0; n < 256; n++) {
+        png_uint_32 c = n;
+        for(int k = 0; k < 8; k++) c = (c & 1) ? 0xEDB88320U ^ (c >> 1) : c >> 1;
+        table[n] = c;
+    }
+
+    png_uint_32 crc = 0xFFFFFFFFU;
+    for(png_size_t i = 0; i < length; i++) {
+        crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc ^ 0xFFFFFFFFU;
+}
+
+/* chunk of the given type, with data preceded by a sequence number unless it's NULL (fcTL, fdAT) */
+static bool rwpng_append_chunk(rwpng_buffer *out, const char *type, const png_uint_32 *sequence, const unsigned char *data, png_size_t length)
+{
+    unsigned char header[12];
+    png_save_uint_32(header, length + (sequence ? 4 : 0));
+    memcpy(header+4, type, 4);
+    if (sequence) png_save_uint_32(header+8, *sequence);
+
+    const png_size_t start = out->size + 4; // CRC covers type and data
+    if (!rwpng_buffer_append(out, header, sequence ? 12 : 8) || !rwpng_buffer_append(out, data, length)) {
+        return false;
+    }
+
+    unsigned char crc[4];
+    png_save_uint_32(crc, rwpng_crc(out->data + start, out->size - start));
+    return rwpng_buffer_append(out, crc, 4);
+}
+
+/* whether the file has acTL before image data. It must be seekable, and it's rewound */
+bool rwpng_is_apng(FILE *infile)
+{
+    bool apng = false;
+    unsigned char header[8];
+    if (fread(header, 1, 8, infile) == 8 && !png_sig_cmp(header, 0, 8)) {
+        while (fread(header, 1, 8, infile) == 8) {
+            if (!memcmp(header+4, "acTL", 4)) apng = true;
+            if (apng || !memcmp(header+4, "IDAT", 4)) break;
+            if (fseek(infile, (long)png_get_uint_32(header) + 4, SEEK_CUR)) break; // data and CRC
+        }
+    }
+    fseek(infile, 0, SEEK_SET);
+    return apng;
+}
+
+static pngquant_error rwpng_decode_frame(const unsigned char *ihdr, png_uint_32 width, png_uint_32 height, const rwpng_buffer *header, const rwpng_buffer *data, png24_image *image)
+{
+    unsigned char frame_ihdr[13];
+    memcpy(frame_ihdr, ihdr, 13);
+    png_save_uint_32(frame_ihdr, width);
+    png_save_uint_32(frame_ihdr+4, height);
+
+    static const unsigned char signature[8] = {137, 'P', 'N', 'G', 13, 10, 26, 10};
+    rwpng_buffer png = {};
+    pngquant_error retval = PNG_OUT_OF_MEMORY_ERROR;
+    if (rwpng_buffer_append(&png, signature, 8) && rwpng_append_chunk(&png, "IHDR", NULL, frame_ihdr, 13) &&
+        rwpng_buffer_append(&png, header->data, header->size) && rwpng_buffer_append(&png, data->data, data->size) &&
+        rwpng_append_chunk(&png, "IEND", NULL, NULL, 0)) {
+        retval = rwpng_read_image24_buffer(png.data, png.size, image);
+    }
+    free(png.data);
+    return retval;
+}
+
+static pngquant_error rwpng_read_apng24_buffer(const unsigned char *file, png_size_t size, apng_info *info, png24_image *frames)
+{
+    const unsigned char *ihdr = NULL;
+    png_uint_32 canvas_width = 0, canvas_height = 0, width = 0, height = 0;
+    rwpng_buffer header = {}, data = {}; // chunks before image data, and image data of the current frame
+    bool in_frame = false, seen_data = false;
+    unsigned int max_frames = info->num_frames;
+    info->num_frames = 0;
+
+    pngquant_error retval = SUCCESS;
+    png_size_t pos = 8;
+    while (!retval && pos + 12 <= size) {
+        const png_uint_32 length = png_get_uint_32(file + pos);
+        const unsigned char *const type = file + pos + 4, *const chunk = file + pos + 8;
+        if (length > size - pos - 12) {
+            retval = READ_ERROR;
+            break;
+        }
+        pos += length + 12;
+
+        const bool fctl = !memcmp(type, "fcTL", 4), idat = !memcmp(type, "IDAT", 4), iend = !memcmp(type, "IEND", 4);
+        if ((fctl || iend) && in_frame) {
+            retval = rwpng_decode_frame(ihdr, width, height, &header, &data, &frames[info->num_frames++]);
+            data.size = 0;
+            in_frame = false;
+        }
+        if (retval || iend) break;
+
+        if (!memcmp(type, "IHDR", 4) && length == 13) {
+            ihdr = chunk;
+            canvas_width = png_get_uint_32(chunk);
+            canvas_height = png_get_uint_32(chunk+4);
+        } else if (!memcmp(type, "acTL", 4) && length == 8) {
+            info->num_plays = png_get_uint_32(chunk+4);
+        } else if (fctl) {
+            if (length != 26 || !ihdr || info->num_frames >= max_frames) {
+                retval = READ_ERROR;
+                break;
+            }
+            width = png_get_uint_32(chunk+4);
+            height = png_get_uint_32(chunk+8);
+            apng_frame_control *control = &info->controls[info->num_frames];
+            *control = (apng_frame_control){
+                .x_offset = png_get_uint_32(chunk+12),
+                .y_offset = png_get_uint_32(chunk+16),
+                .delay_num = png_get_uint_16(chunk+20),
+                .delay_den = png_get_uint_16(chunk+22),
+                .dispose_op = chunk[24],
+                .blend_op = chunk[25],
+            };
+            if (!width || !height || width > canvas_width || height > canvas_height ||
+                control->x_offset > canvas_width - width || control->y_offset > canvas_height - height) {
+                retval = READ_ERROR;
+                break;
+            }
+            in_frame = true;
+        } else if (idat || (!memcmp(type, "fdAT", 4) && length >= 4)) {
+            if (!ihdr) {
+                retval = READ_ERROR;
+                break;
+            }
+            if (!in_frame) {
+                // image data without fcTL is the default image, which isn't part of the animation
+                if (seen_data || info->num_frames >= max_frames) {
+                    retval = READ_ERROR;
+                    break;
+                }
+                info->hidden_default_image = true;
+                width = canvas_width; height = canvas_height;
+                in_frame = true;
+            }
+            seen_data = true;
+            if (!(idat ? rwpng_buffer_append(&data, type - 4, length + 12) : rwpng_append_chunk(&data, "IDAT", NULL, chunk + 4, length - 4))) {
+                retval = PNG_OUT_OF_MEMORY_ERROR;
+            }
+        } else if (!seen_data) {
+            // PLTE, tRNS, gAMA, etc. apply to all frames. Chunks after image data are dropped
+            if (!rwpng_buffer_append(&header, type - 4, length + 12)) retval = PNG_OUT_OF_MEMORY_ERROR;
+        }
+    }
+    if (!retval && (in_frame || !info->num_frames)) retval = READ_ERROR; // truncated
+
+    free(header.data);
+    free(data.data);
+    return retval;
+}
+
+/*
+ Frames are decoded into an array of images, the default image first if it isn't a frame.
+ Frames have dimensions of their rectangles, and the default image (or first frame) has dimensions of the canvas.
+ */
+pngquant_error rwpng_read_apng24(FILE *infile, apng_info *info, png24_image **frames_p)
+{
+    rwpng_buffer file = {};
+    unsigned char buf[1<<16];
+    png_size_t read;
+    while ((read = fread(buf, 1, sizeof(buf), infile))) {
+        if (!rwpng_buffer_append(&file, buf, read)) {
+            free(file.data);
+            return PNG_OUT_OF_MEMORY_ERROR;
+        }
+    }
+
+    // acTL is before the image data, and its count of frames excludes the default image
+    png_uint_32 max_frames = 0;
+    for(png_size_t pos = 8; pos + 16 <= file.size; pos += png_get_uint_32(file.data + pos) + 12) {
+        if (!memcmp(file.data + pos + 4, "acTL", 4)) {
+            max_frames = png_get_uint_32(file.data + pos + 8) + 1;
+            break;
+        }
+        if (png_get_uint_32(file.data + pos) > file.size) break;
+    }
+    if (!max_frames || max_frames > file.size / 26) { // each frame needs at least a fcTL
+        free(file.data);
+        return READ_ERROR;
+    }
+
+    *info = (apng_info){
+        .num_frames = max_frames,
+        .controls = calloc(max_frames, sizeof(info->controls[0])),
+        .file_size = file.size,
+    };
+    png24_image *frames = calloc(max_frames, sizeof(frames[0]));
+    pngquant_error retval = PNG_OUT_OF_MEMORY_ERROR;
+    if (info->controls && frames) {
+        retval = rwpng_read_apng24_buffer(file.data, file.size, info, frames);
+    }
+    free(file.data);
+
+    if (retval) {
+        for(unsigned int i = 0; frames && i < max_frames; i++) {
+            free(frames[i].rgba_data);
+            free(frames[i].row_pointers);
+        }
+        free(frames);
+        rwpng_free_apng_info(info);
+        return retval;
+    }
+    *frames_p = frames;
+    return SUCCESS;
+}
+
+void rwpng_free_apng_info(apng_info *info)
+{
+    free(info->controls);
+    info->controls = NULL;
+}
 
-pngquant_error rwpng_write_image_init(png_image *mainprog_ptr, png_structpp png_ptr_p, png_infopp info_ptr_p, FILE *outfile)
+/* all frames must have the same palette, since APNG has one PLTE */
+pngquant_error rwpng_write_apng8(FILE *outfile, const apng_info *info, png8_image frames[])
+{
+    rwpng_buffer out = {}, frame = {};
+    png_uint_32 sequence = 0;
+    pngquant_error retval = SUCCESS;
+
+    for(unsigned int i = 0; i < info->num_frames && !retval; i++) {
+        frame.size = 0;
+        if ((retval = rwpng_write_image8_buffer(&frame, &frames[i]))) break;
+
+        bool frame_started = false;
+        for(png_size_t pos = 8; pos + 12 <= frame.size && !retval; ) {
+            const png_uint_32 length = png_get_uint_32(frame.data + pos);
+            const unsigned char *const type = frame.data + pos + 4, *const chunk = frame.data + pos + 8;
+            const png_size_t chunk_start = pos;
+            pos += length + 12;
+
+            bool ok = true;
+            if (!memcmp(type, "IDAT", 4)) {
+                if (!frame_started && !(i == 0 && info->hidden_default_image)) {
+                    const apng_frame_control *control = &info->controls[i];
+                    unsigned char fctl[22];
+                    png_save_uint_32(fctl, frames[i].width);
+                    png_save_uint_32(fctl+4, frames[i].height);
+                    png_save_uint_32(fctl+8, control->x_offset);
+                    png_save_uint_32(fctl+12, control->y_offset);
+                    png_save_uint_16(fctl+16, control->delay_num);
+                    png_save_uint_16(fctl+18, control->delay_den);
+                    fctl[20] = control->dispose_op;
+                    fctl[21] = control->blend_op;
+                    ok = rwpng_append_chunk(&out, "fcTL", &sequence, fctl, sizeof(fctl));
+                    sequence++;
+                }
+                frame_started = true;
+                if (i == 0) {
+                    ok = ok && rwpng_buffer_append(&out, frame.data + chunk_start, length + 12);
+                } else {
+                    ok = ok && rwpng_append_chunk(&out, "fdAT", &sequence, chunk, length);
+                    sequence++;
+                }
+            } else if (i == 0 && !memcmp(type, "IHDR", 4)) {
+                // the first image has the size of the canvas
+                unsigned char actl[8];
+                png_save_uint_32(actl, info->num_frames - (info->hidden_default_image ? 1 : 0));
+                png_save_uint_32(actl+4, info->num_plays);
+                ok = rwpng_buffer_append(&out, frame.data, pos) && rwpng_append_chunk(&out, "acTL", NULL, actl, sizeof(actl));
+            } else if (i == 0 && !frame_started && memcmp(type, "IEND", 4)) {
+                ok = rwpng_buffer_append(&out, frame.data + chunk_start, length + 12);
+            }
+            if (!ok) retval = PNG_OUT_OF_MEMORY_ERROR;
+        }
+    }
+
+    if (!retval && !rwpng_append_chunk(&out, "IEND", NULL, NULL, 0)) retval = PNG_OUT_OF_MEMORY_ERROR;
+    if (!retval && fwrite(out.data, 1, out.size, outfile) != out.size) retval = CANT_WRITE_ERROR;
+
+    free(out.data);
+    free(frame.data);
+    return retval;
+}
+
+
+static pngquant_error rwpng_write_image_init(png_image *mainprog_ptr, png_structpp png_ptr_p, png_infopp info_ptr_p, FILE *outfile, rwpng_buffer *outbuf)
 {
     /* could also replace libpng warning-handler (final NULL), but no need: */
 
@@ -240,7 +643,11 @@ pngquant_error rwpng_write_image_init(png_image *mainprog_ptr, png_structpp png_
         return LIBPNG_INIT_ERROR;   /* libpng error (via longjmp()) */
     }
 
-    png_init_io(*png_ptr_p, outfile);
+    if (outbuf) {
+        png_set_write_fn(*png_ptr_p, outbuf, user_write_data, user_flush_data);
+    } else {
+        png_init_io(*png_ptr_p, outfile);
+    }
 
     png_set_compression_level(*png_ptr_p, Z_BEST_COMPRESSION);
 
@@ -261,6 +668,35 @@ void rwpng_write_end(png_infopp info_ptr_p, png_structpp png_ptr_p, png_bytepp r
     png_destroy_write_struct(png_ptr_p, info_ptr_p);
 }
 
+/* same as rwpng_write_end(), but rows are written one by one as they're fetched from the callback */
+static pngquant_error rwpng_write_rows(png_infopp info_ptr_p, png_structpp png_ptr_p, png_uint_32 width, png_uint_32 height, rwpng_row_callback *get_row, void *user_info)
+{
+    png_bytep row = malloc(width);
+    if (!row) {
+        png_destroy_write_struct(png_ptr_p, info_ptr_p);
+        return OUT_OF_MEMORY_ERROR;
+    }
+
+    png_write_info(*png_ptr_p, *info_ptr_p);
+
+    png_set_packing(*png_ptr_p);
+
+    for(png_uint_32 i=0; i < height; i++) {
+        if (!get_row(row, user_info)) {
+            free(row);
+            png_destroy_write_struct(png_ptr_p, info_ptr_p);
+            return READ_ERROR;
+        }
+        png_write_row(*png_ptr_p, row);
+    }
+    free(row);
+
+    png_write_end(*png_ptr_p, NULL);
+
+    png_destroy_write_struct(png_ptr_p, info_ptr_p);
+    return SUCCESS;
+}
+
 void rwpng_set_gamma(png_infop info_ptr, png_structp png_ptr, double gamma)
 {
     if (gamma > 0.0) {
@@ -272,12 +708,12 @@ void rwpng_set_gamma(png_infop info_ptr, png_structp png_ptr, double gamma)
     }
 }
 
-pngquant_error rwpng_write_image8(FILE *outfile, png8_image *mainprog_ptr)
+static pngquant_error rwpng_write_image8_to(FILE *outfile, rwpng_buffer *outbuf, png8_image *mainprog_ptr, rwpng_row_callback *get_row, void *get_row_user_info)
 {
     png_structp png_ptr;
     png_infop info_ptr;
 
-    pngquant_error retval = rwpng_write_image_init((png_image*)mainprog_ptr, &png_ptr, &info_ptr, outfile);
+    pngquant_error retval = rwpng_write_image_init((png_image*)mainprog_ptr, &png_ptr, &info_ptr, outfile, outbuf);
     if (retval) return retval;
 
     // Palette images generally don't gain anything from filtering
@@ -306,6 +742,9 @@ pngquant_error rwpng_write_image8(FILE *outfile, png8_image *mainprog_ptr)
     if (mainprog_ptr->num_trans > 0)
         png_set_tRNS(png_ptr, info_ptr, mainprog_ptr->trans, mainprog_ptr->num_trans, NULL);
 
+    if (get_row) {
+        return rwpng_write_rows(&info_ptr, &png_ptr, mainprog_ptr->width, mainprog_ptr->height, get_row, get_row_user_info);
+    }
 
     png_bytepp row_pointers = rwpng_create_row_pointers(info_ptr, png_ptr, mainprog_ptr->indexed_data, mainprog_ptr->height, mainprog_ptr->width);
 
@@ -316,18 +755,18 @@ pngquant_error rwpng_write_image8(FILE *outfile, png8_image *mainprog_ptr)
     return SUCCESS;
 }
 
-pngquant_error rwpng_write_image24(FILE *outfile, png24_image *mainprog_ptr)
+static pngquant_error rwpng_write_image24_to(FILE *outfile, rwpng_buffer *outbuf, png24_image *mainprog_ptr)
 {
     png_structp png_ptr;
     png_infop info_ptr;
 
-    pngquant_error retval = rwpng_write_image_init((png_image*)mainprog_ptr, &png_ptr, &info_ptr, outfile);
+    pngquant_error retval = rwpng_write_image_init((png_image*)mainprog_ptr, &png_ptr, &info_ptr, outfile, outbuf);
     if (retval) return retval;
 
     rwpng_set_gamma(info_ptr, png_ptr, mainprog_ptr->gamma);
 
     png_set_IHDR(png_ptr, info_ptr, mainprog_ptr->width, mainprog_ptr->height,
-                 8, PNG_COLOR_TYPE_RGB_ALPHA,
+                 8, mainprog_ptr->channels == 3 ? PNG_COLOR_TYPE_RGB : PNG_COLOR_TYPE_RGB_ALPHA,
                  0, PNG_COMPRESSION_TYPE_DEFAULT,
                  PNG_FILTER_TYPE_BASE);
 
@@ -341,6 +780,31 @@ pngquant_error rwpng_write_image24(FILE *outfile, png24_image *mainprog_ptr)
     return SUCCESS;
 }
 
+pngquant_error rwpng_write_image8(FILE *outfile, png8_image *mainprog_ptr)
+{
+    return rwpng_write_image8_to(outfile, NULL, mainprog_ptr, NULL, NULL);
+}
+
+pngquant_error rwpng_write_image8_rows(FILE *outfile, png8_image *mainprog_ptr, rwpng_row_callback *get_row, void *user_info)
+{
+    return rwpng_write_image8_to(outfile, NULL, mainprog_ptr, get_row, user_info);
+}
+
+pngquant_error rwpng_write_image24(FILE *outfile, png24_image *mainprog_ptr)
+{
+    return rwpng_write_image24_to(outfile, NULL, mainprog_ptr);
+}
+
+pngquant_error rwpng_write_image8_buffer(rwpng_buffer *outbuf, png8_image *mainprog_ptr)
+{
+    return rwpng_write_image8_to(NULL, outbuf, mainprog_ptr, NULL, NULL);
+}
+
+pngquant_error rwpng_write_image24_buffer(rwpng_buffer *outbuf, png24_image *mainprog_ptr)
+{
+    return rwpng_write_image24_to(NULL, outbuf, mainprog_ptr);
+}
+
 
 static void rwpng_error_handler(png_structp png_ptr, png_const_charp msg)
 {
@@ -34,6 +34,7 @@
 
 #include "png.h"    /* libpng header; includes zlib.h */
 #include <setjmp.h>
+#include <stdbool.h>
 
 #ifndef USE_COCOA
 #define USE_COCOA 0
@@ -61,7 +62,10 @@ typedef struct {
     double gamma;
     unsigned char **row_pointers;
     unsigned char *rgba_data;
+    unsigned char channels; // 4 for RGBA, or 3 for RGB if the image is opaque
     png_size_t file_size;
+    /* optional, called after image memory is allocated and before it's decoded, e.g. to place memory pages */
+    void (*first_touch)(unsigned char **row_pointers, png_size_t rowbytes, png_uint_32 height);
 } png24_image;
 
 typedef struct {
@@ -76,6 +80,28 @@ typedef struct {
     unsigned char trans[256];
 } png8_image;
 
+/* fcTL chunk of a frame of an animated PNG (APNG) */
+typedef struct {
+    png_uint_32 x_offset, y_offset;
+    png_uint_16 delay_num, delay_den;
+    png_byte dispose_op, blend_op;
+} apng_frame_control;
+
+/* animated PNG. Each frame is an image of its own, covering a rectangle of the canvas */
+typedef struct {
+    png_uint_32 num_frames; // including the default image, if it's not a frame
+    png_uint_32 num_plays;
+    bool hidden_default_image; // the first image is shown only by viewers without APNG support, and has no fcTL
+    apng_frame_control *controls;
+    png_size_t file_size;
+} apng_info;
+
+/* growable in-memory output for the *_buffer writers; caller frees data */
+typedef struct {
+    unsigned char *data;
+    png_size_t size, capacity;
+} rwpng_buffer;
+
 typedef union {
     jmp_buf jmpbuf;
     png24_image png24;
@@ -87,8 +113,21 @@ typedef union {
 void rwpng_version_info(FILE *fp);
 
 pngquant_error rwpng_read_image24(FILE *infile, png24_image *mainprog_ptr);
+pngquant_error rwpng_read_image24_buffer(const unsigned char *buffer, size_t size, png24_image *mainprog_ptr);
+pngquant_error rwpng_read_dimensions(FILE *infile, png_uint_32 *width, png_uint_32 *height);
+/* decodes only num_rows rows starting at first_row, and the image's height is num_rows */
+pngquant_error rwpng_read_image24_rows(FILE *infile, png24_image *mainprog_ptr, png_uint_32 first_row, png_uint_32 num_rows);
+bool rwpng_is_apng(FILE *infile);
+pngquant_error rwpng_read_apng24(FILE *infile, apng_info *info, png24_image **frames_p);
+void rwpng_free_apng_info(apng_info *info);
 
 pngquant_error rwpng_write_image8(FILE *outfile, png8_image *mainprog_ptr);
 pngquant_error rwpng_write_image24(FILE *outfile, png24_image *mainprog_ptr);
+/* fetches the next row of indexed pixels (width bytes), so the whole image doesn't have to be in memory. Returns false on failure */
+typedef bool rwpng_row_callback(unsigned char *row, void *user_info);
+pngquant_error rwpng_write_image8_rows(FILE *outfile, png8_image *mainprog_ptr, rwpng_row_callback *get_row, void *user_info);
+pngquant_error rwpng_write_image8_buffer(rwpng_buffer *outbuf, png8_image *mainprog_ptr);
+pngquant_error rwpng_write_image24_buffer(rwpng_buffer *outbuf, png24_image *mainprog_ptr);
+pngquant_error rwpng_write_apng8(FILE *outfile, const apng_info *info, png8_image frames[]);
 
 #endif
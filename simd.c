@@ -0,0 +1,448 @@
+/*
+ Kernels for SSE2, AVX2 and AVX-512 are compiled with target attributes, so the rest of the library
+ (and the binary's baseline) doesn't require these instruction sets.
+
+ Distances are computed with exactly the same float operations in the same order as SSE colordifference()
+ in pam.h: (onwhite² + onblack²) summed as g + (r + b). Makefile builds this file with -ffp-contract=off,
+ so that AVX-512 versions aren't fused into FMA, which would round differently.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "pam.h"
+#include "simd.h"
+
+#if USE_SSE && (defined(__GNUC__) || defined(__clang__))
+#define SIMD_DISPATCH 1
+#include <immintrin.h>
+#else
+#define SIMD_DISPATCH 0
+#endif
+
+inline static double variance_diff(double val, const double good_enough) ALWAYS_INLINE;
+inline static double variance_diff(double val, const double good_enough)
+{
+    val *= val;
+    if (val < good_enough*good_enough) return val*0.5;
+    return val;
+}
+
+static void variance_generic(const hist_item items[], unsigned int count, f_pixel mean, double variance[4])
+{
+    double variancea=0, variancer=0, varianceg=0, varianceb=0;
+
+    for(unsigned int i = 0; i < count; ++i) {
+        f_pixel px = items[i].acolor;
+        double weight = items[i].adjusted_weight;
+        variancea += variance_diff(mean.a - px.a, 2.0/256.0)*weight;
+        variancer += variance_diff(mean.r - px.r, 1.0/256.0)*weight;
+        varianceg += variance_diff(mean.g - px.g, 1.0/256.0)*weight;
+        varianceb += variance_diff(mean.b - px.b, 1.0/256.0)*weight;
+    }
+
+    variance[0] = variancea;
+    variance[1] = variancer;
+    variance[2] = varianceg;
+    variance[3] = varianceb;
+}
+
+static void variance_rgb_generic(const hist_item items[], unsigned int count, f_pixel mean, double variance[4])
+{
+    double variancer=0, varianceg=0, varianceb=0;
+
+    for(unsigned int i = 0; i < count; ++i) {
+        f_pixel px = items[i].acolor;
+        double weight = items[i].adjusted_weight;
+        variancer += variance_diff(mean.r - px.r, 1.0/256.0)*weight;
+        varianceg += variance_diff(mean.g - px.g, 1.0/256.0)*weight;
+        varianceb += variance_diff(mean.b - px.b, 1.0/256.0)*weight;
+    }
+
+    variance[0] = 0;
+    variance[1] = variancer;
+    variance[2] = varianceg;
+    variance[3] = varianceb;
+}
+
+/* picks lowest index of the smallest distance, same as a loop over colors in order would */
+static unsigned int nearest_reduce(const float dists[], const unsigned int indices[], unsigned int lanes, float *dist)
+{
+    unsigned int best = indices[0];
+    float best_dist = dists[0];
+    for(unsigned int i=1; i < lanes; i++) {
+        if (dists[i] < best_dist || (dists[i] == best_dist && indices[i] < best)) {
+            best_dist = dists[i];
+            best = indices[i];
+        }
+    }
+    *dist = best_dist;
+    return best;
+}
+
+#if SIMD_DISPATCH
+
+__attribute__((target("sse2")))
+static unsigned int nearest_scan_sse2(const float *channels, unsigned int stride, unsigned int count, f_pixel px, float penalty, float *dist)
+{
+    const __m128 pa = _mm_set1_ps(px.a), pr = _mm_set1_ps(px.r), pg = _mm_set1_ps(px.g), pb = _mm_set1_ps(px.b);
+    const __m128 vpenalty = _mm_set1_ps(penalty), one = _mm_set1_ps(1.f);
+
+    __m128 best_dist = _mm_set1_ps(MAX_DIFF);
+    __m128i best = _mm_setzero_si128(), index = _mm_setr_epi32(0,1,2,3);
+    const __m128i step = _mm_set1_epi32(4);
+
+    for(unsigned int i=0; i < count; i += 4) {
+        const __m128 ca = _mm_loadu_ps(&channels[i]);
+        const __m128 alphas = _mm_sub_ps(ca, pa);
+
+        __m128 onblack = _mm_sub_ps(pr, _mm_loadu_ps(&channels[stride + i]));
+        __m128 onwhite = _mm_add_ps(onblack, alphas);
+        const __m128 dr = _mm_add_ps(_mm_mul_ps(onwhite, onwhite), _mm_mul_ps(onblack, onblack));
+
+        onblack = _mm_sub_ps(pg, _mm_loadu_ps(&channels[stride*2 + i]));
+        onwhite = _mm_add_ps(onblack, alphas);
+        const __m128 dg = _mm_add_ps(_mm_mul_ps(onwhite, onwhite), _mm_mul_ps(onblack, onblack));
+
+        onblack = _mm_sub_ps(pb, _mm_loadu_ps(&channels[stride*3 + i]));
+        onwhite = _mm_add_ps(onblack, alphas);
+        const __m128 db = _mm_add_ps(_mm_mul_ps(onwhite, onwhite), _mm_mul_ps(onblack, onblack));
+
+        __m128 d = _mm_add_ps(dg, _mm_add_ps(dr, db));
+        d = _mm_add_ps(d, _mm_and_ps(_mm_cmplt_ps(ca, one), vpenalty));
+
+        const __m128 closer = _mm_cmplt_ps(d, best_dist);
+        best_dist = _mm_or_ps(_mm_and_ps(closer, d), _mm_andnot_ps(closer, best_dist));
+        best = _mm_or_si128(_mm_and_si128(_mm_castps_si128(closer), index), _mm_andnot_si128(_mm_castps_si128(closer), best));
+        index = _mm_add_epi32(index, step);
+    }
+
+    float dists[4]; unsigned int indices[4];
+    _mm_storeu_ps(dists, best_dist);
+    _mm_storeu_si128((__m128i*)indices, best);
+    return nearest_reduce(dists, indices, 4, dist);
+}
+
+__attribute__((target("avx2")))
+static unsigned int nearest_scan_avx2(const float *channels, unsigned int stride, unsigned int count, f_pixel px, float penalty, float *dist)
+{
+    const __m256 pa = _mm256_set1_ps(px.a), pr = _mm256_set1_ps(px.r), pg = _mm256_set1_ps(px.g), pb = _mm256_set1_ps(px.b);
+    const __m256 vpenalty = _mm256_set1_ps(penalty), one = _mm256_set1_ps(1.f);
+
+    __m256 best_dist = _mm256_set1_ps(MAX_DIFF);
+    __m256i best = _mm256_setzero_si256(), index = _mm256_setr_epi32(0,1,2,3,4,5,6,7);
+    const __m256i step = _mm256_set1_epi32(8);
+
+    for(unsigned int i=0; i < count; i += 8) {
+        const __m256 ca = _mm256_loadu_ps(&channels[i]);
+        const __m256 alphas = _mm256_sub_ps(ca, pa);
+
+        __m256 onblack = _mm256_sub_ps(pr, _mm256_loadu_ps(&channels[stride + i]));
+        __m256 onwhite = _mm256_add_ps(onblack, alphas);
+        const __m256 dr = _mm256_add_ps(_mm256_mul_ps(onwhite, onwhite), _mm256_mul_ps(onblack, onblack));
+
+        onblack = _mm256_sub_ps(pg, _mm256_loadu_ps(&channels[stride*2 + i]));
+        onwhite = _mm256_add_ps(onblack, alphas);
+        const __m256 dg = _mm256_add_ps(_mm256_mul_ps(onwhite, onwhite), _mm256_mul_ps(onblack, onblack));
+
+        onblack = _mm256_sub_ps(pb, _mm256_loadu_ps(&channels[stride*3 + i]));
+        onwhite = _mm256_add_ps(onblack, alphas);
+        const __m256 db = _mm256_add_ps(_mm256_mul_ps(onwhite, onwhite), _mm256_mul_ps(onblack, onblack));
+
+        __m256 d = _mm256_add_ps(dg, _mm256_add_ps(dr, db));
+        d = _mm256_add_ps(d, _mm256_and_ps(_mm256_cmp_ps(ca, one, _CMP_LT_OQ), vpenalty));
+
+        const __m256 closer = _mm256_cmp_ps(d, best_dist, _CMP_LT_OQ);
+        best_dist = _mm256_blendv_ps(best_dist, d, closer);
+        best = _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(best), _mm256_castsi256_ps(index), closer));
+        index = _mm256_add_epi32(index, step);
+    }
+
+    float dists[8]; unsigned int indices[8];
+    _mm256_storeu_ps(dists, best_dist);
+    _mm256_storeu_si256((__m256i*)indices, best);
+    return nearest_reduce(dists, indices, 8, dist);
+}
+
+__attribute__((target("avx512f")))
+static unsigned int nearest_scan_avx512(const float *channels, unsigned int stride, unsigned int count, f_pixel px, float penalty, float *dist)
+{
+    const __m512 pa = _mm512_set1_ps(px.a), pr = _mm512_set1_ps(px.r), pg = _mm512_set1_ps(px.g), pb = _mm512_set1_ps(px.b);
+    const __m512 vpenalty = _mm512_set1_ps(penalty), one = _mm512_set1_ps(1.f);
+
+    __m512 best_dist = _mm512_set1_ps(MAX_DIFF);
+    __m512i best = _mm512_setzero_si512(), index = _mm512_setr_epi32(0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15);
+    const __m512i step = _mm512_set1_epi32(16);
+
+    for(unsigned int i=0; i < count; i += 16) {
+        const __m512 ca = _mm512_loadu_ps(&channels[i]);
+        const __m512 alphas = _mm512_sub_ps(ca, pa);
+
+        __m512 onblack = _mm512_sub_ps(pr, _mm512_loadu_ps(&channels[stride + i]));
+        __m512 onwhite = _mm512_add_ps(onblack, alphas);
+        const __m512 dr = _mm512_add_ps(_mm512_mul_ps(onwhite, onwhite), _mm512_mul_ps(onblack, onblack));
+
+        onblack = _mm512_sub_ps(pg, _mm512_loadu_ps(&channels[stride*2 + i]));
+        onwhite = _mm512_add_ps(onblack, alphas);
+        const __m512 dg = _mm512_add_ps(_mm512_mul_ps(onwhite, onwhite), _mm512_mul_ps(onblack, onblack));
+
+        onblack = _mm512_sub_ps(pb, _mm512_loadu_ps(&channels[stride*3 + i]));
+        onwhite = _mm512_add_ps(onblack, alphas);
+        const __m512 db = _mm512_add_ps(_mm512_mul_ps(onwhite, onwhite), _mm512_mul_ps(onblack, onblack));
+
+        __m512 d = _mm512_add_ps(dg, _mm512_add_ps(dr, db));
+        d = _mm512_mask_add_ps(d, _mm512_cmp_ps_mask(ca, one, _CMP_LT_OQ), d, vpenalty);
+
+        const __mmask16 closer = _mm512_cmp_ps_mask(d, best_dist, _CMP_LT_OQ);
+        best_dist = _mm512_mask_mov_ps(best_dist, closer, d);
+        best = _mm512_mask_mov_epi32(best, closer, index);
+        index = _mm512_add_epi32(index, step);
+    }
+
+    float dists[16]; unsigned int indices[16];
+    _mm512_storeu_ps(dists, best_dist);
+    _mm512_storeu_si512(indices, best);
+    return nearest_reduce(dists, indices, 16, dist);
+}
+
+/*
+ For opaque colors alphas are 0, so onwhite is the same as onblack and each channel's distance is onblack² + onblack²,
+ which gives exactly the same floats as the kernels above.
+ */
+__attribute__((target("sse2")))
+static unsigned int nearest_scan_rgb_sse2(const float *channels, unsigned int stride, unsigned int count, f_pixel px, float *dist)
+{
+    const __m128 pr = _mm_set1_ps(px.r), pg = _mm_set1_ps(px.g), pb = _mm_set1_ps(px.b);
+
+    __m128 best_dist = _mm_set1_ps(MAX_DIFF);
+    __m128i best = _mm_setzero_si128(), index = _mm_setr_epi32(0,1,2,3);
+    const __m128i step = _mm_set1_epi32(4);
+
+    for(unsigned int i=0; i < count; i += 4) {
+        __m128 diff = _mm_sub_ps(pr, _mm_loadu_ps(&channels[stride + i]));
+        diff = _mm_mul_ps(diff, diff);
+        const __m128 dr = _mm_add_ps(diff, diff);
+
+        diff = _mm_sub_ps(pg, _mm_loadu_ps(&channels[stride*2 + i]));
+        diff = _mm_mul_ps(diff, diff);
+        const __m128 dg = _mm_add_ps(diff, diff);
+
+        diff = _mm_sub_ps(pb, _mm_loadu_ps(&channels[stride*3 + i]));
+        diff = _mm_mul_ps(diff, diff);
+        const __m128 db = _mm_add_ps(diff, diff);
+
+        const __m128 d = _mm_add_ps(dg, _mm_add_ps(dr, db));
+
+        const __m128 closer = _mm_cmplt_ps(d, best_dist);
+        best_dist = _mm_or_ps(_mm_and_ps(closer, d), _mm_andnot_ps(closer, best_dist));
+        best = _mm_or_si128(_mm_and_si128(_mm_castps_si128(closer), index), _mm_andnot_si128(_mm_castps_si128(closer), best));
+        index = _mm_add_epi32(index, step);
+    }
+
+    float dists[4]; unsigned int indices[4];
+    _mm_storeu_ps(dists, best_dist);
+    _mm_storeu_si128((__m128i*)indices, best);
+    return nearest_reduce(dists, indices, 4, dist);
+}
+
+__attribute__((target("avx2")))
+static unsigned int nearest_scan_rgb_avx2(const float *channels, unsigned int stride, unsigned int count, f_pixel px, float *dist)
+{
+    const __m256 pr = _mm256_set1_ps(px.r), pg = _mm256_set1_ps(px.g), pb = _mm256_set1_ps(px.b);
+
+    __m256 best_dist = _mm256_set1_ps(MAX_DIFF);
+    __m256i best = _mm256_setzero_si256(), index = _mm256_setr_epi32(0,1,2,3,4,5,6,7);
+    const __m256i step = _mm256_set1_epi32(8);
+
+    for(unsigned int i=0; i < count; i += 8) {
+        __m256 diff = _mm256_sub_ps(pr, _mm256_loadu_ps(&channels[stride + i]));
+        diff = _mm256_mul_ps(diff, diff);
+        const __m256 dr = _mm256_add_ps(diff, diff);
+
+        diff = _mm256_sub_ps(pg, _mm256_loadu_ps(&channels[stride*2 + i]));
+        diff = _mm256_mul_ps(diff, diff);
+        const __m256 dg = _mm256_add_ps(diff, diff);
+
+        diff = _mm256_sub_ps(pb, _mm256_loadu_ps(&channels[stride*3 + i]));
+        diff = _mm256_mul_ps(diff, diff);
+        const __m256 db = _mm256_add_ps(diff, diff);
+
+        const __m256 d = _mm256_add_ps(dg, _mm256_add_ps(dr, db));
+
+        const __m256 closer = _mm256_cmp_ps(d, best_dist, _CMP_LT_OQ);
+        best_dist = _mm256_blendv_ps(best_dist, d, closer);
+        best = _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(best), _mm256_castsi256_ps(index), closer));
+        index = _mm256_add_epi32(index, step);
+    }
+
+    float dists[8]; unsigned int indices[8];
+    _mm256_storeu_ps(dists, best_dist);
+    _mm256_storeu_si256((__m256i*)indices, best);
+    return nearest_reduce(dists, indices, 8, dist);
+}
+
+__attribute__((target("avx512f")))
+static unsigned int nearest_scan_rgb_avx512(const float *channels, unsigned int stride, unsigned int count, f_pixel px, float *dist)
+{
+    const __m512 pr = _mm512_set1_ps(px.r), pg = _mm512_set1_ps(px.g), pb = _mm512_set1_ps(px.b);
+
+    __m512 best_dist = _mm512_set1_ps(MAX_DIFF);
+    __m512i best = _mm512_setzero_si512(), index = _mm512_setr_epi32(0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15);
+    const __m512i step = _mm512_set1_epi32(16);
+
+    for(unsigned int i=0; i < count; i += 16) {
+        __m512 diff = _mm512_sub_ps(pr, _mm512_loadu_ps(&channels[stride + i]));
+        diff = _mm512_mul_ps(diff, diff);
+        const __m512 dr = _mm512_add_ps(diff, diff);
+
+        diff = _mm512_sub_ps(pg, _mm512_loadu_ps(&channels[stride*2 + i]));
+        diff = _mm512_mul_ps(diff, diff);
+        const __m512 dg = _mm512_add_ps(diff, diff);
+
+        diff = _mm512_sub_ps(pb, _mm512_loadu_ps(&channels[stride*3 + i]));
+        diff = _mm512_mul_ps(diff, diff);
+        const __m512 db = _mm512_add_ps(diff, diff);
+
+        const __m512 d = _mm512_add_ps(dg, _mm512_add_ps(dr, db));
+
+        const __mmask16 closer = _mm512_cmp_ps_mask(d, best_dist, _CMP_LT_OQ);
+        best_dist = _mm512_mask_mov_ps(best_dist, closer, d);
+        best = _mm512_mask_mov_epi32(best, closer, index);
+        index = _mm512_add_epi32(index, step);
+    }
+
+    float dists[16]; unsigned int indices[16];
+    _mm512_storeu_ps(dists, best_dist);
+    _mm512_storeu_si512(indices, best);
+    return nearest_reduce(dists, indices, 16, dist);
+}
+
+/* each channel is accumulated separately in the same order as in the generic loop, so sums are identical */
+__attribute__((target("sse2")))
+static void variance_sse2(const hist_item items[], unsigned int count, f_pixel mean, double variance[4])
+{
+    const __m128 vmean = _mm_load_ps((const float*)&mean);
+    const __m128d good_enough_ar = _mm_setr_pd(2.0/256.0 * 2.0/256.0, 1.0/256.0 * 1.0/256.0),
+                  good_enough_gb = _mm_set1_pd(1.0/256.0 * 1.0/256.0), half = _mm_set1_pd(0.5);
+    __m128d sum_ar = _mm_setzero_pd(), sum_gb = _mm_setzero_pd();
+
+    for(unsigned int i=0; i < count; i++) {
+        const __m128 diff = _mm_sub_ps(vmean, _mm_load_ps((const float*)&items[i].acolor));
+        const __m128d weight = _mm_set1_pd(items[i].adjusted_weight);
+
+        __m128d ar = _mm_cvtps_pd(diff), gb = _mm_cvtps_pd(_mm_movehl_ps(diff, diff));
+        ar = _mm_mul_pd(ar, ar);
+        gb = _mm_mul_pd(gb, gb);
+        const __m128d small_ar = _mm_cmplt_pd(ar, good_enough_ar), small_gb = _mm_cmplt_pd(gb, good_enough_gb);
+        ar = _mm_or_pd(_mm_and_pd(small_ar, _mm_mul_pd(ar, half)), _mm_andnot_pd(small_ar, ar));
+        gb = _mm_or_pd(_mm_and_pd(small_gb, _mm_mul_pd(gb, half)), _mm_andnot_pd(small_gb, gb));
+
+        sum_ar = _mm_add_pd(sum_ar, _mm_mul_pd(ar, weight));
+        sum_gb = _mm_add_pd(sum_gb, _mm_mul_pd(gb, weight));
+    }
+
+    _mm_storeu_pd(&variance[0], sum_ar);
+    _mm_storeu_pd(&variance[2], sum_gb);
+}
+
+__attribute__((target("avx2")))
+static void variance_avx2(const hist_item items[], unsigned int count, f_pixel mean, double variance[4])
+{
+    const __m128 vmean = _mm_load_ps((const float*)&mean);
+    const __m256d good_enough = _mm256_setr_pd(2.0/256.0 * 2.0/256.0, 1.0/256.0 * 1.0/256.0, 1.0/256.0 * 1.0/256.0, 1.0/256.0 * 1.0/256.0),
+                  half = _mm256_set1_pd(0.5);
+    __m256d sum = _mm256_setzero_pd();
+
+    for(unsigned int i=0; i < count; i++) {
+        const __m128 diff = _mm_sub_ps(vmean, _mm_load_ps((const float*)&items[i].acolor));
+        __m256d sq = _mm256_cvtps_pd(diff);
+        sq = _mm256_mul_pd(sq, sq);
+        sq = _mm256_blendv_pd(sq, _mm256_mul_pd(sq, half), _mm256_cmp_pd(sq, good_enough, _CMP_LT_OQ));
+        sum = _mm256_add_pd(sum, _mm256_mul_pd(sq, _mm256_set1_pd(items[i].adjusted_weight)));
+    }
+
+    _mm256_storeu_pd(variance, sum);
+}
+
+#endif
+
+struct simd_kernels simd = {
+    .nearest_scan = NULL,
+    .nearest_scan_rgb = NULL,
+    .variance = variance_generic,
+    .variance_rgb = variance_rgb_generic,
+};
+
+static simd_isa selected_isa = SIMD_GENERIC;
+static bool initialized = false;
+
+static const char *const isa_names[SIMD_ISAS] = {
+    [SIMD_GENERIC] = "generic",
+    [SIMD_SSE2] = "sse2",
+    [SIMD_AVX2] = "avx2",
+    [SIMD_AVX512] = "avx512",
+};
+
+static simd_isa detect_isa(void)
+{
+#if SIMD_DISPATCH
+    // also checks that the OS saves AVX registers
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) return SIMD_AVX512;
+    if (__builtin_cpu_supports("avx2")) return SIMD_AVX2;
+    if (__builtin_cpu_supports("sse2")) return SIMD_SSE2;
+#endif
+    return SIMD_GENERIC;
+}
+
+void simd_init(void)
+{
+    if (initialized) return;
+
+    simd_isa isa = detect_isa();
+
+    // can't go above what the CPU supports
+    const char *requested = getenv("LIQ_ISA");
+    if (requested) {
+        for(unsigned int i=0; i < SIMD_ISAS; i++) {
+            if (0 == strcmp(requested, isa_names[i]) && i < isa) isa = i;
+        }
+    }
+
+    switch (isa) {
+#if SIMD_DISPATCH
+        // alpha takes a vector lane that is free anyway, so these variance kernels are used for opaque colors too
+        case SIMD_AVX512:
+            // variance has only 4 channels, so AVX-512 wouldn't help it
+            simd.nearest_scan = nearest_scan_avx512;
+            simd.nearest_scan_rgb = nearest_scan_rgb_avx512;
+            simd.variance = simd.variance_rgb = variance_avx2;
+            break;
+        case SIMD_AVX2:
+            simd.nearest_scan = nearest_scan_avx2;
+            simd.nearest_scan_rgb = nearest_scan_rgb_avx2;
+            simd.variance = simd.variance_rgb = variance_avx2;
+            break;
+        case SIMD_SSE2:
+            simd.nearest_scan = nearest_scan_sse2;
+            simd.nearest_scan_rgb = nearest_scan_rgb_sse2;
+            simd.variance = simd.variance_rgb = variance_sse2;
+            break;
+#endif
+        default:
+            simd.nearest_scan = NULL;
+            simd.nearest_scan_rgb = NULL;
+            simd.variance = variance_generic;
+            simd.variance_rgb = variance_rgb_generic;
+            isa = SIMD_GENERIC;
+    }
+
+    selected_isa = isa;
+    initialized = true;
+}
+
+const char *simd_isa_name(void)
+{
+    simd_init();
+    return isa_names[selected_isa];
+}
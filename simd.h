@@ -0,0 +1,49 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+/*
+ Kernels of the hottest loops, compiled for several instruction sets and chosen at run time
+ for the best one the CPU supports, so that a generic x86-64 binary can use AVX2 and AVX-512.
+ All versions give bit-identical results, so the choice affects only speed.
+
+ LIQ_ISA environment variable (generic, sse2, avx2 or avx512) selects a lower instruction set for testing.
+ */
+
+typedef enum {
+    SIMD_GENERIC, // one color at a time, with colordifference() from pam.h (which uses SSE2 when compiled for it)
+    SIMD_SSE2,
+    SIMD_AVX2,
+    SIMD_AVX512,
+    SIMD_ISAS
+} simd_isa;
+
+// arrays for simd.nearest_scan are padded to a multiple of this many colors
+#define SIMD_PADDING 16
+#define SIMD_PADDED(count) (((count) + SIMD_PADDING-1) / SIMD_PADDING * SIMD_PADDING)
+// value of padding that is never the nearest color
+#define SIMD_PADDING_COLOR 1e6f
+
+struct simd_kernels {
+    /*
+     Index of the nearest of count colors stored as arrays of a, r, g and b channels, each stride floats apart.
+     penalty is added to distance of colors that aren't opaque. Distance is written to *dist.
+     NULL for generic, which compares colors one at a time in nearest.c.
+     */
+    unsigned int (*nearest_scan)(const float *channels, unsigned int stride, unsigned int count, f_pixel px, float penalty, float *dist);
+
+    /* same as nearest_scan for an opaque px and opaque colors, skipping the alpha channel (and penalty, which is only for non-opaque colors) */
+    unsigned int (*nearest_scan_rgb)(const float *channels, unsigned int stride, unsigned int count, f_pixel px, float *dist);
+
+    /* sums of weighted (squared) differences from mean in a, r, g and b channels, for box_variance() in mediancut.c */
+    void (*variance)(const hist_item items[], unsigned int count, f_pixel mean, double variance[4]);
+
+    /* same for opaque colors, where variance of alpha is 0 */
+    void (*variance_rgb)(const hist_item items[], unsigned int count, f_pixel mean, double variance[4]);
+};
+
+extern struct simd_kernels simd;
+
+void simd_init(void); // detects CPU. Until it's called generic kernels are used
+const char *simd_isa_name(void);
+
+#endif
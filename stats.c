@@ -0,0 +1,339 @@
+
+#if !defined(WIN32) && !defined(__WIN32__)
+#define _POSIX_C_SOURCE 200112L /* clock_gettime() */
+#endif
+#ifdef __linux__
+#define _DEFAULT_SOURCE /* syscall() */
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#ifdef __linux__
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#include "stats.h"
+
+/*
+ Wall time is measured with monotonic clock, CPU time and hardware events only for the calling thread
+ (work done by other threads of the thread pool is not included).
+ */
+
+#ifdef __linux__
+static const struct {
+    uint32_t type;
+    uint64_t config;
+} hw_event_configs[STATS_HW_EVENTS] = {
+    [STATS_HW_CYCLES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    [STATS_HW_INSTRUCTIONS] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    [STATS_HW_CACHE_MISSES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    [STATS_HW_BRANCH_MISSES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    [STATS_HW_DTLB_MISSES] = {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+};
+#endif
+
+bool stats_hw_open(struct liq_stats *stats)
+{
+    stats_hw_close(stats);
+#ifdef __linux__
+    for(unsigned int i=0; i < STATS_HW_EVENTS; i++) {
+        struct perf_event_attr attr = {
+            .size = sizeof(attr),
+            .type = hw_event_configs[i].type,
+            .config = hw_event_configs[i].config,
+            .read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING,
+            .exclude_kernel = 1,
+            .exclude_hv = 1,
+        };
+        const int fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+        if (fd >= 0) {
+            stats->hw_fd[i] = fd;
+            stats->hw_events |= 1u << i;
+        }
+    }
+#endif
+    return stats->hw_events != 0;
+}
+
+void stats_hw_close(struct liq_stats *stats)
+{
+#ifdef __linux__
+    for(unsigned int i=0; i < STATS_HW_EVENTS; i++) {
+        if (stats->hw_events & (1u << i)) close(stats->hw_fd[i]);
+    }
+#endif
+    stats->hw_events = 0;
+}
+
+static void stats_hw_read(const struct liq_stats *stats, double hw[])
+{
+#ifdef __linux__
+    for(unsigned int i=0; i < STATS_HW_EVENTS; i++) {
+        uint64_t value[3]; // count, time enabled, time running
+        if ((stats->hw_events & (1u << i)) && read(stats->hw_fd[i], value, sizeof(value)) == sizeof(value) && value[2]) {
+            // the count is extrapolated to the whole time when the counter had to be shared with other events
+            hw[i] = (double)value[0] * value[1] / value[2];
+        }
+    }
+#endif
+}
+
+static stats_time stats_now(const struct liq_stats *stats)
+{
+#if defined(CLOCK_MONOTONIC) && defined(CLOCK_THREAD_CPUTIME_ID)
+    struct timespec wall, cpu;
+    clock_gettime(CLOCK_MONOTONIC, &wall);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu);
+    stats_time now = {
+        .wall = wall.tv_sec + wall.tv_nsec/1e9,
+        .cpu = cpu.tv_sec + cpu.tv_nsec/1e9,
+    };
+#else
+    const double cpu = (double)clock() / CLOCKS_PER_SEC;
+    stats_time now = {.wall = cpu, .cpu = cpu};
+#endif
+    if (stats->hw_events) stats_hw_read(stats, now.hw);
+    return now;
+}
+
+stats_time stats_start(struct liq_stats *stats)
+{
+    if (!stats) return (stats_time){0,0};
+    stats->mem_stage_peak = stats->mem_live;
+    return stats_now(stats);
+}
+
+static stats_time stats_elapsed(const struct liq_stats *stats, stats_time start)
+{
+    stats_time t = stats_now(stats);
+    t.wall -= start.wall;
+    t.cpu -= start.cpu;
+    for(unsigned int i=0; i < STATS_HW_EVENTS; i++) t.hw[i] -= start.hw[i];
+    return t;
+}
+
+void stats_end(struct liq_stats *stats, stats_stage stage, stats_time start)
+{
+    if (!stats) return;
+
+    const stats_time t = stats_elapsed(stats, start);
+    stats->stage[stage].wall += t.wall;
+    stats->stage[stage].cpu += t.cpu;
+    for(unsigned int i=0; i < STATS_HW_EVENTS; i++) stats->stage[stage].hw[i] += t.hw[i];
+    stats->stage_count[stage]++;
+    if (stats->stage_mem_peak[stage] < stats->mem_stage_peak) {
+        stats->stage_mem_peak[stage] = stats->mem_stage_peak;
+    }
+}
+
+void stats_end_trial(struct liq_stats *stats, stats_time start)
+{
+    if (!stats) return;
+
+    if (stats->trials < STATS_MAX_TRIALS) {
+        stats->trial[stats->trials] = stats_elapsed(stats, start);
+    }
+    stats->trials++;
+    stats_end(stats, STATS_PALETTE_SEARCH, start);
+}
+
+/* size and owner of the block are stored in front of it. 16 bytes keep blocks aligned for SSE */
+typedef union {
+    struct {
+        size_t size;
+        struct liq_stats *owner;
+    } info;
+    char align[16];
+} mem_header;
+
+static __thread struct liq_stats *stats_current;
+
+struct liq_stats *stats_set_current(struct liq_stats *stats)
+{
+    struct liq_stats *const prev = stats_current;
+    stats_current = stats;
+    return prev;
+}
+
+void stats_mem_add(struct liq_stats *stats, size_t size)
+{
+    if (!stats) return;
+
+    stats->mem_live += size;
+    if (stats->mem_peak < stats->mem_live) stats->mem_peak = stats->mem_live;
+    if (stats->mem_stage_peak < stats->mem_live) stats->mem_stage_peak = stats->mem_live;
+}
+
+void stats_mem_sub(struct liq_stats *stats, size_t size)
+{
+    if (!stats) return;
+    stats->mem_live -= size;
+}
+
+void *stats_malloc(size_t size)
+{
+    if (size > (size_t)-1 - sizeof(mem_header)) return NULL;
+
+    mem_header *h = malloc(sizeof(*h) + size);
+    if (!h) return NULL;
+
+    h->info.size = size;
+    h->info.owner = stats_current;
+    stats_mem_add(stats_current, size);
+    return h+1;
+}
+
+void *stats_calloc(size_t count, size_t size)
+{
+    if (size && count > ((size_t)-1 - sizeof(mem_header)) / size) return NULL;
+
+    void *ptr = stats_malloc(count * size);
+    if (ptr) memset(ptr, 0, count * size);
+    return ptr;
+}
+
+void stats_free(void *ptr)
+{
+    if (!ptr) return;
+
+    mem_header *h = (mem_header *)ptr - 1;
+    stats_mem_sub(h->info.owner, h->info.size);
+    free(h);
+}
+
+#ifdef LIQ_COUNTERS
+__thread struct liq_counters liq_thread_counters;
+
+static void counters_sum(struct liq_counters *dst, const struct liq_counters *src)
+{
+    dst->hash_pixels += src->hash_pixels;
+    dst->hash_probes += src->hash_probes;
+    if (dst->hash_longest_chain < src->hash_longest_chain) dst->hash_longest_chain = src->hash_longest_chain;
+    dst->hash_chain_allocs += src->hash_chain_allocs;
+    dst->hash_chain_reallocs += src->hash_chain_reallocs;
+    dst->nearest_searches += src->nearest_searches;
+    dst->nearest_heads += src->nearest_heads;
+    dst->nearest_candidates += src->nearest_candidates;
+    dst->floyd_tolerance_checks += src->floyd_tolerance_checks;
+    dst->floyd_tolerance_hits += src->floyd_tolerance_hits;
+    dst->boxes_split += src->boxes_split;
+    dst->sort_partitions += src->sort_partitions;
+}
+
+void counters_add(const struct liq_counters *src)
+{
+    counters_sum(&liq_thread_counters, src);
+}
+
+void counters_flush(struct liq_counters *dst)
+{
+    if (dst) {
+        // dst may be shared by all tasks of a parallel loop
+        static pthread_mutex_t counters_lock = PTHREAD_MUTEX_INITIALIZER;
+        pthread_mutex_lock(&counters_lock);
+        counters_sum(dst, &liq_thread_counters);
+        pthread_mutex_unlock(&counters_lock);
+    }
+    liq_thread_counters = (struct liq_counters){0};
+}
+#endif
+
+static const char *const stage_names[STATS_STAGES] = {
+    [STATS_READ] = "read",
+    [STATS_MODIFY_ALPHA] = "modify_alpha",
+    [STATS_PYRAMID] = "pyramid_level",
+    [STATS_CONTRAST_MAPS] = "contrast_maps",
+    [STATS_HISTOGRAM] = "histogram",
+    [STATS_QUALITY_ESTIMATE] = "quality_estimate",
+    [STATS_PALETTE_SEARCH] = "find_best_palette",
+    [STATS_VORONOI] = "voronoi",
+    [STATS_REMAP] = "remap",
+    [STATS_DITHER_MAP] = "update_dither_map",
+    [STATS_FLOYD] = "floyd",
+    [STATS_WRITE] = "write",
+};
+
+void json_write_string(FILE *fp, const char *str)
+{
+    fputc('"', fp);
+    for(; *str; str++) {
+        const unsigned char c = *str;
+        if (c == '"' || c == '\\') {
+            fputc('\\', fp); fputc(c, fp);
+        } else if (c < 0x20) {
+            fprintf(fp, "\\u%04x", c);
+        } else {
+            fputc(c, fp);
+        }
+    }
+    fputc('"', fp);
+}
+
+static const char *const hw_event_names[STATS_HW_EVENTS] = {
+    [STATS_HW_CYCLES] = "cycles",
+    [STATS_HW_INSTRUCTIONS] = "instructions",
+    [STATS_HW_CACHE_MISSES] = "cache_misses",
+    [STATS_HW_BRANCH_MISSES] = "branch_misses",
+    [STATS_HW_DTLB_MISSES] = "dtlb_misses",
+};
+
+/* object with stages that were run, times in milliseconds, memory in bytes, and hardware events that could be counted */
+void stats_write_stages_json(FILE *fp, const struct liq_stats *stats)
+{
+    fputc('{', fp);
+    bool first = true;
+    for(unsigned int i=0; i < STATS_STAGES; i++) {
+        if (!stats->stage_count[i]) continue;
+        fprintf(fp, "%s\"%s\":{\"wall_ms\":%.3f,\"cpu_ms\":%.3f,\"count\":%u,\"mem_peak\":%lu", first ? "" : ",",
+                stage_names[i], stats->stage[i].wall*1000.0, stats->stage[i].cpu*1000.0, stats->stage_count[i],
+                (unsigned long)stats->stage_mem_peak[i]);
+        if (stats->hw_events) {
+            fputs(",\"hw\":{", fp);
+            bool first_event = true;
+            for(unsigned int e=0; e < STATS_HW_EVENTS; e++) {
+                if (!(stats->hw_events & (1u << e))) continue;
+                fprintf(fp, "%s\"%s\":%.0f", first_event ? "" : ",", hw_event_names[e], stats->stage[i].hw[e]);
+                first_event = false;
+            }
+            fputc('}', fp);
+        }
+        fputc('}', fp);
+        first = false;
+    }
+    fputc('}', fp);
+}
+
+/* one line per file */
+void stats_write_json(FILE *fp, const struct liq_stats *stats, const char *filename, int status)
+{
+    fputs("{\"file\":", fp);
+    json_write_string(fp, filename);
+    fprintf(fp, ",\"status\":%d,\"stages\":", status);
+    stats_write_stages_json(fp, stats);
+
+    fprintf(fp, ",\"mem_peak\":%lu,\"histogram_restarts\":%u,", (unsigned long)stats->mem_peak, stats->histogram_restarts);
+
+#ifdef LIQ_COUNTERS
+    const struct liq_counters *c = &stats->counters;
+    fprintf(fp, "\"counters\":{\"hash_pixels\":%lu,\"hash_probes\":%lu,\"hash_longest_chain\":%lu,"
+                "\"hash_chain_allocs\":%lu,\"hash_chain_reallocs\":%lu,"
+                "\"nearest_searches\":%lu,\"nearest_heads\":%lu,\"nearest_candidates\":%lu,"
+                "\"floyd_tolerance_checks\":%lu,\"floyd_tolerance_hits\":%lu,"
+                "\"boxes_split\":%lu,\"sort_partitions\":%lu},",
+            c->hash_pixels, c->hash_probes, c->hash_longest_chain, c->hash_chain_allocs, c->hash_chain_reallocs,
+            c->nearest_searches, c->nearest_heads, c->nearest_candidates,
+            c->floyd_tolerance_checks, c->floyd_tolerance_hits, c->boxes_split, c->sort_partitions);
+#endif
+
+    fputs("\"palette_trials\":[", fp);
+    for(unsigned int i=0; i < stats->trials && i < STATS_MAX_TRIALS; i++) {
+        fprintf(fp, "%s{\"wall_ms\":%.3f,\"cpu_ms\":%.3f}", i ? "," : "", stats->trial[i].wall*1000.0, stats->trial[i].cpu*1000.0);
+    }
+    fputs("]}\n", fp);
+}
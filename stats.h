@@ -0,0 +1,89 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "counters.h"
+
+/* stages of processing of a single file, timed separately */
+typedef enum {
+    STATS_READ,
+    STATS_MODIFY_ALPHA,
+    STATS_PYRAMID,
+    STATS_CONTRAST_MAPS,
+    STATS_HISTOGRAM,
+    STATS_QUALITY_ESTIMATE,
+    STATS_PALETTE_SEARCH, // all find_best_palette trials, see trial[] for each one, or gray_quantize()
+    STATS_VORONOI,
+    STATS_REMAP,
+    STATS_DITHER_MAP,
+    STATS_FLOYD,
+    STATS_WRITE,
+    STATS_STAGES
+} stats_stage;
+
+#define STATS_MAX_TRIALS 64
+
+/* hardware events counted when enabled with stats_hw_open() */
+typedef enum {
+    STATS_HW_CYCLES,
+    STATS_HW_INSTRUCTIONS,
+    STATS_HW_CACHE_MISSES,
+    STATS_HW_BRANCH_MISSES,
+    STATS_HW_DTLB_MISSES,
+    STATS_HW_EVENTS
+} stats_hw_event;
+
+typedef struct {
+    double wall, cpu; // seconds
+    double hw[STATS_HW_EVENTS]; // counts of events, estimated if the kernel had to share counters between events
+} stats_time;
+
+/* collected per file, when enabled with liq_set_stats() */
+struct liq_stats {
+    stats_time stage[STATS_STAGES];
+    unsigned int stage_count[STATS_STAGES];
+    stats_time trial[STATS_MAX_TRIALS];
+    unsigned int trials, histogram_restarts;
+    struct liq_counters counters; // only with -DLIQ_COUNTERS
+
+    // bytes allocated with stats_malloc() while these stats were current, and buffers added with stats_mem_add()
+    size_t mem_live, mem_peak, mem_stage_peak;
+    size_t stage_mem_peak[STATS_STAGES];
+
+    // perf events of the thread that called stats_hw_open(). Only those with their bit set in hw_events are open
+    int hw_fd[STATS_HW_EVENTS];
+    unsigned int hw_events;
+};
+
+/* returns zero time when stats are disabled, so that disabled stats don't cost any clock calls */
+stats_time stats_start(struct liq_stats *stats);
+void stats_end(struct liq_stats *stats, stats_stage stage, stats_time start);
+void stats_end_trial(struct liq_stats *stats, stats_time start);
+
+/*
+ Counts hardware events of the calling thread (in user space only) in all following stages. Only Linux perf events are supported.
+ Events that the CPU, kernel or its perf_event_paranoid setting don't allow are skipped. Returns false if none could be counted.
+ */
+bool stats_hw_open(struct liq_stats *stats);
+void stats_hw_close(struct liq_stats *stats);
+
+/*
+ Tracking allocator. Memory is counted in stats made current for the calling thread (NULL for none),
+ and freeing subtracts it from the same stats, so they must outlive all blocks allocated while current.
+ */
+struct liq_stats *stats_set_current(struct liq_stats *stats); // returns previously current stats
+void *stats_malloc(size_t size);
+void *stats_calloc(size_t count, size_t size);
+void stats_free(void *ptr);
+
+/* for big buffers allocated elsewhere, e.g. decoded image */
+void stats_mem_add(struct liq_stats *stats, size_t size);
+void stats_mem_sub(struct liq_stats *stats, size_t size);
+
+void stats_write_json(FILE *fp, const struct liq_stats *stats, const char *filename, int status);
+void stats_write_stages_json(FILE *fp, const struct liq_stats *stats);
+void json_write_string(FILE *fp, const char *str);
+
+#endif
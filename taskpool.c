@@ -0,0 +1,496 @@
+/*
+ Work-stealing thread pool (see taskpool.h for its use).
+
+ Every worker has its own queue, a ring buffer with its own lock, and the last queue is shared by threads
+ outside of the pool. A thread takes its newest task first, and idle threads steal the oldest tasks of others,
+ from threads on the same NUMA node first. pool.queued and pool.queued_leaves count tasks in all queues,
+ so that threads sleep on pool.cond only while there's nothing to take. A task is counted before it's pushed
+ and uncounted when it's removed, so the counts can be briefly too high, but never wrap below zero.
+ */
+
+
+#if !defined(WIN32) && !defined(__WIN32__)
+#define _POSIX_C_SOURCE 200112L /* sysconf() */
+#endif
+#ifdef __linux__
+#define _GNU_SOURCE /* sched_setaffinity() */
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#include "taskpool.h"
+
+struct task {
+    task_fn *fn;
+    void *arg;
+    task_group *group;
+    bool leaf;
+};
+
+/* ring buffer, tasks[head] is the oldest */
+struct task_queue {
+    pthread_mutex_t lock;
+    struct task *tasks;
+    unsigned int head, count, capacity;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond; // broadcast when tasks are queued, a group finishes or the pool shuts down
+    struct task_queue *queues; // one for every worker, and the last one for threads outside of the pool
+    pthread_t *workers;
+    unsigned int threads; // workers + 1
+    volatile unsigned int queued, queued_leaves;
+    bool shutdown, initialized;
+
+    // with pinning, CPU and NUMA node of each queue's thread (the last one is the thread that started the pool)
+    bool pin, pinned;
+    int *cpus;
+    unsigned int *nodes, numa_nodes;
+} pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
+static pthread_mutex_t init_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread int worker_index = -1;
+
+/* counters are changed outside of locks that waiting threads hold, so they're always read atomically */
+static unsigned int atomic_get(volatile unsigned int *value)
+{
+    return __sync_fetch_and_add(value, 0);
+}
+
+static unsigned int cpu_count(void)
+{
+#ifdef _SC_NPROCESSORS_ONLN
+    const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus > 0) return cpus;
+#endif
+    return 1;
+}
+
+static struct task_queue *own_queue(void)
+{
+    return &pool.queues[worker_index >= 0 ? (unsigned int)worker_index : pool.threads-1];
+}
+
+static bool queue_push(struct task_queue *q, struct task task)
+{
+    pthread_mutex_lock(&q->lock);
+    if (q->count == q->capacity) {
+        const unsigned int capacity = q->capacity ? q->capacity*2 : 64;
+        struct task *tasks = malloc(capacity * sizeof(tasks[0]));
+        if (!tasks) {
+            pthread_mutex_unlock(&q->lock);
+            return false;
+        }
+        for(unsigned int i=0; i < q->count; i++) {
+            tasks[i] = q->tasks[(q->head + i) % q->capacity];
+        }
+        free(q->tasks);
+        q->tasks = tasks; q->capacity = capacity; q->head = 0;
+    }
+    q->tasks[(q->head + q->count) % q->capacity] = task;
+    q->count++;
+    pthread_mutex_unlock(&q->lock);
+    return true;
+}
+
+/* removes i-th oldest task, called with the queue locked */
+static struct task queue_remove(struct task_queue *q, unsigned int i)
+{
+    const struct task task = q->tasks[(q->head + i) % q->capacity];
+    for(; i+1 < q->count; i++) {
+        q->tasks[(q->head + i) % q->capacity] = q->tasks[(q->head + i + 1) % q->capacity];
+    }
+    q->count--;
+
+    __sync_sub_and_fetch(&pool.queued, 1);
+    if (task.leaf) __sync_sub_and_fetch(&pool.queued_leaves, 1);
+    return task;
+}
+
+/* newest task from the group, or any group if group is NULL */
+static bool queue_take_newest(struct task_queue *q, const task_group *group, struct task *task)
+{
+    bool found = false;
+    pthread_mutex_lock(&q->lock);
+    for(unsigned int i=q->count; i-- > 0;) {
+        const struct task *t = &q->tasks[(q->head + i) % q->capacity];
+        if (!group || t->group == group) {
+            *task = queue_remove(q, i);
+            found = true;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&q->lock);
+    return found;
+}
+
+static bool queue_steal_oldest(struct task_queue *q, bool leaf_only, struct task *task)
+{
+    bool found = false;
+    pthread_mutex_lock(&q->lock);
+    for(unsigned int i=0; i < q->count; i++) {
+        if (!leaf_only || q->tasks[(q->head + i) % q->capacity].leaf) {
+            *task = queue_remove(q, i);
+            found = true;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&q->lock);
+    return found;
+}
+
+static bool steal_task(bool leaf_only, struct task *task)
+{
+    const unsigned int self = worker_index >= 0 ? (unsigned int)worker_index : pool.threads-1;
+
+    // tasks from the same NUMA node first, since their data was most likely touched there
+    for(unsigned int pass=0; pass < 2; pass++) {
+        for(unsigned int i=1; i <= pool.threads; i++) {
+            const unsigned int q = (self + i) % pool.threads;
+            if ((pool.nodes[q] == pool.nodes[self]) != (pass == 0)) continue;
+            if (queue_steal_oldest(&pool.queues[q], leaf_only, task)) return true;
+        }
+    }
+    return false;
+}
+
+static void run_task(const struct task *task)
+{
+    task->fn(task->arg);
+
+    if (!__sync_sub_and_fetch(&task->group->pending, 1)) {
+        pthread_mutex_lock(&pool.lock);
+        pthread_cond_broadcast(&pool.cond);
+        pthread_mutex_unlock(&pool.lock);
+    }
+}
+
+static void pin_current_thread(int cpu)
+{
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    sched_setaffinity(0, sizeof(set), &set);
+#endif
+}
+
+static void *worker_main(void *index)
+{
+    worker_index = (int)(intptr_t)index;
+    if (pool.pinned) pin_current_thread(pool.cpus[worker_index]);
+
+    for(;;) {
+        struct task task;
+        if (queue_take_newest(own_queue(), NULL, &task) || steal_task(false, &task)) {
+            run_task(&task);
+            continue;
+        }
+
+        pthread_mutex_lock(&pool.lock);
+        while (!pool.shutdown && !atomic_get(&pool.queued)) {
+            pthread_cond_wait(&pool.cond, &pool.lock);
+        }
+        const bool stop = pool.shutdown;
+        pthread_mutex_unlock(&pool.lock);
+        if (stop) return NULL;
+    }
+}
+
+#ifdef __linux__
+#define MAX_NUMA_NODES 64
+
+/* "0-3,8-11" from /sys/devices/system/node/nodeN/cpulist, only CPUs this process may use */
+static bool read_node_cpus(unsigned int node, const cpu_set_t *allowed, cpu_set_t *cpus)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%u/cpulist", node);
+    FILE *f = fopen(path, "r");
+    if (!f) return false;
+
+    CPU_ZERO(cpus);
+    int first, last;
+    while (1 == fscanf(f, "%d", &first)) {
+        if (1 != fscanf(f, "-%d", &last)) last = first;
+        for(int cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, allowed)) CPU_SET(cpu, cpus);
+        }
+        if (',' != fgetc(f)) break;
+    }
+    fclose(f);
+    return CPU_COUNT(cpus) > 0;
+}
+
+/*
+ Threads take NUMA nodes in turn, so that a few threads still use memory bandwidth of all nodes,
+ and within a node take its CPUs in order. Returns number of nodes used, 0 if it can't be done.
+ */
+static unsigned int numa_placement(unsigned int threads, int cpus[], unsigned int nodes[])
+{
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed)) return 0;
+
+    static cpu_set_t node_cpus[MAX_NUMA_NODES];
+    unsigned int num_nodes = 0;
+    for(unsigned int node=0; node < MAX_NUMA_NODES; node++) {
+        if (read_node_cpus(node, &allowed, &node_cpus[num_nodes])) num_nodes++;
+    }
+    if (!num_nodes) { // no NUMA information, everything is one node
+        node_cpus[0] = allowed;
+        num_nodes = 1;
+    }
+
+    int next_cpu[MAX_NUMA_NODES] = {0};
+    for(unsigned int i=0; i < threads; i++) {
+        const unsigned int node = i % num_nodes;
+        int cpu = next_cpu[node];
+        while (!CPU_ISSET(cpu % CPU_SETSIZE, &node_cpus[node])) cpu++; // more threads than CPUs wrap around
+        cpus[i] = cpu % CPU_SETSIZE;
+        nodes[i] = node;
+        next_cpu[node] = cpu+1;
+    }
+    return num_nodes < threads ? num_nodes : threads;
+}
+#else
+static unsigned int numa_placement(unsigned int threads, int cpus[], unsigned int nodes[])
+{
+    return 0;
+}
+#endif
+
+static void taskpool_stop(void)
+{
+    pthread_mutex_lock(&pool.lock);
+    pool.shutdown = true;
+    pthread_cond_broadcast(&pool.cond);
+    pthread_mutex_unlock(&pool.lock);
+
+    for(unsigned int i=0; i < pool.threads-1; i++) {
+        pthread_join(pool.workers[i], NULL);
+    }
+    for(unsigned int i=0; i < pool.threads; i++) {
+        pthread_mutex_destroy(&pool.queues[i].lock);
+        free(pool.queues[i].tasks);
+    }
+    free(pool.queues); pool.queues = NULL;
+    free(pool.workers); pool.workers = NULL;
+    free(pool.cpus); pool.cpus = NULL;
+    free(pool.nodes); pool.nodes = NULL;
+    pool.shutdown = false;
+    pool.initialized = false;
+}
+
+/* only the forking thread exists in the child, so it starts without a pool (memory of the old one is leaked) */
+static void taskpool_after_fork(void)
+{
+    pthread_mutex_init(&init_lock, NULL);
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.cond, NULL);
+    pool.queues = NULL;
+    pool.workers = NULL;
+    pool.cpus = NULL;
+    pool.nodes = NULL;
+    pool.queued = pool.queued_leaves = 0;
+    pool.shutdown = pool.initialized = false;
+}
+
+static bool taskpool_start(unsigned int threads)
+{
+    static bool atfork_registered = false;
+    if (!atfork_registered) {
+        pthread_atfork(NULL, NULL, taskpool_after_fork);
+        atfork_registered = true;
+    }
+
+    if (!threads) threads = cpu_count();
+
+    pool.queues = calloc(threads, sizeof(pool.queues[0]));
+    pool.workers = calloc(threads, sizeof(pool.workers[0]));
+    pool.cpus = calloc(threads, sizeof(pool.cpus[0]));
+    pool.nodes = calloc(threads, sizeof(pool.nodes[0]));
+    if (!pool.queues || !pool.workers || !pool.cpus || !pool.nodes) {
+        free(pool.queues); pool.queues = NULL;
+        free(pool.workers); pool.workers = NULL;
+        free(pool.cpus); pool.cpus = NULL;
+        free(pool.nodes); pool.nodes = NULL;
+        return false;
+    }
+    for(unsigned int i=0; i < threads; i++) {
+        pthread_mutex_init(&pool.queues[i].lock, NULL);
+    }
+
+    pool.pinned = false;
+    pool.numa_nodes = 0;
+    if (pool.pin) {
+        // the thread that starts the pool gets the first place, and uses the last queue
+        int cpus[threads]; unsigned int nodes[threads];
+        pool.numa_nodes = numa_placement(threads, cpus, nodes);
+        if (pool.numa_nodes) {
+            for(unsigned int i=0; i < threads; i++) {
+                pool.cpus[i] = cpus[(i+1) % threads];
+                pool.nodes[i] = nodes[(i+1) % threads];
+            }
+            pin_current_thread(cpus[0]);
+            pool.pinned = true;
+        }
+    }
+
+    // queues must exist before workers start stealing
+    pool.threads = threads;
+    pool.initialized = true;
+
+    unsigned int started = 0;
+    for(; started < threads-1; started++) {
+        if (pthread_create(&pool.workers[started], NULL, worker_main, (void*)(intptr_t)started)) break;
+    }
+    if (started < threads-1) {
+        // fewer threads is still a working pool, but the external queue has to be the last one
+        pool.threads = started+1;
+        return false;
+    }
+    return true;
+}
+
+bool taskpool_init(unsigned int threads)
+{
+    pthread_mutex_lock(&init_lock);
+    bool ok = true;
+    if (!pool.initialized || pool.threads != (threads ? threads : cpu_count()) || pool.pinned != pool.pin) {
+        if (pool.initialized) taskpool_stop();
+        ok = taskpool_start(threads);
+    }
+    pthread_mutex_unlock(&init_lock);
+    return ok;
+}
+
+void taskpool_set_pinning(bool pin)
+{
+    pthread_mutex_lock(&init_lock);
+    pool.pin = pin;
+    pthread_mutex_unlock(&init_lock);
+}
+
+unsigned int taskpool_numa_nodes(void)
+{
+    pthread_mutex_lock(&init_lock);
+    const unsigned int nodes = pool.initialized && pool.pinned ? pool.numa_nodes : 0;
+    pthread_mutex_unlock(&init_lock);
+    return nodes;
+}
+
+unsigned int taskpool_threads(void)
+{
+    pthread_mutex_lock(&init_lock);
+    if (!pool.initialized) taskpool_start(0);
+    const unsigned int threads = pool.initialized ? pool.threads : 1;
+    pthread_mutex_unlock(&init_lock);
+    return threads;
+}
+
+void taskpool_spawn(task_group *group, task_fn *fn, void *arg, bool leaf)
+{
+    if (!pool.initialized) taskpool_threads();
+
+    __sync_add_and_fetch(&group->pending, 1);
+
+    const struct task task = {.fn = fn, .arg = arg, .group = group, .leaf = leaf};
+    if (!pool.initialized) {
+        run_task(&task);
+        return;
+    }
+
+    // counted before another thread can take the task and uncount it
+    __sync_add_and_fetch(&pool.queued, 1);
+    if (leaf) __sync_add_and_fetch(&pool.queued_leaves, 1);
+    if (!queue_push(own_queue(), task)) {
+        __sync_sub_and_fetch(&pool.queued, 1);
+        if (leaf) __sync_sub_and_fetch(&pool.queued_leaves, 1);
+        run_task(&task); // without memory for the queue it's still correct, just not parallel
+        return;
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    pthread_cond_broadcast(&pool.cond);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+void taskpool_wait(task_group *group)
+{
+    while (atomic_get(&group->pending)) {
+        struct task task;
+        if (queue_take_newest(own_queue(), group, &task) || steal_task(true, &task)) {
+            run_task(&task);
+            continue;
+        }
+
+        // the rest of the group is running on other threads
+        pthread_mutex_lock(&pool.lock);
+        while (atomic_get(&group->pending) && !atomic_get(&pool.queued_leaves)) {
+            pthread_cond_wait(&pool.cond, &pool.lock);
+        }
+        pthread_mutex_unlock(&pool.lock);
+    }
+}
+
+unsigned int taskpool_chunks(unsigned int count, unsigned int min_chunk)
+{
+    const unsigned int chunks = count / (min_chunk ? min_chunk : 1);
+    return chunks < 1 ? 1 : (chunks > TASKPOOL_MAX_CHUNKS ? TASKPOOL_MAX_CHUNKS : chunks);
+}
+
+unsigned int taskpool_row_chunks(unsigned int rows, unsigned int cols)
+{
+    const unsigned int min_rows = 3000 / (cols ? cols : 1);
+    return taskpool_chunks(rows, min_rows ? min_rows : 1);
+}
+
+struct range_task {
+    task_range_fn *fn;
+    void *context;
+    unsigned int chunk, start, end;
+};
+
+static void range_task_run(void *arg)
+{
+    const struct range_task *t = arg;
+    t->fn(t->context, t->chunk, t->start, t->end);
+}
+
+void taskpool_parallel_for(unsigned int count, unsigned int chunks, task_range_fn *fn, void *context, bool parallel)
+{
+    if (!chunks) return;
+
+    struct range_task tasks[chunks];
+    for(unsigned int i=0; i < chunks; i++) {
+        tasks[i] = (struct range_task){
+            .fn = fn, .context = context, .chunk = i,
+            .start = (unsigned long long)count * i / chunks,
+            .end = (unsigned long long)count * (i+1) / chunks,
+        };
+    }
+
+    if (!parallel || chunks < 2 || taskpool_threads() < 2) {
+        for(unsigned int i=0; i < chunks; i++) {
+            range_task_run(&tasks[i]);
+        }
+        return;
+    }
+
+    task_group group = {0};
+    for(unsigned int i=0; i < chunks; i++) {
+        taskpool_spawn(&group, range_task_run, &tasks[i], true);
+    }
+    taskpool_wait(&group);
+}
@@ -0,0 +1,57 @@
+#ifndef TASKPOOL_H
+#define TASKPOOL_H
+
+#include <stdbool.h>
+
+/*
+ Work-stealing thread pool shared by the whole process. It doesn't need OpenMP.
+
+ Tasks are spawned into a group and taskpool_wait() waits for all of them. Each worker thread has its own
+ queue: it runs its newest tasks first, and idle threads steal the oldest tasks from others.
+ Threads outside of the pool share one queue. A thread waiting for a group runs tasks of that group,
+ and otherwise only helps with "leaf" tasks (which never wait themselves), so that waiting for row bands
+ of one file can't get stuck behind a whole other file.
+ */
+
+typedef void task_fn(void *arg);
+
+/* runs items from start to end-1, which are the chunk-th part of the range */
+typedef void task_range_fn(void *context, unsigned int chunk, unsigned int start, unsigned int end);
+
+typedef struct {
+    volatile unsigned int pending; // tasks not finished yet, changed atomically
+} task_group;
+
+#define TASKPOOL_MAX_CHUNKS 64
+
+/* threads = 0 uses all CPUs. The pool starts threads-1 workers, since the thread that waits also does work.
+   It's created on first use if this isn't called, and must not be resized while tasks are running */
+bool taskpool_init(unsigned int threads);
+unsigned int taskpool_threads(void);
+
+/*
+ Pins threads to CPUs, taking NUMA nodes in turn (Linux only), from the next taskpool_init(). The thread that
+ calls taskpool_init() is pinned too. Idle threads steal tasks from their own node first.
+ */
+void taskpool_set_pinning(bool pin);
+unsigned int taskpool_numa_nodes(void); // nodes used by pinned threads, 0 when not pinned
+
+void taskpool_spawn(task_group *group, task_fn *fn, void *arg, bool leaf);
+void taskpool_wait(task_group *group);
+
+/*
+ Number of chunks to split count items into, each at least min_chunk big. It doesn't depend on the number
+ of threads, so results summed per chunk are the same regardless of how many threads did the work.
+ */
+unsigned int taskpool_chunks(unsigned int count, unsigned int min_chunk);
+
+/*
+ Chunks of remapping, in bands of rows. Buffers written for the first time in the same bands (first-touch)
+ get their memory pages on NUMA nodes of the threads that later read them.
+ */
+unsigned int taskpool_row_chunks(unsigned int rows, unsigned int cols);
+
+/* calls fn for every chunk, as leaf tasks if parallel is true, otherwise in order on the calling thread */
+void taskpool_parallel_for(unsigned int count, unsigned int chunks, task_range_fn *fn, void *context, bool parallel);
+
+#endif
@@ -0,0 +1,1101 @@
+/*
+ pngquant-test - regression tests that need more than a single command to check.
+
+ Input images are generated, so the tests don't depend on any files. Tests of the command-line program
+ run the binary given by --pngquant (./pngquant by default) in a temporary directory, and decode its output
+ with a minimal reader of palette PNGs.
+ */
+
+#if !defined(WIN32) && !defined(__WIN32__)
+#define _POSIX_C_SOURCE 200809L /* mkdtemp() */
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <math.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <zlib.h>
+
+#include "libimagequant.h"
+
+#define TEST_USAGE "\
+usage:  pngquant-test [options] [filter...]\n\n\
+options:\n\
+  --pngquant path   executable to test (default: ./pngquant)\n\
+  --huge            also run tests of huge images. Take minutes\n\n\
+Only tests whose names contain one of the filters are run.\n"
+
+struct options {
+    const char *pngquant;
+    char tmpdir[64];
+    char **filters;
+    unsigned int num_filters;
+    bool huge;
+};
+
+static bool selected(const struct options *options, const char *name)
+{
+    if (!options->num_filters) return true;
+    for(unsigned int i=0; i < options->num_filters; i++) {
+        if (strstr(name, options->filters[i])) return true;
+    }
+    return false;
+}
+
+static bool fail(const char *name, const char *reason)
+{
+    printf("FAIL %s: %s\n", name, reason);
+    return false;
+}
+
+/* xorshift, so that data is the same on every run and platform */
+static unsigned int random_next(unsigned int *state)
+{
+    unsigned int x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+static unsigned char clamp_channel(double v)
+{
+    return v < 0 ? 0 : (v > 255 ? 255 : v + 0.5);
+}
+
+/* smooth shapes with noise, different for every seed. Unless opaque, a few lines are semitransparent */
+static liq_color *test_pixels(unsigned int width, unsigned int height, unsigned int seed, bool opaque)
+{
+    liq_color *pixels = malloc(sizeof(liq_color) * width * height);
+    unsigned int state = 3 + seed;
+    for(unsigned int y=0; y < height; y++) {
+        for(unsigned int x=0; x < width; x++) {
+            const double u = (double)x/width, v = (double)y/height;
+            const int noise = random_next(&state) % 17 - 8;
+            pixels[x + y*width] = (liq_color){
+                .r = clamp_channel(128 + 100*sin(6*u + 2*v + seed) + noise),
+                .g = clamp_channel(128 + 90*sin(3*v - 4*u*u + seed*0.5)),
+                .b = clamp_channel(128 + 110*cos(5*u*v + 3*u - seed)),
+                .a = opaque || (x + y + seed*7) % 40 > 5 ? 255 : 80,
+            };
+        }
+    }
+    return pixels;
+}
+
+static void put_u32(unsigned char *out, unsigned int v)
+{
+    out[0] = v >> 24; out[1] = v >> 16; out[2] = v >> 8; out[3] = v;
+}
+
+static unsigned int get_u32(const unsigned char *in)
+{
+    return (unsigned int)in[0]<<24 | in[1]<<16 | in[2]<<8 | in[3];
+}
+
+static void write_chunk(FILE *fp, const char *type, const unsigned char *data, unsigned int length)
+{
+    unsigned char header[8];
+    put_u32(header, length);
+    memcpy(header + 4, type, 4);
+    uLong crc = crc32(crc32(0, NULL, 0), header + 4, 4);
+    if (length) crc = crc32(crc, data, length);
+    unsigned char trailer[4];
+    put_u32(trailer, crc);
+
+    fwrite(header, 1, 8, fp);
+    if (length) fwrite(data, 1, length, fp);
+    fwrite(trailer, 1, 4, fp);
+}
+
+static void write_header(FILE *fp, unsigned int width, unsigned int height)
+{
+    fwrite("\x89PNG\r\n\x1a\n", 1, 8, fp);
+    unsigned char ihdr[13] = {0};
+    put_u32(ihdr, width);
+    put_u32(ihdr + 4, height);
+    ihdr[8] = 8; // bit depth
+    ihdr[9] = 6; // RGBA
+    write_chunk(fp, "IHDR", ihdr, sizeof(ihdr));
+}
+
+/* deflated RGBA rows without filters, after prefix_size bytes left for the caller */
+static unsigned char *deflate_pixels(const liq_color *pixels, unsigned int width, unsigned int height, unsigned int prefix_size, unsigned long *size_out)
+{
+    const unsigned long raw_size = (width * 4ul + 1) * height;
+    unsigned char *raw = malloc(raw_size), *p = raw;
+    for(unsigned int y=0; y < height; y++) {
+        *p++ = 0; // filter type
+        memcpy(p, &pixels[(size_t)y * width], width * 4ul);
+        p += width * 4ul;
+    }
+
+    uLongf size = compressBound(raw_size);
+    unsigned char *data = malloc(prefix_size + size);
+    compress2(data + prefix_size, &size, raw, raw_size, 6);
+    free(raw);
+    *size_out = prefix_size + size;
+    return data;
+}
+
+static bool write_png(const char *path, const liq_color *pixels, unsigned int width, unsigned int height)
+{
+    FILE *fp = fopen(path, "wb");
+    if (!fp) return false;
+
+    write_header(fp, width, height);
+    unsigned long size;
+    unsigned char *data = deflate_pixels(pixels, width, height, 0, &size);
+    write_chunk(fp, "IDAT", data, size);
+    free(data);
+    write_chunk(fp, "IEND", NULL, 0);
+    return 0 == fclose(fp);
+}
+
+/* writes the generated image to a file in the temporary directory, and returns its pixels */
+static liq_color *test_png(const struct options *options, const char *filename, unsigned int width, unsigned int height, unsigned int seed, bool opaque)
+{
+    char path[256];
+    snprintf(path, sizeof(path), "%s/%s", options->tmpdir, filename);
+    liq_color *pixels = test_pixels(width, height, seed, opaque);
+    if (!write_png(path, pixels, width, height)) {
+        free(pixels);
+        return NULL;
+    }
+    return pixels;
+}
+
+/* animated PNG where the first frame covers the canvas and others are rectangles of it */
+static bool write_apng(const char *path, unsigned int width, unsigned int height, unsigned int frames)
+{
+    FILE *fp = fopen(path, "wb");
+    if (!fp) return false;
+
+    write_header(fp, width, height);
+    unsigned char actl[8];
+    put_u32(actl, frames);
+    put_u32(actl + 4, 0);
+    write_chunk(fp, "acTL", actl, sizeof(actl));
+
+    unsigned int sequence = 0;
+    for(unsigned int k=0; k < frames; k++) {
+        const unsigned int w = k ? width/2 - k : width, h = k ? height/3 + k : height;
+        const unsigned int x = k ? (k*7) % (width - w) : 0, y = k ? (k*5) % (height - h) : 0;
+
+        unsigned char fctl[26] = {0};
+        put_u32(fctl, sequence++);
+        put_u32(fctl + 4, w);
+        put_u32(fctl + 8, h);
+        put_u32(fctl + 12, x);
+        put_u32(fctl + 16, y);
+        fctl[21] = 1; fctl[23] = 10; // delay 1/10s
+        fctl[25] = k & 1; // blend over previous frame
+        write_chunk(fp, "fcTL", fctl, sizeof(fctl));
+
+        liq_color *pixels = test_pixels(w, h, k, false);
+        unsigned long size;
+        unsigned char *data = deflate_pixels(pixels, w, h, k ? 4 : 0, &size);
+        if (k) put_u32(data, sequence++);
+        write_chunk(fp, k ? "fdAT" : "IDAT", data, size);
+        free(data);
+        free(pixels);
+    }
+    write_chunk(fp, "IEND", NULL, 0);
+    return 0 == fclose(fp);
+}
+
+static unsigned char *read_file(const char *path, size_t *size_out)
+{
+    FILE *fp = fopen(path, "rb");
+    if (!fp) return NULL;
+    fseek(fp, 0, SEEK_END);
+    const long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    unsigned char *data = size > 0 ? malloc(size) : NULL;
+    if (data && fread(data, 1, size, fp) != (size_t)size) {
+        free(data);
+        data = NULL;
+    }
+    fclose(fp);
+    *size_out = size;
+    return data;
+}
+
+/* pngquant's output: a palette image, not interlaced, with 1, 2, 4 or 8 bits per pixel */
+struct png8 {
+    unsigned int width, height, num_palette;
+    liq_color palette[256];
+    unsigned char *indices;
+};
+
+static unsigned char paeth(int a, int b, int c)
+{
+    const int p = a + b - c, pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+    return pa <= pb && pa <= pc ? a : (pb <= pc ? b : c);
+}
+
+static bool read_png8(const struct options *options, const char *filename, struct png8 *out)
+{
+    char path[256];
+    snprintf(path, sizeof(path), "%s/%s", options->tmpdir, filename);
+    size_t size;
+    unsigned char *file = read_file(path, &size);
+    if (!file || size < 8 || memcmp(file, "\x89PNG\r\n\x1a\n", 8)) {
+        free(file);
+        return false;
+    }
+
+    *out = (struct png8){.indices = NULL};
+    unsigned int depth = 0;
+    unsigned char *idat = malloc(size);
+    size_t idat_size = 0;
+    bool ok = true;
+    for(size_t pos = 8; ok && pos + 12 <= size; ) {
+        const unsigned int length = get_u32(file + pos);
+        const unsigned char *type = file + pos + 4, *data = file + pos + 8;
+        if (pos + 12 + length > size) break;
+        if (!memcmp(type, "IHDR", 4)) {
+            out->width = get_u32(data);
+            out->height = get_u32(data + 4);
+            depth = data[8];
+            ok = data[9] == 3 && data[12] == 0 && 8 % depth == 0;
+        } else if (!memcmp(type, "PLTE", 4)) {
+            out->num_palette = length / 3;
+            for(unsigned int i=0; i < out->num_palette; i++) {
+                out->palette[i] = (liq_color){data[i*3], data[i*3+1], data[i*3+2], 255};
+            }
+        } else if (!memcmp(type, "tRNS", 4)) {
+            for(unsigned int i=0; i < length && i < out->num_palette; i++) out->palette[i].a = data[i];
+        } else if (!memcmp(type, "IDAT", 4)) {
+            memcpy(idat + idat_size, data, length);
+            idat_size += length;
+        } else if (!memcmp(type, "IEND", 4)) {
+            break;
+        }
+        pos += 12 + length;
+    }
+    free(file);
+
+    const size_t stride = (out->width * depth + 7) / 8;
+    uLongf raw_size = (stride + 1) * out->height;
+    unsigned char *raw = ok && depth && out->num_palette ? malloc(raw_size) : NULL;
+    ok = raw && Z_OK == uncompress(raw, &raw_size, idat, idat_size) && raw_size == (stride + 1) * out->height;
+    free(idat);
+
+    if (ok) {
+        out->indices = malloc((size_t)out->width * out->height);
+        for(unsigned int y=0; y < out->height; y++) {
+            unsigned char *const row = raw + y * (stride + 1) + 1;
+            const unsigned char *const prev = y ? row - (stride + 1) : NULL;
+            for(size_t i=0; i < stride; i++) {
+                const int a = i ? row[i-1] : 0, b = prev ? prev[i] : 0, c = i && prev ? prev[i-1] : 0;
+                switch (row[-1]) {
+                    case 1: row[i] += a; break;
+                    case 2: row[i] += b; break;
+                    case 3: row[i] += (a + b) / 2; break;
+                    case 4: row[i] += paeth(a, b, c); break;
+                }
+            }
+            for(unsigned int x=0; x < out->width; x++) {
+                const unsigned int bit = x * depth;
+                const unsigned int index = (row[bit / 8] >> (8 - depth - bit % 8)) & ((1 << depth) - 1);
+                out->indices[(size_t)y * out->width + x] = index;
+                if (index >= out->num_palette) ok = false;
+            }
+        }
+    }
+    free(raw);
+    if (!ok) {
+        free(out->indices);
+        out->indices = NULL;
+    }
+    return ok;
+}
+
+static double color_error(liq_color a, liq_color b)
+{
+    const double r = a.r - b.r, g = a.g - b.g, bl = a.b - b.b, al = a.a - b.a;
+    return (r*r + g*g + bl*bl + al*al) / 4.0;
+}
+
+/* mean squared difference per channel, in 0-255 units, of pixels in the rectangle */
+static double png8_error(const struct png8 *image, const liq_color *pixels, unsigned int left, unsigned int top, unsigned int width, unsigned int height)
+{
+    double sum = 0;
+    for(unsigned int y = top; y < top + height; y++) {
+        for(unsigned int x = left; x < left + width; x++) {
+            const size_t i = (size_t)y * image->width + x;
+            sum += color_error(image->palette[image->indices[i]], pixels[i]);
+        }
+    }
+    return sum / ((double)width * height);
+}
+
+static bool palette_has_color(const liq_color palette[], unsigned int count, liq_color color)
+{
+    for(unsigned int i=0; i < count; i++) {
+        if (palette[i].r == color.r && palette[i].g == color.g && palette[i].b == color.b && palette[i].a == color.a) return true;
+    }
+    return false;
+}
+
+/* runs pngquant in the temporary directory and returns its exit status, or -1 */
+static int run_pngquant(const struct options *options, const char *args)
+{
+    char command[1024];
+    snprintf(command, sizeof(command), "cd '%s' && '%s' %s", options->tmpdir, options->pngquant, args);
+    const int status = system(command);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+static bool file_exists(const struct options *options, const char *name)
+{
+    char path[256];
+    snprintf(path, sizeof(path), "%s/%s", options->tmpdir, name);
+    FILE *fp = fopen(path, "rb");
+    if (fp) fclose(fp);
+    return fp != NULL;
+}
+
+static char *read_text(const struct options *options, const char *name)
+{
+    char path[256];
+    snprintf(path, sizeof(path), "%s/%s", options->tmpdir, name);
+    size_t size;
+    char *data = (char *)read_file(path, &size);
+    if (!data) return calloc(1, 1);
+    data = realloc(data, size + 1);
+    data[size] = '\0';
+    return data;
+}
+
+/* works for binary files too */
+static bool file_contains(const struct options *options, const char *name, const char *text)
+{
+    char path[256];
+    snprintf(path, sizeof(path), "%s/%s", options->tmpdir, name);
+    size_t size;
+    unsigned char *data = read_file(path, &size);
+    const size_t length = strlen(text);
+    bool found = false;
+    for(size_t i=0; data && !found && i + length <= size; i++) {
+        found = 0 == memcmp(data + i, text, length);
+    }
+    free(data);
+    return found;
+}
+
+static bool same_files(const struct options *options, const char *name1, const char *name2)
+{
+    char path[256];
+    size_t size1, size2;
+    snprintf(path, sizeof(path), "%s/%s", options->tmpdir, name1);
+    unsigned char *data1 = read_file(path, &size1);
+    snprintf(path, sizeof(path), "%s/%s", options->tmpdir, name2);
+    unsigned char *data2 = read_file(path, &size2);
+
+    const bool same = data1 && data2 && size1 == size2 && 0 == memcmp(data1, data2, size1);
+    free(data1);
+    free(data2);
+    return same;
+}
+
+/* files that don't fit in --max-memory together wait for others, and their output is the same as when files are quantized one at a time */
+static bool test_max_memory_deferral(const struct options *options)
+{
+    const char *name = "max_memory_deferral";
+    for(unsigned int i=0; i < 4; i++) {
+        char filename[32];
+        snprintf(filename, sizeof(filename), "file%u.png", i);
+        liq_color *pixels = test_png(options, filename, 200, 150, i, false);
+        if (!pixels) return fail(name, "can't write input");
+        free(pixels);
+    }
+
+    if (0 != run_pngquant(options, "--threads 1 --max-memory 1M -f --ext -a.png file0.png file1.png file2.png file3.png")) return fail(name, "run with one thread failed");
+    if (0 != run_pngquant(options, "--threads 4 -v --max-memory 1M -f --ext -b.png file0.png file1.png file2.png file3.png 2> log")) return fail(name, "run with --max-memory failed");
+    if (!file_contains(options, "log", "deferred until other files finish")) return fail(name, "no file was deferred");
+    for(unsigned int i=0; i < 4; i++) {
+        char a[32], b[32];
+        snprintf(a, sizeof(a), "file%u-a.png", i);
+        snprintf(b, sizeof(b), "file%u-b.png", i);
+        if (!same_files(options, a, b)) return fail(name, "output of a deferred file differs");
+    }
+    return true;
+}
+
+#define HUGE_WIDTH 65536
+#define HUGE_HEIGHT 65537 /* the last row is past 2^32 pixels */
+#define HUGE_REMAP_ROWS 2
+
+static const liq_color huge_below = {0, 0, 0, 255}, huge_even = {255, 255, 255, 255}, huge_odd = {128, 128, 128, 255};
+
+/* color depends on 64-bit index of the pixel: black below 2^32, then alternating white and gray */
+static void huge_rows(liq_color rows_out[], int first_row, int num_rows, int width, void *user_info)
+{
+    for(int row=0; row < num_rows; row++) {
+        for(int col=0; col < width; col++) {
+            const unsigned long long index = (unsigned long long)(first_row + row) * width + col;
+            rows_out[(size_t)row * width + col] = index < (1ULL<<32) ? huge_below : (index & 1 ? huge_odd : huge_even);
+        }
+    }
+}
+
+static int palette_index(const liq_palette *palette, liq_color color)
+{
+    for(unsigned int i=0; i < palette->count; i++) {
+        const liq_color c = palette->entries[i];
+        if (c.r == color.r && c.g == color.g && c.b == color.b && c.a == color.a) return i;
+    }
+    return -1;
+}
+
+/*
+ An image of more than 2^32 pixels from the row callback is quantized and remapped. The whole output would need 4GB,
+ so output rows share a few buffers, and with one thread and no dithering they end up holding the last rows.
+ */
+static bool test_huge_custom_image(const struct options *options)
+{
+    const char *name = "huge_custom_image";
+    unsigned char *remapped = malloc(HUGE_WIDTH * HUGE_REMAP_ROWS);
+    unsigned char **row_pointers = malloc(sizeof(row_pointers[0]) * HUGE_HEIGHT);
+    if (!remapped || !row_pointers) {
+        free(remapped); free(row_pointers);
+        return fail(name, "out of memory");
+    }
+    for(unsigned int row=0; row < HUGE_HEIGHT; row++) {
+        row_pointers[row] = remapped + (size_t)(row % HUGE_REMAP_ROWS) * HUGE_WIDTH;
+    }
+
+    const int threads = liq_get_threads();
+    liq_set_threads(1);
+    liq_attr *attr = liq_attr_create();
+    liq_set_speed(attr, 10);
+    liq_image *image = liq_image_create_custom(attr, huge_rows, NULL, HUGE_WIDTH, HUGE_HEIGHT, 0);
+    liq_result *result = NULL;
+    bool ok = true;
+    if (!image || LIQ_OK != liq_image_quantize(image, attr, &result)) {
+        ok = fail(name, "quantization failed");
+    } else {
+        liq_set_dithering_level(result, 0);
+        if (LIQ_OK != liq_write_remapped_image_rows(result, image, row_pointers)) {
+            ok = fail(name, "remapping failed");
+        } else {
+            const liq_palette *palette = liq_get_palette(result);
+            const int below = palette_index(palette, huge_below), even = palette_index(palette, huge_even), odd = palette_index(palette, huge_odd);
+            if (palette->count != 3 || below < 0 || even < 0 || odd < 0) {
+                ok = fail(name, "palette doesn't have the 3 colors of the image");
+            }
+            for(unsigned int row = HUGE_HEIGHT - HUGE_REMAP_ROWS; row < HUGE_HEIGHT && ok; row++) {
+                for(unsigned int col=0; col < HUGE_WIDTH; col++) {
+                    const unsigned long long index = (unsigned long long)row * HUGE_WIDTH + col;
+                    const int expected = index < (1ULL<<32) ? below : (index & 1 ? odd : even);
+                    if (row_pointers[row][col] != expected) {
+                        ok = fail(name, "wrong color index near the end of the image");
+                        break;
+                    }
+                }
+            }
+        }
+        liq_result_destroy(result);
+    }
+
+    if (image) liq_image_destroy(image);
+    liq_attr_destroy(attr);
+    liq_set_threads(threads);
+    free(row_pointers);
+    free(remapped);
+    return ok;
+}
+
+/* quantizes and remaps pixels, and returns mean squared difference per channel of the result, or -1 */
+static double quantize_error(liq_attr *attr, const liq_color *pixels, int width, int height)
+{
+    liq_image *image = liq_image_create_rgba(attr, (void *)pixels, width, height, 0, 0);
+    unsigned char *output = malloc((size_t)width * height);
+    liq_result *result = NULL;
+    double error = -1;
+    if (image && output && LIQ_OK == liq_image_quantize(image, attr, &result)) {
+        liq_set_dithering_level(result, 0);
+        if (LIQ_OK == liq_write_remapped_image(result, image, output, (size_t)width * height)) {
+            const liq_palette *palette = liq_get_palette(result);
+            error = 0;
+            for(size_t i=0; i < (size_t)width * height; i++) {
+                error += color_error(palette->entries[output[i]], pixels[i]);
+            }
+            error /= (double)width * height;
+        }
+        liq_result_destroy(result);
+    }
+    if (image) liq_image_destroy(image);
+    free(output);
+    return error;
+}
+
+/*
+ Palette of a gray image is found exactly, so it can't be worse than median cut's palette for the same pixels,
+ which is what an image with one slightly tinted pixel gets.
+ */
+static bool test_gray_palette(const struct options *options)
+{
+    const char *name = "gray_palette";
+    const int width = 256, height = 64;
+    liq_color *pixels = malloc(sizeof(liq_color) * width * height);
+    unsigned int state = 11;
+    for(int y=0; y < height; y++) {
+        for(int x=0; x < width; x++) {
+            const unsigned char v = clamp_channel(128 + 100*sin(x/40.0) * cos(y/20.0) + (int)(random_next(&state) % 9) - 4);
+            pixels[x + y*width] = (liq_color){v, v, v, 255};
+        }
+    }
+
+    liq_attr *attr = liq_attr_create();
+    liq_set_max_colors(attr, 8);
+    const double gray_error = quantize_error(attr, pixels, width, height);
+    pixels[0].b ^= 1;
+    const double mediancut_error = quantize_error(attr, pixels, width, height);
+    liq_attr_destroy(attr);
+    free(pixels);
+
+    if (gray_error < 0 || mediancut_error < 0) return fail(name, "quantization failed");
+    if (gray_error > mediancut_error) return fail(name, "gray palette has larger error than median cut's");
+    return true;
+}
+
+/* --map uses colors of a text palette or of another PNG's palette, and nothing else */
+static bool test_map_palette(const struct options *options)
+{
+    const char *name = "map_palette";
+    liq_color *pixels = test_png(options, "still.png", 160, 120, 0, true);
+    if (!pixels) return fail(name, "can't write input");
+    free(pixels);
+
+    const liq_color colors[] = {{0,0,0,255}, {255,255,255,255}, {220,40,40,255}, {40,40,220,255}, {40,200,60,255}};
+    char path[256];
+    snprintf(path, sizeof(path), "%s/palette.txt", options->tmpdir);
+    FILE *fp = fopen(path, "w");
+    if (!fp) return fail(name, "can't write palette");
+    fputs("GIMP Palette\n", fp);
+    for(unsigned int i=0; i < sizeof(colors)/sizeof(colors[0]); i++) fprintf(fp, "%d %d %d\n", colors[i].r, colors[i].g, colors[i].b);
+    fclose(fp);
+
+    if (0 != run_pngquant(options, "--map palette.txt -f --ext -text.png still.png")) return fail(name, "--map with a text palette failed");
+    struct png8 text;
+    if (!read_png8(options, "still-text.png", &text)) return fail(name, "can't read output");
+    free(text.indices);
+    for(unsigned int i=0; i < text.num_palette; i++) {
+        if (!palette_has_color(colors, sizeof(colors)/sizeof(colors[0]), text.palette[i])) return fail(name, "output has a color that isn't in the text palette");
+    }
+
+    // the second image gets the palette of the first one's output
+    liq_color *pixels2 = test_png(options, "still2.png", 120, 90, 2, true);
+    if (!pixels2) return fail(name, "can't write input");
+    free(pixels2);
+    if (0 != run_pngquant(options, "16 -f --ext -a.png still.png")) return fail(name, "quantization of the map failed");
+    if (0 != run_pngquant(options, "--map still-a.png -f --ext -png.png still2.png")) return fail(name, "--map with a PNG failed");
+    struct png8 map, png;
+    if (!read_png8(options, "still-a.png", &map)) return fail(name, "can't read map");
+    free(map.indices);
+    if (!read_png8(options, "still2-png.png", &png)) return fail(name, "can't read output");
+    free(png.indices);
+    for(unsigned int i=0; i < png.num_palette; i++) {
+        if (!palette_has_color(map.palette, map.num_palette, png.palette[i])) return fail(name, "output has a color that isn't in the PNG palette");
+    }
+    return true;
+}
+
+struct log_capture {
+    char text[4096];
+    size_t length;
+};
+
+static void log_capture(const liq_attr *attr, const char *message, void *user_info)
+{
+    struct log_capture *capture = user_info;
+    const size_t length = strlen(message);
+    if (capture->length + length + 2 > sizeof(capture->text)) return;
+    memcpy(capture->text + capture->length, message, length);
+    capture->length += length;
+    capture->text[capture->length++] = '\n';
+    capture->text[capture->length] = '\0';
+}
+
+/*
+ Images rejected by the estimate before the full search must be ones the full search wouldn't get within the
+ --quality minimum either, and an image the full search gets within it must not be rejected.
+ */
+static bool test_quality_early_reject(const struct options *options)
+{
+    const char *name = "quality_early_reject";
+    const int width = 256, height = 256;
+    liq_color *pixels = malloc(sizeof(liq_color) * width * height);
+    unsigned int state = 9;
+    for(int i=0; i < width * height; i++) {
+        const unsigned int v = random_next(&state);
+        pixels[i] = (liq_color){v, v >> 8, v >> 16, 255};
+    }
+
+    liq_attr *attr = liq_attr_create();
+    liq_image *image = liq_image_create_rgba(attr, pixels, width, height, 0, 0);
+    liq_result *result = NULL;
+    bool ok = true;
+    if (LIQ_OK != liq_image_quantize(image, attr, &result)) {
+        ok = fail(name, "quantization without a limit failed");
+    } else {
+        const int full_quality = liq_get_quantization_quality(result);
+        liq_result_destroy(result);
+
+        struct log_capture capture = {.length = 0};
+        liq_set_log_callback(attr, log_capture, &capture);
+        liq_set_quality(attr, 90, 100);
+        if (LIQ_QUALITY_TOO_LOW != liq_image_quantize(image, attr, &result)) {
+            ok = fail(name, "image wasn't rejected");
+        } else if (!strstr(capture.text, "far above limit")) {
+            ok = fail(name, "image wasn't rejected by the estimate");
+        } else if (full_quality >= 90) {
+            ok = fail(name, "full search would have met the minimum");
+        }
+
+        liq_set_quality(attr, full_quality > 5 ? full_quality - 5 : 0, 100);
+        if (ok && LIQ_OK != liq_image_quantize(image, attr, &result)) {
+            ok = fail(name, "image within the minimum was rejected");
+        } else if (ok) {
+            liq_result_destroy(result);
+        }
+    }
+
+    liq_image_destroy(image);
+    liq_attr_destroy(attr);
+    free(pixels);
+    return ok;
+}
+
+/* bands of rows quantized by separate processes share one palette, which is about as good as one process' */
+static bool test_shards(const struct options *options)
+{
+    const char *name = "shards";
+    const unsigned int width = 160, height = 256;
+    liq_color *pixels = test_png(options, "tall.png", width, height, 3, false);
+    if (!pixels) return fail(name, "can't write input");
+
+    bool ok = true;
+    struct png8 whole = {.indices = NULL}, sharded = {.indices = NULL};
+    if (0 != run_pngquant(options, "--nofs -f --ext -whole.png tall.png")) ok = fail(name, "run without --shards failed");
+    else if (0 != run_pngquant(options, "--shards 2 --nofs -f --ext -sharded.png tall.png")) ok = fail(name, "--shards 2 failed");
+    else if (!read_png8(options, "tall-whole.png", &whole) || !read_png8(options, "tall-sharded.png", &sharded)) ok = fail(name, "can't read output");
+    else if (sharded.width != width || sharded.height != height) ok = fail(name, "sharded output has wrong size");
+    else {
+        const double whole_error = png8_error(&whole, pixels, 0, 0, width, height);
+        const double sharded_error = png8_error(&sharded, pixels, 0, 0, width, height);
+        if (sharded_error > whole_error * 1.15 + 0.5) ok = fail(name, "sharded output is much worse");
+    }
+    free(whole.indices);
+    free(sharded.indices);
+    free(pixels);
+    return ok;
+}
+
+/* every rung of --ladder is written with at most its number of colors, and fewer colors give larger error */
+static bool test_ladder(const struct options *options)
+{
+    const char *name = "ladder";
+    const unsigned int width = 160, height = 120;
+    liq_color *pixels = test_png(options, "still.png", width, height, 0, false);
+    if (!pixels) return fail(name, "can't write input");
+
+    bool ok = true;
+    struct png8 large = {.indices = NULL}, small = {.indices = NULL}, direct = {.indices = NULL};
+    if (0 != run_pngquant(options, "--ladder 64,16 -f still.png")) ok = fail(name, "--ladder failed");
+    else if (0 != run_pngquant(options, "64 -f --ext -direct.png still.png")) ok = fail(name, "quantization to 64 colors failed");
+    else if (!read_png8(options, "still-64-fs8.png", &large) || !read_png8(options, "still-16-fs8.png", &small) ||
+             !read_png8(options, "still-direct.png", &direct)) ok = fail(name, "can't read output");
+    else if (large.num_palette > 64 || small.num_palette > 16) ok = fail(name, "rung has too many colors");
+    else {
+        const double large_error = png8_error(&large, pixels, 0, 0, width, height);
+        const double small_error = png8_error(&small, pixels, 0, 0, width, height);
+        const double direct_error = png8_error(&direct, pixels, 0, 0, width, height);
+        if (small_error < large_error) ok = fail(name, "16 colors have smaller error than 64");
+        else if (large_error > direct_error * 1.1 + 0.5) ok = fail(name, "largest rung is much worse than a separate run");
+    }
+    free(large.indices);
+    free(small.indices);
+    free(direct.indices);
+    free(pixels);
+    return ok;
+}
+
+/* MSE curve of --analyze never grows with more colors, and refined palettes are better than median cut alone */
+static bool test_analyze(const struct options *options)
+{
+    const char *name = "analyze";
+    liq_color *pixels = test_png(options, "still.png", 160, 120, 0, false);
+    if (!pixels) return fail(name, "can't write input");
+    free(pixels);
+
+    if (0 != run_pngquant(options, "--analyze=16,64 still.png > analysis.json")) return fail(name, "--analyze failed");
+    char *json = read_text(options, "analysis.json");
+    const char *mse = strstr(json, "\"mse\":["), *refined = strstr(json, "\"refined\":[");
+    bool ok = true;
+    double curve[256];
+    unsigned int count = 0;
+    if (!mse || !refined) {
+        ok = fail(name, "output has no mse or refined");
+    } else {
+        char *end = (char *)mse + 7;
+        while (count < 256 && *end != ']') {
+            curve[count++] = strtod(end, &end);
+            if (*end == ',') end++;
+        }
+        if (count != 256) ok = fail(name, "curve doesn't have 256 entries");
+        for(unsigned int i=1; i < count && ok; i++) {
+            if (curve[i] > curve[i-1]) ok = fail(name, "error grows with more colors");
+        }
+    }
+
+    const int colors[] = {16, 64};
+    for(unsigned int i=0; i < 2 && ok; i++) {
+        char key[32];
+        snprintf(key, sizeof(key), "{\"colors\":%d,\"mse\":", colors[i]);
+        const char *entry = strstr(refined, key);
+        if (!entry) ok = fail(name, "refined entry is missing");
+        else if (strtod(entry + strlen(key), NULL) > curve[colors[i]-1]) ok = fail(name, "refined palette is worse than median cut's");
+    }
+    free(json);
+    return ok;
+}
+
+/* dithering is seeded by the library itself, without touching rand() that other threads may be using */
+static bool test_remap_rand_state(const struct options *options)
+{
+    const char *name = "remap_rand_state";
+    const int width = 256, height = 64;
+    liq_color *pixels = malloc(sizeof(liq_color) * width * height);
+    unsigned char *output = malloc(width * height);
+    for(int y=0; y < height; y++) {
+        for(int x=0; x < width; x++) {
+            pixels[x + y*width] = (liq_color){.r = x, .g = y*4, .b = x ^ y, .a = 255};
+        }
+    }
+
+    liq_attr *attr = liq_attr_create();
+    liq_set_max_colors(attr, 16);
+    liq_image *image = liq_image_create_rgba(attr, pixels, width, height, 0, 0);
+    liq_result *result = NULL;
+    bool ok = LIQ_OK == liq_image_quantize(image, attr, &result);
+    if (ok) {
+        liq_set_dithering_level(result, 1.0);
+        srand(7);
+        const int expected = rand();
+        srand(7);
+        ok = LIQ_OK == liq_write_remapped_image(result, image, output, width * height);
+        if (!ok) fail(name, "remapping failed");
+        else if (rand() != expected) ok = fail(name, "remapping changed the state of rand()");
+        liq_result_destroy(result);
+    } else {
+        fail(name, "quantization failed");
+    }
+
+    liq_image_destroy(image);
+    liq_attr_destroy(attr);
+    free(pixels);
+    free(output);
+    return ok;
+}
+
+/* frames of an animation are remapped in parallel, and dithering must not depend on which thread got which frame */
+static bool test_apng_threads(const struct options *options)
+{
+    const char *name = "apng_threads";
+    char path[256];
+    snprintf(path, sizeof(path), "%s/anim.png", options->tmpdir);
+    if (!write_apng(path, 160, 120, 6)) return fail(name, "can't write input");
+
+    if (0 != run_pngquant(options, "--threads 1 -f --ext -1.png anim.png")) return fail(name, "--threads 1 failed");
+    for(int run=0; run < 3; run++) {
+        if (0 != run_pngquant(options, "--threads 8 -f --ext -8.png anim.png")) return fail(name, "--threads 8 failed");
+        if (!same_files(options, "anim-1.png", "anim-8.png")) return fail(name, "output of --threads 8 differs from --threads 1");
+    }
+    if (!file_contains(options, "anim-1.png", "acTL")) return fail(name, "output isn't animated");
+    return true;
+}
+
+/* quality rungs of --ladder keep the --quality minimum, so a rung with a target below it must fail and not be written */
+static bool test_ladder_quality_minimum(const struct options *options)
+{
+    const char *name = "ladder_quality_minimum";
+    liq_color *pixels = test_png(options, "still.png", 160, 120, 0, false);
+    if (!pixels) return fail(name, "can't write input");
+    free(pixels);
+
+    if (99 != run_pngquant(options, "--quality 50-100 --ladder q90,q20 -f still.png 2>/dev/null")) return fail(name, "exit status isn't 99");
+    if (file_exists(options, "still-q20-fs8.png")) return fail(name, "rung below the minimum was written");
+    return true;
+}
+
+/* palette found on a pyramid level must not be much worse than a full-resolution search, even for noisy images */
+static bool test_pyramid_noise(const struct options *options)
+{
+    const char *name = "pyramid_noise";
+    const int width = 640, height = 640;
+    liq_color *pixels = test_pixels(width, height, 1, true);
+    unsigned int state = 5;
+    for(int i=0; i < width * height; i++) {
+        // gaussian noise from sums of uniform numbers, independent in each channel
+        int noise[3] = {0};
+        for(int c=0; c < 3; c++) {
+            for(int k=0; k < 12; k++) noise[c] += random_next(&state) % 1001;
+            noise[c] = (noise[c] - 6000) * 90 / 1000;
+        }
+        pixels[i].r = clamp_channel(pixels[i].r + noise[0]);
+        pixels[i].g = clamp_channel(pixels[i].g + noise[1]);
+        pixels[i].b = clamp_channel(pixels[i].b + noise[2]);
+    }
+
+    liq_attr *attr = liq_attr_create();
+    const double full_error = quantize_error(attr, pixels, width, height);
+    liq_set_pyramid(attr, 160*160);
+    const double pyramid_error = quantize_error(attr, pixels, width, height);
+    liq_attr_destroy(attr);
+    free(pixels);
+
+    if (full_error < 0 || pyramid_error < 0) return fail(name, "quantization failed");
+    if (pyramid_error > full_error * 1.1) return fail(name, "error of pyramid level's palette is much larger");
+    return true;
+}
+
+static void write_request(FILE *fp, const char *optstr, const unsigned char *png_data, unsigned int png_size)
+{
+    unsigned char length[4];
+    put_u32(length, strlen(optstr));
+    fwrite(length, 1, 4, fp);
+    fwrite(optstr, 1, strlen(optstr), fp);
+    put_u32(length, png_size);
+    fwrite(length, 1, 4, fp);
+    fwrite(png_data, 1, png_size, fp);
+}
+
+/* --daemon must not allocate whatever length a client sends, and must stay in sync with the client after rejecting it */
+static bool test_daemon_request_size(const struct options *options)
+{
+    const char *name = "daemon_request_size";
+    liq_color *pixels = test_png(options, "still.png", 64, 48, 0, false);
+    if (!pixels) return fail(name, "can't write input");
+    free(pixels);
+    char path[256];
+    snprintf(path, sizeof(path), "%s/still.png", options->tmpdir);
+    size_t png_size;
+    unsigned char *png_data = read_file(path, &png_size);
+    if (!png_data) return fail(name, "can't read input");
+
+    const unsigned int large_size = 2<<20;
+    unsigned char *large = calloc(large_size, 1);
+    snprintf(path, sizeof(path), "%s/requests", options->tmpdir);
+    FILE *fp = fopen(path, "wb");
+    if (!fp || !large) {
+        free(png_data); free(large);
+        if (fp) fclose(fp);
+        return fail(name, "can't write requests");
+    }
+    write_request(fp, "16", large, large_size);
+    write_request(fp, "16", png_data, png_size);
+    fclose(fp);
+    free(png_data);
+    free(large);
+
+    if (0 != run_pngquant(options, "--daemon --max-memory 1M < requests > responses")) return fail(name, "daemon failed");
+
+    snprintf(path, sizeof(path), "%s/responses", options->tmpdir);
+    size_t size;
+    unsigned char *responses = read_file(path, &size);
+    bool ok = true;
+    if (!responses || size < 16) ok = fail(name, "responses are missing");
+    else if (get_u32(responses) != 17 || get_u32(responses + 4) != 0) ok = fail(name, "request above --max-memory wasn't rejected with status 17");
+    else if (get_u32(responses + 8) != 0 || size != 16 + get_u32(responses + 12)) ok = fail(name, "request after the rejected one failed");
+    free(responses);
+    return ok;
+}
+
+/* options that need single frames reject animated files instead of ignoring the animation */
+static bool test_apng_options(const struct options *options)
+{
+    const char *name = "apng_options";
+    char path[256];
+    snprintf(path, sizeof(path), "%s/anim.png", options->tmpdir);
+    if (!write_apng(path, 160, 128, 3)) return fail(name, "can't write input");
+
+    if (0 == run_pngquant(options, "--shards 2 -f anim.png 2>/dev/null")) return fail(name, "--shards accepted an animated PNG");
+    if (0 == run_pngquant(options, "--sequence -f anim.png 2>/dev/null")) return fail(name, "--sequence accepted an animated PNG");
+    return true;
+}
+
+/*
+ In a --sequence, pixels that didn't change keep indices of the previous frame's output,
+ and changed ones are remapped to its palette.
+ */
+static bool test_sequence_changes(const struct options *options)
+{
+    const char *name = "sequence_changes";
+    const unsigned int width = 160, height = 128;
+    const struct {unsigned int left, top, width, height;} changes[2] = {{30, 0, 40, 64}, {90, 64, 50, 64}};
+
+    liq_color *frames[3] = {test_pixels(width, height, 0, true)};
+    for(unsigned int f=1; f < 3; f++) {
+        frames[f] = malloc(sizeof(liq_color) * width * height);
+        memcpy(frames[f], frames[f-1], sizeof(liq_color) * width * height);
+        for(unsigned int y = changes[f-1].top; y < changes[f-1].top + changes[f-1].height; y++) {
+            for(unsigned int x = changes[f-1].left; x < changes[f-1].left + changes[f-1].width; x++) {
+                // moved part of the picture has colors the keyframe's palette already covers
+                frames[f][x + y*width] = frames[0][(x + 9) % width + ((y + 5) % height) * width];
+            }
+        }
+    }
+
+    bool ok = true;
+    for(unsigned int f=0; f < 3 && ok; f++) {
+        char path[256];
+        snprintf(path, sizeof(path), "%s/frame%u.png", options->tmpdir, f);
+        if (!write_png(path, frames[f], width, height)) ok = fail(name, "can't write input");
+    }
+    if (ok && 0 != run_pngquant(options, "--sequence -f frame0.png frame1.png frame2.png")) ok = fail(name, "--sequence failed");
+
+    struct png8 outputs[3] = {{.indices = NULL}};
+    for(unsigned int f=0; f < 3 && ok; f++) {
+        char filename[32];
+        snprintf(filename, sizeof(filename), "frame%u-fs8.png", f);
+        if (!read_png8(options, filename, &outputs[f])) ok = fail(name, "can't read output");
+    }
+
+    for(unsigned int f=1; f < 3 && ok; f++) {
+        const struct png8 *prev = &outputs[f-1], *out = &outputs[f];
+        if (out->num_palette != prev->num_palette || memcmp(out->palette, prev->palette, sizeof(out->palette[0]) * out->num_palette)) {
+            ok = fail(name, "palette of the keyframe wasn't kept");
+            break;
+        }
+        const unsigned int left = changes[f-1].left, top = changes[f-1].top, right = left + changes[f-1].width, bottom = top + changes[f-1].height;
+        for(unsigned int y=0; y < height && ok; y++) {
+            for(unsigned int x=0; x < width; x++) {
+                const bool changed = x >= left && x < right && y >= top && y < bottom;
+                if (!changed && out->indices[x + y*width] != prev->indices[x + y*width]) {
+                    ok = fail(name, "unchanged pixel has a different index than in the previous output");
+                    break;
+                }
+            }
+        }
+        const double changed_error = png8_error(out, frames[f], left, top, changes[f-1].width, changes[f-1].height);
+        const double keyframe_error = png8_error(&outputs[0], frames[0], 0, 0, width, height);
+        if (ok && changed_error > keyframe_error * 2.5) ok = fail(name, "changed pixels are far from their colors");
+    }
+
+    for(unsigned int f=0; f < 3; f++) {
+        free(outputs[f].indices);
+        free(frames[f]);
+    }
+    return ok;
+}
+
+struct test {
+    const char *name;
+    bool (*run)(const struct options *options);
+    bool huge; // only with --huge
+};
+
+static const struct test tests[] = {
+    {"max_memory_deferral", test_max_memory_deferral},
+    {"huge_custom_image", test_huge_custom_image, true},
+    {"gray_palette", test_gray_palette},
+    {"map_palette", test_map_palette},
+    {"quality_early_reject", test_quality_early_reject},
+    {"shards", test_shards},
+    {"ladder", test_ladder},
+    {"analyze", test_analyze},
+    {"remap_rand_state", test_remap_rand_state},
+    {"apng_threads", test_apng_threads},
+    {"ladder_quality_minimum", test_ladder_quality_minimum},
+    {"pyramid_noise", test_pyramid_noise},
+    {"daemon_request_size", test_daemon_request_size},
+    {"apng_options", test_apng_options},
+    {"sequence_changes", test_sequence_changes},
+};
+
+static const struct option long_options[] = {
+    {"pngquant", required_argument, NULL, 'p'},
+    {"huge", no_argument, NULL, 'H'},
+    {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0},
+};
+
+int main(int argc, char *argv[])
+{
+    struct options options = {
+        .pngquant = "./pngquant",
+        .tmpdir = "/tmp/pngquant-test-XXXXXX",
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "h", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'p':
+                options.pngquant = optarg;
+                break;
+            case 'H':
+                options.huge = true;
+                break;
+            case 'h':
+                fputs(TEST_USAGE, stdout);
+                return 0;
+            default:
+                fputs(TEST_USAGE, stderr);
+                return 1;
+        }
+    }
+    options.filters = &argv[optind];
+    options.num_filters = argc - optind;
+
+    // tests run the program from the temporary directory
+    char pngquant[1024];
+    if (!strchr(options.pngquant, '/') || options.pngquant[0] == '/') {
+        snprintf(pngquant, sizeof(pngquant), "%s", options.pngquant);
+    } else {
+        char cwd[512];
+        if (!getcwd(cwd, sizeof(cwd))) {
+            perror("pngquant-test: current directory");
+            return 1;
+        }
+        snprintf(pngquant, sizeof(pngquant), "%s/%s", cwd, options.pngquant);
+    }
+    options.pngquant = pngquant;
+
+    if (!mkdtemp(options.tmpdir)) {
+        perror("pngquant-test: temporary directory");
+        return 1;
+    }
+
+    unsigned int failed = 0, passed = 0, skipped = 0;
+    for(unsigned int i=0; i < sizeof(tests)/sizeof(tests[0]); i++) {
+        if (!selected(&options, tests[i].name)) continue;
+        if (tests[i].huge && !options.huge) {
+            skipped++;
+            continue;
+        }
+        if (tests[i].run(&options)) {
+            printf("ok   %s\n", tests[i].name);
+            passed++;
+        } else {
+            failed++;
+        }
+        fflush(stdout);
+    }
+
+    char command[128];
+    snprintf(command, sizeof(command), "rm -rf '%s'", options.tmpdir);
+    if (0 != system(command)) fprintf(stderr, "pngquant-test: can't remove %s\n", options.tmpdir);
+
+    printf("%u passed, %u failed", passed, failed);
+    if (skipped) printf(", %u skipped (need --huge)", skipped);
+    putchar('\n');
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,124 @@
+
+#if !defined(WIN32) && !defined(__WIN32__)
+#define _POSIX_C_SOURCE 200112L /* clock_gettime() */
+#endif
+
+#include <stdlib.h>
+#include <time.h>
+
+#include "trace.h"
+#include "stats.h" /* json_write_string() */
+
+#define TRACE_CHUNK_EVENTS 4096
+
+struct trace_item {
+    const char *name, *arg;
+    double timestamp; // microseconds since trace_enable()
+    char phase;
+};
+
+struct trace_chunk {
+    struct trace_chunk *next;
+    unsigned int used;
+    struct trace_item items[TRACE_CHUNK_EVENTS];
+};
+
+/*
+ Every thread appends only to its own buffer, so no locking is needed.
+ Buffers are added to the global list with compare-and-swap when a thread records its first event.
+ */
+struct trace_buffer {
+    struct trace_buffer *next;
+    unsigned int tid;
+    struct trace_chunk *first, *last;
+};
+
+bool trace_enabled = false;
+
+static double trace_start_time;
+static struct trace_buffer *volatile trace_buffers;
+static volatile unsigned int trace_next_tid;
+static __thread struct trace_buffer *thread_buffer;
+
+static double trace_now(void)
+{
+#if defined(CLOCK_MONOTONIC)
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec*1e6 + now.tv_nsec/1e3;
+#else
+    return (double)clock() * 1e6 / CLOCKS_PER_SEC;
+#endif
+}
+
+void trace_enable(void)
+{
+    trace_start_time = trace_now();
+    trace_enabled = true;
+}
+
+static struct trace_buffer *trace_thread_buffer(void)
+{
+    if (thread_buffer) return thread_buffer;
+
+    struct trace_buffer *buf = calloc(1, sizeof(*buf));
+    if (!buf) return NULL;
+
+    buf->tid = __sync_add_and_fetch(&trace_next_tid, 1);
+    do {
+        buf->next = trace_buffers;
+    } while (!__sync_bool_compare_and_swap(&trace_buffers, buf->next, buf));
+
+    return thread_buffer = buf;
+}
+
+void trace_event(const char *name, const char *arg, char phase)
+{
+    const double timestamp = trace_now() - trace_start_time;
+
+    struct trace_buffer *buf = trace_thread_buffer();
+    if (!buf) return;
+
+    if (!buf->last || buf->last->used >= TRACE_CHUNK_EVENTS) {
+        struct trace_chunk *chunk = malloc(sizeof(*chunk));
+        if (!chunk) return;
+        chunk->next = NULL;
+        chunk->used = 0;
+        if (buf->last) buf->last->next = chunk; else buf->first = chunk;
+        buf->last = chunk;
+    }
+
+    buf->last->items[buf->last->used++] = (struct trace_item){
+        .name = name, .arg = arg, .timestamp = timestamp, .phase = phase,
+    };
+}
+
+/* must not be called while other threads are still recording */
+bool trace_write(FILE *fp)
+{
+    fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", fp);
+
+    bool first = true;
+    for(const struct trace_buffer *buf = trace_buffers; buf; buf = buf->next) {
+        fprintf(fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"thread %u\"}}", first ? "" : ",\n", buf->tid, buf->tid);
+        first = false;
+
+        for(const struct trace_chunk *chunk = buf->first; chunk; chunk = chunk->next) {
+            for(unsigned int i=0; i < chunk->used; i++) {
+                const struct trace_item *item = &chunk->items[i];
+                fputs(",\n{\"name\":", fp);
+                json_write_string(fp, item->name);
+                fprintf(fp, ",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":1,\"tid\":%u", item->phase, item->timestamp, buf->tid);
+                if (item->arg) {
+                    fputs(",\"args\":{\"detail\":", fp);
+                    json_write_string(fp, item->arg);
+                    fputc('}', fp);
+                }
+                fputc('}', fp);
+            }
+        }
+    }
+
+    fputs("\n]}\n", fp);
+    return !ferror(fp);
+}
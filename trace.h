@@ -0,0 +1,34 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+#include <stdbool.h>
+
+/*
+ Timeline of begin/end spans per thread, written as Chrome trace-event JSON (about://tracing, Perfetto).
+ When tracing is not enabled a span costs only a check of trace_enabled.
+ */
+extern bool trace_enabled;
+
+void trace_enable(void);
+void trace_event(const char *name, const char *arg, char phase);
+bool trace_write(FILE *fp);
+
+/* name and arg are not copied, so they must stay valid until trace_write() */
+inline static void trace_begin_arg(const char *name, const char *arg)
+{
+    if (trace_enabled) trace_event(name, arg, 'B');
+}
+
+inline static void trace_begin(const char *name)
+{
+    if (trace_enabled) trace_event(name, NULL, 'B');
+}
+
+/* spans must be nested properly within a thread */
+inline static void trace_end(const char *name)
+{
+    if (trace_enabled) trace_event(name, NULL, 'E');
+}
+
+#endif
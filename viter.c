@@ -2,27 +2,24 @@
 #include "pam.h"
 #include "viter.h"
 #include "nearest.h"
+#include "trace.h"
+#include "counters.h"
+#include "taskpool.h"
+#include "stats.h"
 #include <stdlib.h>
 #include <string.h>
 
-#ifdef _OPENMP
-#include <omp.h>
-#else
-#define omp_get_max_threads() 1
-#define omp_get_thread_num() 0
-#endif
-
 /*
  * Voronoi iteration: new palette color is computed from weighted average of colors that map to that palette entry.
  */
-void viter_init(const colormap *map, const unsigned int max_threads, viter_state average_color[])
+void viter_init(const colormap *map, const unsigned int slots, viter_state average_color[])
 {
-    memset(average_color, 0, sizeof(average_color[0])*map->colors*max_threads);
+    memset(average_color, 0, sizeof(average_color[0])*map->colors*slots);
 }
 
-void viter_update_color(const f_pixel acolor, const float value, const colormap *map, unsigned int match, const unsigned int thread, viter_state average_color[])
+void viter_update_color(const f_pixel acolor, const float value, const colormap *map, unsigned int match, const unsigned int slot, viter_state average_color[])
 {
-    match += thread * map->colors;
+    match += slot * map->colors;
     average_color[match].a += acolor.a * value;
     average_color[match].r += acolor.r * value;
     average_color[match].g += acolor.g * value;
@@ -30,13 +27,13 @@ void viter_update_color(const f_pixel acolor, const float value, const colormap
     average_color[match].total += value;
 }
 
-void viter_finalize(colormap *map, const unsigned int max_threads, const viter_state average_color[])
+void viter_finalize(colormap *map, const unsigned int slots, const viter_state average_color[])
 {
     for (unsigned int i=0; i < map->colors; i++) {
         double a=0, r=0, g=0, b=0, total=0;
 
-        // Aggregate results from all threads
-        for(unsigned int t=0; t < max_threads; t++) {
+        // Aggregate results from all chunks, always in the same order
+        for(unsigned int t=0; t < slots; t++) {
             const unsigned int offset = map->colors * t + i;
 
             a += average_color[offset].a;
@@ -58,30 +55,71 @@ void viter_finalize(colormap *map, const unsigned int max_threads, const viter_s
     }
 }
 
-double viter_do_iteration(histogram *hist, colormap *const map, const float min_opaque_val, viter_callback callback)
+struct viter_context {
+    const hist_item *achv;
+    colormap *map;
+    struct nearest_map *n;
+    float min_opaque_val;
+    bool opaque; // histogram and palette are opaque
+    viter_callback callback;
+    viter_state *average_color;
+    double *diffs; // one per chunk
+    struct liq_counters *counters;
+};
+
+static void viter_chunk(void *context, unsigned int chunk, unsigned int start, unsigned int end)
 {
-    const unsigned int max_threads = omp_get_max_threads();
-    viter_state average_color[map->colors * max_threads];
-    viter_init(map, max_threads, average_color);
-    struct nearest_map *const n = nearest_init(map);
-    hist_item *const achv = hist->achv;
-    const int hist_size = hist->size;
+    struct viter_context *const c = context;
+    trace_begin("viter_do_iteration");
 
     double total_diff=0;
-    #pragma omp parallel for if (hist_size > 3000) \
-        default(none) shared(average_color,callback) reduction(+:total_diff)
-    for(int j=0; j < hist_size; j++) {
+    for(unsigned int j=start; j < end; j++) {
         float diff;
-        unsigned int match = nearest_search(n, achv[j].acolor, min_opaque_val, &diff);
-        total_diff += diff * achv[j].perceptual_weight;
+        hist_item *const item = (hist_item *)&c->achv[j];
+        unsigned int match = c->opaque ? nearest_search_rgb(c->n, item->acolor, &diff) : nearest_search(c->n, item->acolor, c->min_opaque_val, &diff);
+        total_diff += diff * item->perceptual_weight;
 
-        viter_update_color(achv[j].acolor, achv[j].perceptual_weight, map, match, omp_get_thread_num(), average_color);
+        viter_update_color(item->acolor, item->perceptual_weight, c->map, match, chunk, c->average_color);
 
-        if (callback) callback(&achv[j], diff);
+        if (c->callback) c->callback(item, diff);
     }
+    c->diffs[chunk] = total_diff;
+
+    counters_flush(c->counters);
+    trace_end("viter_do_iteration");
+}
+
+double viter_do_iteration(histogram *hist, colormap *const map, const float min_opaque_val, viter_callback callback)
+{
+    const unsigned int chunks = taskpool_chunks(hist->size, 3000);
+    // sums for every color in every chunk are too large for stacks of worker threads
+    viter_state *average_color = stats_malloc(sizeof(average_color[0]) * map->colors * chunks);
+    if (!average_color) return MAX_DIFF; // palette is left as it was
+    double diffs[chunks];
+    viter_init(map, chunks, average_color);
+
+    struct liq_counters counters = {0};
+    struct nearest_map *const n = nearest_init(map);
+    struct viter_context context = {
+        .achv = hist->achv,
+        .map = map,
+        .n = n,
+        .min_opaque_val = min_opaque_val,
+        .opaque = hist->opaque && nearest_is_opaque(n),
+        .callback = callback,
+        .average_color = average_color,
+        .diffs = diffs,
+        .counters = &counters,
+    };
+    taskpool_parallel_for(hist->size, chunks, viter_chunk, &context, true);
+    counters_add(&counters);
+
+    double total_diff=0;
+    for(unsigned int i=0; i < chunks; i++) total_diff += diffs[i];
 
-    nearest_free(n);
-    viter_finalize(map, max_threads, average_color);
+    nearest_free(context.n);
+    viter_finalize(map, chunks, average_color);
+    stats_free(average_color);
 
     return total_diff / hist->total_perceptual_weight;
 }